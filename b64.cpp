@@ -3,13 +3,320 @@
 //
 
 #include <iostream>
+#include <array>
 #include <math.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "base64.hpp"
 
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Every supported kernel must produce the scalar kernel's output, byte for byte
+unsigned int
+kernel_compare(const uint8_t *buf, size_t len)
+{
+  using namespace std;
+  namespace b64 = base64;
+  static char ref_enc[16*1024], enc[16*1024];
+  static uint8_t ref_dec[12*1024], dec[12*1024];
+  unsigned int errors = 0;
+
+  size_t ref_enc_sz = sizeof(ref_enc);
+  b64::encode_with(b64::KERNEL_SCALAR, buf, len, ref_enc, &ref_enc_sz);
+  size_t ref_dec_sz = sizeof(ref_dec);
+  b64::decode_with(b64::KERNEL_SCALAR, ref_enc, ref_enc_sz, ref_dec, &ref_dec_sz);
+  int k = b64::KERNEL_SSE41;
+  for (; k < b64::KERNEL_COUNT; k++) {
+    if (!b64::kernel_supported((b64::kernel)k)) {
+      break;
+    }
+    size_t enc_sz = sizeof(enc);
+    b64::encode_with((b64::kernel)k, buf, len, enc, &enc_sz);
+    if (enc_sz != ref_enc_sz || memcmp(enc, ref_enc, enc_sz) != 0) {
+      cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " encode of length " << len << " differs from scalar" << endl;
+      errors++;
+    }
+    size_t dec_sz = sizeof(dec);
+    b64::decode_with((b64::kernel)k, ref_enc, ref_enc_sz, dec, &dec_sz);
+    if (dec_sz != ref_dec_sz || memcmp(dec, ref_dec, dec_sz) != 0) {
+      cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " decode of length " << len << " differs from scalar" << endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+// Every kernel, into every room short of what len bytes need, writes no
+// more than the room, and writes the encoding of as many bytes as fit
+unsigned int
+short_out_compare(const uint8_t *buf, size_t len)
+{
+  using namespace std;
+  namespace b64 = base64;
+  static char full[512];
+  static char part[512];
+  static char enc[512 + 64];
+  unsigned int errors = 0;
+  size_t full_sz = sizeof(full);
+  b64::encode_with(b64::KERNEL_SCALAR, buf, len, full, &full_sz);
+  int k = b64::KERNEL_SCALAR;
+  for (; k < b64::KERNEL_COUNT && b64::kernel_supported((b64::kernel)k); k++) {
+    size_t room = 0;
+    for (; room < full_sz && errors < 5; room++) {
+      memset(enc, '#', sizeof(enc));
+      size_t enc_sz = room;
+      b64::encode_with((b64::kernel)k, buf, len, enc, &enc_sz);
+      size_t over = room;
+      while (over < sizeof(enc) && enc[over] == '#') {
+        over++;
+      }
+      size_t part_sz = sizeof(part);
+      b64::encode_with(b64::KERNEL_SCALAR, buf, b64::decoded_size(enc_sz), part, &part_sz);
+      if (over != sizeof(enc) || enc_sz > room || enc_sz + 2 < room || part_sz != enc_sz ||
+          memcmp(enc, part, enc_sz) != 0) {
+        cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " encode of " << len << " bytes into " << room
+             << " wrote " << enc_sz << ", past the room at " << over << endl;
+        errors++;
+      }
+    }
+  }
+  return errors;
+}
+
+// A bad character anywhere must be caught, by every kernel, at the same offset
+unsigned int
+bad_char_compare(const uint8_t *buf, size_t len)
+{
+  using namespace std;
+  namespace b64 = base64;
+  static char enc[16*1024];
+  static uint8_t dec[12*1024];
+  const char bad_chars[] = { '=', ' ', '\n', '-', '_', '.', '\x80', '\xff', 0 };
+  unsigned int errors = 0;
+
+  size_t enc_sz = sizeof(enc);
+  b64::encode(buf, len, enc, &enc_sz);
+  if (enc_sz == 0) {
+    return 0;
+  }
+  size_t pos = random() % enc_sz;
+  char saved = enc[pos];
+  enc[pos] = bad_chars[random() % sizeof(bad_chars)];
+  int k = b64::KERNEL_SCALAR;
+  for (; k < b64::KERNEL_COUNT && b64::kernel_supported((b64::kernel)k); k++) {
+    size_t dec_sz = sizeof(dec);
+    size_t err_off = ~(size_t)0;
+    bool ok = b64::decode_with((b64::kernel)k, enc, enc_sz, dec, &dec_sz, &err_off);
+    if (ok || err_off != pos || dec_sz != (pos / 4) * 3) {
+      cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " bad char at " << pos << " of " << enc_sz
+           << " reported ok " << ok << " at " << err_off << " with " << dec_sz << " bytes" << endl;
+      errors++;
+    } else if (memcmp(dec, buf, dec_sz) != 0) {
+      cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " bytes before bad char at " << pos << " differ" << endl;
+      errors++;
+    }
+  }
+  enc[pos] = saved;
+  return errors;
+}
+
+// Stream buf through encoder/decoder in random sized pieces, must match the one shot codec
+unsigned int
+stream_compare(const uint8_t *buf, size_t len)
+{
+  using namespace std;
+  namespace b64 = base64;
+  static char ref_enc[16*1024], enc[16*1024];
+  static uint8_t dec[12*1024];
+  unsigned int errors = 0;
+
+  size_t ref_enc_sz = sizeof(ref_enc);
+  b64::encode(buf, len, ref_enc, &ref_enc_sz);
+
+  b64::encoder encoder;
+  size_t in_pos = 0, enc_sz = 0, used, made;
+  while (in_pos < len) {
+    size_t in_chunk = 1 + random() % 700;
+    size_t out_slice = random() % 300;
+    if (in_chunk > len - in_pos) {
+      in_chunk = len - in_pos;
+    }
+    encoder.update(buf + in_pos, in_chunk, enc + enc_sz, out_slice, &used, &made);
+    in_pos += used;
+    enc_sz += made;
+  }
+  if (!encoder.finish(enc + enc_sz, sizeof(enc) - enc_sz, &made)) {
+    cout << "ERROR: stream encode finish of length " << len << " failed" << endl;
+    errors++;
+  }
+  enc_sz += made;
+  if (enc_sz != ref_enc_sz || memcmp(enc, ref_enc, enc_sz) != 0) {
+    cout << "ERROR: stream encode of length " << len << " differs from encode" << endl;
+    errors++;
+  }
+
+  b64::decoder decoder;
+  size_t dec_sz = 0;
+  in_pos = 0;
+  while (in_pos < enc_sz) {
+    size_t in_chunk = 1 + random() % 900;
+    size_t out_slice = random() % 200;
+    if (in_chunk > enc_sz - in_pos) {
+      in_chunk = enc_sz - in_pos;
+    }
+    if (!decoder.update(enc + in_pos, in_chunk, dec + dec_sz, out_slice, &used, &made)) {
+      cout << "ERROR: stream decode of length " << len << " failed at " << decoder.error_offset() << endl;
+      return errors + 1;
+    }
+    in_pos += used;
+    dec_sz += made;
+  }
+  if (!decoder.finish(dec + dec_sz, sizeof(dec) - dec_sz, &made)) {
+    cout << "ERROR: stream decode finish of length " << len << " failed" << endl;
+    errors++;
+  }
+  dec_sz += made;
+  if (dec_sz != len || memcmp(dec, buf, len) != 0) {
+    cout << "ERROR: stream decode of length " << len << " does not round trip" << endl;
+    errors++;
+  }
+
+  // a bad character is reported at its stream offset
+  if (enc_sz > 0) {
+    size_t pos = random() % enc_sz;
+    enc[pos] = '*';
+    decoder.reset();
+    in_pos = 0;
+    bool ok = true;
+    while (ok && in_pos < enc_sz) {
+      size_t in_chunk = 1 + random() % 100;
+      if (in_chunk > enc_sz - in_pos) {
+        in_chunk = enc_sz - in_pos;
+      }
+      ok = decoder.update(enc + in_pos, in_chunk, dec, sizeof(dec), &used, &made);
+      in_pos += used;
+    }
+    if (ok) {
+      ok = decoder.finish(dec, sizeof(dec), &made);
+    }
+    if (ok || decoder.error_offset() != pos) {
+      cout << "ERROR: stream decode bad char at " << pos << " reported ok " << ok << " at " << decoder.error_offset() << endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+// encode_fixed/decode_fixed<N> against the general codec
+template <size_t N>
+unsigned int
+fixed_compare(const uint8_t *buf)
+{
+  using namespace std;
+  namespace b64 = base64;
+  unsigned int errors = 0;
+  char ref_enc[b64::encoded_size(N) + 1];
+  size_t ref_enc_sz = sizeof(ref_enc);
+  b64::encode(buf, N, ref_enc, &ref_enc_sz);
+  std::array<char, b64::encoded_size(N)> enc = b64::encode_fixed<N>(buf);
+  if (ref_enc_sz != enc.size() || memcmp(ref_enc, enc.data(), enc.size()) != 0) {
+    cout << "ERROR: encode_fixed<" << N << "> differs from encode" << endl;
+    errors++;
+  }
+  bool ok;
+  std::array<uint8_t, N> dec = b64::decode_fixed<N>(enc, &ok);
+  if (!ok || memcmp(dec.data(), buf, N) != 0) {
+    cout << "ERROR: decode_fixed<" << N << "> does not round trip" << endl;
+    errors++;
+  }
+  size_t pos = random() % enc.size();
+  enc[pos] = '~';
+  size_t err_off = 0;
+  if (b64::decode_fixed<N>(enc.data(), dec.data(), &err_off) || err_off != pos) {
+    cout << "ERROR: decode_fixed<" << N << "> bad char at " << pos << " reported at " << err_off << endl;
+    errors++;
+  }
+  return errors;
+}
+
+// Fixed size codec against the general one on one block size
+template <size_t N>
+void
+fixed_throughput(size_t total)
+{
+  namespace b64 = base64;
+  uint8_t raw[N];
+  char enc[b64::encoded_size(N)];
+  uint8_t dec[N];
+  size_t i = 0;
+  for (; i < N; i++) {
+    raw[i] = random() & 0xFF;
+  }
+  size_t reps = total / N;
+  double t0 = elapsed();
+  for (i = 0; i < reps; i++) {
+    b64::encode_fixed<N>(raw, enc);
+    __asm__ volatile("" : : "r" (enc) : "memory");
+  }
+  double t_enc = elapsed() - t0;
+  t0 = elapsed();
+  for (i = 0; i < reps; i++) {
+    b64::decode_fixed<N>(enc, dec);
+    __asm__ volatile("" : : "r" (dec) : "memory");
+  }
+  double t_dec = elapsed() - t0;
+  printf("%-10s block %7zu  encode %6.2f GB/s  decode %6.2f GB/s\n", "fixed", N,
+         (reps * N) / t_enc * 1e-9, (reps * N) / t_dec * 1e-9);
+}
+
+// Throughput of each kernel on repeated blocks of blk_sz bytes (GB/s of raw bytes)
+void
+kernel_throughput(size_t blk_sz, size_t total)
+{
+  using namespace std;
+  namespace b64 = base64;
+  uint8_t *raw = (uint8_t *)malloc(blk_sz);
+  char *enc = (char *)malloc((blk_sz * 4) / 3 + 4);
+  uint8_t *dec = (uint8_t *)malloc(blk_sz);
+  size_t i = 0;
+  for (; i < blk_sz; i++) {
+    raw[i] = random() & 0xFF;
+  }
+  size_t reps = total / blk_sz;
+  int k = b64::KERNEL_SCALAR;
+  for (; k < b64::KERNEL_COUNT && b64::kernel_supported((b64::kernel)k); k++) {
+    size_t enc_sz = 0;
+    double t0 = elapsed();
+    for (i = 0; i < reps; i++) {
+      enc_sz = (blk_sz * 4) / 3 + 4;
+      b64::encode_with((b64::kernel)k, raw, blk_sz, enc, &enc_sz);
+    }
+    double t_enc = elapsed() - t0;
+    t0 = elapsed();
+    for (i = 0; i < reps; i++) {
+      size_t dec_sz = blk_sz;
+      b64::decode_with((b64::kernel)k, enc, enc_sz, dec, &dec_sz);
+    }
+    double t_dec = elapsed() - t0;
+    if (memcmp(raw, dec, blk_sz) != 0) {
+      cout << "ERROR: " << b64::kernel_name((b64::kernel)k) << " round trip failed at block size " << blk_sz << endl;
+    }
+    printf("%-10s block %7zu  encode %6.2f GB/s  decode %6.2f GB/s\n", b64::kernel_name((b64::kernel)k), blk_sz,
+           (reps * blk_sz) / t_enc * 1e-9, (reps * blk_sz) / t_dec * 1e-9);
+  }
+  free(raw);
+  free(enc);
+  free(dec);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -48,7 +355,7 @@ main(int argc, char **argv)
   unsigned int test_len[n_trials];
   srandom(((1961*365+6*30)+13)*24+17);
   unsigned int i = 0;
-  for (; i < sizeof(test_len); i++) {
+  for (; i < n_trials; i++) {
     test_len[i] = (unsigned int)((random() & 0xFFF000) >> 12);
   }
   srandom(1832*6955*17);
@@ -58,7 +365,7 @@ main(int argc, char **argv)
   void *decode_out;
   for (i=0; i < n_trials; i++) {
     unsigned int j = 0;
-    for (; j < test_len[j]; j++) {
+    for (; j < test_len[i]; j++) {
       test_buffer[j] = (random() & 0xFF00000) >> 20;
     }
     size_t b64_out_sz = sizeof(b64_out);
@@ -82,5 +389,77 @@ main(int argc, char **argv)
     free(decode_out);
     decode_out = NULL;
   }
+
+  // SIMD kernels against the scalar one, every length through a few SIFT vectors
+  cout << "active kernel is " << b64::kernel_name(b64::kernel_active()) << endl;
+  unsigned int kernel_errors = 0;
+  for (i = 0; i <= 2048; i++) {
+    unsigned int j = 0;
+    for (; j < i; j++) {
+      test_buffer[j] = (random() & 0xFF00000) >> 20;
+    }
+    kernel_errors += kernel_compare(test_buffer, i);
+  }
+  cout << "kernel compare errors " << kernel_errors << endl;
+
+  // Output room short of the input: 7 bytes into 9 characters wrote 10
+  unsigned int short_errors = 0;
+  for (i = 0; i <= 300; i++) {
+    short_errors += short_out_compare(test_buffer, i);
+  }
+  char nine[10];
+  nine[9] = '#';
+  size_t nine_sz = 9;
+  b64::encode((char const *)block, 7, nine, &nine_sz);
+  if (nine[9] != '#' || nine_sz != 8) {
+    cout << "ERROR: 7 bytes into 9 characters wrote " << nine_sz << endl;
+    short_errors++;
+  }
+  cout << "short output errors " << short_errors << endl;
+
+  // Bad input: outside characters, and a lone trailing character
+  unsigned int bad_errors = 0;
+  for (i = 0; i < 4096; i++) {
+    bad_errors += bad_char_compare(test_buffer, i % 2049);
+  }
+  size_t lone_sz = sizeof(out_buf);
+  size_t lone_off = 0;
+  if (b64::decode("QUJDR", 5, out_buf, &lone_sz, &lone_off) || lone_off != 4 || lone_sz != 3) {
+    cout << "ERROR: lone trailing character not reported, offset " << lone_off << endl;
+    bad_errors++;
+  }
+  cout << "bad input errors " << bad_errors << endl;
+
+  unsigned int stream_errors = 0;
+  for (i = 0; i < 2048; i++) {
+    unsigned int j = 0;
+    for (; j < i; j++) {
+      test_buffer[j] = random() & 0xFF;
+    }
+    stream_errors += stream_compare(test_buffer, i);
+  }
+  cout << "stream errors " << stream_errors << endl;
+
+  for (i = 0; i < sizeof(test_buffer); i++) {
+    test_buffer[i] = random() & 0xFF;
+  }
+  unsigned int fixed_errors = 0;
+  fixed_errors += fixed_compare<1>(test_buffer);
+  fixed_errors += fixed_compare<2>(test_buffer);
+  fixed_errors += fixed_compare<3>(test_buffer);
+  fixed_errors += fixed_compare<16>(test_buffer);
+  fixed_errors += fixed_compare<28>(test_buffer);
+  fixed_errors += fixed_compare<47>(test_buffer);
+  fixed_errors += fixed_compare<48>(test_buffer);
+  fixed_errors += fixed_compare<100>(test_buffer);
+  fixed_errors += fixed_compare<128 * sizeof(float)>(test_buffer);
+  fixed_errors += fixed_compare<960 * sizeof(float)>(test_buffer);
+  cout << "fixed errors " << fixed_errors << endl;
+
+  kernel_throughput(512, 256 * 1024 * 1024);   // one SIFT vector
+  fixed_throughput<512>(256 * 1024 * 1024);
+  kernel_throughput(3840, 256 * 1024 * 1024);  // one GIST vector
+  fixed_throughput<3840>(256 * 1024 * 1024);
+  kernel_throughput(1024 * 1024, 256 * 1024 * 1024);
   return 0;
 }
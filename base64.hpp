@@ -2,14 +2,410 @@
 #define __base64_hpp__
 
 #include <vector>
+#include <array>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * SIMD kernels are compiled with per-function target attributes, so the
+ * header builds without -mavx2 and friends; the kernel actually used is
+ * chosen at runtime from CPUID. Define BASE64_NO_SIMD to get the scalar
+ * code only.
+ */
+#if !defined(BASE64_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86_SIMD 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 namespace base64 {
-  static const char encodeLookup[] = {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
-  void encode(const void * in, const size_t in_size, char *out, size_t *out_size_p) {
+  static constexpr char encodeLookup[] = {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+
+  /*
+   * Decode tables, built at compile time from encodeLookup. v[] is the
+   * 6 bit value of a character, or 0x80 for anything outside the alphabet.
+   * d[n][] is the same value already shifted into place for the n'th
+   * character of a quantum, so a quantum is four loads or'ed together; an
+   * outside character sets bits 24 and up, which no valid quantum touches,
+   * so or'ing every quantum into one mask validates the whole buffer.
+   */
+  const uint32_t _DECODE_BAD = 0x01FFFFFF;
+  struct _decode_tables {
+    alignas(64) uint8_t v[256];
+    uint32_t d[4][256];
+    constexpr _decode_tables() : v(), d() {
+      for (int c = 0; c < 256; c++) {
+        v[c] = 0x80;
+        d[0][c] = d[1][c] = d[2][c] = d[3][c] = _DECODE_BAD;
+      }
+      for (uint32_t i = 0; i < 64; i++) {
+        const uint8_t c = (uint8_t)encodeLookup[i];
+        v[c] = i;
+        d[0][c] = i << 18;
+        d[1][c] = i << 12;
+        d[2][c] = i << 6;
+        d[3][c] = i;
+      }
+    }
+  };
+  static constexpr _decode_tables decodeTables{};
+
+  /* Kernels in increasing order of width; a cpu that supports one supports
+   * all the ones below it. */
+  enum kernel {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE41,   // 12 bytes <-> 16 chars per step
+    KERNEL_AVX2,    // 24 bytes <-> 32 chars per step
+    KERNEL_AVX512,  // 48 bytes <-> 64 chars per step, needs AVX512VBMI
+    KERNEL_COUNT
+  };
+
+  inline const char *kernel_name(kernel k) {
+    static const char * const names[] = { "scalar", "sse4.1", "avx2", "avx512vbmi" };
+    return (k >= KERNEL_SCALAR && k < KERNEL_COUNT) ? names[k] : "unknown";
+  }
+
+  /* Widest kernel this cpu (and OS, for the AVX register state) can run */
+  inline kernel kernel_detect() {
+#ifdef BASE64_X86_SIMD
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+      return KERNEL_SCALAR;
+    }
+    if (!(ecx & bit_OSXSAVE) || __get_cpuid_max(0, NULL) < 7) {
+      return KERNEL_SSE41;
+    }
+    uint32_t xcr0, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    (void)xcr0_hi;
+    if ((xcr0 & 0x6) != 0x6) {
+      /* OS does not save YMM */
+      return KERNEL_SSE41;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (!(ebx & bit_AVX2)) {
+      return KERNEL_SSE41;
+    }
+    if ((xcr0 & 0xe0) == 0xe0 &&
+        (ebx & bit_AVX512F) && (ebx & bit_AVX512BW) && (ecx & bit_AVX512VBMI)) {
+      return KERNEL_AVX512;
+    }
+    return KERNEL_AVX2;
+#else
+    return KERNEL_SCALAR;
+#endif
+  }
+
+  /* Kernel used by encode() and decode(), probed once */
+  inline kernel kernel_active() {
+    static const kernel k = kernel_detect();
+    return k;
+  }
+
+  inline bool kernel_supported(kernel k) {
+    return k >= KERNEL_SCALAR && k <= kernel_active();
+  }
+
+#ifdef BASE64_X86_SIMD
+  /*
+   * One step of each kernel: 12/24/48 bytes <-> 16/32/64 characters. A
+   * step may load or store more than it carries (the _NEED constants),
+   * callers make sure that much is there. Decode steps always store and
+   * return false if a character was outside the alphabet, so callers can
+   * either stop or just and the results together and look once.
+   *
+   * Encode is Mula's pshufb/multiply-shift method; decode validates with
+   * a nibble bitmap (or vpermi2b on AVX-512) and packs with pmaddubsw.
+   */
+  const size_t _SSE41_ENC_IN_NEED = 16, _SSE41_ENC_OUT_NEED = 16;
+  const size_t _SSE41_DEC_IN_NEED = 16, _SSE41_DEC_OUT_NEED = 16;
+  const size_t _AVX2_ENC_IN_NEED = 28, _AVX2_ENC_OUT_NEED = 32;
+  const size_t _AVX2_DEC_IN_NEED = 32, _AVX2_DEC_OUT_NEED = 32;
+  const size_t _AVX512_ENC_IN_NEED = 48, _AVX512_ENC_OUT_NEED = 64;
+  const size_t _AVX512_DEC_IN_NEED = 64, _AVX512_DEC_OUT_NEED = 48;
+
+  __attribute__((target("sse4.1")))
+  static inline void _encode_step_sse41(const uint8_t *in, uint8_t *out) {
+    /* [b0 b1 b2] -> 32 bit lane [b1 b0 b2 b1], then four 6 bit fields */
+    const __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in),
+                                       _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i idx = _mm_or_si128(t1, t3);
+    /* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                        '/' - 63, 'A', 0, 0);
+    _mm_storeu_si128((__m128i *)out, _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx));
+  }
+
+  /* values of each character, or a zero bit for a character outside the
+   * alphabet, indexed by [low nibble] and tested with bit [high nibble] */
+  __attribute__((target("sse4.1")))
+  static inline bool _decode_step_sse41(const uint8_t *in, uint8_t *out) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)in);
+    const __m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+    const __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+    const __m128i shift_lut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_lut = _mm_setr_epi8((char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                           (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                           (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    const __m128i bit_lut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i bad = _mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(mask_lut, lo),
+                                                     _mm_shuffle_epi8(bit_lut, hi)),
+                                       _mm_setzero_si128());
+    /* '/' shares its high nibble with '+' */
+    const __m128i shift = _mm_blendv_epi8(_mm_shuffle_epi8(shift_lut, hi), _mm_set1_epi8(16),
+                                          _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    const __m128i vals = _mm_add_epi8(v, shift);
+    const __m128i ab_bc = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+    const __m128i abc = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)out,
+                     _mm_shuffle_epi8(abc, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)));
+    return _mm_movemask_epi8(bad) == 0;
+  }
+
+  __attribute__((target("avx2")))
+  static inline void _encode_step_avx2(const uint8_t *in, uint8_t *out) {
+    /* 12 bytes into each 128 bit lane */
+    __m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in));
+    v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+    v = _mm256_shuffle_epi8(v, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                               10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i idx = _mm256_or_si256(t1, t3);
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0);
+    _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(_mm256_shuffle_epi8(shift, r), idx));
+  }
+
+  __attribute__((target("avx2")))
+  static inline bool _decode_step_avx2(const uint8_t *in, uint8_t *out) {
+    const __m256i shift_lut = _mm256_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                               0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_lut = _mm256_setr_epi8((char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                              (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                              (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54,
+                                              (char)0xa8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                              (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8, (char)0xf8,
+                                              (char)0xf0, 0x54, 0x50, 0x50, 0x50, 0x54);
+    const __m256i bit_lut = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i v = _mm256_loadu_si256((const __m256i *)in);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+    const __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+    const __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(mask_lut, lo),
+                                                           _mm256_shuffle_epi8(bit_lut, hi)),
+                                          _mm256_setzero_si256());
+    const __m256i shift = _mm256_blendv_epi8(_mm256_shuffle_epi8(shift_lut, hi), _mm256_set1_epi8(16),
+                                             _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    const __m256i vals = _mm256_add_epi8(v, shift);
+    const __m256i ab_bc = _mm256_maddubs_epi16(vals, _mm256_set1_epi32(0x01400140));
+    const __m256i abc = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+    __m256i r = _mm256_shuffle_epi8(abc, pack);
+    r = _mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)out, r);
+    return _mm256_movemask_epi8(bad) == 0;
+  }
+
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  static inline void _encode_step_avx512(const uint8_t *in, uint8_t *out) {
+    const __m512i shuf = _mm512_setr_epi32(0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+                                           0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+                                           0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+                                           0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+    const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aLL);
+    const __m512i lookup = _mm512_loadu_si512((const void *)encodeLookup);
+    const __m512i v = _mm512_maskz_loadu_epi8(0x0000ffffffffffffULL, (const void *)in);
+    const __m512i idx = _mm512_multishift_epi64_epi8(shifts, _mm512_permutexvar_epi8(shuf, v));
+    _mm512_storeu_si512((void *)out, _mm512_permutexvar_epi8(idx, lookup));
+  }
+
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  static inline bool _decode_step_avx512(const uint8_t *in, uint8_t *out) {
+    const __m512i lookup_lo = _mm512_load_si512((const void *)decodeTables.v);
+    const __m512i lookup_hi = _mm512_load_si512((const void *)(decodeTables.v + 64));
+    const __m512i pack = _mm512_setr_epi32(0x06000102, 0x090a0405, 0x0c0d0e08, 0x16101112,
+                                           0x191a1415, 0x1c1d1e18, 0x26202122, 0x292a2425,
+                                           0x2c2d2e28, 0x36303132, 0x393a3435, 0x3c3d3e38,
+                                           0, 0, 0, 0);
+    const __m512i v = _mm512_loadu_si512((const void *)in);
+    const __m512i vals = _mm512_permutex2var_epi8(lookup_lo, v, lookup_hi);
+    const __m512i ab_bc = _mm512_maddubs_epi16(vals, _mm512_set1_epi32(0x01400140));
+    const __m512i abc = _mm512_madd_epi16(ab_bc, _mm512_set1_epi32(0x00011000));
+    _mm512_mask_storeu_epi8((void *)out, 0x0000ffffffffffffULL, _mm512_permutexvar_epi8(pack, abc));
+    /* high bit set either in the input (non ascii) or the lookup (not in alphabet) */
+    return _mm512_movepi8_mask(_mm512_or_si512(vals, v)) == 0;
+  }
+
+  /*
+   * Bulk kernels. Each one runs whole steps while the input and output
+   * have room for the step's loads and stores, and returns how much input
+   * it consumed (3 bytes -> 4 chars, so the output size follows).
+   * Whatever is left is handed to the next narrower kernel and finally to
+   * the scalar code. A decode step with a character outside the alphabet
+   * stops the loop, so the scalar code finds and reports it.
+   */
+  __attribute__((target("sse4.1")))
+  static size_t _encode_sse41(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _SSE41_ENC_IN_NEED && out_room >= _SSE41_ENC_OUT_NEED) {
+      _encode_step_sse41(in + i, out);
+      out += 16;
+      out_room -= 16;
+      i += 12;
+    }
+    return i;
+  }
+
+  __attribute__((target("sse4.1")))
+  static size_t _decode_sse41(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _SSE41_DEC_IN_NEED && out_room >= _SSE41_DEC_OUT_NEED) {
+      if (!_decode_step_sse41(in + i, out)) {
+        break;
+      }
+      out += 12;
+      out_room -= 12;
+      i += 16;
+    }
+    return i;
+  }
+
+  __attribute__((target("avx2")))
+  static size_t _encode_avx2(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _AVX2_ENC_IN_NEED && out_room >= _AVX2_ENC_OUT_NEED) {
+      _encode_step_avx2(in + i, out);
+      out += 32;
+      out_room -= 32;
+      i += 24;
+    }
+    return i;
+  }
+
+  __attribute__((target("avx2")))
+  static size_t _decode_avx2(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _AVX2_DEC_IN_NEED && out_room >= _AVX2_DEC_OUT_NEED) {
+      if (!_decode_step_avx2(in + i, out)) {
+        break;
+      }
+      out += 24;
+      out_room -= 24;
+      i += 32;
+    }
+    return i;
+  }
+
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  static size_t _encode_avx512(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _AVX512_ENC_IN_NEED && out_room >= _AVX512_ENC_OUT_NEED) {
+      _encode_step_avx512(in + i, out);
+      out += 64;
+      out_room -= 64;
+      i += 48;
+    }
+    return i;
+  }
+
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  static size_t _decode_avx512(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t i = 0;
+    while (in_len - i >= _AVX512_DEC_IN_NEED && out_room >= _AVX512_DEC_OUT_NEED) {
+      if (!_decode_step_avx512(in + i, out)) {
+        break;
+      }
+      out += 48;
+      out_room -= 48;
+      i += 64;
+    }
+    return i;
+  }
+#endif // BASE64_X86_SIMD
+
+  /* Run kernel k and then the narrower ones over what it left; returns
+   * the input consumed, the rest is for the scalar code */
+  inline size_t _encode_bulk(kernel k, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t done = 0;
+#ifdef BASE64_X86_SIMD
+    size_t n;
+    switch (k) {
+    case KERNEL_AVX512:
+      n = _encode_avx512(in, in_len, out, out_room);
+      done += n; out += (n / 3) * 4; out_room -= (n / 3) * 4;
+      // fall through
+    case KERNEL_AVX2:
+      n = _encode_avx2(in + done, in_len - done, out, out_room);
+      done += n; out += (n / 3) * 4; out_room -= (n / 3) * 4;
+      // fall through
+    case KERNEL_SSE41:
+      done += _encode_sse41(in + done, in_len - done, out, out_room);
+      break;
+    default:
+      break;
+    }
+#else
+    (void)k; (void)in; (void)in_len; (void)out; (void)out_room;
+#endif
+    return done;
+  }
+
+  inline size_t _decode_bulk(kernel k, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_room) {
+    size_t done = 0;
+#ifdef BASE64_X86_SIMD
+    size_t n;
+    switch (k) {
+    case KERNEL_AVX512:
+      n = _decode_avx512(in, in_len, out, out_room);
+      done += n; out += (n / 4) * 3; out_room -= (n / 4) * 3;
+      // fall through
+    case KERNEL_AVX2:
+      n = _decode_avx2(in + done, in_len - done, out, out_room);
+      done += n; out += (n / 4) * 3; out_room -= (n / 4) * 3;
+      // fall through
+    case KERNEL_SSE41:
+      done += _decode_sse41(in + done, in_len - done, out, out_room);
+      break;
+    default:
+      break;
+    }
+#else
+    (void)k; (void)in; (void)in_len; (void)out; (void)out_room;
+#endif
+    return done;
+  }
+
+  /* encode() with an explicit kernel; k must be kernel_supported() */
+  inline void encode_with(kernel k, const void * in, const size_t in_size, char *out, size_t *out_size_p) {
     size_t out_limit;
     if (in_size == 0) {
       /* easy */
+      if (out_size_p) {
+        *out_size_p = 0;
+      }
       return;
     };
     if (out_size_p) {
@@ -23,11 +419,14 @@ namespace base64 {
     uint8_t const * in_p = (uint8_t const *)in;
     size_t in_limit = in_size;
     /* Out_limit big enough? Avoid checking in loops. Adjust
-     * how much input we can drink accordingly */
-    if (out_limit < (4 * in_limit) / 3) {
-      in_limit = (out_limit * 3) / 4;
+     * how much input we can drink accordingly: whole quanta, and
+     * the 2 or 3 characters a trailing 1 or 2 bytes take */
+    if ((in_limit / 3) * 4 + (in_limit % 3 ? in_limit % 3 + 1 : 0) > out_limit) {
+      in_limit = (out_limit / 4) * 3 + (out_limit % 4 ? out_limit % 4 - 1 : 0);
     }
-    int i = 0;
+    size_t i = _encode_bulk(k, in_p, in_limit, out_p, out_limit);
+    in_p += i;
+    out_p += (i / 3) * 4;
     while((in_limit - i) > 0) {
       if ((in_limit - i) >= 3) {
 	temp = (*in_p++) << 16;
@@ -69,23 +468,40 @@ namespace base64 {
     }
   }
 
+  inline void encode(const void * in, const size_t in_size, char *out, size_t *out_size_p) {
+    encode_with(kernel_active(), in, in_size, out, out_size_p);
+  }
+
 
-  unsigned char inline _decode_one(const unsigned char x) {
-    unsigned char ret;
-    if (x >= 'A' && x <= 'Z') ret = x - 'A';
-    else if (x >= 'a' && x <= 'z') ret = x - ('a' - ('Z' - 'A' + 1));
-    /* - ('0' - ('Z' - 'A' + 1) - 'z' - 'a' + 1) wraps to - 0xfc, which is + 4 */
-    else if (x >= '0' && x <= '9') ret = x + 4; 
-    else if (x == '+') ret = 0x3e;
-    else if (x == '/') ret = 0x3f;
-    return ret;
+  /* Offset of the first character of in[0, in_size) outside the alphabet,
+   * in_size if there is none. Only used once decoding has failed. */
+  inline size_t _decode_find_bad(const uint8_t *in, const size_t in_size) {
+    size_t i = 0;
+    while (i < in_size && !(decodeTables.v[in[i]] & 0x80)) {
+      i++;
+    }
+    return i;
   }
 
-  void decode(char const * in, const size_t in_size, void *out, size_t *out_size_p) {
+  /*
+   * decode() with an explicit kernel; k must be kernel_supported().
+   *
+   * Returns false if the input holds a character outside the alphabet or
+   * ends in a lone character (no byte can come out of 6 bits). Then
+   * *err_offset_p, if given, is the offset of the first bad character (or
+   * of the lone one) and *out_size_p counts only the bytes decoded from
+   * the whole quanta before it. As with encode, output that does not fit
+   * in *out_size_p bytes is silently left off.
+   */
+  inline bool decode_with(kernel k, char const * in, const size_t in_size, void *out, size_t *out_size_p,
+                          size_t *err_offset_p = NULL) {
     size_t out_limit;
     if (in_size == 0) {
       /* easy */
-      return;
+      if (out_size_p) {
+        *out_size_p = 0;
+      }
+      return true;
     };
     if (out_size_p) {
       out_limit = *out_size_p;
@@ -96,64 +512,469 @@ namespace base64 {
     uint8_t *out_p = (uint8_t *)out;
     uint8_t const * in_p = (uint8_t const *)in;
     size_t in_limit = in_size;
-    /* Out_limit big enough? Avoid checking in loops. Adjust
-     * how much input we can drink accordingly */
+    /* Out_limit big enough? Avoid checking in loops. Adjust how much
+     * input we can drink accordingly, never leaving a lone character */
     if (out_limit < (3 * in_limit) / 4) {
-      in_limit = (out_limit * 4) / 3;
-    }
-    unsigned int i = 0;
-    while(i < in_limit) {
-      uint32_t tmp = 0;
-      if (in_limit - i >= 4) {
-	// 4 base 64 bytes, 24 bits, into 3 bytes
-	int j = 0;
-	for(; j < 4; j++) {
-	  tmp <<= 6;
-	  uint8_t x = *(in_p + j);
-	  tmp |= _decode_one(x);
-	}
-	*out_p++ = (tmp >> 16) & 0xFF;
-	*out_p++ = (tmp >> 8) & 0xFF;
-	*out_p++ = tmp  & 0xFF;
-	in_p += j;
-	i += j;
-      } else if (in_limit - i == 3) {
-	// decode 3 into 2 bytes
-	uint8_t x = *(in_p);
-	tmp |= _decode_one(x);
-	tmp <<= 6;
-	x = *(in_p + 1);
-	tmp |= _decode_one(x);
-	tmp <<= 6;
-	x = *(in_p + 2);
-	tmp |= _decode_one(x);
-	/* XX+XXXXYYYY+YYZZZZZ */
-	/*   |   b1   |  b0    */
-	*out_p++ = (tmp >> 16) & 0xFF;
-	*out_p++ = (tmp >> 8) & 0xFF;
-	// done, so skipping in_p += 3;
-	i += 3;
-      } else if (in_limit - i == 2) {
-	// decode 2 into 1 byte
-	uint8_t x = *(in_p);
-	tmp |= _decode_one(x);
-	tmp <<= 6;
-	x = *(in_p + 1);
-	tmp |= _decode_one(x);
-	/* +XXXXXXYY+YYYY */
-	/* |   b0   |     */
-	*out_p++ = (tmp >> 4) & 0xFF;
-	// done, so skipping in_p += 3;
-	i += 2;
-      } else if (in_limit - i == 1) {
-	// error, let it go, can't do anything about
-	// caller supplying an incorrectly sized input
-	// buffer.
+      in_limit = (out_limit / 3) * 4 + (out_limit % 3 ? out_limit % 3 + 1 : 0);
+    }
+    const size_t bulk = _decode_bulk(k, in_p, in_limit, out_p, out_limit);
+    size_t i = bulk;
+    in_p += i;
+    out_p += (i / 4) * 3;
+    /* branch free: bad characters only show up in err, looked at once */
+    uint32_t err = 0;
+    while (in_limit - i >= 4) {
+      const uint32_t tmp = decodeTables.d[0][in_p[0]] | decodeTables.d[1][in_p[1]] |
+                           decodeTables.d[2][in_p[2]] | decodeTables.d[3][in_p[3]];
+      err |= tmp;
+      out_p[0] = (tmp >> 16) & 0xFF;
+      out_p[1] = (tmp >> 8) & 0xFF;
+      out_p[2] = tmp & 0xFF;
+      out_p += 3;
+      in_p += 4;
+      i += 4;
+    }
+    const size_t tail = in_limit - i;
+    if (tail >= 2) {
+      /* 2 chars into 1 byte, 3 into 2: decode as a quantum padded with 'A' */
+      const uint32_t tmp = decodeTables.d[0][in_p[0]] | decodeTables.d[1][in_p[1]] |
+                           (tail == 3 ? decodeTables.d[2][in_p[2]] : 0);
+      err |= tmp;
+      *out_p++ = (tmp >> 16) & 0xFF;
+      if (tail == 3) {
+        *out_p++ = (tmp >> 8) & 0xFF;
       }
     }
+    size_t bad = in_limit;
+    if (err & 0xFF000000) {
+      bad = bulk + _decode_find_bad((const uint8_t *)in + bulk, in_limit - bulk);
+    } else if (tail == 1) {
+      bad = in_limit - 1;
+    }
+    if (bad < in_limit) {
+      if (err_offset_p) {
+        *err_offset_p = bad;
+      }
+      if (out_size_p) {
+        *out_size_p = (bad / 4) * 3;
+      }
+      return false;
+    }
     if (out_size_p) {
       *out_size_p = out_p - (uint8_t *)out;
     }
+    return true;
+  }
+
+  inline bool decode(char const * in, const size_t in_size, void *out, size_t *out_size_p,
+                     size_t *err_offset_p = NULL) {
+    return decode_with(kernel_active(), in, in_size, out, out_size_p, err_offset_p);
+  }
+
+  /* Characters for n bytes, no padding */
+  constexpr size_t encoded_size(const size_t n) {
+    return (n / 3) * 4 + (n % 3 ? n % 3 + 1 : 0);
+  }
+
+  /* Bytes from n characters; a lone trailing character gives nothing */
+  constexpr size_t decoded_size(const size_t n) {
+    return (n / 4) * 3 + (n % 4 ? n % 4 - 1 : 0);
+  }
+
+  /*
+   * Streaming encoder for input that arrives, or output that leaves, in
+   * pieces. update() encodes whole quanta as far as both buffers allow and
+   * reports what it used of each; the 0-2 bytes that do not make a quantum
+   * are kept for the next call. Input that was not used (out of room) is
+   * the caller's to offer again. finish() writes the last 0, 2 or 3
+   * characters. The output is exactly what encode() gives for the whole
+   * input at once.
+   */
+  class encoder {
+  public:
+    encoder() : _n(0) {}
+
+    void update(const void *in, size_t in_size, char *out, size_t out_room,
+                size_t *in_used_p, size_t *out_used_p) {
+      const uint8_t *in_p = (const uint8_t *)in;
+      size_t in_used = 0;
+      size_t out_used = 0;
+      if (_n > 0) {
+        if (in_size < 3 - _n) {
+          memcpy(_carry + _n, in_p, in_size);
+          _n += in_size;
+          in_used = in_size;
+        } else if (out_room >= 4) {
+          in_used = 3 - _n;
+          memcpy(_carry + _n, in_p, in_used);
+          size_t sz = 4;
+          encode(_carry, 3, out, &sz);
+          _n = 0;
+          out_used = 4;
+        }
+      }
+      if (_n == 0) {
+        size_t quanta = (in_size - in_used) / 3;
+        if (quanta > (out_room - out_used) / 4) {
+          quanta = (out_room - out_used) / 4;
+        }
+        if (quanta > 0) {
+          size_t sz = quanta * 4;
+          encode(in_p + in_used, quanta * 3, out + out_used, &sz);
+          in_used += quanta * 3;
+          out_used += sz;
+        }
+        if (in_size - in_used < 3) {
+          _n = in_size - in_used;
+          memcpy(_carry, in_p + in_used, _n);
+          in_used = in_size;
+        }
+      }
+      *in_used_p = in_used;
+      *out_used_p = out_used;
+    }
+
+    /* false, and nothing written, if out_room cannot take the tail */
+    bool finish(char *out, size_t out_room, size_t *out_used_p) {
+      *out_used_p = 0;
+      if (_n == 0) {
+        return true;
+      }
+      if (out_room < _n + 1) {
+        return false;
+      }
+      size_t sz = out_room;
+      encode(_carry, _n, out, &sz);
+      _n = 0;
+      *out_used_p = sz;
+      return true;
+    }
+
+    void reset() { _n = 0; }
+
+  private:
+    uint8_t _carry[3];
+    size_t _n;
+  };
+
+  /*
+   * Streaming decoder, the mirror of encoder: keeps 0-3 characters between
+   * calls. On a character outside the alphabet update() returns false, the
+   * bytes of the quanta before it are in out, and error_offset() is its
+   * offset from the start of the stream; the decoder then refuses more
+   * input until reset(). finish() flushes 2 or 3 leftover characters and
+   * fails on a lone one.
+   */
+  class decoder {
+  public:
+    decoder() : _n(0), _base(0), _failed(false), _err_offset(0) {}
+
+    bool update(const char *in, size_t in_size, void *out, size_t out_room,
+                size_t *in_used_p, size_t *out_used_p) {
+      uint8_t *out_p = (uint8_t *)out;
+      size_t in_used = 0;
+      size_t out_used = 0;
+      *in_used_p = 0;
+      *out_used_p = 0;
+      if (_failed) {
+        return false;
+      }
+      if (_n > 0) {
+        if (in_size < 4 - _n) {
+          memcpy(_carry + _n, in, in_size);
+          _n += in_size;
+          in_used = in_size;
+        } else if (out_room >= 3) {
+          in_used = 4 - _n;
+          memcpy(_carry + _n, in, in_used);
+          size_t sz = 3;
+          size_t bad;
+          if (!decode(_carry, 4, out_p, &sz, &bad)) {
+            return _fail(_base + bad, 0, 0, in_used_p, out_used_p);
+          }
+          _n = 0;
+          _base += 4;
+          out_used = 3;
+        }
+      }
+      if (_n == 0) {
+        size_t quanta = (in_size - in_used) / 4;
+        if (quanta > (out_room - out_used) / 3) {
+          quanta = (out_room - out_used) / 3;
+        }
+        if (quanta > 0) {
+          size_t sz = quanta * 3;
+          size_t bad;
+          if (!decode(in + in_used, quanta * 4, out_p + out_used, &sz, &bad)) {
+            return _fail(_base + bad, in_used + (bad / 4) * 4, out_used + sz, in_used_p, out_used_p);
+          }
+          in_used += quanta * 4;
+          out_used += sz;
+          _base += quanta * 4;
+        }
+        if (in_size - in_used < 4) {
+          _n = in_size - in_used;
+          memcpy(_carry, in + in_used, _n);
+          in_used = in_size;
+        }
+      }
+      *in_used_p = in_used;
+      *out_used_p = out_used;
+      return true;
+    }
+
+    /* false on a bad or lone last character, or if out_room is too small */
+    bool finish(void *out, size_t out_room, size_t *out_used_p) {
+      *out_used_p = 0;
+      if (_failed) {
+        return false;
+      }
+      if (_n == 0) {
+        return true;
+      }
+      if (out_room < decoded_size(_n)) {
+        return false;
+      }
+      size_t sz = out_room;
+      size_t bad;
+      if (!decode(_carry, _n, out, &sz, &bad)) {
+        size_t in_used, out_used;
+        return _fail(_base + bad, 0, 0, &in_used, &out_used);
+      }
+      _base += _n;
+      _n = 0;
+      *out_used_p = sz;
+      return true;
+    }
+
+    /* Stream offset of the bad character once update() or finish() failed */
+    uint64_t error_offset() const { return _err_offset; }
+
+    void reset() { _n = 0; _base = 0; _failed = false; _err_offset = 0; }
+
+  private:
+    bool _fail(uint64_t err_offset, size_t in_used, size_t out_used, size_t *in_used_p, size_t *out_used_p) {
+      _failed = true;
+      _err_offset = err_offset;
+      *in_used_p = in_used;
+      *out_used_p = out_used;
+      return false;
+    }
+
+    char _carry[4];
+    size_t _n;
+    uint64_t _base;  // stream offset of _carry[0], or of the next input
+    bool _failed;
+    uint64_t _err_offset;
+  };
+
+  /*
+   * Fixed size codecs, for buffers whose size is known at compile time
+   * (a SIFT vector is encode_fixed<128 * sizeof(float)>). How many steps
+   * each kernel takes and what is left for the scalar tail are constants,
+   * so the loops unroll to straight line code with no bounds arithmetic;
+   * only the kernel is picked at runtime. Output is the same as encode(),
+   * and decode_fixed() accepts exactly what decode() does.
+   */
+  constexpr size_t _fixed_steps(size_t in_len, size_t out_len, size_t in_step, size_t out_step,
+                                size_t in_need, size_t out_need) {
+    size_t n = 0;
+    while (in_len >= in_need && out_len >= out_need) {
+      in_len -= in_step;
+      out_len -= out_step;
+      n++;
+    }
+    return n;
+  }
+
+  template <size_t N>
+  inline void _encode_fixed_scalar(const uint8_t *in, uint8_t *out) {
+#pragma GCC unroll 16
+    for (size_t q = 0; q < N / 3; q++) {
+      const uint32_t temp = (in[3 * q] << 16) | (in[3 * q + 1] << 8) | in[3 * q + 2];
+      // little endian
+      uint32_t out_val = encodeLookup[(temp & 0x00FC0000) >> 18];
+      out_val |= encodeLookup[(temp & 0x0003F000) >> 12] << 8;
+      out_val |= encodeLookup[(temp & 0x00000FC0) >> 6] << 16;
+      out_val |= encodeLookup[(temp & 0x0000003F)] << 24;
+      memcpy(out + 4 * q, &out_val, 4);
+    }
+    if (N % 3) {
+      in += (N / 3) * 3;
+      out += (N / 3) * 4;
+      const uint32_t temp = (in[0] << 16) | (N % 3 == 2 ? in[1] << 8 : 0);
+      out[0] = encodeLookup[(temp & 0x00FC0000) >> 18];
+      out[1] = encodeLookup[(temp & 0x0003F000) >> 12];
+      if (N % 3 == 2) {
+        out[2] = encodeLookup[(temp & 0x00000FC0) >> 6];
+      }
+    }
+  }
+
+  /* Returns the or of the pre-shifted table entries; bits 24 and up mean a bad character */
+  template <size_t N>
+  inline uint32_t _decode_fixed_scalar(const uint8_t *in, uint8_t *out) {
+    uint32_t err = 0;
+#pragma GCC unroll 16
+    for (size_t q = 0; q < N / 3; q++) {
+      const uint32_t tmp = decodeTables.d[0][in[4 * q]] | decodeTables.d[1][in[4 * q + 1]] |
+                           decodeTables.d[2][in[4 * q + 2]] | decodeTables.d[3][in[4 * q + 3]];
+      err |= tmp;
+      out[3 * q] = (tmp >> 16) & 0xFF;
+      out[3 * q + 1] = (tmp >> 8) & 0xFF;
+      out[3 * q + 2] = tmp & 0xFF;
+    }
+    if (N % 3) {
+      in += (N / 3) * 4;
+      out += (N / 3) * 3;
+      const uint32_t tmp = decodeTables.d[0][in[0]] | decodeTables.d[1][in[1]] |
+                           (N % 3 == 2 ? decodeTables.d[2][in[2]] : 0);
+      err |= tmp;
+      out[0] = (tmp >> 16) & 0xFF;
+      if (N % 3 == 2) {
+        out[1] = (tmp >> 8) & 0xFF;
+      }
+    }
+    return err;
+  }
+
+#ifdef BASE64_X86_SIMD
+  template <size_t N>
+  __attribute__((target("sse4.1")))
+  inline void _encode_fixed_sse41(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(N, encoded_size(N), 12, 16, _SSE41_ENC_IN_NEED, _SSE41_ENC_OUT_NEED);
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      _encode_step_sse41(in + 12 * s, out + 16 * s);
+    }
+    _encode_fixed_scalar<N - 12 * steps>(in + 12 * steps, out + 16 * steps);
+  }
+
+  template <size_t N>
+  __attribute__((target("avx2")))
+  inline void _encode_fixed_avx2(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(N, encoded_size(N), 24, 32, _AVX2_ENC_IN_NEED, _AVX2_ENC_OUT_NEED);
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      _encode_step_avx2(in + 24 * s, out + 32 * s);
+    }
+    _encode_fixed_sse41<N - 24 * steps>(in + 24 * steps, out + 32 * steps);
+  }
+
+  template <size_t N>
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  inline void _encode_fixed_avx512(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(N, encoded_size(N), 48, 64, _AVX512_ENC_IN_NEED, _AVX512_ENC_OUT_NEED);
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      _encode_step_avx512(in + 48 * s, out + 64 * s);
+    }
+    _encode_fixed_avx2<N - 48 * steps>(in + 48 * steps, out + 64 * steps);
+  }
+
+  template <size_t N>
+  __attribute__((target("sse4.1")))
+  inline bool _decode_fixed_sse41(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(encoded_size(N), N, 16, 12, _SSE41_DEC_IN_NEED, _SSE41_DEC_OUT_NEED);
+    bool ok = true;
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      ok &= _decode_step_sse41(in + 16 * s, out + 12 * s);
+    }
+    return ok & !(_decode_fixed_scalar<N - 12 * steps>(in + 16 * steps, out + 12 * steps) & 0xFF000000);
+  }
+
+  template <size_t N>
+  __attribute__((target("avx2")))
+  inline bool _decode_fixed_avx2(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(encoded_size(N), N, 32, 24, _AVX2_DEC_IN_NEED, _AVX2_DEC_OUT_NEED);
+    bool ok = true;
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      ok &= _decode_step_avx2(in + 32 * s, out + 24 * s);
+    }
+    return ok & _decode_fixed_sse41<N - 24 * steps>(in + 32 * steps, out + 24 * steps);
+  }
+
+  template <size_t N>
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  inline bool _decode_fixed_avx512(const uint8_t *in, uint8_t *out) {
+    constexpr size_t steps = _fixed_steps(encoded_size(N), N, 64, 48, _AVX512_DEC_IN_NEED, _AVX512_DEC_OUT_NEED);
+    bool ok = true;
+#pragma GCC unroll 64
+    for (size_t s = 0; s < steps; s++) {
+      ok &= _decode_step_avx512(in + 64 * s, out + 48 * s);
+    }
+    return ok & _decode_fixed_avx2<N - 48 * steps>(in + 64 * steps, out + 48 * steps);
+  }
+#endif // BASE64_X86_SIMD
+
+  /* Writes exactly encoded_size(N) characters */
+  template <size_t N>
+  inline void encode_fixed(const void *in, char *out) {
+    const uint8_t *in_p = (const uint8_t *)in;
+    uint8_t *out_p = (uint8_t *)out;
+    switch (kernel_active()) {
+#ifdef BASE64_X86_SIMD
+    case KERNEL_AVX512:
+      _encode_fixed_avx512<N>(in_p, out_p);
+      break;
+    case KERNEL_AVX2:
+      _encode_fixed_avx2<N>(in_p, out_p);
+      break;
+    case KERNEL_SSE41:
+      _encode_fixed_sse41<N>(in_p, out_p);
+      break;
+#endif
+    default:
+      _encode_fixed_scalar<N>(in_p, out_p);
+      break;
+    }
+  }
+
+  template <size_t N>
+  inline std::array<char, encoded_size(N)> encode_fixed(const void *in) {
+    std::array<char, encoded_size(N)> out;
+    encode_fixed<N>(in, out.data());
+    return out;
+  }
+
+  /* Reads exactly encoded_size(N) characters; false and *err_offset_p as for decode() */
+  template <size_t N>
+  inline bool decode_fixed(const char *in, void *out, size_t *err_offset_p = NULL) {
+    const uint8_t *in_p = (const uint8_t *)in;
+    uint8_t *out_p = (uint8_t *)out;
+    bool ok;
+    switch (kernel_active()) {
+#ifdef BASE64_X86_SIMD
+    case KERNEL_AVX512:
+      ok = _decode_fixed_avx512<N>(in_p, out_p);
+      break;
+    case KERNEL_AVX2:
+      ok = _decode_fixed_avx2<N>(in_p, out_p);
+      break;
+    case KERNEL_SSE41:
+      ok = _decode_fixed_sse41<N>(in_p, out_p);
+      break;
+#endif
+    default:
+      ok = !(_decode_fixed_scalar<N>(in_p, out_p) & 0xFF000000);
+      break;
+    }
+    if (!ok) {
+      /* rare, let the general decoder find the offset */
+      size_t out_sz = N;
+      return decode_with(KERNEL_SCALAR, in, encoded_size(N), out, &out_sz, err_offset_p);
+    }
+    return true;
+  }
+
+  template <size_t N>
+  inline std::array<uint8_t, N> decode_fixed(const std::array<char, encoded_size(N)> &in, bool *ok_p,
+                                             size_t *err_offset_p = NULL) {
+    std::array<uint8_t, N> out;
+    *ok_p = decode_fixed<N>(in.data(), out.data(), err_offset_p);
+    return out;
   }
 
   void encode(std::vector<double>in, char *out, size_t *out_size_p) {
@@ -0,0 +1,532 @@
+//
+// Benchmarks for the codecs, the vector files and the database paths
+//
+// Every case runs -w times untimed to warm caches and the branch
+// predictors, then -r timed repetitions, and reports min, p50, p90, p99,
+// max and mean seconds a repetition and the items and MB a second at the
+// median. The results go out as JSON (the default) or CSV, so the runs of
+// two builds can be diffed or kept over time. -d adds inserts and
+// retrieves against the local mysqld, in a database of their own.
+//
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "base64.hpp"
+#include "envelope.hpp"
+#include "quant.hpp"
+#include "vecs.hpp"
+#include "dbpool.hpp"
+#include "vecdb.hpp"
+#include "nlohmann/json.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+const uint16_t OP_BENCH = 151;
+const uint16_t CLASS_A_BENCH = 900;
+const uint16_t CLASS_B_BENCH = 901;
+
+// Something the optimizer cannot see through, so the loops are not dropped
+volatile uint64_t sink;
+
+struct options {
+  unsigned int reps;
+  unsigned int warmups;
+};
+
+// One case: what it does a repetition and how long each repetition took
+struct result {
+  std::string name;
+  std::string variant;
+  size_t items;
+  double bytes;
+  std::vector<double> secs;
+  bool ok;
+};
+
+typedef std::function<bool ()> step;
+
+// Nearest rank percentile of sorted s, p in (0, 1]
+double
+percentile(const std::vector<double> &s, double p)
+{
+  size_t r = (size_t)ceil(p * s.size());
+  return s[r == 0 ? 0 : std::min(r, s.size()) - 1];
+}
+
+// run warmups then reps times; prepare, if given, before each run and untimed
+void
+measure(std::vector<result> *results, const options &opt, const std::string &name, const std::string &variant,
+        size_t items, double bytes, const step &run, const step &prepare = step())
+{
+  result r;
+  r.name = name;
+  r.variant = variant;
+  r.items = items;
+  r.bytes = bytes;
+  r.ok = true;
+  unsigned int i = 0;
+  for (; i < opt.warmups + opt.reps && r.ok; i++) {
+    if (prepare && !prepare()) {
+      r.ok = false;
+      break;
+    }
+    const double t0 = elapsed();
+    r.ok = run();
+    if (i >= opt.warmups) {
+      r.secs.push_back(elapsed() - t0);
+    }
+  }
+  if (r.ok) {
+    std::vector<double> s = r.secs;
+    std::sort(s.begin(), s.end());
+    const double p50 = percentile(s, 0.5);
+    fprintf(stderr, "%-22s %-24s p50 %10.6fs  %12.0f items/s  %9.1f MB/s\n", name.c_str(), variant.c_str(), p50,
+            items / p50, bytes / p50 / 1e6);
+  } else {
+    fprintf(stderr, "%-22s %-24s FAILED\n", name.c_str(), variant.c_str());
+  }
+  results->push_back(r);
+}
+
+// Throughput of every supported kernel over buffers from a header to a large blob
+void
+bench_base64(std::vector<result> *results, const options &opt)
+{
+  namespace b64 = base64;
+  const size_t sizes[] = { 48, 512, 4096, 65536, 1 << 20 };
+  std::vector<uint8_t> raw(1 << 20);
+  std::vector<char> text(b64::encoded_size(raw.size()) + 4);
+  std::vector<uint8_t> back(raw.size() + 4);
+  srandom(19);
+  for (uint8_t &c : raw) {
+    c = random();
+  }
+  for (size_t size : sizes) {
+    // a few MB a repetition, however small the buffer
+    const size_t iters = std::max((size_t)1, (size_t)(4 << 20) / size);
+    const size_t text_len = b64::encoded_size(size);
+    int k = b64::KERNEL_SCALAR;
+    for (; k < b64::KERNEL_COUNT; k++) {
+      if (!b64::kernel_supported((b64::kernel)k)) {
+        continue;
+      }
+      const b64::kernel kern = (b64::kernel)k;
+      const std::string variant = std::string(b64::kernel_name(kern)) + "/" + std::to_string(size);
+      measure(results, opt, "base64.encode", variant, iters, (double)iters * size, [&]() {
+        size_t i = 0;
+        for (; i < iters; i++) {
+          size_t out = text.size();
+          b64::encode_with(kern, raw.data(), size, text.data(), &out);
+          sink += out;
+        }
+        return true;
+      });
+      bool ok = true;
+      measure(results, opt, "base64.decode", variant, iters, (double)iters * size, [&]() {
+        size_t i = 0;
+        for (; i < iters; i++) {
+          size_t out = back.size();
+          ok &= b64::decode_with(kern, text.data(), text_len, back.data(), &out);
+          sink += out;
+        }
+        return ok && memcmp(back.data(), raw.data(), size) == 0;
+      });
+    }
+  }
+}
+
+// A SIFT row through the envelope: written in place, parsed in place, and parsed by nlohmann
+void
+bench_envelope(std::vector<result> *results, const options &opt)
+{
+  const size_t d = 128, iters = 20000;
+  std::vector<float> v(d), out(d);
+  size_t i = 0;
+  for (; i < d; i++) {
+    v[i] = (float)(i * 7 % 128);
+  }
+  const envelope::fields f(d, "f32");
+  std::vector<char> buf(envelope::max_size(d * sizeof(float)));
+  const size_t len = envelope::write(buf.data(), v.data(), d * sizeof(float), f);
+  const double row_bytes = d * sizeof(float);
+
+  measure(results, opt, "envelope.write", "sift", iters, iters * row_bytes, [&]() {
+    size_t i = 0;
+    for (; i < iters; i++) {
+      sink += envelope::write(buf.data(), v.data(), d * sizeof(float), f);
+    }
+    return true;
+  });
+  std::string s;
+  measure(results, opt, "envelope.append", "sift", iters, iters * row_bytes, [&]() {
+    s.clear();
+    size_t i = 0;
+    for (; i < iters; i++) {
+      envelope::append(&s, v.data(), d * sizeof(float), f);
+    }
+    sink += s.size();
+    return true;
+  });
+  measure(results, opt, "envelope.parse_decode", "sift", iters, iters * row_bytes, [&]() {
+    bool ok = true;
+    size_t i = 0;
+    for (; i < iters; i++) {
+      envelope::view e;
+      ok &= envelope::parse(buf.data(), len, &e) && envelope::decode(e, out.data(), d * sizeof(float));
+    }
+    return ok && out == v;
+  });
+
+  // the same row with the keys the other way round takes the nlohmann path
+  std::string slow(buf.data(), len);
+  const size_t comma = slow.find(",\"dim\"");
+  slow = "{" + slow.substr(comma + 1, slow.size() - comma - 2) + "," + slow.substr(1, comma - 1) + "}";
+  const size_t slow_iters = iters / 10;
+  measure(results, opt, "envelope.parse_decode", "sift/slow path", slow_iters, slow_iters * row_bytes, [&]() {
+    bool ok = true;
+    std::string spill;
+    size_t i = 0;
+    for (; i < slow_iters; i++) {
+      envelope::view e;
+      ok &= envelope::parse(slow.data(), slow.size(), &e, &spill) && envelope::decode(e, out.data(), d * sizeof(float));
+    }
+    return ok && out == v;
+  });
+}
+
+// Every smaller dtype, both ways, through every supported kernel
+void
+bench_quant(std::vector<result> *results, const options &opt)
+{
+  const size_t d = 128, iters = 100000;
+  std::vector<float> v(d), out(d);
+  size_t i = 0;
+  for (; i < d; i++) {
+    v[i] = (float)(i * 7 % 128);
+  }
+  std::vector<uint8_t> packed(quant::bytes(quant::DT_I8, d) + quant::bytes(quant::DT_F32, d));
+  int t = quant::DT_F16;
+  for (; t < quant::DT_COUNT; t++) {
+    int k = quant::KERNEL_SCALAR;
+    for (; k < quant::KERNEL_COUNT; k++) {
+      if (!quant::kernel_supported((quant::kernel)k)) {
+        continue;
+      }
+      const quant::dtype dt = (quant::dtype)t;
+      const quant::kernel kern = (quant::kernel)k;
+      const std::string variant = std::string(quant::name(dt)) + "/" + quant::kernel_name(kern);
+      measure(results, opt, "quant.encode", variant, iters, (double)iters * d * sizeof(float), [&]() {
+        size_t i = 0;
+        for (; i < iters; i++) {
+          quant::encode_with(kern, dt, v.data(), d, packed.data());
+          sink += packed[i % d];
+        }
+        return true;
+      });
+      measure(results, opt, "quant.decode", variant, iters, (double)iters * d * sizeof(float), [&]() {
+        size_t i = 0;
+        for (; i < iters; i++) {
+          quant::decode_with(kern, dt, packed.data(), d, out.data());
+          sink += out[i % d];
+        }
+        return true;
+      });
+    }
+  }
+}
+
+// Writes n rows of dimension d to fname as an fvecs file
+bool
+write_fvecs(const char *fname, size_t n, size_t d)
+{
+  FILE *f = fopen(fname, "wb");
+  if (!f) {
+    fprintf(stderr, "could not create %s: %s\n", fname, strerror(errno));
+    return false;
+  }
+  srandom(7);
+  std::vector<float> row(d);
+  const int32_t dim = d;
+  bool ok = true;
+  size_t i = 0;
+  for (; i < n && ok; i++) {
+    for (float &x : row) {
+      x = random() % 128;
+    }
+    ok = fwrite(&dim, sizeof(dim), 1, f) == 1 && fwrite(row.data(), sizeof(float), d, f) == d;
+  }
+  return fclose(f) == 0 && ok;
+}
+
+// Opening and one pass over an fvecs file, mapped and streamed; the page cache is warm after the warmups
+void
+bench_fvecs(std::vector<result> *results, const options &opt, const char *fname)
+{
+  vecs::fvecs probe;
+  if (!probe.open(fname)) {
+    results->push_back(result{ "fvecs", fname, 0, 0, {}, false });
+    return;
+  }
+  const size_t n = probe.n(), d = probe.d();
+  const double bytes = (double)n * (d + 1) * sizeof(float);
+  probe.close();
+
+  measure(results, opt, "fvecs.mapped_scan", "", n, bytes, [&]() {
+    vecs::fvecs f;
+    if (!f.open(fname)) {
+      return false;
+    }
+    float sum = 0;
+    size_t i = 0;
+    for (; i < f.n(); i++) {
+      sum += f.row(i)[i % d];
+    }
+    sink += (uint64_t)sum;
+    return true;
+  });
+  measure(results, opt, "fvecs.read_dense", "", n, bytes, [&]() {
+    vecs::fvecs f;
+    if (!f.open(fname)) {
+      return false;
+    }
+    float *x = f.read_dense();
+    sink += (uint64_t)x[n * d - 1];
+    delete[] x;
+    return true;
+  });
+  const unsigned int threads[] = { 1, 4 };
+  for (unsigned int t : threads) {
+    measure(results, opt, "fvecs.reader", std::to_string(t) + " threads", n, bytes, [&]() {
+      vecs::reader<float> r(4096, t, 8);
+      float sum = 0;
+      size_t rows = 0;
+      bool ok = r.open(fname) && r.for_each([&](const vecs::batch<float> &b) {
+        sum += b.row(b.count - 1)[0];
+        rows += b.count;
+        return true;
+      });
+      sink += (uint64_t)sum;
+      return ok && rows == n;
+    });
+  }
+}
+
+// Each store and ingest mode into an emptied table, then the rows read back whole and in parts
+void
+bench_db(std::vector<result> *results, const options &opt, const char *fname, size_t rows, quant::dtype dtype)
+{
+  vecs::fvecs f;
+  if (!f.open(fname)) {
+    return;
+  }
+  rows = std::min(rows, f.n());
+  const size_t d = f.d();
+  std::vector<float> x(rows * d);
+  f.copy_dense(x.data(), 0, rows);
+  const double bytes = (double)rows * d * sizeof(float);
+
+  dbpool::config db_cfg;
+  db_cfg.user = "vectoruser";
+  db_cfg.pass = "vectorpw";
+  db_cfg.db = "vector_bench";
+  db_cfg.create_db = true;
+  db_cfg.local_infile = true;
+  db_cfg.size = 4;
+  dbpool::pool pool(db_cfg);
+  if (!pool.ok()) {
+    fprintf(stderr, "no database, skipping the database cases\n");
+    results->push_back(result{ "db", "connect", 0, 0, {}, false });
+    return;
+  }
+  const vecdb::store_mode modes[] = { vecdb::STORE_JSON, vecdb::STORE_BLOB };
+  const vecdb::ingest_mode ingests[] = { vecdb::INGEST_INSERT, vecdb::INGEST_LOAD_DATA };
+  for (vecdb::store_mode mode : modes) {
+    vecdb::selection sel(mode, OP_BENCH, CLASS_A_BENCH, CLASS_B_BENCH);
+    sel.dtype = dtype;
+    const std::string store = std::string(mode == vecdb::STORE_BLOB ? "blob" : "json") + "/" + quant::name(dtype);
+    if (!vecdb::create_table(pool, mode)) {
+      results->push_back(result{ "db.create_table", store, 0, 0, {}, false });
+      continue;
+    }
+    const step empty = [&]() {
+      dbpool::lease conn = pool.borrow();
+      return conn && conn.query((std::string("TRUNCATE TABLE ") + sel.table()).c_str());
+    };
+    for (vecdb::ingest_mode ingest : ingests) {
+      vecdb::load_config cfg;
+      cfg.mode = mode;
+      cfg.ingest = ingest;
+      cfg.dtype = dtype;
+      cfg.adapt = false;  // every rep at the size the server's limits give
+      const std::string variant = store + (ingest == vecdb::INGEST_LOAD_DATA ? "/load" : "/insert");
+      measure(results, opt, "db.insert", variant, rows, bytes, [&]() {
+        vecdb::loader loader(pool, cfg);
+        loader.add(OP_BENCH, CLASS_A_BENCH, CLASS_B_BENCH, x.data(), rows, d);
+        return loader.finish() && loader.rows() == rows;
+      }, empty);
+    }
+
+    // the table holds the last insert's rows
+    std::vector<float> dst(rows * d);
+    measure(results, opt, "db.retrieve", store, rows, bytes, [&]() {
+      return vecdb::select_into(pool, sel, d, dst.data(), rows, NULL) == (long)rows;
+    });
+    measure(results, opt, "db.retrieve", store + "/4 parts", rows, bytes, [&]() {
+      return vecdb::select_parallel(pool, sel, d, dst.data(), rows, NULL, 4) == (long)rows;
+    });
+    empty();
+  }
+}
+
+void
+write_json(std::ostream &out, const std::vector<result> &results, const options &opt)
+{
+  nlohmann::json j;
+  j["compiler"] = __VERSION__;
+  j["base64_kernel"] = base64::kernel_name(base64::kernel_active());
+  j["quant_kernel"] = quant::kernel_name(quant::kernel_active());
+  j["reps"] = opt.reps;
+  j["warmups"] = opt.warmups;
+  j["cases"] = nlohmann::json::array();
+  for (const result &r : results) {
+    nlohmann::json c;
+    c["name"] = r.name;
+    c["variant"] = r.variant;
+    c["ok"] = r.ok;
+    if (r.ok) {
+      std::vector<double> s = r.secs;
+      std::sort(s.begin(), s.end());
+      const double p50 = percentile(s, 0.5);
+      c["items"] = r.items;
+      c["bytes"] = r.bytes;
+      c["min_s"] = s.front();
+      c["p50_s"] = p50;
+      c["p90_s"] = percentile(s, 0.9);
+      c["p99_s"] = percentile(s, 0.99);
+      c["max_s"] = s.back();
+      c["mean_s"] = std::accumulate(s.begin(), s.end(), 0.0) / s.size();
+      c["items_per_s"] = r.items / p50;
+      c["mb_per_s"] = r.bytes / p50 / 1e6;
+    }
+    j["cases"].push_back(c);
+  }
+  out << j.dump(2) << std::endl;
+}
+
+void
+write_csv(std::ostream &out, const std::vector<result> &results)
+{
+  out << "name,variant,ok,items,bytes,min_s,p50_s,p90_s,p99_s,max_s,mean_s,items_per_s,mb_per_s\n";
+  for (const result &r : results) {
+    char line[512];
+    if (!r.ok) {
+      snprintf(line, sizeof(line), "%s,%s,0,,,,,,,,,,\n", r.name.c_str(), r.variant.c_str());
+    } else {
+      std::vector<double> s = r.secs;
+      std::sort(s.begin(), s.end());
+      const double p50 = percentile(s, 0.5);
+      snprintf(line, sizeof(line), "%s,%s,1,%lu,%.0f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.1f,%.3f\n", r.name.c_str(),
+               r.variant.c_str(), (unsigned long)r.items, r.bytes, s.front(), p50, percentile(s, 0.9),
+               percentile(s, 0.99), s.back(), std::accumulate(s.begin(), s.end(), 0.0) / s.size(), r.items / p50,
+               r.bytes / p50 / 1e6);
+    }
+    out << line;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  options opt;
+  opt.reps = 10;
+  opt.warmups = 2;
+  bool csv = false;
+  bool db = false;
+  size_t db_rows = 100000;
+  quant::dtype dtype = quant::DT_F32;
+  const char *out_fname = NULL;
+  const char *fvecs_fname = NULL;
+  int opt_c;
+  while ((opt_c = getopt(argc, argv, "r:w:f:o:dn:q:")) != -1) {
+    switch (opt_c) {
+    case 'r': opt.reps = std::max(1, atoi(optarg)); break;
+    case 'w': opt.warmups = std::max(0, atoi(optarg)); break;
+    case 'o': out_fname = optarg; break;
+    case 'd': db = true; break;
+    case 'n': db_rows = atol(optarg); break;
+    case 'f': csv = strcmp(optarg, "csv") == 0; break;
+    case 'q':
+      if (quant::from_name(optarg, &dtype)) {
+        break;
+      }
+      // fall through
+    default:
+      fprintf(stderr, "usage: %s [-r reps] [-w warmups] [-f json|csv] [-o file] [-d] [-n db rows] "
+              "[-q f32|f16|bf16|i8] [fvecs file]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    fvecs_fname = argv[optind];
+  }
+
+  // without a file, 100k SIFT sized rows of our own
+  char tmp_fname[] = "/tmp/benchXXXXXX";
+  if (!fvecs_fname) {
+    const int fd = mkstemp(tmp_fname);
+    if (fd < 0 || close(fd) != 0 || !write_fvecs(tmp_fname, std::max(db_rows, (size_t)100000), 128)) {
+      fprintf(stderr, "could not write %s\n", tmp_fname);
+      return 1;
+    }
+    fvecs_fname = tmp_fname;
+  }
+
+  std::vector<result> results;
+  bench_base64(&results, opt);
+  bench_envelope(&results, opt);
+  bench_quant(&results, opt);
+  bench_fvecs(&results, opt, fvecs_fname);
+  if (db) {
+    bench_db(&results, opt, fvecs_fname, db_rows, dtype);
+  }
+  if (fvecs_fname == tmp_fname) {
+    unlink(tmp_fname);
+  }
+
+  std::ofstream file;
+  if (out_fname) {
+    file.open(out_fname);
+    if (!file) {
+      fprintf(stderr, "could not create %s\n", out_fname);
+      return 1;
+    }
+  }
+  std::ostream &out = out_fname ? file : std::cout;
+  if (csv) {
+    write_csv(out, results);
+  } else {
+    write_json(out, results, opt);
+  }
+  size_t failed = 0;
+  for (const result &r : results) {
+    failed += !r.ok;
+  }
+  return failed != 0;
+}
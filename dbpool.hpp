@@ -0,0 +1,339 @@
+#ifndef __dbpool_hpp__
+#define __dbpool_hpp__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+#include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+
+#include "timing.hpp"
+
+/*
+ * A fixed size pool of MySQL connections, opened once and lent out for as
+ * long as a batch or a retrieval takes, instead of a connect and close per
+ * statement. A connection idle longer than idle_ping_s is pinged before it
+ * is lent, and one that fails the ping or a query is reconnected. Each
+ * connection keeps the statements prepared on it, so a statement is
+ * prepared once per connection and not once per use. Time spent
+ * connecting is kept apart from everything else, see connect_seconds().
+ */
+namespace dbpool {
+  struct config {
+    std::string host;
+    unsigned int port;
+    std::string user;
+    std::string pass;
+    std::string db;
+    unsigned int size;       // connections in the pool
+    bool create_db;          // CREATE DATABASE IF NOT EXISTS db before opening the pool
+    double idle_ping_s;      // ping a connection idle this long before lending it
+    unsigned int connect_tries;
+    bool local_infile;       // allow LOAD DATA LOCAL INFILE on the connections
+    config() : host("127.0.0.1"), port(3306), size(4), create_db(false), idle_ping_s(5.0), connect_tries(3),
+               local_infile(false) {}
+  };
+
+  inline double _now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  struct _conn {
+    MYSQL *mysql;
+    double last_used;
+    std::map<std::string, MYSQL_STMT *> stmts;
+    bool broken;
+    unsigned int generation;  // bumped on every connect, session state starts over
+    _conn() : mysql(NULL), last_used(0), broken(true), generation(0) {}
+  };
+
+  class pool;
+
+  /* A borrowed connection, given back when the lease goes away */
+  class lease {
+  public:
+    lease() : _pool(NULL), _c(NULL) {}
+    lease(lease &&o) : _pool(o._pool), _c(o._c) { o._c = NULL; }
+    lease &operator=(lease &&o);
+    lease(const lease &) = delete;
+    lease &operator=(const lease &) = delete;
+    ~lease() { release(); }
+
+    explicit operator bool() const { return _c != NULL && _c->mysql != NULL; }
+    MYSQL *mysql() const { return _c ? _c->mysql : NULL; }
+
+    /* Changes when the connection is remade, so session settings (SET,
+     * autocommit) and any open transaction were lost */
+    unsigned int generation() const { return _c ? _c->generation : 0; }
+
+    /*
+     * mysql_real_query(), saying what went wrong on stderr. If the server
+     * had already gone away the statement was never sent, so it is sent
+     * again on a new connection; a connection lost mid statement is only
+     * marked for reconnect, as the statement may have run.
+     */
+    bool query(const char *sql, size_t len = 0);
+
+    /* Statement prepared on this connection, prepared on first use */
+    MYSQL_STMT *prepare(const char *sql);
+
+    /* Reconnects now if the connection was marked broken; false if it is down */
+    bool ready();
+
+    /* Reconnect before this connection is used again */
+    void broken() {
+      if (_c) {
+        _c->broken = true;
+      }
+    }
+
+    void release();
+
+  private:
+    friend class pool;
+    lease(pool *p, _conn *c) : _pool(p), _c(c) {}
+    pool *_pool;
+    _conn *_c;
+  };
+
+  class pool {
+  public:
+    /* Opens every connection now, so the setup cost is paid (and timed) up front */
+    explicit pool(const config &cfg) : _cfg(cfg), _connects(0), _connect_s(0), _pings(0) {
+      mysql_library_init(0, NULL, NULL);
+      if (_cfg.create_db && !_create_db()) {
+        return;
+      }
+      unsigned int i = 0;
+      for (; i < _cfg.size; i++) {
+        _all.push_back(std::unique_ptr<_conn>(new _conn));
+        _connect(*_all.back());
+        _idle.push_back(_all.back().get());
+      }
+    }
+
+    ~pool() {
+      for (std::unique_ptr<_conn> &c : _all) {
+        _disconnect(*c);
+      }
+    }
+
+    pool(const pool &) = delete;
+    pool &operator=(const pool &) = delete;
+
+    /* true when every connection came up */
+    bool ok() const {
+      std::lock_guard<std::mutex> lock(_mtx);
+      if (_all.empty()) {
+        return false;
+      }
+      for (const std::unique_ptr<_conn> &c : _all) {
+        if (c->broken) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /* Waits while every connection is lent out. The lease is false if the
+     * connection is down and could not be brought back. */
+    lease borrow() {
+      static const unsigned int st_borrow = timing::stage("dbpool.borrow");
+      timing::scope t(st_borrow);
+      std::unique_lock<std::mutex> lock(_mtx);
+      _cv.wait(lock, [this]() { return !_idle.empty() || _all.empty(); });
+      if (_all.empty()) {
+        return lease();
+      }
+      _conn *c = _idle.back();
+      _idle.pop_back();
+      lock.unlock();
+      if (!c->broken && _now() - c->last_used > _cfg.idle_ping_s) {
+        _pings++;
+        if (mysql_ping(c->mysql) != 0) {
+          fprintf(stderr, "pooled connection failed ping: %s, reconnecting\n", mysql_error(c->mysql));
+          c->broken = true;
+        }
+      }
+      if (c->broken) {
+        _connect(*c);
+      }
+      return lease(this, c);
+    }
+
+    unsigned int size() const { return _all.size(); }
+    const config &cfg() const { return _cfg; }
+    /* Connects (first and re-) made, and the seconds they took */
+    unsigned int connects() const {
+      std::lock_guard<std::mutex> lock(_mtx);
+      return _connects;
+    }
+    double connect_seconds() const {
+      std::lock_guard<std::mutex> lock(_mtx);
+      return _connect_s;
+    }
+    unsigned int pings() const { return _pings; }
+
+  private:
+    friend class lease;
+
+    void _give_back(_conn *c) {
+      c->last_used = _now();
+      std::lock_guard<std::mutex> lock(_mtx);
+      _idle.push_back(c);
+      _cv.notify_one();
+    }
+
+    void _disconnect(_conn &c) {
+      for (auto &s : c.stmts) {
+        mysql_stmt_close(s.second);
+      }
+      c.stmts.clear();
+      if (c.mysql) {
+        mysql_close(c.mysql);
+      }
+      c.mysql = NULL;
+      c.broken = true;
+    }
+
+    bool _connect(_conn &c) {
+      static const unsigned int st_connect = timing::stage("dbpool.connect");
+      timing::scope t(st_connect);
+      _disconnect(c);
+      const double t0 = _now();
+      const char *db = _cfg.db.empty() ? NULL : _cfg.db.c_str();
+      unsigned int tries = 0;
+      for (; tries < (_cfg.connect_tries ? _cfg.connect_tries : 1); tries++) {
+        c.mysql = mysql_init(NULL);
+        if (_cfg.local_infile) {
+          unsigned int on = 1;
+          mysql_options(c.mysql, MYSQL_OPT_LOCAL_INFILE, &on);
+        }
+        if (mysql_real_connect(c.mysql, _cfg.host.c_str(), _cfg.user.c_str(), _cfg.pass.c_str(), db,
+                               _cfg.port, NULL, 0)) {
+          c.broken = false;
+          c.generation++;
+          break;
+        }
+        fprintf(stderr, "Connect to %s on %s:%u failed: %s\n", db ? db : "(none)", _cfg.host.c_str(),
+                _cfg.port, mysql_error(c.mysql));
+        mysql_close(c.mysql);
+        c.mysql = NULL;
+      }
+      c.last_used = _now();
+      std::lock_guard<std::mutex> lock(_mtx);
+      _connects++;
+      _connect_s += c.last_used - t0;
+      return !c.broken;
+    }
+
+    bool _create_db() {
+      const double t0 = _now();
+      MYSQL *m = mysql_init(NULL);
+      bool ok = mysql_real_connect(m, _cfg.host.c_str(), _cfg.user.c_str(), _cfg.pass.c_str(), NULL,
+                                   _cfg.port, NULL, 0) != NULL;
+      if (ok) {
+        std::string q = "CREATE DATABASE IF NOT EXISTS " + _cfg.db;
+        ok = mysql_query(m, q.c_str()) == 0;
+      }
+      if (!ok) {
+        fprintf(stderr, "Create database %s on %s:%u failed: %s\n", _cfg.db.c_str(), _cfg.host.c_str(),
+                _cfg.port, mysql_error(m));
+      }
+      mysql_close(m);
+      _connects++;
+      _connect_s += _now() - t0;
+      return ok;
+    }
+
+    const config _cfg;
+    mutable std::mutex _mtx;
+    std::condition_variable _cv;
+    std::vector<std::unique_ptr<_conn>> _all;
+    std::vector<_conn *> _idle;
+    unsigned int _connects;
+    double _connect_s;
+    std::atomic<unsigned int> _pings;
+  };
+
+  inline lease &lease::operator=(lease &&o) {
+    if (this != &o) {
+      release();
+      _pool = o._pool;
+      _c = o._c;
+      o._c = NULL;
+    }
+    return *this;
+  }
+
+  inline void lease::release() {
+    if (_c) {
+      _pool->_give_back(_c);
+      _c = NULL;
+    }
+  }
+
+  inline bool lease::query(const char *sql, size_t len) {
+    if (!_c) {
+      return false;
+    }
+    if (len == 0) {
+      len = strlen(sql);
+    }
+    int tries = 0;
+    for (; tries < 2; tries++) {
+      if (_c->broken && !_pool->_connect(*_c)) {
+        return false;
+      }
+      if (mysql_real_query(_c->mysql, sql, len) == 0) {
+        return true;
+      }
+      const unsigned int err = mysql_errno(_c->mysql);
+      fprintf(stderr, "query failed: %u %s\n", err, mysql_error(_c->mysql));
+      if (err == CR_SERVER_GONE_ERROR) {
+        _c->broken = true;
+        continue;
+      }
+      if (err == CR_SERVER_LOST) {
+        _c->broken = true;
+      }
+      return false;
+    }
+    return false;
+  }
+
+  inline bool lease::ready() {
+    return _c && (!_c->broken || _pool->_connect(*_c));
+  }
+
+  inline MYSQL_STMT *lease::prepare(const char *sql) {
+    if (!ready()) {
+      return NULL;
+    }
+    auto it = _c->stmts.find(sql);
+    if (it != _c->stmts.end()) {
+      return it->second;
+    }
+    MYSQL_STMT *stmt = mysql_stmt_init(_c->mysql);
+    if (!stmt || mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+      fprintf(stderr, "prepare failed: %s\n", stmt ? mysql_stmt_error(stmt) : mysql_error(_c->mysql));
+      if (stmt) {
+        mysql_stmt_close(stmt);
+      }
+      return NULL;
+    }
+    _c->stmts[sql] = stmt;
+    return stmt;
+  }
+}
+#endif // __dbpool_hpp__
@@ -0,0 +1,275 @@
+#ifndef __distance_hpp__
+#define __distance_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Distance kernels for float vectors: squared L2 and inner product, of
+ * one pair, or of one row against four queries at once so the row is
+ * loaded once for all four (what the brute force search tiles on). As in
+ * base64.hpp the AVX2 (with FMA) and AVX-512 kernels are compiled with
+ * per-function target attributes and picked at runtime from CPUID;
+ * define DISTANCE_NO_SIMD for the scalar code only. The kernels add in a
+ * different order than the scalar code, so results agree to rounding, not
+ * bit for bit.
+ */
+#if !defined(DISTANCE_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86_SIMD 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+namespace distance {
+  enum kernel {
+    KERNEL_SCALAR = 0,
+    KERNEL_AVX2,    // AVX2 and FMA, 8 floats a step
+    KERNEL_AVX512,  // AVX-512F, 16 floats a step
+    KERNEL_COUNT
+  };
+
+  inline const char *kernel_name(kernel k) {
+    static const char * const names[] = { "scalar", "avx2", "avx512f" };
+    return (k >= KERNEL_SCALAR && k < KERNEL_COUNT) ? names[k] : "unknown";
+  }
+
+  inline kernel kernel_detect() {
+#ifdef DISTANCE_X86_SIMD
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) ||
+        !(ecx & bit_FMA) || __get_cpuid_max(0, NULL) < 7) {
+      return KERNEL_SCALAR;
+    }
+    uint32_t xcr0, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    (void)xcr0_hi;
+    if ((xcr0 & 0x6) != 0x6) {
+      return KERNEL_SCALAR;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if (!(ebx & bit_AVX2)) {
+      return KERNEL_SCALAR;
+    }
+    if ((xcr0 & 0xe0) == 0xe0 && (ebx & bit_AVX512F)) {
+      return KERNEL_AVX512;
+    }
+    return KERNEL_AVX2;
+#else
+    return KERNEL_SCALAR;
+#endif
+  }
+
+  /* Kernel used by l2sq(), dot() and the x4 forms, probed once */
+  inline kernel kernel_active() {
+    static const kernel k = kernel_detect();
+    return k;
+  }
+
+  inline bool kernel_supported(kernel k) {
+    return k >= KERNEL_SCALAR && k <= kernel_active();
+  }
+
+  inline float _l2sq_scalar(const float *a, const float *b, size_t d) {
+    float s = 0;
+    size_t i = 0;
+    for (; i < d; i++) {
+      const float t = a[i] - b[i];
+      s += t * t;
+    }
+    return s;
+  }
+
+  inline float _dot_scalar(const float *a, const float *b, size_t d) {
+    float s = 0;
+    size_t i = 0;
+    for (; i < d; i++) {
+      s += a[i] * b[i];
+    }
+    return s;
+  }
+
+#ifdef DISTANCE_X86_SIMD
+  __attribute__((target("avx2,fma")))
+  inline float _hsum_avx2(__m256 v) {
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_movehdup_ps(h));
+    return _mm_cvtss_f32(h);
+  }
+
+  /* L2 when IP is false, else the inner product */
+  template <bool IP>
+  __attribute__((target("avx2,fma")))
+  inline float _pair_avx2(const float *a, const float *b, size_t d) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= d; i += 16) {
+      const __m256 a0 = _mm256_loadu_ps(a + i), a1 = _mm256_loadu_ps(a + i + 8);
+      const __m256 b0 = _mm256_loadu_ps(b + i), b1 = _mm256_loadu_ps(b + i + 8);
+      if (IP) {
+        s0 = _mm256_fmadd_ps(a0, b0, s0);
+        s1 = _mm256_fmadd_ps(a1, b1, s1);
+      } else {
+        const __m256 t0 = _mm256_sub_ps(a0, b0), t1 = _mm256_sub_ps(a1, b1);
+        s0 = _mm256_fmadd_ps(t0, t0, s0);
+        s1 = _mm256_fmadd_ps(t1, t1, s1);
+      }
+    }
+    for (; i + 8 <= d; i += 8) {
+      const __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+      if (IP) {
+        s0 = _mm256_fmadd_ps(a0, b0, s0);
+      } else {
+        const __m256 t0 = _mm256_sub_ps(a0, b0);
+        s0 = _mm256_fmadd_ps(t0, t0, s0);
+      }
+    }
+    float s = _hsum_avx2(_mm256_add_ps(s0, s1));
+    return s + (IP ? _dot_scalar(a + i, b + i, d - i) : _l2sq_scalar(a + i, b + i, d - i));
+  }
+
+  template <bool IP>
+  __attribute__((target("avx2,fma")))
+  inline void _x4_avx2(const float *x, const float * const q[4], size_t d, float out[4]) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+      const __m256 v = _mm256_loadu_ps(x + i);
+      if (IP) {
+        s0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(q[0] + i), s0);
+        s1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(q[1] + i), s1);
+        s2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(q[2] + i), s2);
+        s3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(q[3] + i), s3);
+      } else {
+        const __m256 t0 = _mm256_sub_ps(v, _mm256_loadu_ps(q[0] + i));
+        const __m256 t1 = _mm256_sub_ps(v, _mm256_loadu_ps(q[1] + i));
+        const __m256 t2 = _mm256_sub_ps(v, _mm256_loadu_ps(q[2] + i));
+        const __m256 t3 = _mm256_sub_ps(v, _mm256_loadu_ps(q[3] + i));
+        s0 = _mm256_fmadd_ps(t0, t0, s0);
+        s1 = _mm256_fmadd_ps(t1, t1, s1);
+        s2 = _mm256_fmadd_ps(t2, t2, s2);
+        s3 = _mm256_fmadd_ps(t3, t3, s3);
+      }
+    }
+    out[0] = _hsum_avx2(s0);
+    out[1] = _hsum_avx2(s1);
+    out[2] = _hsum_avx2(s2);
+    out[3] = _hsum_avx2(s3);
+    if (i < d) {
+      int j = 0;
+      for (; j < 4; j++) {
+        out[j] += IP ? _dot_scalar(x + i, q[j] + i, d - i) : _l2sq_scalar(x + i, q[j] + i, d - i);
+      }
+    }
+  }
+
+  template <bool IP>
+  __attribute__((target("avx512f")))
+  inline float _pair_avx512(const float *a, const float *b, size_t d) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= d; i += 32) {
+      const __m512 a0 = _mm512_loadu_ps(a + i), a1 = _mm512_loadu_ps(a + i + 16);
+      const __m512 b0 = _mm512_loadu_ps(b + i), b1 = _mm512_loadu_ps(b + i + 16);
+      if (IP) {
+        s0 = _mm512_fmadd_ps(a0, b0, s0);
+        s1 = _mm512_fmadd_ps(a1, b1, s1);
+      } else {
+        const __m512 t0 = _mm512_sub_ps(a0, b0), t1 = _mm512_sub_ps(a1, b1);
+        s0 = _mm512_fmadd_ps(t0, t0, s0);
+        s1 = _mm512_fmadd_ps(t1, t1, s1);
+      }
+    }
+    // the rest, 16 at a time, the last one masked
+    for (; i < d; i += 16) {
+      const __mmask16 m = d - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (d - i)) - 1);
+      const __m512 a0 = _mm512_maskz_loadu_ps(m, a + i), b0 = _mm512_maskz_loadu_ps(m, b + i);
+      if (IP) {
+        s0 = _mm512_fmadd_ps(a0, b0, s0);
+      } else {
+        const __m512 t0 = _mm512_sub_ps(a0, b0);
+        s0 = _mm512_fmadd_ps(t0, t0, s0);
+      }
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+  }
+
+  template <bool IP>
+  __attribute__((target("avx512f")))
+  inline void _x4_avx512(const float *x, const float * const q[4], size_t d, float out[4]) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i < d; i += 16) {
+      const __mmask16 m = d - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (d - i)) - 1);
+      const __m512 v = _mm512_maskz_loadu_ps(m, x + i);
+      if (IP) {
+        s0 = _mm512_fmadd_ps(v, _mm512_maskz_loadu_ps(m, q[0] + i), s0);
+        s1 = _mm512_fmadd_ps(v, _mm512_maskz_loadu_ps(m, q[1] + i), s1);
+        s2 = _mm512_fmadd_ps(v, _mm512_maskz_loadu_ps(m, q[2] + i), s2);
+        s3 = _mm512_fmadd_ps(v, _mm512_maskz_loadu_ps(m, q[3] + i), s3);
+      } else {
+        const __m512 t0 = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(m, q[0] + i));
+        const __m512 t1 = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(m, q[1] + i));
+        const __m512 t2 = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(m, q[2] + i));
+        const __m512 t3 = _mm512_sub_ps(v, _mm512_maskz_loadu_ps(m, q[3] + i));
+        s0 = _mm512_fmadd_ps(t0, t0, s0);
+        s1 = _mm512_fmadd_ps(t1, t1, s1);
+        s2 = _mm512_fmadd_ps(t2, t2, s2);
+        s3 = _mm512_fmadd_ps(t3, t3, s3);
+      }
+    }
+    out[0] = _mm512_reduce_add_ps(s0);
+    out[1] = _mm512_reduce_add_ps(s1);
+    out[2] = _mm512_reduce_add_ps(s2);
+    out[3] = _mm512_reduce_add_ps(s3);
+  }
+#endif
+
+  /* Squared L2 distance of a and b with an explicit kernel; k must be kernel_supported() */
+  inline float l2sq_with(kernel k, const float *a, const float *b, size_t d) {
+#ifdef DISTANCE_X86_SIMD
+    switch (k) {
+    case KERNEL_AVX512: return _pair_avx512<false>(a, b, d);
+    case KERNEL_AVX2: return _pair_avx2<false>(a, b, d);
+    default: break;
+    }
+#endif
+    return _l2sq_scalar(a, b, d);
+  }
+
+  inline float dot_with(kernel k, const float *a, const float *b, size_t d) {
+#ifdef DISTANCE_X86_SIMD
+    switch (k) {
+    case KERNEL_AVX512: return _pair_avx512<true>(a, b, d);
+    case KERNEL_AVX2: return _pair_avx2<true>(a, b, d);
+    default: break;
+    }
+#endif
+    return _dot_scalar(a, b, d);
+  }
+
+  /* out[j] = l2sq(x, q[j]) (or dot, with IP) for the four queries q[] */
+  template <bool IP>
+  inline void x4_with(kernel k, const float *x, const float * const q[4], size_t d, float out[4]) {
+#ifdef DISTANCE_X86_SIMD
+    switch (k) {
+    case KERNEL_AVX512: _x4_avx512<IP>(x, q, d, out); return;
+    case KERNEL_AVX2: _x4_avx2<IP>(x, q, d, out); return;
+    default: break;
+    }
+#endif
+    int j = 0;
+    for (; j < 4; j++) {
+      out[j] = IP ? _dot_scalar(x, q[j], d) : _l2sq_scalar(x, q[j], d);
+    }
+  }
+
+  inline float l2sq(const float *a, const float *b, size_t d) {
+    return l2sq_with(kernel_active(), a, b, d);
+  }
+
+  inline float dot(const float *a, const float *b, size_t d) {
+    return dot_with(kernel_active(), a, b, d);
+  }
+}
+#endif // __distance_hpp__
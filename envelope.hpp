@@ -0,0 +1,208 @@
+#ifndef __envelope_hpp__
+#define __envelope_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+
+#include "base64.hpp"
+#include "nlohmann/json.hpp"
+
+/*
+ * The JSON a stored vector travels in:
+ *
+ *   {"v":"<base64>"}  or, with the optional fields,  {"v":"<base64>","dim":128,"dtype":"f16"}
+ *
+ * write() puts it straight into the caller's buffer, base64 and all, and
+ * parse() finds the base64 in place, so neither allocates. Anything that
+ * is not exactly what write() makes (spaces, other key orders, escapes,
+ * extra keys) goes through nlohmann::json instead, which does allocate.
+ * The envelope never holds a quote, backslash, tab or newline other than
+ * its own punctuation, so it can go into a quoted SQL string or a LOAD
+ * DATA row without escaping.
+ */
+namespace envelope {
+  const size_t MAX_DTYPE = 15;
+
+  /* The optional fields; 0 and "" leave them out */
+  struct fields {
+    size_t dim;
+    char dtype[MAX_DTYPE + 1];
+    fields() : dim(0) { dtype[0] = 0; }
+    fields(size_t d, const char *t) : dim(d) {
+      const size_t n = t ? strnlen(t, MAX_DTYPE) : 0;
+      memcpy(dtype, t, n);
+      dtype[n] = 0;
+    }
+  };
+
+  /* A parsed envelope. v points into the parsed text, or into the spill
+   * string on the slow path. */
+  struct view {
+    const char *v;
+    size_t v_len;
+    fields f;
+  };
+
+  /* Longest envelope write() makes for raw_bytes of payload */
+  constexpr size_t max_size(size_t raw_bytes) {
+    return base64::encoded_size(raw_bytes) + sizeof("{\"v\":\"\",\"dim\":,\"dtype\":\"\"}") + 20 + MAX_DTYPE;
+  }
+
+  inline char *_put(char *out, const char *s, size_t n) {
+    memcpy(out, s, n);
+    return out + n;
+  }
+
+  inline char *_put_uint(char *out, uint64_t n) {
+    char digits[20];
+    int i = 0;
+    do {
+      digits[i++] = '0' + n % 10;
+      n /= 10;
+    } while (n);
+    while (i) {
+      *out++ = digits[--i];
+    }
+    return out;
+  }
+
+  /* base64 of raw into out, through the fixed size codec for SIFT and GIST floats */
+  inline size_t _b64(const void *raw, size_t raw_bytes, char *out) {
+    if (raw_bytes == 128 * sizeof(float)) {
+      base64::encode_fixed<128 * sizeof(float)>(raw, out);
+      return base64::encoded_size(128 * sizeof(float));
+    }
+    if (raw_bytes == 960 * sizeof(float)) {
+      base64::encode_fixed<960 * sizeof(float)>(raw, out);
+      return base64::encoded_size(960 * sizeof(float));
+    }
+    size_t n = base64::encoded_size(raw_bytes);
+    base64::encode(raw, raw_bytes, out, &n);
+    return n;
+  }
+
+  /*
+   * Writes the envelope of raw_bytes at raw into out, which has room for
+   * max_size(raw_bytes). Returns the characters written, no terminator.
+   */
+  inline size_t write(char *out, const void *raw, size_t raw_bytes, const fields &f = fields()) {
+    char *p = _put(out, "{\"v\":\"", 6);
+    p += _b64(raw, raw_bytes, p);
+    *p++ = '"';
+    if (f.dim) {
+      p = _put(p, ",\"dim\":", 7);
+      p = _put_uint(p, f.dim);
+    }
+    if (f.dtype[0]) {
+      p = _put(p, ",\"dtype\":\"", 10);
+      p = _put(p, f.dtype, strlen(f.dtype));
+      *p++ = '"';
+    }
+    *p++ = '}';
+    return p - out;
+  }
+
+  /* write() onto the end of s; once s has the capacity this does not allocate */
+  inline void append(std::string *s, const void *raw, size_t raw_bytes, const fields &f = fields()) {
+    const size_t at = s->size();
+    s->resize(at + max_size(raw_bytes));
+    s->resize(at + write(&(*s)[at], raw, raw_bytes, f));
+  }
+
+  /* The general case: whatever JSON holds a string "v" */
+  inline bool _parse_slow(const char *s, size_t len, view *out, std::string *spill) {
+    nlohmann::json j = nlohmann::json::parse(s, s + len, nullptr, false);
+    if (!spill || j.is_discarded() || !j.is_object()) {
+      return false;
+    }
+    auto v = j.find("v");
+    if (v == j.end() || !v->is_string()) {
+      return false;
+    }
+    *spill = v->get<std::string>();
+    out->v = spill->data();
+    out->v_len = spill->size();
+    auto dim = j.find("dim");
+    if (dim != j.end()) {
+      if (!dim->is_number_unsigned()) {
+        return false;
+      }
+      out->f.dim = dim->get<size_t>();
+    }
+    auto dtype = j.find("dtype");
+    if (dtype != j.end()) {
+      if (!dtype->is_string() || dtype->get<std::string>().size() > MAX_DTYPE) {
+        return false;
+      }
+      strcpy(out->f.dtype, dtype->get<std::string>().c_str());
+    }
+    return true;
+  }
+
+  /*
+   * Finds the base64 and the optional fields of the envelope in s. What
+   * write() makes is taken apart in place; anything else is parsed with
+   * nlohmann::json into spill (if given). False if s holds no string "v".
+   */
+  inline bool parse(const char *s, size_t len, view *out, std::string *spill = NULL) {
+    out->f = fields();
+    const char *end = s + len;
+    if (len < 8 || memcmp(s, "{\"v\":\"", 6) != 0) {
+      return _parse_slow(s, len, out, spill);
+    }
+    const char *q = (const char *)memchr(s + 6, '"', len - 6);
+    if (!q || memchr(s + 6, '\\', q - s - 6)) {
+      return _parse_slow(s, len, out, spill);
+    }
+    out->v = s + 6;
+    out->v_len = q - s - 6;
+    const char *p = q + 1;
+    if (end - p > 7 && memcmp(p, ",\"dim\":", 7) == 0) {
+      p += 7;
+      const char *digits = p;
+      size_t dim = 0;
+      for (; p < end && *p >= '0' && *p <= '9' && p - digits < 19; p++) {
+        dim = dim * 10 + (*p - '0');
+      }
+      if (p == digits) {
+        return _parse_slow(s, len, out, spill);
+      }
+      out->f.dim = dim;
+    }
+    if (end - p > 10 && memcmp(p, ",\"dtype\":\"", 10) == 0) {
+      p += 10;
+      const char *t = p;
+      for (; p < end && *p != '"' && *p != '\\' && (size_t)(p - t) <= MAX_DTYPE; p++) {
+      }
+      if (p >= end || *p != '"' || (size_t)(p - t) > MAX_DTYPE) {
+        return _parse_slow(s, len, out, spill);
+      }
+      memcpy(out->f.dtype, t, p - t);
+      out->f.dtype[p - t] = 0;
+      p++;
+    }
+    if (p + 1 != end || *p != '}') {
+      return _parse_slow(s, len, out, spill);
+    }
+    return true;
+  }
+
+  /* Decodes the base64 of e into exactly raw_bytes at out */
+  inline bool decode(const view &e, void *out, size_t raw_bytes) {
+    if (e.v_len != base64::encoded_size(raw_bytes)) {
+      return false;
+    }
+    if (raw_bytes == 128 * sizeof(float)) {
+      return base64::decode_fixed<128 * sizeof(float)>(e.v, out);
+    }
+    if (raw_bytes == 960 * sizeof(float)) {
+      return base64::decode_fixed<960 * sizeof(float)>(e.v, out);
+    }
+    size_t got = raw_bytes;
+    return base64::decode(e.v, e.v_len, out, &got) && got == raw_bytes;
+  }
+}
+#endif // __envelope_hpp__
@@ -0,0 +1,179 @@
+//
+// Test program for envelope.hpp
+//
+
+#include <iostream>
+#include <string>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "envelope.hpp"
+
+// Every operator new is counted, so the hot loop can be shown not to allocate
+static size_t allocations = 0;
+
+// new and delete here are malloc and free underneath, which GCC 11 and
+// later cannot see when it inlines them into their callers
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t n)
+{
+  allocations++;
+  void *p = malloc(n ? n : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// write then parse then decode d floats, with and without the optional fields
+unsigned int
+round_trip(size_t d, const envelope::fields &f)
+{
+  using namespace std;
+  float v[2048], back[2048];
+  size_t i = 0;
+  for (; i < d; i++) {
+    v[i] = i * 0.25f - 17;
+  }
+  string s;
+  envelope::append(&s, v, d * sizeof(float), f);
+  envelope::view e;
+  memset(back, 0, sizeof(back));
+  if (!envelope::parse(s.data(), s.size(), &e) || e.f.dim != f.dim || strcmp(e.f.dtype, f.dtype) != 0 ||
+      !envelope::decode(e, back, d * sizeof(float)) || memcmp(v, back, d * sizeof(float)) != 0 ||
+      e.v < s.data() || e.v >= s.data() + s.size()) {
+    cout << "ERROR: round trip of " << d << " floats through " << s.substr(0, 40) << "..." << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Shapes only the slow path takes, and things that are not envelopes at all
+unsigned int
+shapes()
+{
+  using namespace std;
+  // "AAECAw" is bytes 0 1 2 3
+  struct { const char *json; bool ok; size_t dim; const char *dtype; } cases[] = {
+    { "{\"v\":\"AAECAw\"}", true, 0, "" },
+    { "{\"v\":\"AAECAw\",\"dim\":1,\"dtype\":\"i8\"}", true, 1, "i8" },
+    { "{ \"v\" : \"AAECAw\" }", true, 0, "" },
+    { "{\"dtype\":\"f32\",\"v\":\"AAECAw\"}", true, 0, "f32" },
+    { "{\"v\":\"AA\\u0045CAw\"}", true, 0, "" },
+    { "{\"v\":\"AAECAw\",\"note\":\"x\"}", true, 0, "" },
+    { "{\"v\":\"AAECAw\",\"dim\":-1}", false, 0, "" },
+    { "{\"v\":17}", false, 0, "" },
+    { "{\"w\":\"AAECAw\"}", false, 0, "" },
+    { "[\"AAECAw\"]", false, 0, "" },
+    { "{\"v\":\"AAECAw\"", false, 0, "" },
+    { "", false, 0, "" },
+  };
+  unsigned int errors = 0;
+  size_t i = 0;
+  for (; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    envelope::view e;
+    string spill;
+    uint8_t raw[4] = { 9, 9, 9, 9 };
+    const bool ok = envelope::parse(cases[i].json, strlen(cases[i].json), &e, &spill) &&
+      envelope::decode(e, raw, sizeof(raw));
+    if (ok != cases[i].ok ||
+        (ok && (raw[0] != 0 || raw[3] != 3 || e.f.dim != cases[i].dim || strcmp(e.f.dtype, cases[i].dtype) != 0))) {
+      cout << "ERROR: " << cases[i].json << " parsed " << ok << " expected " << cases[i].ok << endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  size_t d;
+  for (d = 1; d < 300; d++) {
+    errors += round_trip(d, envelope::fields());
+  }
+  errors += round_trip(128, envelope::fields());
+  errors += round_trip(128, envelope::fields(128, "f32"));
+  errors += round_trip(960, envelope::fields(0, "bf16"));
+  errors += round_trip(960, envelope::fields(960, ""));
+  errors += round_trip(2048, envelope::fields(2048, "f16_with_long_n"));
+  errors += shapes();
+
+  // a batch worth of SIFT rows into a statement buffer, and back: once the
+  // buffer is sized, nothing allocates
+  const size_t rows = 2500;
+  static float v[rows][128];
+  static float back[128];
+  size_t i, j;
+  for (i = 0; i < rows; i++) {
+    for (j = 0; j < 128; j++) {
+      v[i][j] = (float)(i ^ j);
+    }
+  }
+  string sql;
+  sql.reserve(rows * envelope::max_size(sizeof(v[0])));
+  size_t ends[rows];
+  int pass = 0;
+  double enc_s = 0, dec_s = 0;
+  size_t before = allocations;
+  for (; pass < 20; pass++) {
+    double t0 = elapsed();
+    sql.clear();
+    for (i = 0; i < rows; i++) {
+      envelope::append(&sql, v[i], sizeof(v[i]));
+      ends[i] = sql.size();
+    }
+    double t1 = elapsed();
+    envelope::view e;
+    for (i = 0; i < rows; i++) {
+      size_t start = i ? ends[i - 1] : 0;
+      if (!envelope::parse(sql.data() + start, ends[i] - start, &e) || !envelope::decode(e, back, sizeof(back)) ||
+          memcmp(back, v[i], sizeof(back)) != 0) {
+        cout << "ERROR: batch row " << i << " did not come back" << endl;
+        errors++;
+        break;
+      }
+    }
+    enc_s += t1 - t0;
+    dec_s += elapsed() - t1;
+  }
+  if (allocations != before) {
+    cout << "ERROR: " << allocations - before << " allocations in the batch loop" << endl;
+    errors++;
+  }
+  printf("envelope of %d SIFT rows: write %.2f M rows/s, parse and decode %.2f M rows/s\n", (int)rows,
+         pass * rows / enc_s / 1e6, pass * rows / dec_s / 1e6);
+
+  cout << "envelope errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,583 @@
+#ifndef __hnsw_hpp__
+#define __hnsw_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "distance.hpp"
+
+/*
+ * Hierarchical navigable small world graph (Malkov and Yashunin) over a
+ * float matrix the caller keeps, squared L2.
+ *
+ * The links are flat uint32_t arrays, no per node allocations: level 0
+ * holds M0 + 1 words a node (a count then M0 = 2 * M ids) at node * (M0 +
+ * 1), and the few nodes above level 0 have their upper levels, M + 1
+ * words each, packed in one more array found through a per node offset.
+ * Levels are drawn for every node before the build, so the upper array is
+ * sized once. The build inserts nodes from several threads, each node's
+ * links guarded by its own spinlock, with the usual neighbour selection
+ * heuristic. save() writes the three arrays to a file that load() maps
+ * read only, so a built index opens in no time and is shared between
+ * processes; the matrix is handed to load() again, the index does not
+ * copy it.
+ */
+namespace hnsw {
+  struct config {
+    size_t M;                 // links a node keeps above level 0; 2 * M at level 0
+    size_t ef_construction;   // candidates kept while inserting
+    unsigned int threads;     // build threads, 0 for one per core
+    uint32_t seed;            // for the levels
+    config() : M(16), ef_construction(200), threads(0), seed(100) {}
+  };
+
+  const char MAGIC[8] = { 'H', 'N', 'S', 'W', 'I', 'D', 'X', '1' };
+  const uint32_t VERSION = 1;
+  const size_t HEADER_BYTES = 4096;
+  const int MAX_LEVEL = 15;
+
+  struct _header {
+    char magic[8];
+    uint32_t version;
+    uint32_t M, M0;
+    int32_t max_level;
+    uint64_t n, d, entry, upper_words;
+  };
+
+  class _spin {
+  public:
+    _spin() : _f(false) {}
+    void lock() {
+      while (_f.exchange(true, std::memory_order_acquire)) {
+        while (_f.load(std::memory_order_relaxed)) {
+          std::this_thread::yield();
+        }
+      }
+    }
+    void unlock() { _f.store(false, std::memory_order_release); }
+  private:
+    std::atomic<bool> _f;
+  };
+
+  /* Nodes seen by one search, cleared by bumping the epoch */
+  struct _visited {
+    std::vector<uint32_t> mark;
+    uint32_t epoch;
+    explicit _visited(size_t n) : mark(n, 0), epoch(0) {}
+    void next() {
+      if (++epoch == 0) {
+        std::fill(mark.begin(), mark.end(), 0);
+        epoch = 1;
+      }
+    }
+    bool test_and_set(uint32_t i) {
+      if (mark[i] == epoch) {
+        return true;
+      }
+      mark[i] = epoch;
+      return false;
+    }
+  };
+
+  class index {
+  public:
+    index() : _base(NULL), _n(0), _stride(0), _d(0), _M(0), _M0(0), _efc(0), _max_level(-1), _entry(0), _ef(64),
+              _l0(NULL), _upper_off(NULL), _upper(NULL), _upper_words(0), _map(NULL), _map_len(0), _building(false) {}
+    ~index() { close(); }
+    index(const index &) = delete;
+    index &operator=(const index &) = delete;
+
+    /* Builds the graph over n rows of dimension d, row i at base + i * stride */
+    bool build(const float *base, size_t n, size_t stride, size_t d, const config &cfg = config()) {
+      close();
+      if (n == 0 || n > 0xffffffffu || cfg.M < 2) {
+        fprintf(stderr, "hnsw: cannot build over %lu rows with M %lu\n", (unsigned long)n, (unsigned long)cfg.M);
+        return false;
+      }
+      _attach(base, n, stride, d);
+      _M = cfg.M;
+      _M0 = 2 * cfg.M;
+      _efc = std::max(cfg.ef_construction, _M);
+
+      // every node's level up front, so the upper links are one array
+      std::mt19937 rng(cfg.seed);
+      std::uniform_real_distribution<double> uni(0.0, 1.0);
+      const double mult = 1 / log((double)_M);
+      _own_off.assign(n + 1, 0);
+      size_t i = 0;
+      for (; i < n; i++) {
+        int level = (int)(-log(1 - uni(rng)) * mult);
+        level = std::min(level, MAX_LEVEL);
+        _own_off[i + 1] = _own_off[i] + level * (_M + 1);
+      }
+      _upper_words = _own_off[n];
+      _own_l0.assign(n * (_M0 + 1), 0);
+      _own_upper.assign(_upper_words, 0);
+      _l0 = _own_l0.data();
+      _upper_off = _own_off.data();
+      _upper = _own_upper.data();
+      _locks.reset(new _spin[n]);
+      _building = true;
+
+      _entry = 0;
+      _max_level = _level(0);
+      unsigned int threads = cfg.threads ? cfg.threads : std::thread::hardware_concurrency();
+      if (threads == 0) {
+        threads = 1;
+      }
+      std::atomic<size_t> next(1);
+      auto work = [&]() {
+        _visited vis(_n);
+        size_t node;
+        while ((node = next++) < _n) {
+          _insert((uint32_t)node, &vis);
+        }
+      };
+      std::vector<std::thread> pool;
+      unsigned int t = 1;
+      for (; t < threads; t++) {
+        pool.push_back(std::thread(work));
+      }
+      work();
+      for (std::thread &th : pool) {
+        th.join();
+      }
+      _building = false;
+      _locks.reset();
+      return true;
+    }
+
+    /* Candidates kept while searching; at least k is used */
+    void set_ef(size_t ef) { _ef = ef ? ef : 1; }
+    size_t ef() const { return _ef; }
+
+    /* The k nearest rows to q, best first; -1 and +inf past what was found */
+    void search(const float *q, size_t k, int64_t *labels, float *dist) const {
+      std::unique_ptr<_visited> vis = _take_visited();
+      _search(q, k, labels, dist, vis.get());
+      _give_visited(std::move(vis));
+    }
+
+    /* search() of nq dense queries over threads threads (0 for one per core) */
+    void search_batch(const float *q, size_t nq, size_t k, int64_t *labels, float *dist, unsigned int threads = 0) const {
+      if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+      }
+      if (threads == 0) {
+        threads = 1;
+      }
+      std::atomic<size_t> next(0);
+      auto work = [&]() {
+        _visited vis(_n);
+        size_t j;
+        while ((j = next++) < nq) {
+          _search(q + j * _d, k, labels + j * k, dist ? dist + j * k : NULL, &vis);
+        }
+      };
+      std::vector<std::thread> pool;
+      unsigned int t = 1;
+      for (; t < threads && t < nq; t++) {
+        pool.push_back(std::thread(work));
+      }
+      work();
+      for (std::thread &th : pool) {
+        th.join();
+      }
+    }
+
+    /* Writes the graph to fname; false, saying why on stderr, if it could not */
+    bool save(const char *fname) const {
+      if (!_l0) {
+        return false;
+      }
+      FILE *f = fopen(fname, "w");
+      if (!f) {
+        fprintf(stderr, "could not create %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      char head[HEADER_BYTES];
+      memset(head, 0, sizeof(head));
+      _header h;
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, MAGIC, sizeof(MAGIC));
+      h.version = VERSION;
+      h.M = _M;
+      h.M0 = _M0;
+      h.max_level = _max_level;
+      h.n = _n;
+      h.d = _d;
+      h.entry = _entry;
+      h.upper_words = _upper_words;
+      memcpy(head, &h, sizeof(h));
+      bool ok = fwrite(head, sizeof(head), 1, f) == 1 &&
+        fwrite(_l0, sizeof(uint32_t), _n * (_M0 + 1), f) == _n * (_M0 + 1) &&
+        fwrite(_upper_off, sizeof(uint32_t), _n + 1, f) == _n + 1 &&
+        fwrite(_upper, sizeof(uint32_t), _upper_words, f) == _upper_words;
+      ok = fclose(f) == 0 && ok;
+      if (!ok) {
+        fprintf(stderr, "could not write %s: %s\n", fname, strerror(errno));
+      }
+      return ok;
+    }
+
+    /*
+     * Maps a graph save() wrote, read only, over the same n rows of
+     * dimension d it was built on. False, saying why on stderr, if the
+     * file is not such a graph.
+     */
+    bool load(const char *fname, const float *base, size_t n, size_t stride, size_t d) {
+      close();
+      int fd = ::open(fname, O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "could not open %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      struct stat st;
+      _header h;
+      if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+          memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) {
+        fprintf(stderr, "%s: not an hnsw index\n", fname);
+        ::close(fd);
+        return false;
+      }
+      const size_t want = HEADER_BYTES + (h.n * (h.M0 + 1) + h.n + 1 + h.upper_words) * sizeof(uint32_t);
+      if (h.n != n || h.d != d || (size_t)st.st_size != want || h.entry >= n || h.max_level > MAX_LEVEL) {
+        fprintf(stderr, "%s: index of %llu rows of dimension %llu, %lu bytes, for %lu rows of dimension %lu\n", fname,
+                (unsigned long long)h.n, (unsigned long long)h.d, (unsigned long)st.st_size, (unsigned long)n,
+                (unsigned long)d);
+        ::close(fd);
+        return false;
+      }
+      void *m = mmap(NULL, want, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (m == MAP_FAILED) {
+        fprintf(stderr, "could not map %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      _map = m;
+      _map_len = want;
+      _attach(base, n, stride, d);
+      _M = h.M;
+      _M0 = h.M0;
+      _max_level = h.max_level;
+      _entry = h.entry;
+      _upper_words = h.upper_words;
+      _l0 = (uint32_t *)((char *)m + HEADER_BYTES);
+      _upper_off = _l0 + n * (_M0 + 1);
+      _upper = _upper_off + n + 1;
+      return true;
+    }
+
+    void close() {
+      if (_map) {
+        munmap(_map, _map_len);
+      }
+      _map = NULL;
+      _map_len = 0;
+      _own_l0.clear();
+      _own_off.clear();
+      _own_upper.clear();
+      _l0 = _upper_off = _upper = NULL;
+      _n = _d = 0;
+      _max_level = -1;
+      std::lock_guard<std::mutex> lock(_visited_mtx);
+      _visited_free.clear();
+    }
+
+    size_t n() const { return _n; }
+    size_t d() const { return _d; }
+    size_t M() const { return _M; }
+    int max_level() const { return _max_level; }
+    /* Bytes of links, what the graph costs on top of the vectors */
+    size_t graph_bytes() const { return (_n * (_M0 + 1) + _n + 1 + _upper_words) * sizeof(uint32_t); }
+
+    /* Levels above 0 of a node, and its links at one of them (count in *count) */
+    int level_of(uint32_t node) const { return _level(node); }
+    const uint32_t *links(uint32_t node, int level, uint32_t *count) const {
+      const uint32_t *l = _list(node, level);
+      *count = l[0];
+      return l + 1;
+    }
+
+  private:
+    typedef std::pair<float, uint32_t> _cand;
+
+    void _attach(const float *base, size_t n, size_t stride, size_t d) {
+      _base = base;
+      _n = n;
+      _stride = stride;
+      _d = d;
+    }
+
+    const float *_vec(uint32_t i) const { return _base + (size_t)i * _stride; }
+    float _dist(const float *q, uint32_t i) const { return distance::l2sq(q, _vec(i), _d); }
+
+    int _level(uint32_t i) const { return (int)((_upper_off[i + 1] - _upper_off[i]) / (_M + 1)); }
+
+    uint32_t *_list(uint32_t i, int level) const {
+      return level == 0 ? _l0 + (size_t)i * (_M0 + 1) : _upper + _upper_off[i] + (level - 1) * (_M + 1);
+    }
+
+    /* A node's links at level, copied under its lock while the build runs */
+    uint32_t _read(uint32_t i, int level, uint32_t *out) const {
+      const uint32_t *l = _list(i, level);
+      if (_building) {
+        _locks[i].lock();
+      }
+      const uint32_t c = l[0];
+      memcpy(out, l + 1, c * sizeof(uint32_t));
+      if (_building) {
+        _locks[i].unlock();
+      }
+      return c;
+    }
+
+    /* The ef nearest found from entry at level, as a max-heap */
+    std::priority_queue<_cand> _search_layer(const float *q, uint32_t entry, float entry_d, size_t ef, int level,
+                                             _visited *vis) const {
+      std::priority_queue<_cand> top;
+      std::priority_queue<_cand> cand;  // distances negated, nearest on top
+      std::vector<uint32_t> nbrs(_M0);
+      vis->next();
+      vis->test_and_set(entry);
+      top.push(_cand(entry_d, entry));
+      cand.push(_cand(-entry_d, entry));
+      float lower = entry_d;
+      while (!cand.empty()) {
+        const _cand c = cand.top();
+        if (-c.first > lower && top.size() >= ef) {
+          break;
+        }
+        cand.pop();
+        const uint32_t cnt = _read(c.second, level, nbrs.data());
+        uint32_t j = 0;
+        for (; j < cnt; j++) {
+          if (j + 1 < cnt) {
+            __builtin_prefetch(_vec(nbrs[j + 1]));
+          }
+          const uint32_t e = nbrs[j];
+          if (vis->test_and_set(e)) {
+            continue;
+          }
+          const float dd = _dist(q, e);
+          if (top.size() < ef || dd < lower) {
+            cand.push(_cand(-dd, e));
+            top.push(_cand(dd, e));
+            if (top.size() > ef) {
+              top.pop();
+            }
+            lower = top.top().first;
+          }
+        }
+      }
+      return top;
+    }
+
+    /* Greedy walk down to level stop + 1, from the entry point */
+    uint32_t _descend(const float *q, uint32_t cur, int from, int stop, float *cur_d) const {
+      std::vector<uint32_t> nbrs(_M0);
+      int level = from;
+      for (; level > stop; level--) {
+        bool changed = true;
+        while (changed) {
+          changed = false;
+          const uint32_t cnt = _read(cur, level, nbrs.data());
+          uint32_t j = 0;
+          for (; j < cnt; j++) {
+            const float dd = _dist(q, nbrs[j]);
+            if (dd < *cur_d) {
+              *cur_d = dd;
+              cur = nbrs[j];
+              changed = true;
+            }
+          }
+        }
+      }
+      return cur;
+    }
+
+    /*
+     * The heuristic: nearest first, a candidate is kept only if it is
+     * nearer the base than to any kept so far, so links spread out in
+     * direction instead of bunching. cands ascending by distance.
+     */
+    void _select(std::vector<_cand> *cands, size_t m) const {
+      if (cands->size() <= m) {
+        return;
+      }
+      std::vector<_cand> kept;
+      kept.reserve(m);
+      for (const _cand &c : *cands) {
+        if (kept.size() >= m) {
+          break;
+        }
+        bool good = true;
+        for (const _cand &k : kept) {
+          if (distance::l2sq(_vec(c.second), _vec(k.second), _d) < c.first) {
+            good = false;
+            break;
+          }
+        }
+        if (good) {
+          kept.push_back(c);
+        }
+      }
+      cands->swap(kept);
+    }
+
+    /* Adds node to e's links at level, reselecting them if e is full */
+    void _link(uint32_t e, uint32_t node, int level) {
+      const size_t max_m = level == 0 ? _M0 : _M;
+      uint32_t *l = _list(e, level);
+      std::lock_guard<_spin> lock(_locks[e]);
+      if (l[0] < max_m) {
+        l[1 + l[0]] = node;
+        l[0]++;
+        return;
+      }
+      std::vector<_cand> c;
+      c.reserve(max_m + 1);
+      c.push_back(_cand(distance::l2sq(_vec(e), _vec(node), _d), node));
+      uint32_t j = 0;
+      for (; j < l[0]; j++) {
+        c.push_back(_cand(distance::l2sq(_vec(e), _vec(l[1 + j]), _d), l[1 + j]));
+      }
+      std::sort(c.begin(), c.end());
+      _select(&c, max_m);
+      l[0] = c.size();
+      for (j = 0; j < c.size(); j++) {
+        l[1 + j] = c[j].second;
+      }
+    }
+
+    void _insert(uint32_t node, _visited *vis) {
+      const int level = _level(node);
+      std::unique_lock<std::mutex> top_lock(_top_mtx);
+      const int max_level = _max_level;
+      uint32_t cur = _entry;
+      if (level <= max_level) {
+        // only a node that raises the top holds the lock throughout
+        top_lock.unlock();
+      }
+      const float *q = _vec(node);
+      float cur_d = _dist(q, cur);
+      cur = _descend(q, cur, max_level, level, &cur_d);
+      int l = std::min(level, max_level);
+      for (; l >= 0; l--) {
+        std::priority_queue<_cand> found = _search_layer(q, cur, cur_d, _efc, l, vis);
+        std::vector<_cand> c;
+        c.reserve(found.size());
+        while (!found.empty()) {
+          c.push_back(found.top());
+          found.pop();
+        }
+        std::reverse(c.begin(), c.end());
+        cur = c[0].second;
+        cur_d = c[0].first;
+        _select(&c, _M);
+        {
+          uint32_t *mine = _list(node, l);
+          std::lock_guard<_spin> lock(_locks[node]);
+          mine[0] = c.size();
+          size_t j = 0;
+          for (; j < c.size(); j++) {
+            mine[1 + j] = c[j].second;
+          }
+        }
+        for (const _cand &e : c) {
+          _link(e.second, node, l);
+        }
+      }
+      if (level > max_level) {
+        _entry = node;
+        _max_level = level;
+      }
+    }
+
+    void _search(const float *q, size_t k, int64_t *labels, float *dist, _visited *vis) const {
+      size_t got = 0;
+      if (_n > 0 && k > 0) {
+        float cur_d = _dist(q, _entry);
+        const uint32_t cur = _descend(q, _entry, _max_level, 0, &cur_d);
+        std::priority_queue<_cand> found = _search_layer(q, cur, cur_d, std::max(_ef, k), 0, vis);
+        while (found.size() > k) {
+          found.pop();
+        }
+        got = found.size();
+        size_t i = got;
+        while (!found.empty()) {
+          i--;
+          labels[i] = found.top().second;
+          if (dist) {
+            dist[i] = found.top().first;
+          }
+          found.pop();
+        }
+      }
+      for (; got < k; got++) {
+        labels[got] = -1;
+        if (dist) {
+          dist[got] = 3.402823466e+38f;
+        }
+      }
+    }
+
+    std::unique_ptr<_visited> _take_visited() const {
+      std::lock_guard<std::mutex> lock(_visited_mtx);
+      if (_visited_free.empty()) {
+        return std::unique_ptr<_visited>(new _visited(_n));
+      }
+      std::unique_ptr<_visited> v = std::move(_visited_free.back());
+      _visited_free.pop_back();
+      return v;
+    }
+
+    void _give_visited(std::unique_ptr<_visited> v) const {
+      std::lock_guard<std::mutex> lock(_visited_mtx);
+      _visited_free.push_back(std::move(v));
+    }
+
+    const float *_base;
+    size_t _n;
+    size_t _stride;
+    size_t _d;
+    size_t _M;
+    size_t _M0;
+    size_t _efc;
+    int _max_level;
+    uint32_t _entry;
+    size_t _ef;
+    uint32_t *_l0;
+    uint32_t *_upper_off;
+    uint32_t *_upper;
+    size_t _upper_words;
+    std::vector<uint32_t> _own_l0;
+    std::vector<uint32_t> _own_off;
+    std::vector<uint32_t> _own_upper;
+    void *_map;
+    size_t _map_len;
+    bool _building;
+    std::unique_ptr<_spin[]> _locks;
+    std::mutex _top_mtx;
+    mutable std::mutex _visited_mtx;
+    mutable std::vector<std::unique_ptr<_visited>> _visited_free;
+  };
+}
+#endif // __hnsw_hpp__
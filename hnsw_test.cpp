@@ -0,0 +1,194 @@
+//
+// Test program for hnsw.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "hnsw.hpp"
+#include "knn.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Points around a few hundred centres, so there are neighbourhoods to find
+void
+fill(std::vector<float> *v, size_t d, unsigned int seed)
+{
+  srandom(seed);
+  std::vector<float> centres(300 * d);
+  for (float &f : centres) {
+    f = (float)(random() % 100000) / 1000 - 50;
+  }
+  size_t i = 0;
+  for (; i < v->size() / d; i++) {
+    const float *c = &centres[(random() % 300) * d];
+    size_t j = 0;
+    for (; j < d; j++) {
+      (*v)[i * d + j] = c[j] + (float)(random() % 10000) / 1000 - 5;
+    }
+  }
+}
+
+// Every link in range, not to itself, not repeated, no more than the level allows
+unsigned int
+check_graph(const hnsw::index &ix)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  uint32_t i = 0;
+  for (; i < ix.n() && errors == 0; i++) {
+    int l = 0;
+    for (; l <= ix.level_of(i); l++) {
+      uint32_t c;
+      const uint32_t *nb = ix.links(i, l, &c);
+      vector<uint32_t> s(nb, nb + c);
+      sort(s.begin(), s.end());
+      if (c > (l == 0 ? 2 : 1) * ix.M() || (c == 0 && ix.n() > 1 && l == 0) ||
+          adjacent_find(s.begin(), s.end()) != s.end() || (c > 0 && s.back() >= ix.n()) ||
+          binary_search(s.begin(), s.end(), i)) {
+        cout << "ERROR: node " << i << " level " << l << " has " << c << " bad links" << endl;
+        errors++;
+        break;
+      }
+      size_t j = 0;
+      for (; j < c; j++) {
+        if (ix.level_of(nb[j]) < l) {
+          cout << "ERROR: node " << i << " links at level " << l << " to " << nb[j] << " of level "
+               << ix.level_of(nb[j]) << endl;
+          errors++;
+          break;
+        }
+      }
+    }
+  }
+  return errors;
+}
+
+// Recall@k against brute force; at least min_recall, and the distances sorted
+unsigned int
+check_recall(const hnsw::index &ix, const float *base, size_t stride, const std::vector<float> &q, size_t d,
+             size_t k, size_t ef, double min_recall, std::vector<int64_t> *labels_out = NULL)
+{
+  using namespace std;
+  const size_t nq = q.size() / d;
+  vector<int64_t> want(nq * k), got(nq * k);
+  vector<float> dist(nq * k);
+  knn::search(base, ix.n(), stride, q.data(), nq, d, k, want.data(), NULL);
+  const_cast<hnsw::index &>(ix).set_ef(ef);
+  ix.search_batch(q.data(), nq, k, got.data(), dist.data(), 2);
+  unsigned int errors = 0;
+  size_t hits = 0, j = 0;
+  for (; j < nq; j++) {
+    vector<int64_t> a(&want[j * k], &want[j * k] + k);
+    sort(a.begin(), a.end());
+    size_t i = 0;
+    for (; i < k; i++) {
+      hits += binary_search(a.begin(), a.end(), got[j * k + i]);
+      if (i > 0 && dist[j * k + i] < dist[j * k + i - 1] && errors++ == 0) {
+        cout << "ERROR: query " << j << " distances out of order at rank " << i << endl;
+      }
+    }
+  }
+  const double recall = (double)hits / (nq * k);
+  printf("n %lu d %lu M %lu ef %lu: recall@%lu %.4f\n", (unsigned long)ix.n(), (unsigned long)d,
+         (unsigned long)ix.M(), (unsigned long)ef, (unsigned long)k, recall);
+  if (recall < min_recall) {
+    cout << "ERROR: recall " << recall << " under " << min_recall << endl;
+    errors++;
+  }
+  if (labels_out) {
+    *labels_out = got;
+  }
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  const size_t d = 32, n = 20000, k = 10;
+  // the queries are the last 200 points, from the same centres
+  vector<float> base((n + 200) * d);
+  fill(&base, d, 3);
+  vector<float> q(base.begin() + n * d, base.end());
+  base.resize(n * d);
+
+  hnsw::config cfg;
+  cfg.M = 12;
+  cfg.ef_construction = 100;
+  cfg.threads = 4;
+  hnsw::index ix;
+  double t0 = elapsed();
+  if (!ix.build(base.data(), n, d, d, cfg)) {
+    cout << "ERROR: build" << endl;
+    return 1;
+  }
+  printf("built %lu in %.2fs over %u threads, %.1f graph bytes a vector, top level %d\n", (unsigned long)n,
+         elapsed() - t0, cfg.threads, (double)ix.graph_bytes() / n, ix.max_level());
+  errors += check_graph(ix);
+  errors += check_recall(ix, base.data(), d, q, d, k, 10, 0.8);
+  vector<int64_t> before;
+  errors += check_recall(ix, base.data(), d, q, d, k, 100, 0.95, &before);
+
+  // the mapped file gives the same answers
+  char fname[] = "/tmp/hnsw_testXXXXXX";
+  int fd = mkstemp(fname);
+  close(fd);
+  hnsw::index loaded;
+  if (!ix.save(fname) || !loaded.load(fname, base.data(), n, d, d)) {
+    cout << "ERROR: save and load" << endl;
+    errors++;
+  } else {
+    vector<int64_t> after;
+    errors += check_graph(loaded);
+    errors += check_recall(loaded, base.data(), d, q, d, k, 100, 0.95, &after);
+    if (after != before || loaded.max_level() != ix.max_level() || loaded.graph_bytes() != ix.graph_bytes()) {
+      cout << "ERROR: loaded index differs" << endl;
+      errors++;
+    }
+  }
+  hnsw::index wrong;
+  if (wrong.load(fname, base.data(), n - 1, d, d)) {
+    cout << "ERROR: loaded an index over the wrong rows" << endl;
+    errors++;
+  }
+  unlink(fname);
+
+  // one thread, strided rows as in a mapped fvecs file
+  vector<float> strided(2000 * (d + 1));
+  size_t i = 0;
+  for (; i < 2000; i++) {
+    memcpy(&strided[i * (d + 1)], &base[i * d], d * sizeof(float));
+  }
+  cfg.threads = 1;
+  hnsw::index small;
+  small.build(strided.data(), 2000, d + 1, d, cfg);
+  errors += check_graph(small);
+  errors += check_recall(small, strided.data(), d + 1, q, d, k, 64, 0.95);
+
+  // a single row, and k past n
+  hnsw::index one;
+  one.build(base.data(), 1, d, d, cfg);
+  int64_t l[3];
+  float dd[3];
+  one.search(&q[0], 3, l, dd);
+  if (l[0] != 0 || l[1] != -1 || l[2] != -1) {
+    cout << "ERROR: one row index gave " << l[0] << " " << l[1] << " " << l[2] << endl;
+    errors++;
+  }
+
+  cout << "hnsw errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,580 @@
+#ifndef __ivfpq_hpp__
+#define __ivfpq_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include "distance.hpp"
+#include "knn.hpp"
+
+/*
+ * Inverted file with product quantization (Jegou, Douze and Schmid), for
+ * squared L2. Training takes a learn set: k-means for nlist coarse
+ * centroids, then the residuals (vector minus its centroid) are cut into
+ * m subvectors and each slice gets its own k-means of 256 codewords. A
+ * vector is stored as its list and m bytes, the nearest codeword of each
+ * slice of its residual, so a 128 dimension SIFT vector is 16 bytes
+ * instead of 512.
+ *
+ * A search ranks the centroids, and for each of the nprobe nearest lists
+ * fills a table of the distance from each slice of the query's residual
+ * to each of its 256 codewords; a stored vector's distance is then the
+ * sum of m table entries picked by its code. The codebooks are kept
+ * slice by slice transposed (dimension major), so a table is built 8 or
+ * 16 codewords at a time with AVX2 or AVX-512 FMAs, and the sums are
+ * gathers of 8 or 16 entries at once, both picked with distance.hpp's
+ * kernel (DISTANCE_NO_SIMD for the scalar code).
+ *
+ * The k-means steps that dominate (assigning points to centroids) go
+ * through knn::search() over every core, and the m slices train on
+ * separate threads. The model (centroids and codebooks) serializes to a
+ * byte string, the codes are plain bytes, so both can be kept in mysql
+ * (pqdb.hpp) instead of the vectors.
+ */
+namespace ivfpq {
+  const size_t KSUB = 256;   // codewords a slice, one byte of code
+  const char MAGIC[8] = { 'I', 'V', 'F', 'P', 'Q', 'M', 'D', '1' };
+  const uint32_t VERSION = 1;
+
+  struct kmeans_config {
+    size_t iters;
+    size_t max_points_per_centroid;   // the learn set is sampled down to this many a centroid
+    unsigned int threads;             // 0 for one per core
+    uint32_t seed;
+    kmeans_config() : iters(20), max_points_per_centroid(256), threads(0), seed(1234) {}
+  };
+
+  /*
+   * Lloyd's k-means of n points of dimension d (point i at x + i *
+   * stride) into k centroids, k * d floats at centroids. A centroid left
+   * empty takes half of the biggest cluster. Returns the mean squared
+   * distance of the sample to its centroid, or -1 with fewer points than
+   * centroids.
+   */
+  inline double kmeans(const float *x, size_t n, size_t stride, size_t d, size_t k, float *centroids,
+                       const kmeans_config &cfg = kmeans_config()) {
+    if (n < k || k == 0) {
+      fprintf(stderr, "kmeans: %lu points for %lu centroids\n", (unsigned long)n, (unsigned long)k);
+      return -1;
+    }
+    std::mt19937 rng(cfg.seed);
+    std::vector<size_t> perm(n);
+    size_t i = 0;
+    for (; i < n; i++) {
+      perm[i] = i;
+    }
+    std::shuffle(perm.begin(), perm.end(), rng);
+    const size_t ns = std::min(n, std::max(k, k * cfg.max_points_per_centroid));
+    std::vector<float> xs(ns * d);
+    for (i = 0; i < ns; i++) {
+      memcpy(&xs[i * d], x + perm[i] * stride, d * sizeof(float));
+    }
+    for (i = 0; i < k; i++) {
+      memcpy(centroids + i * d, &xs[i * d], d * sizeof(float));
+    }
+
+    knn::config kc;
+    kc.threads = cfg.threads;
+    std::vector<int64_t> assign(ns);
+    std::vector<float> dist(ns);
+    std::vector<double> sums(k * d);
+    std::vector<size_t> counts(k);
+    double obj = 0;
+    size_t it = 0;
+    for (;; it++) {
+      knn::search(centroids, k, d, xs.data(), ns, d, 1, assign.data(), dist.data(), kc);
+      obj = 0;
+      for (i = 0; i < ns; i++) {
+        obj += dist[i];
+      }
+      obj /= ns;
+      if (it == cfg.iters) {
+        break;
+      }
+      std::fill(sums.begin(), sums.end(), 0);
+      std::fill(counts.begin(), counts.end(), 0);
+      for (i = 0; i < ns; i++) {
+        double *s = &sums[assign[i] * d];
+        const float *p = &xs[i * d];
+        size_t j = 0;
+        for (; j < d; j++) {
+          s[j] += p[j];
+        }
+        counts[assign[i]]++;
+      }
+      size_t c = 0;
+      for (; c < k; c++) {
+        size_t j = 0;
+        for (; counts[c] && j < d; j++) {
+          centroids[c * d + j] = sums[c * d + j] / counts[c];
+        }
+      }
+      // split the biggest cluster into the empty ones, nudged apart
+      for (c = 0; c < k; c++) {
+        if (counts[c]) {
+          continue;
+        }
+        const size_t big = std::max_element(counts.begin(), counts.end()) - counts.begin();
+        size_t j = 0;
+        for (; j < d; j++) {
+          const float eps = (j % 2 ? 1 : -1) * 1.0f / 1024;
+          centroids[c * d + j] = centroids[big * d + j] * (1 + eps);
+          centroids[big * d + j] *= 1 - eps;
+        }
+        counts[c] = counts[big] / 2;
+        counts[big] -= counts[c];
+      }
+    }
+    return obj;
+  }
+
+#ifdef DISTANCE_X86_SIMD
+  __attribute__((target("avx2,fma")))
+  inline void _table_avx2(const float *r, const float *cbt, size_t m, size_t dsub, float *lut) {
+    size_t j = 0;
+    for (; j < m; j++) {
+      size_t c = 0;
+      for (; c < KSUB; c += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        size_t t = 0;
+        for (; t < dsub; t++) {
+          const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(cbt + (j * dsub + t) * KSUB + c),
+                                            _mm256_set1_ps(r[j * dsub + t]));
+          acc = _mm256_fmadd_ps(diff, diff, acc);
+        }
+        _mm256_storeu_ps(lut + j * KSUB + c, acc);
+      }
+    }
+  }
+
+  __attribute__((target("avx512f")))
+  inline void _table_avx512(const float *r, const float *cbt, size_t m, size_t dsub, float *lut) {
+    size_t j = 0;
+    for (; j < m; j++) {
+      size_t c = 0;
+      for (; c < KSUB; c += 16) {
+        __m512 acc = _mm512_setzero_ps();
+        size_t t = 0;
+        for (; t < dsub; t++) {
+          const __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(cbt + (j * dsub + t) * KSUB + c),
+                                            _mm512_set1_ps(r[j * dsub + t]));
+          acc = _mm512_fmadd_ps(diff, diff, acc);
+        }
+        _mm512_storeu_ps(lut + j * KSUB + c, acc);
+      }
+    }
+  }
+
+  __attribute__((target("avx2")))
+  inline void _scan_avx2(const float *lut, const uint8_t *codes, size_t n, size_t m, float *out) {
+    const __m256i lane = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    size_t i = 0;
+    for (; i < n; i++) {
+      const uint8_t *c = codes + i * m;
+      __m256 acc = _mm256_setzero_ps();
+      size_t j = 0;
+      for (; j < m; j += 8) {
+        const __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(c + j))), lane);
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(lut + j * KSUB, idx, 4));
+      }
+      __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+      h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+      h = _mm_add_ss(h, _mm_movehdup_ps(h));
+      out[i] = _mm_cvtss_f32(h);
+    }
+  }
+
+  __attribute__((target("avx512f")))
+  inline void _scan_avx512(const float *lut, const uint8_t *codes, size_t n, size_t m, float *out) {
+    const __m512i lane = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                            _mm512_set1_epi32(KSUB));
+    size_t i = 0;
+    for (; i < n; i++) {
+      const uint8_t *c = codes + i * m;
+      __m512 acc = _mm512_setzero_ps();
+      size_t j = 0;
+      for (; j < m; j += 16) {
+        const __m512i idx = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(c + j))), lane);
+        acc = _mm512_add_ps(acc, _mm512_i32gather_ps(idx, lut + j * KSUB, 4));
+      }
+      out[i] = _mm512_reduce_add_ps(acc);
+    }
+  }
+#endif
+
+  /*
+   * lut[j * 256 + c] = squared L2 from slice j of r (m slices of dsub
+   * floats) to codeword c of slice j, the codebooks transposed: dimension t
+   * of slice j's codewords at cbt + (j * dsub + t) * 256.
+   */
+  inline void table_with(distance::kernel k, const float *r, const float *cbt, size_t m, size_t dsub, float *lut) {
+#ifdef DISTANCE_X86_SIMD
+    if (k >= distance::KERNEL_AVX512) {
+      _table_avx512(r, cbt, m, dsub, lut);
+      return;
+    }
+    if (k >= distance::KERNEL_AVX2) {
+      _table_avx2(r, cbt, m, dsub, lut);
+      return;
+    }
+#endif
+    (void)k;
+    size_t j = 0;
+    for (; j < m; j++) {
+      float *row = lut + j * KSUB;
+      std::fill(row, row + KSUB, 0.0f);
+      size_t t = 0;
+      for (; t < dsub; t++) {
+        const float rt = r[j * dsub + t];
+        const float *col = cbt + (j * dsub + t) * KSUB;
+        size_t c = 0;
+        for (; c < KSUB; c++) {
+          const float diff = col[c] - rt;
+          row[c] += diff * diff;
+        }
+      }
+    }
+  }
+
+  /*
+   * out[i] = the sum over slices j < m of lut[j * 256 + code j of vector
+   * i], codes m bytes a vector. The gathers take m a multiple of 8
+   * (AVX2) or 16 (AVX-512); other m fall back to a narrower kernel.
+   */
+  inline void scan_with(distance::kernel k, const float *lut, const uint8_t *codes, size_t n, size_t m, float *out) {
+#ifdef DISTANCE_X86_SIMD
+    if (k >= distance::KERNEL_AVX512 && m % 16 == 0) {
+      _scan_avx512(lut, codes, n, m, out);
+      return;
+    }
+    if (k >= distance::KERNEL_AVX2 && m % 8 == 0) {
+      _scan_avx2(lut, codes, n, m, out);
+      return;
+    }
+#endif
+    (void)k;
+    size_t i = 0;
+    for (; i < n; i++) {
+      const uint8_t *c = codes + i * m;
+      float s = 0;
+      size_t j = 0;
+      for (; j < m; j++) {
+        s += lut[j * KSUB + c[j]];
+      }
+      out[i] = s;
+    }
+  }
+
+  struct config {
+    size_t nlist;           // coarse centroids, inverted lists
+    size_t m;               // bytes a code, slices of the residual; must divide d
+    size_t nprobe;          // lists a search visits
+    unsigned int threads;   // training, adding and search_batch threads, 0 for one per core
+    kmeans_config coarse;
+    kmeans_config pq;
+    config() : nlist(1024), m(16), nprobe(16), threads(0) {}
+  };
+
+  class index {
+  public:
+    index() : _d(0), _dsub(0), _ntotal(0) {}
+
+    /* Trains on n learn vectors of dimension d (vector i at x + i * stride) */
+    bool train(const float *x, size_t n, size_t stride, size_t d, const config &cfg = config()) {
+      _cfg = cfg;
+      if (cfg.m == 0 || d % cfg.m != 0) {
+        fprintf(stderr, "ivfpq: %lu slices do not divide dimension %lu\n", (unsigned long)cfg.m, (unsigned long)d);
+        return false;
+      }
+      _d = d;
+      _dsub = d / cfg.m;
+      _ntotal = 0;
+      _centroids.assign(cfg.nlist * d, 0);
+      _lists.assign(cfg.nlist, _list());
+      kmeans_config kc = cfg.coarse;
+      kc.threads = cfg.threads;
+      if (kmeans(x, n, stride, d, cfg.nlist, _centroids.data(), kc) < 0) {
+        return false;
+      }
+
+      // residuals of (a sample of) the learn set to their centroids
+      const size_t ns = std::min(n, KSUB * cfg.pq.max_points_per_centroid);
+      std::vector<float> res(ns * d);
+      size_t i = 0;
+      for (; i < ns; i++) {
+        memcpy(&res[i * d], x + (i * (n / ns)) * stride, d * sizeof(float));
+      }
+      std::vector<int64_t> list(ns);
+      _assign(res.data(), ns, list.data());
+      for (i = 0; i < ns; i++) {
+        size_t j = 0;
+        for (; j < d; j++) {
+          res[i * d + j] -= _centroids[list[i] * d + j];
+        }
+      }
+
+      // one k-means a slice, the slices over threads
+      _codebooks.assign(cfg.m * KSUB * _dsub, 0);
+      std::atomic<size_t> next(0);
+      std::atomic<bool> ok(true);
+      auto work = [&]() {
+        std::vector<float> cb(KSUB * _dsub);
+        kmeans_config pc = cfg.pq;
+        pc.threads = 1;
+        size_t j;
+        while ((j = next++) < cfg.m) {
+          pc.seed = cfg.pq.seed + j;
+          if (kmeans(res.data() + j * _dsub, ns, d, _dsub, KSUB, cb.data(), pc) < 0) {
+            ok = false;
+            continue;
+          }
+          // transposed: codeword c of dimension t at t * 256 + c
+          size_t c = 0;
+          for (; c < KSUB; c++) {
+            size_t t = 0;
+            for (; t < _dsub; t++) {
+              _codebooks[(j * _dsub + t) * KSUB + c] = cb[c * _dsub + t];
+            }
+          }
+        }
+      };
+      _run(work, cfg.m);
+      return ok;
+    }
+
+    bool trained() const { return _d != 0; }
+
+    /*
+     * Encodes n vectors (vector i at x + i * stride) into their lists,
+     * with ids ids[i], or ntotal() + i if ids is NULL.
+     */
+    void add(const float *x, size_t n, size_t stride, const int64_t *ids = NULL) {
+      const size_t chunk = 16384;
+      std::vector<float> dense;
+      std::vector<int64_t> list;
+      std::vector<uint8_t> codes;
+      size_t i0 = 0;
+      for (; i0 < n; i0 += chunk) {
+        const size_t c = std::min(chunk, n - i0);
+        dense.resize(c * _d);
+        size_t i = 0;
+        for (; i < c; i++) {
+          memcpy(&dense[i * _d], x + (i0 + i) * stride, _d * sizeof(float));
+        }
+        list.resize(c);
+        codes.resize(c * _cfg.m);
+        _assign(dense.data(), c, list.data());
+        std::atomic<size_t> next(0);
+        auto work = [&]() {
+          std::vector<float> lut(_cfg.m * KSUB), r(_d);
+          size_t j;
+          while ((j = next++) < c) {
+            _encode(&dense[j * _d], list[j], &codes[j * _cfg.m], lut.data(), r.data());
+          }
+        };
+        _run(work, c);
+        for (i = 0; i < c; i++) {
+          add_code(list[i], ids ? ids[i0 + i] : _ntotal, &codes[i * _cfg.m]);
+        }
+      }
+    }
+
+    /* One vector's list and code, m bytes at code */
+    void encode(const float *x, uint32_t *list, uint8_t *code) const {
+      int64_t l;
+      std::vector<float> lut(_cfg.m * KSUB), r(_d);
+      _assign(x, 1, &l);
+      _encode(x, l, code, lut.data(), r.data());
+      *list = l;
+    }
+
+    /* Adds a vector already encoded, as read back from storage */
+    bool add_code(size_t list, int64_t id, const uint8_t *code) {
+      if (list >= _lists.size()) {
+        return false;
+      }
+      _lists[list].ids.push_back(id);
+      _lists[list].codes.insert(_lists[list].codes.end(), code, code + _cfg.m);
+      _ntotal++;
+      return true;
+    }
+
+    void set_nprobe(size_t nprobe) { _cfg.nprobe = nprobe ? nprobe : 1; }
+    size_t nprobe() const { return _cfg.nprobe; }
+
+    /*
+     * The k nearest of nq dense queries, best first, into labels[nq * k]
+     * (ids) and, if given, dist[nq * k] (approximate squared L2), over the
+     * configured threads.
+     */
+    void search(const float *q, size_t nq, size_t k, int64_t *labels, float *dist) const {
+      std::atomic<size_t> next(0);
+      auto work = [&]() {
+        _scratch s;
+        size_t j;
+        while ((j = next++) < nq) {
+          _search(q + j * _d, k, labels + j * k, dist ? dist + j * k : NULL, &s);
+        }
+      };
+      _run(work, nq);
+    }
+
+    /* The model, not the lists: what train() made */
+    void serialize(std::string *out) const {
+      uint32_t head[6] = { VERSION, (uint32_t)_d, (uint32_t)_cfg.nlist, (uint32_t)_cfg.m, (uint32_t)KSUB, 0 };
+      out->assign(MAGIC, sizeof(MAGIC));
+      out->append((const char *)head, sizeof(head));
+      out->append((const char *)_centroids.data(), _centroids.size() * sizeof(float));
+      out->append((const char *)_codebooks.data(), _codebooks.size() * sizeof(float));
+    }
+
+    /* A model from serialize(), with empty lists; false if p is not one */
+    bool deserialize(const char *p, size_t len, const config &cfg = config()) {
+      uint32_t head[6];
+      if (len < sizeof(MAGIC) + sizeof(head) || memcmp(p, MAGIC, sizeof(MAGIC)) != 0) {
+        fprintf(stderr, "ivfpq: not a model\n");
+        return false;
+      }
+      memcpy(head, p + sizeof(MAGIC), sizeof(head));
+      const size_t d = head[1], nlist = head[2], m = head[3];
+      if (head[0] != VERSION || head[4] != KSUB || m == 0 || d % m != 0 ||
+          len != sizeof(MAGIC) + sizeof(head) + (nlist * d + m * KSUB * (d / m)) * sizeof(float)) {
+        fprintf(stderr, "ivfpq: model of %lu bytes does not match its header\n", (unsigned long)len);
+        return false;
+      }
+      _cfg = cfg;
+      _cfg.nlist = nlist;
+      _cfg.m = m;
+      _d = d;
+      _dsub = d / m;
+      _ntotal = 0;
+      _lists.assign(nlist, _list());
+      const float *f = (const float *)(p + sizeof(MAGIC) + sizeof(head));
+      _centroids.assign(f, f + nlist * d);
+      f += nlist * d;
+      _codebooks.assign(f, f + m * KSUB * _dsub);
+      return true;
+    }
+
+    size_t d() const { return _d; }
+    size_t m() const { return _cfg.m; }
+    size_t nlist() const { return _cfg.nlist; }
+    size_t ntotal() const { return _ntotal; }
+    size_t list_size(size_t l) const { return _lists[l].ids.size(); }
+    const int64_t *list_ids(size_t l) const { return _lists[l].ids.data(); }
+    const uint8_t *list_codes(size_t l) const { return _lists[l].codes.data(); }
+    /* Bytes of codes, and of the model; the ids are 8 bytes a vector more */
+    size_t code_bytes() const { return _ntotal * _cfg.m; }
+    size_t model_bytes() const { return (_centroids.size() + _codebooks.size()) * sizeof(float); }
+
+  private:
+    struct _list {
+      std::vector<int64_t> ids;
+      std::vector<uint8_t> codes;
+    };
+
+    struct _scratch {
+      std::vector<float> coarse;
+      std::vector<std::pair<float, uint32_t>> order;
+      std::vector<float> lut;
+      std::vector<float> res;
+      std::vector<float> dist;
+      knn::topk heap;
+    };
+
+    template <typename F>
+    void _run(F &work, size_t tasks) const {
+      unsigned int threads = _cfg.threads ? _cfg.threads : std::thread::hardware_concurrency();
+      if (threads == 0) {
+        threads = 1;
+      }
+      std::vector<std::thread> pool;
+      unsigned int t = 1;
+      for (; t < threads && t < tasks; t++) {
+        pool.push_back(std::thread(work));
+      }
+      work();
+      for (std::thread &th : pool) {
+        th.join();
+      }
+    }
+
+    /* Nearest coarse centroid of n dense vectors */
+    void _assign(const float *x, size_t n, int64_t *list) const {
+      knn::config kc;
+      kc.threads = _cfg.threads;
+      knn::search(_centroids.data(), _cfg.nlist, _d, x, n, _d, 1, list, NULL, kc);
+    }
+
+    void _table(const float *r, float *lut) const {
+      table_with(distance::kernel_active(), r, _codebooks.data(), _cfg.m, _dsub, lut);
+    }
+
+    void _encode(const float *x, size_t list, uint8_t *code, float *lut, float *r) const {
+      size_t t = 0;
+      for (; t < _d; t++) {
+        r[t] = x[t] - _centroids[list * _d + t];
+      }
+      _table(r, lut);
+      size_t j = 0;
+      for (; j < _cfg.m; j++) {
+        code[j] = std::min_element(lut + j * KSUB, lut + (j + 1) * KSUB) - (lut + j * KSUB);
+      }
+    }
+
+    void _search(const float *q, size_t k, int64_t *labels, float *dist, _scratch *s) const {
+      const size_t nprobe = std::min(_cfg.nprobe, _cfg.nlist);
+      s->order.resize(_cfg.nlist);
+      size_t l = 0;
+      for (; l < _cfg.nlist; l++) {
+        s->order[l] = std::make_pair(distance::l2sq(q, &_centroids[l * _d], _d), (uint32_t)l);
+      }
+      std::partial_sort(s->order.begin(), s->order.begin() + nprobe, s->order.end());
+      s->lut.resize(_cfg.m * KSUB);
+      s->heap.reset(k);
+      const distance::kernel kern = distance::kernel_active();
+      s->res.resize(_d);
+      float *r = s->res.data();
+      size_t p = 0;
+      for (; p < nprobe; p++) {
+        const _list &lst = _lists[s->order[p].second];
+        if (lst.ids.empty()) {
+          continue;
+        }
+        const float *c = &_centroids[s->order[p].second * _d];
+        size_t t = 0;
+        for (; t < _d; t++) {
+          r[t] = q[t] - c[t];
+        }
+        _table(r, s->lut.data());
+        s->dist.resize(lst.ids.size());
+        scan_with(kern, s->lut.data(), lst.codes.data(), lst.ids.size(), _cfg.m, s->dist.data());
+        size_t i = 0;
+        for (; i < lst.ids.size(); i++) {
+          if (s->dist[i] < s->heap.worst()) {
+            s->heap.push(s->dist[i], lst.ids[i]);
+          }
+        }
+      }
+      s->heap.drain(labels, dist, false);
+    }
+
+    config _cfg;
+    size_t _d;
+    size_t _dsub;
+    size_t _ntotal;
+    std::vector<float> _centroids;
+    std::vector<float> _codebooks;
+    std::vector<_list> _lists;
+  };
+}
+#endif // __ivfpq_hpp__
@@ -0,0 +1,280 @@
+//
+// Test program for ivfpq.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "ivfpq.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Points around ncentres centres; the first ncentres * d floats of centres are them
+void
+fill(std::vector<float> *v, size_t d, size_t ncentres, unsigned int seed, std::vector<float> *centres = NULL)
+{
+  srandom(seed);
+  std::vector<float> c(ncentres * d);
+  for (float &f : c) {
+    f = (float)(random() % 100000) / 1000 - 50;
+  }
+  size_t i = 0;
+  for (; i < v->size() / d; i++) {
+    const float *p = &c[(random() % ncentres) * d];
+    size_t j = 0;
+    for (; j < d; j++) {
+      (*v)[i * d + j] = p[j] + (float)(random() % 10000) / 1000 - 5;
+    }
+  }
+  if (centres) {
+    *centres = c;
+  }
+}
+
+// More centroids than well apart blobs: every blob gets at least one, so
+// every centre is covered and the spread is under what the noise gives
+unsigned int
+check_kmeans()
+{
+  using namespace std;
+  const size_t d = 16, blobs = 5, k = 20;
+  vector<float> x(5000 * (d + 1)), centres;
+  vector<float> dense(5000 * d);
+  fill(&dense, d, blobs, 7, &centres);
+  size_t i = 0;
+  for (; i < 5000; i++) {
+    memcpy(&x[i * (d + 1)], &dense[i * d], d * sizeof(float));
+  }
+  vector<float> found(k * d);
+  ivfpq::kmeans_config cfg;
+  cfg.threads = 2;
+  ivfpq::kmeans_config once = cfg;
+  once.iters = 0;
+  const double start = ivfpq::kmeans(x.data(), 5000, d + 1, d, k, found.data(), once);
+  const double obj = ivfpq::kmeans(x.data(), 5000, d + 1, d, k, found.data(), cfg);
+  unsigned int errors = 0;
+  // uniform noise of +-5 a dimension is 16 * 100 / 12 a point about its blob's centre
+  const double noise = d * 100.0 / 12;
+  if (obj > noise || obj >= start) {
+    cout << "ERROR: kmeans objective " << obj << ", " << start << " before iterating" << endl;
+    errors++;
+  }
+  for (i = 0; i < blobs; i++) {
+    float nearest = 1e30f;
+    size_t j = 0;
+    for (; j < k; j++) {
+      nearest = min(nearest, distance::l2sq(&centres[i * d], &found[j * d], d));
+    }
+    if (nearest > noise) {
+      cout << "ERROR: blob " << i << " has no centroid, nearest at " << nearest << endl;
+      errors++;
+    }
+  }
+  if (ivfpq::kmeans(x.data(), 10, d + 1, d, k, found.data(), cfg) >= 0) {
+    cout << "ERROR: kmeans of 10 points into " << k << endl;
+    errors++;
+  }
+  return errors;
+}
+
+// Every table and scan kernel against the scalar code
+unsigned int
+check_kernels()
+{
+  using namespace std;
+  unsigned int errors = 0;
+  const size_t shapes[][2] = { { 16, 8 }, { 8, 4 }, { 3, 5 }, { 32, 1 } };
+  for (const size_t *sh : shapes) {
+    const size_t m = sh[0], dsub = sh[1];
+    vector<float> r(m * dsub), cbt(m * dsub * ivfpq::KSUB), want(m * ivfpq::KSUB), got(m * ivfpq::KSUB);
+    srandom(m + dsub);
+    for (float &f : r) {
+      f = (float)(random() % 100000) / 1000;
+    }
+    for (float &f : cbt) {
+      f = (float)(random() % 100000) / 1000;
+    }
+    ivfpq::table_with(distance::KERNEL_SCALAR, r.data(), cbt.data(), m, dsub, want.data());
+    int k = distance::KERNEL_SCALAR;
+    for (; k < distance::KERNEL_COUNT; k++) {
+      if (!distance::kernel_supported((distance::kernel)k)) {
+        continue;
+      }
+      ivfpq::table_with((distance::kernel)k, r.data(), cbt.data(), m, dsub, got.data());
+      size_t i = 0;
+      for (; i < want.size(); i++) {
+        if (fabsf(got[i] - want[i]) > 1e-5f * max(1.0f, want[i])) {
+          cout << "ERROR: " << distance::kernel_name((distance::kernel)k) << " table of m " << m << " dsub " << dsub
+               << " entry " << i << " " << got[i] << " expected " << want[i] << endl;
+          errors++;
+          break;
+        }
+      }
+    }
+  }
+  const size_t ms[] = { 4, 8, 16, 32, 12 };
+  for (size_t m : ms) {
+    vector<float> lut(m * ivfpq::KSUB);
+    srandom(m);
+    for (float &f : lut) {
+      f = (float)(random() % 100000) / 100;
+    }
+    vector<uint8_t> codes(999 * m);
+    for (uint8_t &c : codes) {
+      c = random();
+    }
+    vector<float> want(999), got(999);
+    ivfpq::scan_with(distance::KERNEL_SCALAR, lut.data(), codes.data(), 999, m, want.data());
+    int k = distance::KERNEL_SCALAR;
+    for (; k < distance::KERNEL_COUNT; k++) {
+      if (!distance::kernel_supported((distance::kernel)k)) {
+        continue;
+      }
+      ivfpq::scan_with((distance::kernel)k, lut.data(), codes.data(), 999, m, got.data());
+      size_t i = 0;
+      for (; i < 999; i++) {
+        if (fabsf(got[i] - want[i]) > 1e-5f * want[i]) {
+          cout << "ERROR: " << distance::kernel_name((distance::kernel)k) << " scan of m " << m << " row " << i << " "
+               << got[i] << " expected " << want[i] << endl;
+          errors++;
+          break;
+        }
+      }
+    }
+  }
+  return errors;
+}
+
+// Recall@k of labels against the exact neighbours
+double
+recall(const std::vector<int64_t> &got, const std::vector<int64_t> &want, size_t nq, size_t k)
+{
+  size_t hits = 0, j = 0;
+  for (; j < nq; j++) {
+    std::vector<int64_t> a(&want[j * k], &want[j * k] + k);
+    std::sort(a.begin(), a.end());
+    size_t i = 0;
+    for (; i < k; i++) {
+      hits += std::binary_search(a.begin(), a.end(), got[j * k + i]);
+    }
+  }
+  return (double)hits / (nq * k);
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  errors += check_kmeans();
+  errors += check_kernels();
+
+  const size_t d = 32, n = 20000, nq = 200, k = 10;
+  vector<float> all((n + nq + 10000) * d);
+  fill(&all, d, 100, 3);
+  const float *base = all.data(), *q = base + n * d, *learn = q + nq * d;
+  vector<int64_t> want(nq * k);
+  knn::search(base, n, d, q, nq, d, k, want.data(), NULL);
+
+  ivfpq::config cfg;
+  // more lists than blobs, so the residuals are the noise and not the gaps between blobs
+  cfg.nlist = 256;
+  cfg.m = 8;
+  cfg.threads = 3;
+  ivfpq::index ix;
+  double t0 = elapsed();
+  if (!ix.train(learn, 10000, d, d, cfg)) {
+    cout << "ERROR: train" << endl;
+    return 1;
+  }
+  const double train_s = elapsed() - t0;
+  t0 = elapsed();
+  ix.add(base, n, d);
+  printf("trained nlist %lu m %lu in %.2fs, added %lu in %.2fs: %lu code bytes, %lu model bytes\n",
+         (unsigned long)ix.nlist(), (unsigned long)ix.m(), train_s, (unsigned long)n, elapsed() - t0,
+         (unsigned long)ix.code_bytes(), (unsigned long)ix.model_bytes());
+  size_t total = 0, l = 0;
+  for (; l < ix.nlist(); l++) {
+    total += ix.list_size(l);
+  }
+  if (ix.ntotal() != n || total != n || ix.code_bytes() != n * cfg.m) {
+    cout << "ERROR: " << ix.ntotal() << " vectors, " << total << " in the lists" << endl;
+    errors++;
+  }
+
+  // recall rises with nprobe, and is what 8 byte codes of 32 dimensions should give once every list is seen
+  vector<int64_t> got(nq * k);
+  vector<float> dist(nq * k);
+  double last = 0;
+  const size_t probes[] = { 1, 4, 16, 256 };
+  for (size_t p : probes) {
+    ix.set_nprobe(p);
+    ix.search(q, nq, k, got.data(), dist.data());
+    const double r = recall(got, want, nq, k);
+    printf("nprobe %2lu: recall@%lu %.4f\n", (unsigned long)p, (unsigned long)k, r);
+    if (r + 0.01 < last) {
+      cout << "ERROR: recall fell from " << last << " to " << r << " at nprobe " << p << endl;
+      errors++;
+    }
+    last = r;
+  }
+  if (last < 0.65) {
+    cout << "ERROR: recall " << last << " probing every list" << endl;
+    errors++;
+  }
+  size_t j = 0;
+  for (; j < nq * k; j++) {
+    if (j % k && dist[j] < dist[j - 1]) {
+      cout << "ERROR: distances out of order at " << j << endl;
+      errors++;
+      break;
+    }
+  }
+
+  // the model and the codes stored apart come back to the same answers
+  string model;
+  ix.serialize(&model);
+  ivfpq::index back;
+  if (model.size() != 8 + 24 + ix.model_bytes() || !back.deserialize(model.data(), model.size(), cfg)) {
+    cout << "ERROR: model of " << model.size() << " bytes did not deserialize" << endl;
+    errors++;
+  } else {
+    vector<uint8_t> code(cfg.m);
+    size_t i = 0;
+    for (; i < n; i++) {
+      uint32_t list;
+      ix.encode(base + i * d, &list, code.data());
+      back.add_code(list, i, code.data());
+    }
+    vector<int64_t> again(nq * k);
+    back.search(q, nq, k, again.data(), NULL);
+    if (again != got) {
+      cout << "ERROR: model and codes put back search differently" << endl;
+      errors++;
+    }
+  }
+  if (back.deserialize(model.data(), model.size() - 4) || back.deserialize("IVFPQMD2", 8)) {
+    cout << "ERROR: took a bad model" << endl;
+    errors++;
+  }
+  ivfpq::config bad;
+  bad.m = 5;
+  if (ix.train(learn, 10000, d, d, bad)) {
+    cout << "ERROR: trained with m not dividing d" << endl;
+    errors++;
+  }
+
+  cout << "ivfpq errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,192 @@
+#ifndef __knn_hpp__
+#define __knn_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include "distance.hpp"
+
+/*
+ * Exact k nearest neighbours by brute force, the baseline approximate
+ * indexes are measured against. Queries are taken four at a time against
+ * one base row (distance::x4_with), over blocks of base rows small enough
+ * to stay in L2 while a thread's chunk of queries goes over them, so the
+ * base matrix streams from memory once per chunk rather than once per
+ * query. Threads take query chunks off a shared counter, each keeping the
+ * top-k heaps of its own queries. Base rows may be strided, so a mapped
+ * fvecs file (stride d + 1) can be searched where it lies.
+ */
+namespace knn {
+  enum metric {
+    METRIC_L2,   // smallest squared L2 first
+    METRIC_IP    // largest inner product first
+  };
+
+  struct config {
+    metric m;
+    unsigned int threads;     // 0 for one per core
+    size_t query_chunk;       // queries a thread takes at a time, a multiple of 4
+    size_t base_block;        // base rows a chunk goes over before the next block
+    config() : m(METRIC_L2), threads(0), query_chunk(32), base_block(1024) {}
+  };
+
+  /* (distance, label) max-heap of the k best so far; for IP the distance is -dot */
+  class topk {
+  public:
+    explicit topk(size_t k = 0) : _k(k) { _h.reserve(k); }
+
+    void reset(size_t k) {
+      _k = k;
+      _h.clear();
+      _h.reserve(k);
+    }
+
+    /* The distance a candidate has to beat */
+    float worst() const { return _h.size() < _k ? 3.402823466e+38f : _h.front().first; }
+
+    void push(float dist, int64_t label) {
+      if (_h.size() < _k) {
+        _h.push_back(std::make_pair(dist, label));
+        std::push_heap(_h.begin(), _h.end());
+      } else if (_k > 0 && dist < _h.front().first) {
+        std::pop_heap(_h.begin(), _h.end());
+        _h.back() = std::make_pair(dist, label);
+        std::push_heap(_h.begin(), _h.end());
+      }
+    }
+
+    /* Best first into labels[k] and dist[k], -1 and +inf past what was found */
+    void drain(int64_t *labels, float *dist, bool negate) {
+      std::sort_heap(_h.begin(), _h.end());
+      size_t i = 0;
+      for (; i < _k; i++) {
+        const bool have = i < _h.size();
+        labels[i] = have ? _h[i].second : -1;
+        if (dist) {
+          dist[i] = have ? (negate ? -_h[i].first : _h[i].first) : (negate ? -3.402823466e+38f : 3.402823466e+38f);
+        }
+      }
+      _h.clear();
+    }
+
+  private:
+    size_t _k;
+    std::vector<std::pair<float, int64_t>> _h;
+  };
+
+  inline void _chunk(const float *base, size_t nb, size_t base_stride, const float *q, size_t q0, size_t q1, size_t d,
+                     size_t k, const config &cfg, int64_t *labels, float *dist, std::vector<topk> *heaps) {
+    const size_t nq = q1 - q0;
+    heaps->resize(cfg.query_chunk);
+    size_t j;
+    for (j = 0; j < nq; j++) {
+      (*heaps)[j].reset(k);
+    }
+    const bool ip = cfg.m == METRIC_IP;
+    const distance::kernel kern = distance::kernel_active();
+    size_t b0 = 0;
+    for (; b0 < nb; b0 += cfg.base_block) {
+      const size_t b1 = std::min(nb, b0 + cfg.base_block);
+      for (j = 0; j < nq; j += 4) {
+        // a short last group repeats its last query
+        const float *qs[4];
+        int g = 0;
+        for (; g < 4; g++) {
+          qs[g] = q + (q0 + std::min(j + g, nq - 1)) * d;
+        }
+        const size_t in_group = std::min((size_t)4, nq - j);
+        size_t i = b0;
+        float out[4];
+        for (; i < b1; i++) {
+          const float *x = base + i * base_stride;
+          if (ip) {
+            distance::x4_with<true>(kern, x, qs, d, out);
+          } else {
+            distance::x4_with<false>(kern, x, qs, d, out);
+          }
+          for (g = 0; g < (int)in_group; g++) {
+            const float dd = ip ? -out[g] : out[g];
+            if (dd < (*heaps)[j + g].worst()) {
+              (*heaps)[j + g].push(dd, i);
+            }
+          }
+        }
+      }
+    }
+    for (j = 0; j < nq; j++) {
+      (*heaps)[j].drain(labels + (q0 + j) * k, dist ? dist + (q0 + j) * k : NULL, ip);
+    }
+  }
+
+  /*
+   * The k nearest of nb base rows (row i at base + i * base_stride) to
+   * each of the nq queries (dense, q + j * d), best first, into
+   * labels[nq * k] (base row numbers) and, if given, dist[nq * k]
+   * (squared L2, or the inner product for METRIC_IP).
+   */
+  inline void search(const float *base, size_t nb, size_t base_stride, const float *q, size_t nq, size_t d, size_t k,
+                     int64_t *labels, float *dist, const config &cfg_in = config()) {
+    config cfg = cfg_in;
+    cfg.query_chunk = std::max((size_t)4, (cfg.query_chunk + 3) & ~(size_t)3);
+    if (cfg.base_block == 0) {
+      cfg.base_block = 1;
+    }
+    unsigned int threads = cfg.threads ? cfg.threads : std::thread::hardware_concurrency();
+    const size_t chunks = (nq + cfg.query_chunk - 1) / cfg.query_chunk;
+    if (threads == 0) {
+      threads = 1;
+    }
+    if (threads > chunks) {
+      threads = chunks ? chunks : 1;
+    }
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+      std::vector<topk> heaps;
+      size_t c;
+      while ((c = next++) < chunks) {
+        const size_t q0 = c * cfg.query_chunk;
+        _chunk(base, nb, base_stride, q, q0, std::min(nq, q0 + cfg.query_chunk), d, k, cfg, labels, dist, &heaps);
+      }
+    };
+    std::vector<std::thread> pool;
+    unsigned int t = 1;
+    for (; t < threads; t++) {
+      pool.push_back(std::thread(work));
+    }
+    work();
+    for (std::thread &th : pool) {
+      th.join();
+    }
+  }
+
+  /*
+   * Recall@r as the SIFT1M benchmarks count it: the fraction of queries
+   * whose true nearest neighbour (gt[j * gt_stride]) is among the first r
+   * of their k labels.
+   */
+  inline double recall_at(const int64_t *labels, size_t nq, size_t k, const int32_t *gt, size_t gt_stride, size_t r) {
+    if (r > k) {
+      r = k;
+    }
+    size_t hits = 0;
+    size_t j = 0;
+    for (; j < nq; j++) {
+      const int64_t want = gt[j * gt_stride];
+      size_t i = 0;
+      for (; i < r; i++) {
+        if (labels[j * k + i] == want) {
+          hits++;
+          break;
+        }
+      }
+    }
+    return nq ? (double)hits / nq : 0;
+  }
+}
+#endif // __knn_hpp__
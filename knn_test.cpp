@@ -0,0 +1,155 @@
+//
+// Test program for distance.hpp and knn.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "knn.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void
+fill(std::vector<float> *v, unsigned int seed)
+{
+  srandom(seed);
+  for (float &f : *v) {
+    f = (float)(random() % 100000) / 1000 - 50;
+  }
+}
+
+bool
+close_to(float a, float b)
+{
+  return fabsf(a - b) <= 1e-4f * std::max(1.0f, std::max(fabsf(a), fabsf(b)));
+}
+
+// Every kernel against the scalar code, at every tail length
+unsigned int
+check_kernels()
+{
+  using namespace std;
+  unsigned int errors = 0;
+  vector<float> a(300), b(300 * 4);
+  fill(&a, 3);
+  fill(&b, 5);
+  const float *q[4] = { &b[0], &b[300], &b[600], &b[900] };
+  size_t d = 1;
+  for (; d < 300; d++) {
+    const float l2 = distance::l2sq_with(distance::KERNEL_SCALAR, &a[0], q[1], d);
+    const float ip = distance::dot_with(distance::KERNEL_SCALAR, &a[0], q[1], d);
+    int k = distance::KERNEL_SCALAR;
+    for (; k < distance::KERNEL_COUNT; k++) {
+      if (!distance::kernel_supported((distance::kernel)k)) {
+        continue;
+      }
+      float l2x4[4], ipx4[4];
+      distance::x4_with<false>((distance::kernel)k, &a[0], q, d, l2x4);
+      distance::x4_with<true>((distance::kernel)k, &a[0], q, d, ipx4);
+      if (!close_to(distance::l2sq_with((distance::kernel)k, &a[0], q[1], d), l2) ||
+          !close_to(distance::dot_with((distance::kernel)k, &a[0], q[1], d), ip) ||
+          !close_to(l2x4[1], l2) || !close_to(ipx4[1], ip) ||
+          !close_to(l2x4[3], distance::l2sq_with(distance::KERNEL_SCALAR, &a[0], q[3], d))) {
+        cout << "ERROR: " << distance::kernel_name((distance::kernel)k) << " differs from scalar at dimension " << d << endl;
+        errors++;
+      }
+    }
+  }
+  return errors;
+}
+
+// search() against sorting every distance, for one shape of problem
+unsigned int
+check_search(size_t nb, size_t nq, size_t d, size_t k, size_t stride, knn::metric m, unsigned int threads, size_t block)
+{
+  using namespace std;
+  vector<float> base(nb * stride), q(nq * d);
+  fill(&base, (unsigned int)(nb + d));
+  fill(&q, (unsigned int)(nq + k));
+  knn::config cfg;
+  cfg.m = m;
+  cfg.threads = threads;
+  cfg.base_block = block;
+  vector<int64_t> labels(nq * k, -7);
+  vector<float> dist(nq * k);
+  knn::search(base.data(), nb, stride, q.data(), nq, d, k, labels.data(), dist.data(), cfg);
+  unsigned int errors = 0;
+  size_t j = 0;
+  for (; j < nq && errors == 0; j++) {
+    vector<pair<float, int64_t>> all(nb);
+    size_t i = 0;
+    for (; i < nb; i++) {
+      const float *x = &base[i * stride], *y = &q[j * d];
+      all[i].first = m == knn::METRIC_IP ? -distance::dot_with(distance::KERNEL_SCALAR, x, y, d)
+                                         : distance::l2sq_with(distance::KERNEL_SCALAR, x, y, d);
+      all[i].second = i;
+    }
+    sort(all.begin(), all.end());
+    for (i = 0; i < k; i++) {
+      const bool have = i < nb;
+      const float want = have ? (m == knn::METRIC_IP ? -all[i].first : all[i].first) : 0;
+      if (have ? !close_to(dist[j * k + i], want) : labels[j * k + i] != -1) {
+        cout << "ERROR: nb " << nb << " nq " << nq << " d " << d << " k " << k << " threads " << threads << " query " << j
+             << " rank " << i << " has " << labels[j * k + i] << " at " << dist[j * k + i] << ", expected "
+             << (have ? all[i].second : -1) << " at " << want << endl;
+        errors++;
+        break;
+      }
+    }
+  }
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  printf("distance kernel %s\n", distance::kernel_name(distance::kernel_active()));
+  errors += check_kernels();
+  errors += check_search(1000, 37, 128, 10, 129, knn::METRIC_L2, 4, 1024);
+  errors += check_search(1000, 37, 128, 10, 128, knn::METRIC_IP, 3, 100);
+  errors += check_search(5000, 9, 100, 100, 100, knn::METRIC_L2, 1, 333);
+  errors += check_search(333, 5, 17, 1, 17, knn::METRIC_L2, 2, 7);
+  errors += check_search(20, 6, 960, 30, 961, knn::METRIC_L2, 8, 1024);
+  errors += check_search(7, 3, 5, 10, 5, knn::METRIC_IP, 1, 1024);
+
+  // recall: query 0 finds its neighbour first, query 1 at rank 5, query 2 not at all
+  int64_t labels[3 * 10];
+  size_t i = 0;
+  for (; i < 30; i++) {
+    labels[i] = 1000 + i;
+  }
+  labels[0] = 7;
+  labels[15] = 8;
+  int32_t gt[3 * 2] = { 7, 0, 8, 0, 9, 0 };
+  if (knn::recall_at(labels, 3, 10, gt, 2, 1) != 1.0 / 3 || knn::recall_at(labels, 3, 10, gt, 2, 10) != 2.0 / 3 ||
+      knn::recall_at(labels, 3, 10, gt, 2, 5) != 1.0 / 3) {
+    cout << "ERROR: recall" << endl;
+    errors++;
+  }
+
+  // SIFT sized queries over a 100k base
+  const size_t nb = 100000, nq = 1000, d = 128, k = 100;
+  vector<float> base(nb * d), q(nq * d);
+  fill(&base, 11);
+  fill(&q, 13);
+  vector<int64_t> out(nq * k);
+  double t0 = elapsed();
+  knn::search(base.data(), nb, d, q.data(), nq, d, k, out.data(), NULL);
+  printf("brute force %lu queries over %lu: %.0f queries/s\n", (unsigned long)nq, (unsigned long)nb, nq / (elapsed() - t0));
+
+  cout << "knn errors " << errors << endl;
+  return errors != 0;
+}
@@ -8,15 +8,30 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstring>
+#include <cerrno>
+#include <csignal>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <mysql/mysql.h>
 
 #include <sys/time.h>
-#include "b64.hpp"
+#include "base64.hpp"
+#include "vecs.hpp"
+#include "dbpool.hpp"
+#include "vecdb.hpp"
+#include "quant.hpp"
+#include "snapcache.hpp"
+#include "knn.hpp"
+#include "hnsw.hpp"
+#include "ivfpq.hpp"
+#include "pqdb.hpp"
+#include "packdb.hpp"
+#include "timing.hpp"
+#include "vserve.hpp"
 #include "nlohmann/json.hpp"
 
 using json = nlohmann::json;
@@ -29,8 +44,6 @@ const uint16_t CLASS_B_SIFT_TYPE_TRAIN = 401;
 const uint16_t CLASS_B_SIFT_TYPE_BASE = 402; // the general population of sift vectors
 const uint16_t CLASS_B_SIFT_TYPE_QUERY = 403;
 
-// Maxium Raw Vector Size for padding
-const uint32_t MAX_RAW_VEC_SZ = sizeof(float) * 2 * 1024;  // 2K floats is our maximum
 
 /**
  * To run this demo, please download the ANN_SIFT1M dataset from
@@ -44,42 +57,27 @@ const uint32_t MAX_RAW_VEC_SZ = sizeof(float) * 2 * 1024;  // 2K floats is our m
  * I/O functions for fvecs and ivecs
  *****************************************************/
 
+// Dense copies, for code that wants float[n * d]; main() works on the
+// mapped files directly
 float * fvecs_read (const char *fname,
                     size_t *d_out, size_t *n_out)
 {
-  FILE *f = fopen(fname, "r");
-  if(!f) {
-    fprintf(stderr, "could not open %s\n", fname);
-    perror("");
+  vecs::fvecs f;
+  if (!f.open(fname)) {
     abort();
   }
-  int d;
-  fread(&d, 1, sizeof(int), f);
-  assert((d > 0 && d < 1000000) || !"unreasonable dimension");
-  fseek(f, 0, SEEK_SET);
-  struct stat st;
-  fstat(fileno(f), &st);
-  size_t sz = st.st_size;
-  assert(sz % ((d + 1) * 4) == 0 || !"weird file size");
-  size_t n = sz / ((d + 1) * 4);
-
-  *d_out = d; *n_out = n;
-  float *x = new float[n * (d + 1)];
-  size_t nr = fread(x, sizeof(float), n * (d + 1), f);
-  assert(nr == n * (d + 1) || !"could not read whole file");
-
-  // shift array to remove row headers
-  for(size_t i = 0; i < n; i++)
-    memmove(x + i * d, x + 1 + i * (d + 1), d * sizeof(*x));
-
-  fclose(f);
-  return x;
+  *d_out = f.d(); *n_out = f.n();
+  return f.read_dense();
 }
 
-// not very clean, but works as long as sizeof(int) == sizeof(float)
 int *ivecs_read(const char *fname, size_t *d_out, size_t *n_out)
 {
-  return (int*)fvecs_read(fname, d_out, n_out);
+  vecs::ivecs f;
+  if (!f.open(fname)) {
+    abort();
+  }
+  *d_out = f.d(); *n_out = f.n();
+  return f.read_dense();
 }
 
 double elapsed ()
@@ -89,225 +87,528 @@ double elapsed ()
   return  tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-void vec_test(const float *const xv, const size_t numElem, const int d)
+void vec_test(const vecs::fvecs &xv)
 {
   char b64_vec[16*1024];
-  size_t b64_vec_chars = sizeof(b64_vec);
   char raw_vec[24*1024];
-  size_t raw_vec_sz = sizeof(raw_vec);
-
-  int i = 0;
-  for (; i < numElem; i++) {
-    b64::encode((char const *)(xv + i * d), sizeof(xv[0] * d), b64_vec, &b64_vec_chars);
-    b64::decode((char const *)b64_vec, b64_vec_chars, raw_vec, &raw_vec_sz);
-    if (raw_vec_sz != sizeof(xv[0] * d)) {
-      printf ("ERROR! size mismatch in raw vector to baase64 encode to raw decode mismatch at vector %d got %ld, expected %ld\n", i, raw_vec_sz, sizeof(xv[0]) * d);
+  const size_t vec_sz = sizeof(float) * xv.d();
+
+  size_t i = 0;
+  for (; i < xv.n(); i++) {
+    size_t b64_vec_chars = sizeof(b64_vec);
+    size_t raw_vec_sz = sizeof(raw_vec);
+    b64::encode((char const *)xv.row(i), vec_sz, b64_vec, &b64_vec_chars);
+    size_t bad_off;
+    if (!b64::decode((char const *)b64_vec, b64_vec_chars, raw_vec, &raw_vec_sz, &bad_off)) {
+      printf ("ERROR! bad base64 character at offset %ld of vector %lu\n", bad_off, i);
     }
-    else if (memcmp((char const *)(xv + i * d), raw_vec, sizeof(xv[0] * d)) != 0) {
-      printf ("ERROR! data mismatch in raw vector to baase64 encode to raw decode at vector %d\n", i);
+    else if (raw_vec_sz != vec_sz) {
+      printf ("ERROR! size mismatch in raw vector to baase64 encode to raw decode mismatch at vector %lu got %ld, expected %ld\n", i, raw_vec_sz, vec_sz);
+    }
+    else if (memcmp((char const *)xv.row(i), raw_vec, vec_sz) != 0) {
+      printf ("ERROR! data mismatch in raw vector to baase64 encode to raw decode at vector %lu\n", i);
     }
   }
 }
 
-void *myDBLocalConnect(unsigned int port, const char * user, const char * pass, const char * db) {
-  const char *server = "127.0.0.1";
-  void *conn = (void *)mysql_init(NULL);
-  if (!mysql_real_connect((MYSQL *)conn, server, user, pass, db, port, NULL, 0)) {
-    fprintf(stderr, "Connect to %s on %s:%u failed: %s\n", db, server, port, mysql_error((MYSQL *)conn));
-    return NULL;
+// What storing xv as dtype t costs in accuracy: every row through
+// quant::encode() and decode(), as inserts and retrieves will do
+void quant_report(const vecs::fvecs &xv, quant::dtype t)
+{
+  std::vector<char> packed(quant::bytes(t, xv.d()));
+  std::vector<float> back(xv.d());
+  double sq = 0, max_err = 0, max_rel = 0;
+  const double start = elapsed();
+  size_t i = 0;
+  for (; i < xv.n(); i++) {
+    quant::encode(t, xv.row(i), xv.d(), packed.data());
+    quant::decode(t, packed.data(), xv.d(), back.data());
+    double norm = 0, diff = 0;
+    size_t j = 0;
+    for (; j < xv.d(); j++) {
+      const double e = fabs((double)xv.row(i)[j] - back[j]);
+      sq += e * e;
+      diff += e * e;
+      norm += (double)xv.row(i)[j] * xv.row(i)[j];
+      max_err = e > max_err ? e : max_err;
+    }
+    if (norm > 0 && sqrt(diff / norm) > max_rel) {
+      max_rel = sqrt(diff / norm);
+    }
   }
-  return conn;
+  printf("%s (%s): %lu bytes a row for %lu, rms error %.4g, max %.4g, worst row relative %.4g, %.1f M rows/s round trip\n",
+         quant::name(t), quant::kernel_name(quant::kernel_active()), (unsigned long)packed.size(),
+         (unsigned long)(xv.d() * sizeof(float)), sqrt(sq / (xv.n() * xv.d())), max_err, max_rel,
+         xv.n() / (elapsed() - start) / 1e6);
 }
 
-void insertJsonVector(uint16_t op, uint16_t class_a, uint16_t class_b, json &vec);
-void insertExtended(char * query, const char * const db_name, const char * const user, const char * const pw);
-void insertJsonVectorFlush();
-
-void insertRawVector(uint16_t op, uint16_t class_a, uint16_t class_b, float * rvec, uint16_t dim) {
-  namespace b64 = base64;
-  char b64_vec[(sizeof(rvec[0]) * dim * 4) / 3  + 60];
-  // ensure NULL termination
-  size_t b64_vec_chars = sizeof(b64_vec) - 1;
-  b64::encode((char const *)rvec, sizeof(rvec[0]) * dim, b64_vec, &b64_vec_chars);
-  b64_vec[b64_vec_chars] = 0;
-  // printf("b64_vec: %s\n", b64_vec);
-  json jvec;
-  jvec["v"] = std::string(b64_vec);
-  insertJsonVector(op, class_a, class_b, jvec);
+// Exact k-NN of every query over the mapped base, the baseline for any
+// approximate index: queries a second and recall@1/10/100 against the
+// groundtruth file
+void search_test(const vecs::fvecs &xb, const vecs::fvecs &xq, const char *gt_fname)
+{
+  const size_t k = 100;
+  vecs::ivecs gt;
+  if (!gt.open(gt_fname)) {
+    return;
+  }
+  float *q = xq.read_dense();
+  std::vector<int64_t> labels(xq.n() * k);
+  knn::config cfg;
+  const double start = elapsed();
+  knn::search(xb.row(0), xb.n(), xb.stride(), q, xq.n(), xq.d(), k, labels.data(), NULL, cfg);
+  const double secs = elapsed() - start;
+  delete [] q;
+  printf("brute force (%s, %u threads): %lu queries over %lu in %.3fs, %.1f queries/s, R@1 %.4f R@10 %.4f R@100 %.4f\n",
+         distance::kernel_name(distance::kernel_active()), std::thread::hardware_concurrency(), xq.n(), xb.n(), secs,
+         xq.n() / secs, knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 1),
+         knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 10),
+         knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 100));
 }
 
-void insertRawVectorFlush() {
-  insertJsonVectorFlush();
+// HNSW over the mapped base: build time (or the graph mapped from
+// index_fname if one is there for this base, saved there if not), memory
+// a vector, then queries a second and recall@1/10/100 for a range of
+// efSearch, the curve to set against the brute force line
+void hnsw_test(const vecs::fvecs &xb, const vecs::fvecs &xq, const char *gt_fname, const std::string &index_fname)
+{
+  const size_t k = 100;
+  vecs::ivecs gt;
+  if (!gt.open(gt_fname)) {
+    return;
+  }
+  hnsw::index ix;
+  hnsw::config cfg;
+  double start = elapsed();
+  if (!index_fname.empty() && access(index_fname.c_str(), R_OK) == 0 &&
+      ix.load(index_fname.c_str(), xb.row(0), xb.n(), xb.stride(), xb.d())) {
+    printf("hnsw: mapped %s in %.3fs\n", index_fname.c_str(), elapsed() - start);
+  } else {
+    if (!ix.build(xb.row(0), xb.n(), xb.stride(), xb.d(), cfg)) {
+      return;
+    }
+    printf("hnsw: built M %lu efConstruction %lu over %lu in %.1fs on %u threads\n", (unsigned long)cfg.M,
+           (unsigned long)cfg.ef_construction, xb.n(), elapsed() - start, std::thread::hardware_concurrency());
+    if (!index_fname.empty() && ix.save(index_fname.c_str())) {
+      printf("hnsw: saved %s\n", index_fname.c_str());
+    }
+  }
+  printf("hnsw: %.1f bytes of links a vector, %.1f with the vector, top level %d\n", (double)ix.graph_bytes() / xb.n(),
+         (double)ix.graph_bytes() / xb.n() + xb.d() * sizeof(float), ix.max_level());
+  float *q = xq.read_dense();
+  std::vector<int64_t> labels(xq.n() * k);
+  // k is 100, so efSearch starts there
+  const size_t efs[] = { 100, 150, 200, 300, 500, 800 };
+  for (size_t ef : efs) {
+    ix.set_ef(ef);
+    start = elapsed();
+    ix.search_batch(q, xq.n(), k, labels.data(), NULL);
+    const double secs = elapsed() - start;
+    printf("hnsw efSearch %3lu: %.1f queries/s, R@1 %.4f R@10 %.4f R@100 %.4f\n", (unsigned long)ef, xq.n() / secs,
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 1),
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 10),
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 100));
+  }
+  delete [] q;
 }
 
-// not much speed difference between buffer sizes, the 2M buffer is probably a second
-// faster using local host
-// char vector_buffer[512 * 1024]; // see note below
-char vector_buffer[2 * 1024 * 1024]; // see note below
-// char vector_buffer[1 * 1024 * 1024]; // see note below
-char * vbuf_ptr = vector_buffer;
-unsigned short insert_count = 0;
-// unsigned short max_extended_insert = 100;
-// unsigned short max_extended_insert = 500;
-// unsigned short max_extended_insert = 1000; // with vector bufer size of 512K, 1000 SIFT vectors tests the overflow logic
-unsigned short max_extended_insert = 2500; // with vector buffer size of 512K, 1000 SIFT vectors tests the overflow logic
-                                           // and with vector buffer size of 1024K, which also tests the overflow logic, and
-                                           // the newer flush logic
-
-void insertJsonVectorFlush() {
-  // TODO: should be constants
-  const char db_name [] = { "vector_db" };
-  const char user [] = {"vectoruser"};
-  const char pw [] = {"vectorpw"};
-  if (vbuf_ptr - vector_buffer > 0) {
-    insertExtended(vector_buffer, db_name, user, pw);
-    vbuf_ptr = vector_buffer;
-    vector_buffer[0] = 0;
-    insert_count = 0;
+// IVF-PQ with 16 byte codes, trained on the learn set and filled with the
+// base; nlist shrinks for a learn set too small to train 1024 lists
+bool ivfpq_build(const vecs::fvecs &xt, const vecs::fvecs &xb, ivfpq::index *ix)
+{
+  ivfpq::config cfg;
+  cfg.nlist = std::min((size_t)1024, std::max((size_t)1, xt.n() / 39));
+  double start = elapsed();
+  if (!ix->train(xt.row(0), xt.n(), xt.stride(), xt.d(), cfg)) {
+    return false;
   }
+  printf("ivfpq: trained nlist %lu m %lu on %lu in %.1fs\n", (unsigned long)cfg.nlist, (unsigned long)cfg.m, xt.n(),
+         elapsed() - start);
+  start = elapsed();
+  ix->add(xb.row(0), xb.n(), xb.stride());
+  printf("ivfpq: encoded %lu in %.1fs, %.1f MB of codes (%.1f MB with ids) for %.1f MB of floats\n", xb.n(),
+         elapsed() - start, ix->code_bytes() / 1e6, (ix->code_bytes() + ix->ntotal() * sizeof(int64_t)) / 1e6,
+         xb.n() * xb.d() * sizeof(float) / 1e6);
+  return true;
 }
 
-// Batches up the actual db writes
-void insertJsonVector(uint16_t op, uint16_t class_a, uint16_t class_b, json &jvec) {
-  size_t len;
-  bool overflow;
-  char vec_table_name[] = { "vectors" };
-
-  if (vector_buffer == vbuf_ptr) {
-    len = snprintf(vbuf_ptr, sizeof(vector_buffer), "INSERT INTO %s (op16, cla16, clb16, jstr60k) VALUES ", vec_table_name);
-    vbuf_ptr += len;
-    // printf("extended insert of size %ld: %s\n", vbuf_ptr - vector_buffer, vector_buffer);
-  }
-  size_t prev_len = len;
-  size_t cur_cap = sizeof(vector_buffer) - (vbuf_ptr - vector_buffer);
-  // printf("cur_cap: %ld\n", cur_cap);
-
-  char value_buf[2 * 1024];
-  size_t insert_len = snprintf(vbuf_ptr, cur_cap, "%s(%d, %d, %d, '%s')", insert_count == 0 ? "" : ", ", op, class_a, class_b, jvec.dump().c_str());
-  // printf("value buf at %ld: %s\n", vbuf_ptr - vector_buffer, value_buf);
-  insert_count++;
-  overflow = false;
-  if (insert_len >= cur_cap) {
-    printf("overflow at %ld with cur_cap: %ld\n", vbuf_ptr - vector_buffer, cur_cap);
-    // overflow, put back null and perform the insert
-    vector_buffer[sizeof(vector_buffer) - 1] = 0;
-    // printf("insert overflow before trunc: %s\n", vbuf_ptr);
-    *vbuf_ptr = 0;
-    // printf("insert overflow after trunc: %s\n", vbuf_ptr);
-    overflow = true;
-  }
-  if (overflow || insert_count >= max_extended_insert) {
-    //  printf("issuing extended insert of size %ld: %s\n", vbuf_ptr - vector_buffer, vector_buffer);
-    double t0 = elapsed();
-    insertJsonVectorFlush();
-    if (overflow) {
-      // repeat because the one that we tried to add
-      // overflows the available space.
-      insertJsonVector(op, class_a, class_b, jvec);
-    }
-  } else {
-    // string stuff together
-    // if (insert_count != 1) snprintf()
-    vbuf_ptr += insert_len;
+// Queries a second and recall@1/10/100 over a range of nprobe
+void ivfpq_report(ivfpq::index &ix, const vecs::fvecs &xq, const char *gt_fname)
+{
+  const size_t k = 100;
+  vecs::ivecs gt;
+  if (!gt.open(gt_fname)) {
+    return;
+  }
+  float *q = xq.read_dense();
+  std::vector<int64_t> labels(xq.n() * k);
+  const size_t probes[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  for (size_t p : probes) {
+    ix.set_nprobe(p);
+    const double start = elapsed();
+    ix.search(q, xq.n(), k, labels.data(), NULL);
+    const double secs = elapsed() - start;
+    printf("ivfpq nprobe %3lu: %.1f queries/s, R@1 %.4f R@10 %.4f R@100 %.4f\n", (unsigned long)p, xq.n() / secs,
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 1),
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 10),
+           knn::recall_at(labels.data(), xq.n(), k, gt.row(0), gt.stride(), 100));
   }
+  delete [] q;
 }
 
-void insertExtended(char * query, const char * const db_name, const char * const user, const char * const pw) {
-  // char db_name [] = { "vector_db" };
-  // char user [] = {"vectoruser"};
-  // char pw [] = {"vectorpw"};
+// Connections to vector_db, opened once in main() and lent to every insert
+// and retrieve
+dbpool::pool *db_pool = NULL;
 
-  void * conn = myDBLocalConnect(3306, user, pw, db_name);
-  (void)mysql_query((MYSQL *)conn, query);
-  // printf("ExtendedInsert query: %s\n", query);
-  mysql_close((MYSQL *)conn);
+// How vectors are stored: base64 in a JSON string in vectors.jstr60k, or
+// raw bytes in vectors_bin.vec through prepared statements. Picked on the
+// command line so the two can be compared.
+vecdb::store_mode db_store = vecdb::STORE_JSON;
+
+// What a vector is stored as; JSON rows are tagged with it, blob rows are
+// read back with it
+quant::dtype db_dtype = quant::DT_F32;
+
+// Bulk loader the inserts go through: encoder threads build the INSERTs,
+// writer threads send them on pooled connections
+vecdb::loader *db_loader = NULL;
+
+void insertRawVector(uint16_t op, uint16_t class_a, uint16_t class_b, float const * rvec, uint16_t dim) {
+  db_loader->add(op, class_a, class_b, rvec, 1, dim);
 }
 
-unsigned long retrieveRawVectors(uint16_t cla16, uint16_t clb16) {
-  char query_buf [512];
-  snprintf(query_buf, sizeof(query_buf), "SELECT jstr60k FROM vectors WHERE op16 = %d AND cla16 = %u AND clb16 = %u",
-           (unsigned int)OP_VECTOR, (unsigned int)cla16, (unsigned int)clb16);
-    
-  char db_name [] = { "vector_db" };
-  char user [] = {"vectoruser"};
-  char pw [] = {"vectorpw"};
-
-  unsigned long num_rows = 0;
-  void * conn = myDBLocalConnect(3306, user, pw, db_name);
-  (void)mysql_query((MYSQL *)conn, query_buf);
-  MYSQL_RES * result = mysql_store_result((MYSQL *)conn);
-  if (result) {
-    num_rows = mysql_num_rows(result);
-    // printf ("Number of rows: %lu\n", num_rows);
-  } else {
-    printf("Error: %s\n", mysql_error((MYSQL *)conn));
-  }
-  int i;
-  char * raw_buf_alloc = NULL;
-  char * raw_ptr = NULL;
-  size_t raw_vec_sz;
-  unsigned int first_vec_sz;
-  unsigned int raw_buf_alloc_sz;
-  for (i=0; i < num_rows; i++) {
-    MYSQL_ROW row = mysql_fetch_row(result);
-    unsigned int num_fields = mysql_num_fields(result);
-    // this shoudl be 1
-    // does what you expect row[0] is *the* value
-    // printf("row: %u fields: %u row value: %s\n", i, num_fields, row[0]) ;
-    json jvec = json::parse(row[0]);
-    std::string b64_vec = jvec["v"];
-    // printf("row: %d, len: %lu, b64_vec: %s\n", i, b64_vec.size(), b64_vec.c_str());
-    if (!raw_buf_alloc) {
-      first_vec_sz = b64_vec.size() * 3 / 4;
-      raw_buf_alloc_sz = num_rows * first_vec_sz;
-      raw_ptr = raw_buf_alloc = (char *)malloc(raw_buf_alloc_sz + MAX_RAW_VEC_SZ);
+void insertRawVectorFlush() {
+  db_loader->flush();
+}
+
+// -R: load resumably, checkpointed under this dataset name
+std::string load_dataset;
+
+// Insert every vector of an fvecs file of any size. Reader threads pread
+// batches ahead into a bounded ring, this thread hands them to the loader.
+// A resumable load starts reading at the first row not yet loaded, and
+// the loader skips any loaded after it.
+size_t insertVecsFile(const char *fname, uint16_t clb16) {
+  vecs::reader<float> reader(4096, 4, 8);
+  if (!reader.open(fname)) {
+    abort();
+  }
+  uint64_t first = 0;
+  if (!load_dataset.empty()) {
+    first = db_loader->resume_from(OP_VECTOR, CLASS_A_SIFT, clb16);
+    if (first == ~(uint64_t)0) {
+      fprintf(stderr, "could not read the checkpoints of %s\n", load_dataset.c_str());
+      return 0;
+    }
+    if (first > 0) {
+      printf("resuming %s at row %lu of %lu\n", fname, (unsigned long)first, reader.n());
     }
-    if ((raw_buf_alloc + raw_buf_alloc_sz) - raw_ptr < first_vec_sz) {
-      // Error out of space
-      printf("ERROR: (rba + rbas) - raw_ptr: %lu\n", (raw_buf_alloc + raw_buf_alloc_sz) - raw_ptr);
+  }
+  bool ok = reader.for_each([clb16](const vecs::batch<float> &b) {
+      return db_loader->add_at(OP_VECTOR, CLASS_A_SIFT, clb16, b.first, b.data, b.count, b.d);
+    }, first);
+  insertRawVectorFlush();
+  if (!ok) {
+    fprintf(stderr, "insert of %s stopped early\n", fname);
+  }
+  return reader.n();
+}
+
+// -m: store each class packed, this many vectors a row of vectors_packed,
+// instead of a row a vector
+unsigned int pack_block = 0;
+
+// Insert every vector of an fvecs file into a class of packed blocks,
+// replacing what the class had, so the ids are the file's row numbers
+size_t insertPackedFile(const char *fname, uint16_t clb16, size_t *blocks) {
+  vecs::reader<float> reader(4096, 4, 8);
+  if (!reader.open(fname)) {
+    abort();
+  }
+  const packdb::key k(OP_VECTOR, CLASS_A_SIFT, clb16);
+  if (!packdb::clear(*db_pool, k)) {
+    return 0;
+  }
+  packdb::writer w(*db_pool, k, reader.d(), db_dtype, pack_block);
+  bool ok = w.ok() && reader.for_each([&w](const vecs::batch<float> &b) {
+      return w.add(b.data, b.count);
+    });
+  ok = w.finish() && ok;
+  if (!ok) {
+    fprintf(stderr, "packed insert of %s stopped early\n", fname);
+  }
+  *blocks = w.blocks();
+  return w.rows();
+}
+
+// Stream a packed class into one anonymous mapping, a block at a time
+unsigned long retrievePackedVectors(uint16_t cla16, uint16_t clb16, size_t dim, double *first_rows_s) {
+  const packdb::key k(OP_VECTOR, cla16, clb16);
+  size_t n;
+  if (!packdb::count(*db_pool, k, &n) || n == 0) {
+    return 0;
+  }
+  const size_t bytes = n * dim * sizeof(float);
+  float *matrix = (float *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (matrix == MAP_FAILED) {
+    printf("ERROR: could not map %lu vectors: %s\n", n, strerror(errno));
+    return 0;
+  }
+  const double start = elapsed();
+  *first_rows_s = -1;
+  long num_rows = packdb::load(*db_pool, k, dim, matrix, n, [&](size_t, size_t) {
+      if (*first_rows_s < 0) {
+        *first_rows_s = elapsed() - start;
+      }
+    });
+  if (num_rows < 0) {
+    printf("ERROR: retrieve of packed class %u/%u failed\n", (unsigned int)cla16, (unsigned int)clb16);
+    num_rows = 0;
+  } else if ((size_t)num_rows != n) {
+    printf("ERROR: retrieved %ld packed vectors of class %u/%u, counted %lu\n", num_rows, (unsigned int)cla16,
+           (unsigned int)clb16, n);
+  }
+  munmap(matrix, bytes);
+  return num_rows;
+}
+
+// Look up count vectors of the base by id, spread over the file, and
+// check each against the file row as stored (quantized and back)
+void lookupPacked(const vecs::fvecs &xb, size_t count) {
+  const packdb::key k(OP_VECTOR, CLASS_A_SIFT, CLASS_B_SIFT_TYPE_BASE);
+  std::vector<float> got(xb.d()), want(xb.d());
+  std::vector<char> packed;
+  unsigned int missing = 0, wrong = 0;
+  const double start = elapsed();
+  size_t i = 0;
+  for (; i < count; i++) {
+    const size_t id = (i * 7919 + 13) % xb.n();
+    if (!packdb::get(*db_pool, k, id, xb.d(), got.data())) {
+      missing++;
+      continue;
     }
-    else {
-      raw_vec_sz = (raw_buf_alloc + raw_buf_alloc_sz) - raw_ptr;
-      b64::decode((char const *)b64_vec.c_str(), b64_vec.size(), raw_ptr, &raw_vec_sz);
+    packed.clear();
+    packdb::pack(db_dtype, xb.row(id), 1, xb.d(), &packed);
+    packdb::unpack(db_dtype, packed.data(), 1, xb.d(), want.data());
+    wrong += memcmp(got.data(), want.data(), xb.d() * sizeof(float)) != 0;
+  }
+  const double secs = elapsed() - start;
+  printf("looked up %lu packed vectors by id in %.3fs, %.1f us each\n", (unsigned long)count, secs, secs * 1e6 / count);
+  if (missing || wrong) {
+    printf("ERROR: %u lookups found nothing, %u found the wrong vector\n", missing, wrong);
+  }
+}
+
+// Partitions of the id range retrieved at once, each on its own connection
+unsigned int retrieve_parts = 1;
+
+// Directory of class snapshots (-c); empty to always fetch
+std::string snapshot_dir;
+
+// -H: where -s keeps its HNSW graph between runs
+std::string hnsw_fname;
+
+// -P: store the base as IVF-PQ codes under this model name instead of
+// storing the vectors
+std::string pq_model;
+
+// -S: after the retrieves, serve the base class from memory on this
+// socket until SIGINT or SIGTERM; -W: microseconds a query may wait there
+// for others to be searched with
+std::string serve_path;
+unsigned int serve_wait_us = 0;
+
+// What a retrieve leaves in memory when asked to keep it: the snapshot
+// stays mapped, or the fetched rows stay in their anonymous mapping
+struct resident {
+  snapcache::snapshot snap;
+  float *matrix;
+  size_t bytes;
+  resident() : matrix(NULL), bytes(0) {}
+  ~resident() {
+    if (matrix) {
+      munmap(matrix, bytes);
     }
-    if (raw_vec_sz != first_vec_sz) {
-      // Error unexpected buffer decode size
-      printf("ERROR: decode size: %lu vs expected decode size: %u\n", raw_vec_sz, first_vec_sz);
-      break;
+  }
+  const float *data() const { return matrix ? matrix : snap.data(); }
+};
+
+// Map the class's snapshot, fetching only the rows newer than it
+unsigned long retrieveSnapshot(const vecdb::selection &sel, size_t dim, snapcache::snapshot *keep = NULL) {
+  snapcache::snapshot own;
+  snapcache::snapshot &snap = keep ? *keep : own;
+  if (!snap.open(*db_pool, sel, dim, snapshot_dir, retrieve_parts)) {
+    printf("ERROR: snapshot of class %u/%u failed\n", (unsigned int)sel.class_a, (unsigned int)sel.class_b);
+    return 0;
+  }
+  const snapcache::stats &st = snap.last();
+  printf("snapshot %s: %lu rows mapped, %lu fetched in %.3fs%s, checked in %.3fs\n",
+         snapcache::path(snapshot_dir, sel, dim).c_str(), st.cached_rows, st.fetched_rows, st.fetch_s,
+         st.rebuilt ? " (new)" : "", st.check_s);
+  return snap.n();
+}
+
+// Stream every vector of a class into one anonymous mapping of n * dim
+// floats: rows are decoded (or, for blobs, fetched) straight into place
+// as they come off the socket, and the first ones are usable before the
+// last arrive
+unsigned long retrieveVectors(uint16_t cla16, uint16_t clb16, size_t dim, double *first_rows_s, resident *keep = NULL) {
+  vecdb::selection sel(db_store, OP_VECTOR, cla16, clb16);
+  sel.dtype = db_dtype;
+  if (!snapshot_dir.empty()) {
+    *first_rows_s = 0;
+    return retrieveSnapshot(sel, dim, keep ? &keep->snap : NULL);
+  }
+  size_t n;
+  if (!vecdb::count(*db_pool, sel, &n) || n == 0) {
+    return 0;
+  }
+  const size_t bytes = n * dim * sizeof(float);
+  float *matrix = (float *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (matrix == MAP_FAILED) {
+    printf("ERROR: could not map %lu vectors: %s\n", n, strerror(errno));
+    return 0;
+  }
+  vecdb::rows_info info;
+  const double start = elapsed();
+  *first_rows_s = -1;
+  auto ready = [&](size_t, size_t) {
+    if (*first_rows_s < 0) {
+      *first_rows_s = elapsed() - start;
     }
-    raw_ptr += raw_vec_sz;
+  };
+  long num_rows = retrieve_parts > 1 ? vecdb::select_parallel(*db_pool, sel, dim, matrix, n, &info, retrieve_parts, ready)
+                                     : vecdb::select_into(*db_pool, sel, dim, matrix, n, &info, ready);
+  if (num_rows < 0) {
+    printf("ERROR: retrieve of class %u/%u failed\n", (unsigned int)cla16, (unsigned int)clb16);
+    num_rows = 0;
+  } else if ((size_t)num_rows != n || info.class_b.size() != n || info.class_b[0] != clb16) {
+    printf("ERROR: retrieved %ld vectors of class %u/%u, counted %lu\n", num_rows, (unsigned int)cla16,
+           (unsigned int)clb16, n);
   }
-  if (num_rows > 0) {
-    mysql_free_result(result);
-    free(raw_buf_alloc);
+  if (keep && num_rows > 0) {
+    keep->matrix = matrix;
+    keep->bytes = bytes;
+  } else {
+    munmap(matrix, bytes);
   }
-  mysql_close((MYSQL *)conn);
   return num_rows;
 }
 
-int main()
+vserve::server *query_server = NULL;
+
+void stopServing(int) {
+  if (query_server) {
+    query_server->stop();
+  }
+}
+
+// Serve n rows of d floats, stride apart, on serve_path until a signal
+// stops it; the queries that come in together are searched together
+bool serveVectors(const float *base, size_t n, size_t stride, size_t d) {
+  vserve::config cfg;
+  cfg.max_wait_us = serve_wait_us;
+  vserve::server srv(base, n, stride, d, cfg);
+  if (!srv.listen(serve_path.c_str())) {
+    return false;
+  }
+  query_server = &srv;
+  signal(SIGINT, stopServing);
+  signal(SIGTERM, stopServing);
+  printf("serving %lu vectors, d=%lu, on %s\n", (unsigned long)n, (unsigned long)d, serve_path.c_str());
+  fflush(stdout);
+  const double start = elapsed();
+  const bool ok = srv.run();
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  query_server = NULL;
+  const vserve::stats st = srv.counters();
+  printf("served %lu requests on %lu connections in %.3fs: %lu knn in %lu searches (%.1f a search), %lu gets, "
+         "%lu errors\n", (unsigned long)st.requests, (unsigned long)st.conns, elapsed() - start,
+         (unsigned long)st.knn, (unsigned long)st.batches, st.batches ? (double)st.batched / st.batches : 0.0,
+         (unsigned long)st.gets, (unsigned long)st.errors);
+  return ok;
+}
+
+int main(int argc, char **argv)
 {
   double t0 = elapsed();
+  bool retrieve_only = false;  // -r: skip the inserts, retrieve what is there
+  bool search_only = false;    // -s: search the files, no database
+  // orca_vh [-e encoders] [-w writers] [-a async inserts] [-b batch bytes] [-t txn rows] [-k] [-R dataset] [-p retrieve parts] [-q f32|f16|bf16|i8] [-c snapshot dir] [-r] [-s] [-H hnsw file] [-P pq model]
+  //         [-m vectors a row] [-T] [-S socket] [-W wait us] [json|blob] [insert|load]
+  vecdb::load_config load_cfg;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:w:a:b:t:kR:p:q:c:rsH:P:m:TS:W:")) != -1) {
+    switch (opt) {
+    case 'e': load_cfg.encoders = atoi(optarg); break;
+    case 'w': load_cfg.writers = atoi(optarg); break;
+    case 'a': load_cfg.inflight = atoi(optarg); break;
+    case 'b': load_cfg.batch_bytes = strtoull(optarg, NULL, 10); load_cfg.adapt = false; break;
+    case 't': load_cfg.txn_rows = atol(optarg); break;
+    case 'k': load_cfg.disable_keys = true; break;
+    case 'R': load_dataset = optarg; break;
+    case 'p': retrieve_parts = atoi(optarg); break;
+    case 'c': snapshot_dir = optarg; break;
+    case 'r': retrieve_only = true; break;
+    case 's': search_only = true; break;
+    case 'H': hnsw_fname = optarg; break;
+    case 'P': pq_model = optarg; break;
+    case 'm': pack_block = atoi(optarg); break;
+    case 'T': timing::report_at_exit(); break;
+    case 'S': serve_path = optarg; break;
+    case 'W': serve_wait_us = atoi(optarg); break;
+    case 'q':
+      if (quant::from_name(optarg, &db_dtype)) {
+        break;
+      }
+      // fall through
+    default:
+      fprintf(stderr, "usage: %s [-e encoders] [-w writers] [-a async inserts] [-b batch bytes] [-t txn rows] [-k] [-R dataset] [-p retrieve parts] [-q f32|f16|bf16|i8] "
+              "[-c snapshot dir] [-r] [-s] [-H hnsw file] [-P pq model] [-m vectors a row] [-T] [-S socket] [-W wait us] [json|blob] [insert|load]\n", argv[0]);
+      return 1;
+    }
+  }
+  for (; optind < argc; optind++) {
+    if (strcmp(argv[optind], "blob") == 0) {
+      db_store = vecdb::STORE_BLOB;
+    } else if (strcmp(argv[optind], "load") == 0) {
+      load_cfg.ingest = vecdb::INGEST_LOAD_DATA;
+    } else if (strcmp(argv[optind], "json") != 0 && strcmp(argv[optind], "insert") != 0) {
+      fprintf(stderr, "%s: unknown mode %s\n", argv[0], argv[optind]);
+      return 1;
+    }
+  }
+  load_cfg.mode = db_store;
+  load_cfg.dataset = load_dataset;
+  load_cfg.dtype = db_dtype;
+  const char *ingest_name = load_cfg.ingest == vecdb::INGEST_LOAD_DATA ? "load data" : "insert";
 
+  // mapped, not read: pages come in as the inserts below touch them
   size_t d;
   size_t nt;
-  float *xt;
+  vecs::fvecs xt;
   {
     printf ("[%.3f s] Loading train set\n", elapsed() - t0);
 
-    xt = fvecs_read("sift1M/sift_learn.fvecs", &d, &nt);
+    if (!xt.open("sift1M/sift_learn.fvecs")) {
+      abort();
+    }
+    d = xt.d(); nt = xt.n();
 
     printf ("[%.3f s] Done Loading train set d=%ld N=%ld\n",
             elapsed() - t0, d, nt);
   }
 
   size_t nb;
-  float *xb;
+  vecs::fvecs xb;
   {
     printf ("[%.3f s] Loading database\n", elapsed() - t0);
 
-    size_t d2;
-    xb = fvecs_read("sift1M/sift_base.fvecs", &d2, &nb);
+    if (!xb.open("sift1M/sift_base.fvecs")) {
+      abort();
+    }
+    size_t d2 = xb.d(); nb = xb.n();
     assert(d == d2 || !"dataset does not have same dimension as train set");
     printf ("[%.3f s] Indexing database, d=%ld N=%ld\n",
             elapsed() - t0, d2, nb);
@@ -315,82 +616,196 @@ int main()
   }
 
   size_t nq;
-  float *xq;
+  vecs::fvecs xq;
   {
     printf ("[%.3f s] Loading queries\n", elapsed() - t0);
 
-    size_t d2;
-    xq = fvecs_read("sift1M/sift_query.fvecs", &d2, &nq);
+    if (!xq.open("sift1M/sift_query.fvecs")) {
+      abort();
+    }
+    size_t d2 = xq.d(); nq = xq.n();
     assert(d == d2 || !"query does not have same dimension as train set");
     printf ("[%.3f s] Queries database, d=%ld N=%ld\n",
             elapsed() - t0, d2, nq);
   }
 
   // tests the base64 encoding/decoding of the SIFT vectors
-  vec_test(xq, nq, d);
-  vec_test(xb, nb, d);
-  vec_test(xt, nt, d);
+  vec_test(xq);
+  vec_test(xb);
+  vec_test(xt);
+  quant_report(xq, db_dtype);
+  if (search_only && !serve_path.empty()) {
+    // the base file as it is mapped, no database
+    return serveVectors(xb.row(0), nb, xb.stride(), d) ? 0 : 1;
+  }
+  if (search_only) {
+    search_test(xb, xq, "sift1M/sift_groundtruth.ivecs");
+    hnsw_test(xb, xq, "sift1M/sift_groundtruth.ivecs", hnsw_fname);
+    ivfpq::index ix;
+    if (ivfpq_build(xt, xb, &ix)) {
+      ivfpq_report(ix, xq, "sift1M/sift_groundtruth.ivecs");
+    }
+    return 0;
+  }
     
-  char user [] = { "vectoruser" };
-  char pw [] = { "vectorpw" };
-  char server [] = { "127.0.0.1" };
-  void *conn = myDBLocalConnect(3306, user, pw, NULL);
-
-  char db_name [] = { "vector_db" };
-  char vec_table_name [] = { "vectors" };
-  char vec_table_schema[] = { "(op16 smallint unsigned default 0, "
-                              "cla16 smallint unsigned default 0, "
-                              "clb16 smallint unsigned default 0, "
-                              "jstr60k varchar(61440) default '{}')" };
-  char query[1600];
-  snprintf(query, sizeof(query), "CREATE DATABASE IF NOT EXISTS %s", db_name);
-  (void)mysql_query((MYSQL *)conn, query);
-  mysql_close((MYSQL *)conn);
-
-  conn = myDBLocalConnect(3306, user, pw, db_name);
-  // conn = (void *)mysql_init(NULL);
-  // (void)mysql_real_connect((MYSQL *)conn, server, user, pw, db_name, 3306, NULL, 0);
-  // snprintf(query, sizeof(query), "CREATE TABLE IF NOT EXISTS %s", vec_table_name);
-  snprintf(query, sizeof(query), "CREATE TABLE IF NOT EXISTS %s %s", vec_table_name, vec_table_schema);
-  (void)mysql_query((MYSQL *)conn, query);
-  mysql_close((MYSQL *)conn);
-
-  // Add vectors to the db/table
-  double db_insert_start = elapsed();
-  int i;
-  for (i = 0; i < nq; i++) {
-    insertRawVector(OP_VECTOR, CLASS_A_SIFT, CLASS_B_SIFT_TYPE_QUERY, xq + i, d);
+  // One pool for the run: the connects are paid here, not per statement
+  double db_setup_start = elapsed();
+  dbpool::config db_cfg;
+  db_cfg.user = "vectoruser";
+  db_cfg.pass = "vectorpw";
+  db_cfg.db = "vector_db";
+  db_cfg.create_db = true;
+  db_cfg.local_infile = load_cfg.ingest == vecdb::INGEST_LOAD_DATA;
+  db_cfg.size = std::max(std::max(load_cfg.writers, load_cfg.inflight), retrieve_parts);
+  if (db_cfg.size == 0) {
+    db_cfg.size = 1;
   }
-  insertRawVectorFlush();
-  printf("inserted %ld vectors in %.3fs\n", nq, elapsed() - db_insert_start);
-  db_insert_start = elapsed();
-  for (i = 0; i < nt; i++) {
-    insertRawVector(OP_VECTOR, CLASS_A_SIFT, CLASS_B_SIFT_TYPE_TRAIN, xt + i, d);
+  dbpool::pool pool(db_cfg);
+  if (!pool.ok()) {
+    fprintf(stderr, "could not open the connection pool to %s\n", db_cfg.db.c_str());
+    return 1;
   }
-  insertRawVectorFlush();
-  printf("inserted %ld vectors in %.3fs\n", nt, elapsed() - db_insert_start);
-  db_insert_start = elapsed();
-  for (i = 0; i < nb; i++) {
-    insertRawVector(OP_VECTOR, CLASS_A_SIFT, CLASS_B_SIFT_TYPE_BASE, xb + i, d);
+  db_pool = &pool;
+  printf("opened %u connections in %.3fs\n", pool.size(), elapsed() - db_setup_start);
+
+  if (!pq_model.empty()) {
+    // the codes go in and come back out, and the index read back is searched
+    ivfpq::index ix, back;
+    if (!pqdb::create_tables(pool) || !ivfpq_build(xt, xb, &ix)) {
+      return 1;
+    }
+    double start = elapsed();
+    if (!pqdb::store(pool, pq_model.c_str(), ix)) {
+      return 1;
+    }
+    printf("ivfpq: stored model %s and %lu codes in %.3fs\n", pq_model.c_str(), ix.ntotal(), elapsed() - start);
+    start = elapsed();
+    const long codes = pqdb::load(pool, pq_model.c_str(), &back);
+    if (codes != (long)ix.ntotal()) {
+      printf("ERROR: read back %ld of %lu ivfpq codes\n", codes, ix.ntotal());
+      return 1;
+    }
+    printf("ivfpq: read back model %s and %ld codes in %.3fs\n", pq_model.c_str(), codes, elapsed() - start);
+    ivfpq_report(back, xq, "sift1M/sift_groundtruth.ivecs");
+    db_pool = NULL;
+    return 0;
+  }
+
+  if (pack_block) {
+    // the same three classes, a block of vectors a row
+    if (!packdb::create_table(pool)) {
+      return 1;
+    }
+    printf("storing vectors as %s, %u a row in %s\n", quant::name(db_dtype), pack_block, packdb::TABLE);
+    const char *fnames[] = { "sift1M/sift_query.fvecs", "sift1M/sift_learn.fvecs", "sift1M/sift_base.fvecs" };
+    const uint16_t classes[] = { CLASS_B_SIFT_TYPE_QUERY, CLASS_B_SIFT_TYPE_TRAIN, CLASS_B_SIFT_TYPE_BASE };
+    int c = 0;
+    for (; c < 3 && !retrieve_only; c++) {
+      const double start = elapsed();
+      size_t blocks = 0;
+      const size_t rows = insertPackedFile(fnames[c], classes[c], &blocks);
+      printf("packed %lu vectors into %lu rows in %.3fs\n", (unsigned long)rows, (unsigned long)blocks,
+             elapsed() - start);
+    }
+    for (c = 0; c < 3; c++) {
+      double first_rows_s;
+      const double start = elapsed();
+      const unsigned long num_rows = retrievePackedVectors(CLASS_A_SIFT, classes[c], d, &first_rows_s);
+      printf("retrieved %lu packed vectors in %.3fs, first rows after %.3fs\n", num_rows, elapsed() - start,
+             first_rows_s);
+    }
+    lookupPacked(xb, 1000);
+    db_pool = NULL;
+    return 0;
+  }
+
+  if (!vecdb::create_table(pool, db_store)) {
+    return 1;
+  }
+  vecdb::loader loader(pool, load_cfg);
+  db_loader = &loader;
+  if (load_cfg.inflight && vecdb::async_supported(load_cfg)) {
+    printf("storing vectors as %s %s by %s, %u encoders, %u inserts in flight\n", quant::name(db_dtype),
+           db_store == vecdb::STORE_BLOB ? "raw bytes in vectors_bin" : "base64 json in vectors",
+           ingest_name, load_cfg.encoders, load_cfg.inflight);
+  } else {
+    printf("storing vectors as %s %s by %s, %u encoders, %u writers\n", quant::name(db_dtype),
+           db_store == vecdb::STORE_BLOB ? "raw bytes in vectors_bin" : "base64 json in vectors",
+           ingest_name, load_cfg.encoders, load_cfg.writers);
+  }
+  if (loader.limits().max_allowed_packet) {
+    printf("statements of %.2f MB%s, max_allowed_packet %.2f MB\n", loader.stmt_bytes() / 1048576.0,
+           load_cfg.adapt ? " to start" : "", loader.limits().max_allowed_packet / 1048576.0);
+  } else {
+    printf("statements of %.2f MB%s, max_allowed_packet not known\n", loader.stmt_bytes() / 1048576.0,
+           load_cfg.adapt ? " to start" : "");
   }
-  insertRawVectorFlush();
-  printf("inserted %ld vectors in %.3fs\n", nb, elapsed() - db_insert_start);
+
+  // Add vectors to the db/table, streamed from the files so the reads
+  // overlap the inserts. Any reconnects are reported apart from the
+  // statement time, and so is the time the files waited on the database.
+  double connect_s = pool.connect_seconds();
+  if (!retrieve_only) {
+    double db_insert_start = elapsed();
+    double stalled_s = loader.stalled_seconds();
+    insertVecsFile("sift1M/sift_query.fvecs", CLASS_B_SIFT_TYPE_QUERY);
+    printf("inserted %ld vectors by %s in %.3fs (reconnects %.3fs, stalled %.3fs)\n", nq, ingest_name, elapsed() - db_insert_start,
+           pool.connect_seconds() - connect_s, loader.stalled_seconds() - stalled_s);
+    connect_s = pool.connect_seconds();
+    db_insert_start = elapsed();
+    stalled_s = loader.stalled_seconds();
+    insertVecsFile("sift1M/sift_learn.fvecs", CLASS_B_SIFT_TYPE_TRAIN);
+    printf("inserted %ld vectors by %s in %.3fs (reconnects %.3fs, stalled %.3fs)\n", nt, ingest_name, elapsed() - db_insert_start,
+           pool.connect_seconds() - connect_s, loader.stalled_seconds() - stalled_s);
+    connect_s = pool.connect_seconds();
+    db_insert_start = elapsed();
+    stalled_s = loader.stalled_seconds();
+    insertVecsFile("sift1M/sift_base.fvecs", CLASS_B_SIFT_TYPE_BASE);
+    printf("inserted %ld vectors by %s in %.3fs (reconnects %.3fs, stalled %.3fs)\n", nb, ingest_name, elapsed() - db_insert_start,
+           pool.connect_seconds() - connect_s, loader.stalled_seconds() - stalled_s);
+  }
+
+  // the writers hand their connections back to the pool for the retrieves
+  if (!loader.finish()) {
+    printf("ERROR: %u of %lu inserts failed\n", loader.errors(), loader.batches() + loader.errors());
+  }
+  if (!retrieve_only && !load_dataset.empty()) {
+    printf("resumable load %s: %lu rows loaded before were skipped\n", load_dataset.c_str(), loader.skipped());
+  }
+  if (!retrieve_only && load_cfg.adapt) {
+    printf("statements of %.2f MB at the end of the load\n", loader.stmt_bytes() / 1048576.0);
+  }
+  db_loader = NULL;
 
   unsigned long num_rows;
+  double first_rows_s;
+  connect_s = pool.connect_seconds();
   double db_retrieve_start = elapsed();
-  num_rows = retrieveRawVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_QUERY);
-  printf("retrieveded %ld vectors in %.3fs\n", num_rows, elapsed() - db_insert_start);
+  num_rows = retrieveVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_QUERY, d, &first_rows_s);
+  printf("retrieveded %ld vectors in %.3fs, first rows after %.3fs (reconnects %.3fs)\n", num_rows,
+         elapsed() - db_retrieve_start, first_rows_s, pool.connect_seconds() - connect_s);
 
+  connect_s = pool.connect_seconds();
   db_retrieve_start = elapsed();
-  num_rows = retrieveRawVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_TRAIN);
-  printf("retrieveded %ld vectors in %.3fs\n", num_rows, elapsed() - db_insert_start);
+  num_rows = retrieveVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_TRAIN, d, &first_rows_s);
+  printf("retrieveded %ld vectors in %.3fs, first rows after %.3fs (reconnects %.3fs)\n", num_rows,
+         elapsed() - db_retrieve_start, first_rows_s, pool.connect_seconds() - connect_s);
 
+  connect_s = pool.connect_seconds();
   db_retrieve_start = elapsed();
-  num_rows = retrieveRawVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_BASE);
-  printf("retrieveded %ld vectors in %.3fs\n", num_rows, elapsed() - db_insert_start);
-
-  delete [] xq;
-  delete [] xb;
-  delete [] xt;
+  resident base;
+  num_rows = retrieveVectors(CLASS_A_SIFT, CLASS_B_SIFT_TYPE_BASE, d, &first_rows_s, serve_path.empty() ? NULL : &base);
+  printf("retrieveded %ld vectors in %.3fs, first rows after %.3fs (reconnects %.3fs)\n", num_rows,
+         elapsed() - db_retrieve_start, first_rows_s, pool.connect_seconds() - connect_s);
+
+  printf("pool: %u connects in %.3fs, %u pings\n", pool.connects(), pool.connect_seconds(), pool.pings());
+  db_pool = NULL;
+  if (!serve_path.empty()) {
+    if (num_rows == 0 || !base.data()) {
+      fprintf(stderr, "no base vectors to serve\n");
+      return 1;
+    }
+    return serveVectors(base.data(), num_rows, d, d) ? 0 : 1;
+  }
   return 0;
 }
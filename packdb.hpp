@@ -0,0 +1,446 @@
+#ifndef __packdb_hpp__
+#define __packdb_hpp__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <mysql/mysql.h>
+
+#include "dbpool.hpp"
+#include "quant.hpp"
+#include "timing.hpp"
+#include "vecdb.hpp"
+
+/*
+ * Vectors stored a block to a row: each row of vectors_packed holds up to
+ * block vectors of one class back to back in a blob, in the dtype named
+ * by the row, with the id of its first vector. Ids run from 0 up within
+ * a class, in the order the vectors were added. At one vector a row the
+ * row header, index entry and SQL tuple cost as much as a SIFT vector in
+ * f16; at 1024 a row they are lost in the noise, a million vectors are
+ * under a thousand rows, and a class comes back as a few large blobs.
+ *
+ * A single vector is still read by id: the row whose start is the
+ * largest at or below it is found through the primary key, and the
+ * server cuts the vector out of the blob with SUBSTRING, so only its
+ * bytes come over.
+ */
+namespace packdb {
+  const char TABLE[] = "vectors_packed";
+  const char SCHEMA[] = "(op16 smallint unsigned not null, "
+                        "cla16 smallint unsigned not null, "
+                        "clb16 smallint unsigned not null, "
+                        "start bigint unsigned not null, "
+                        "n int unsigned not null, "
+                        "dim smallint unsigned not null, "
+                        "dtype varchar(8) not null, "
+                        "vecs mediumblob not null, "
+                        "primary key (op16, cla16, clb16, start))";
+  const unsigned int DEFAULT_BLOCK = 1024;
+  // a mediumblob takes 16 MB; blocks are kept well under, so a few go in a statement
+  const size_t MAX_BLOCK_BYTES = 4 * 1024 * 1024;
+
+  /* The class a set of blocks belongs to */
+  struct key {
+    uint16_t op;
+    uint16_t class_a;
+    uint16_t class_b;
+    key(uint16_t o, uint16_t a, uint16_t b) : op(o), class_a(a), class_b(b) {}
+
+    std::string where() const {
+      char w[96];
+      snprintf(w, sizeof(w), "WHERE op16 = %u AND cla16 = %u AND clb16 = %u", (unsigned int)op,
+               (unsigned int)class_a, (unsigned int)class_b);
+      return w;
+    }
+  };
+
+  inline bool create_table(dbpool::pool &pool) {
+    const std::string q = std::string("CREATE TABLE IF NOT EXISTS ") + TABLE + " " + SCHEMA;
+    dbpool::lease conn = pool.borrow();
+    return conn && conn.query(q.c_str());
+  }
+
+  /* Drops every block of the class, so its ids start from 0 again */
+  inline bool clear(dbpool::pool &pool, const key &k) {
+    const std::string q = std::string("DELETE FROM ") + TABLE + " " + k.where();
+    dbpool::lease conn = pool.borrow();
+    return conn && conn.query(q.c_str());
+  }
+
+  /* Vectors and rows of the class, and the id the next vector gets; false if the query fails */
+  inline bool count(dbpool::pool &pool, const key &k, size_t *n, size_t *rows = NULL, uint64_t *next = NULL) {
+    const std::string q = std::string("SELECT COALESCE(SUM(n), 0), COUNT(*), COALESCE(MAX(start + n), 0) FROM ") +
+      TABLE + " " + k.where();
+    dbpool::lease conn = pool.borrow();
+    MYSQL_RES *res = conn && conn.query(q.c_str()) ? mysql_store_result(conn.mysql()) : NULL;
+    MYSQL_ROW row = res ? mysql_fetch_row(res) : NULL;
+    if (row) {
+      *n = row[0] ? strtoull(row[0], NULL, 10) : 0;
+      if (rows) {
+        *rows = row[1] ? strtoull(row[1], NULL, 10) : 0;
+      }
+      if (next) {
+        *next = row[2] ? strtoull(row[2], NULL, 10) : 0;
+      }
+    }
+    if (res) {
+      mysql_free_result(res);
+    }
+    return row != NULL;
+  }
+
+  /* Appends the n vectors of dimension d at v to out, each in dtype t */
+  inline void pack(quant::dtype t, const float *v, size_t n, size_t d, std::vector<char> *out) {
+    static const unsigned int st = timing::stage("packdb.pack");
+    timing::scope ts(st);
+    const size_t row_bytes = quant::bytes(t, d);
+    size_t at = out->size();
+    out->resize(at + n * row_bytes);
+    if (t == quant::DT_F32) {
+      memcpy(out->data() + at, v, n * row_bytes);
+    } else {
+      size_t i = 0;
+      for (; i < n; i++, at += row_bytes) {
+        quant::encode(t, v + i * d, d, out->data() + at);
+      }
+    }
+    ts.add(n * d * sizeof(float), n);
+  }
+
+  /* The n vectors packed at p in dtype t, as n * d floats at out */
+  inline void unpack(quant::dtype t, const char *p, size_t n, size_t d, float *out) {
+    static const unsigned int st = timing::stage("packdb.unpack");
+    timing::scope ts(st);
+    const size_t row_bytes = quant::bytes(t, d);
+    if (t == quant::DT_F32) {
+      memcpy(out, p, n * row_bytes);
+    } else {
+      size_t i = 0;
+      for (; i < n; i++) {
+        quant::decode(t, p + i * row_bytes, d, out + i * d);
+      }
+    }
+    ts.add(n * d * sizeof(float), n);
+  }
+
+  /*
+   * Appends vectors to a class, on a connection of its own. Vectors are
+   * packed into blocks as they come, whatever sizes add() gets them in,
+   * and the blocks go to the server several to a multi-row INSERT, as
+   * many as fit under max_allowed_packet. Ids carry on from what the
+   * class had when the writer started, so a class takes one writer at a
+   * time (a second would collide on the primary key, and fail).
+   */
+  class writer {
+  public:
+    writer(dbpool::pool &pool, const key &k, size_t d, quant::dtype t = quant::DT_F32,
+           unsigned int block = DEFAULT_BLOCK)
+      : _key(k), _d(d), _dtype(t), _block(block ? block : 1), _row_bytes(quant::bytes(t, d)), _next(0), _first(0),
+        _rows(0), _blocks(0), _stmts(0), _ok(false) {
+      const vecdb::server_limits lim = vecdb::read_limits(pool);
+      size_t stmt_bytes = lim.max_allowed_packet > 4096 ? lim.max_allowed_packet - 4096 : vecdb::DEFAULT_STMT_BYTES;
+      stmt_bytes = std::min(stmt_bytes, vecdb::MAX_STMT_BYTES);
+      const size_t block_bytes = std::min(stmt_bytes, MAX_BLOCK_BYTES);
+      if (_block * _row_bytes > block_bytes) {
+        _block = std::max((size_t)1, block_bytes / _row_bytes);
+        fprintf(stderr, "packed blocks of %u vectors of %lu bytes, to fit %lu byte statements\n", _block,
+                (unsigned long)_row_bytes, (unsigned long)stmt_bytes);
+      }
+      _per_stmt = std::max((size_t)1, stmt_bytes / (_block * _row_bytes));
+      size_t have;
+      if (d > 65535 || !count(pool, k, &have, NULL, &_next)) {
+        return;
+      }
+      _first = _next;
+      _conn = pool.borrow();
+      _ok = (bool)_conn;
+    }
+
+    ~writer() { finish(); }
+
+    writer(const writer &) = delete;
+    writer &operator=(const writer &) = delete;
+
+    /* Whether the class could be read and nothing has failed since */
+    bool ok() const { return _ok; }
+
+    /* Packs n vectors; full blocks go out as statements fill. false once anything failed. */
+    bool add(const float *v, size_t n) {
+      while (_ok && n > 0) {
+        if (_data.empty() || _fill[_data.size() - 1] == _block) {
+          _data.push_back(std::vector<char>());
+          _data.back().reserve(_block * _row_bytes);
+          _fill.push_back(0);
+        }
+        const size_t take = std::min(n, (size_t)(_block - _fill.back()));
+        pack(_dtype, v, take, _d, &_data.back());
+        _fill.back() += take;
+        v += take * _d;
+        n -= take;
+        if (_data.size() == _per_stmt && _fill.back() == _block) {
+          _ok = _insert();
+        }
+      }
+      return _ok;
+    }
+
+    /* Writes the blocks still held, the last one part full; true if every statement went through */
+    bool finish() {
+      if (_ok && !_data.empty()) {
+        _ok = _insert();
+      }
+      _conn.release();
+      return _ok;
+    }
+
+    /* The id of the first vector added, vectors and blocks written, and INSERTs sent */
+    uint64_t first_id() const { return _first; }
+    size_t rows() const { return _rows; }
+    size_t blocks() const { return _blocks; }
+    size_t statements() const { return _stmts; }
+    unsigned int block() const { return _block; }
+
+  private:
+    bool _insert() {
+      static const unsigned int st = timing::stage("packdb.insert");
+      const size_t nb = _data.size();
+      std::string sql = std::string("INSERT INTO ") + TABLE + " (op16, cla16, clb16, start, n, dim, dtype, vecs) VALUES ";
+      size_t i = 0;
+      for (; i < nb; i++) {
+        sql += i == 0 ? "(?,?,?,?,?,?,?,?)" : ",(?,?,?,?,?,?,?,?)";
+      }
+      MYSQL_STMT *stmt = _conn.prepare(sql.c_str());
+      if (!stmt) {
+        return false;
+      }
+      uint16_t keys[4] = { _key.op, _key.class_a, _key.class_b, (uint16_t)_d };
+      const char *dtype = quant::name(_dtype);
+      unsigned long dtype_len = strlen(dtype);
+      std::vector<uint64_t> starts(nb), ns(nb);
+      std::vector<unsigned long> lens(nb);
+      std::vector<MYSQL_BIND> binds(8 * nb);
+      uint64_t start = _next;
+      size_t bytes = 0, rows = 0;
+      for (i = 0; i < nb; i++) {
+        starts[i] = start;
+        ns[i] = _fill[i];
+        lens[i] = _data[i].size();
+        start += _fill[i];
+        bytes += lens[i];
+        rows += _fill[i];
+        MYSQL_BIND *b = &binds[8 * i];
+        vecdb::_bind_u16(&b[0], &keys[0]);
+        vecdb::_bind_u16(&b[1], &keys[1]);
+        vecdb::_bind_u16(&b[2], &keys[2]);
+        vecdb::_bind_u64(&b[3], &starts[i]);
+        vecdb::_bind_u64(&b[4], &ns[i]);
+        vecdb::_bind_u16(&b[5], &keys[3]);
+        vecdb::_bind_blob(&b[6], (void *)dtype, dtype_len, &dtype_len);
+        vecdb::_bind_blob(&b[7], _data[i].data(), lens[i], &lens[i]);
+      }
+      timing::scope ts(st);
+      ts.add(bytes, rows);
+      if (mysql_stmt_bind_param(stmt, binds.data()) || mysql_stmt_execute(stmt)) {
+        fprintf(stderr, "insert of %lu packed blocks into %s failed: %s\n", (unsigned long)nb, TABLE,
+                mysql_stmt_error(stmt));
+        _conn.broken();
+        return false;
+      }
+      _next = start;
+      _rows += rows;
+      _blocks += nb;
+      _stmts++;
+      _data.clear();
+      _fill.clear();
+      return true;
+    }
+
+    const key _key;
+    const size_t _d;
+    const quant::dtype _dtype;
+    unsigned int _block;
+    const size_t _row_bytes;
+    size_t _per_stmt;
+    uint64_t _next;
+    uint64_t _first;
+    size_t _rows;
+    size_t _blocks;
+    size_t _stmts;
+    bool _ok;
+    dbpool::lease _conn;
+    std::vector<std::vector<char>> _data;  // blocks waiting for the next INSERT
+    std::vector<unsigned int> _fill;       // vectors in each
+  };
+
+  /* The dtype named by a row, checked against the bytes it came with */
+  inline bool _row_dtype(const char *name, unsigned long name_len, size_t d, size_t n, unsigned long len,
+                         quant::dtype *t) {
+    char s[16];
+    if (name_len >= sizeof(s)) {
+      return false;
+    }
+    memcpy(s, name, name_len);
+    s[name_len] = 0;
+    return quant::from_name(s, t) && len == n * quant::bytes(*t, d);
+  }
+
+  /*
+   * Streams every vector of the class, of dimension d, in id order into
+   * dst, a caller owned float[max_rows * d]. The blocks come off the
+   * socket one at a time over the binary protocol; f32 blocks are copied
+   * straight into their place in dst, others decoded into it. ready, if
+   * given, is called as each block lands. Returns the number of vectors,
+   * or -1 on a failed query, a bad block, ids that are not 0, 1, 2, ...
+   * in order, or more than max_rows vectors.
+   */
+  inline long load(dbpool::pool &pool, const key &k, size_t d, float *dst, size_t max_rows,
+                   const vecdb::rows_ready &ready = vecdb::rows_ready()) {
+    static const unsigned int st_query = timing::stage("packdb.query");
+    static const unsigned int st_fetch = timing::stage("packdb.fetch");
+    dbpool::lease conn = pool.borrow();
+    if (!conn) {
+      return -1;
+    }
+    char sql[192];
+    snprintf(sql, sizeof(sql), "SELECT start, n, dim, dtype, vecs FROM %s WHERE op16 = ? AND cla16 = ? AND clb16 = ? "
+             "ORDER BY start", TABLE);
+    MYSQL_STMT *stmt = conn.prepare(sql);
+    if (!stmt) {
+      return -1;
+    }
+    uint16_t keys[3] = { k.op, k.class_a, k.class_b };
+    MYSQL_BIND params[3];
+    vecdb::_bind_u16(&params[0], &keys[0]);
+    vecdb::_bind_u16(&params[1], &keys[1]);
+    vecdb::_bind_u16(&params[2], &keys[2]);
+    timing::scope tq(st_query);
+    if (mysql_stmt_bind_param(stmt, params) || mysql_stmt_execute(stmt)) {
+      fprintf(stderr, "retrieve from %s failed: %s\n", TABLE, mysql_stmt_error(stmt));
+      conn.broken();
+      return -1;
+    }
+    tq.stop();
+    uint64_t start, n;
+    uint16_t dim;
+    char dtype[16];
+    unsigned long dtype_len = 0, len = 0;
+    // the blob is bound with no room: the fetch says how big it is, and
+    // mysql_stmt_fetch_column() then copies it to where it goes
+    MYSQL_BIND cols[5];
+    vecdb::_bind_u64(&cols[0], &start);
+    vecdb::_bind_u64(&cols[1], &n);
+    vecdb::_bind_u16(&cols[2], &dim);
+    vecdb::_bind_blob(&cols[3], dtype, sizeof(dtype), &dtype_len);
+    vecdb::_bind_blob(&cols[4], NULL, 0, &len);
+    std::vector<char> spill;
+    long rows = 0;
+    if (mysql_stmt_bind_result(stmt, cols)) {
+      rows = -1;
+    }
+    while (rows >= 0) {
+      timing::scope tf(st_fetch);
+      const int rc = mysql_stmt_fetch(stmt);
+      if (rc == MYSQL_NO_DATA) {
+        break;
+      }
+      quant::dtype t;
+      if (rc == 1 || start != (uint64_t)rows || dim != d ||
+          !_row_dtype(dtype, dtype_len, d, n, len, &t)) {
+        fprintf(stderr, "retrieve from %s: bad block at id %llu, expected id %ld of dimension %lu\n", TABLE,
+                (unsigned long long)start, rows, (unsigned long)d);
+        rows = -1;
+        break;
+      }
+      if (rows + n > max_rows) {
+        fprintf(stderr, "retrieve from %s: more than %lu rows\n", TABLE, (unsigned long)max_rows);
+        rows = -1;
+        break;
+      }
+      char *to = (char *)(dst + rows * d);
+      if (t != quant::DT_F32) {
+        spill.resize(len);
+        to = spill.data();
+      }
+      unsigned long got = 0;
+      MYSQL_BIND col;
+      vecdb::_bind_blob(&col, to, len, &got);
+      if (len > 0 && (mysql_stmt_fetch_column(stmt, &col, 4, 0) || got != len)) {
+        fprintf(stderr, "retrieve from %s failed: %s\n", TABLE, mysql_stmt_error(stmt));
+        rows = -1;
+        break;
+      }
+      tf.add(len, n);
+      tf.stop();
+      if (t != quant::DT_F32) {
+        unpack(t, spill.data(), n, d, dst + rows * d);
+      }
+      if (ready) {
+        ready(rows, n);
+      }
+      rows += n;
+    }
+    // drains whatever was not fetched
+    mysql_stmt_free_result(stmt);
+    return rows;
+  }
+
+  /* Vector id of the class, of dimension d, into out; false if there is none or the read fails */
+  inline bool get(dbpool::pool &pool, const key &k, uint64_t id, size_t d, float *out) {
+    dbpool::lease conn = pool.borrow();
+    if (!conn) {
+      return false;
+    }
+    char sql[320];
+    snprintf(sql, sizeof(sql), "SELECT start, n, dim, dtype, SUBSTRING(vecs, (? - start) * (LENGTH(vecs) DIV n) + 1, "
+             "LENGTH(vecs) DIV n) FROM %s WHERE op16 = ? AND cla16 = ? AND clb16 = ? AND start <= ? "
+             "ORDER BY start DESC LIMIT 1", TABLE);
+    MYSQL_STMT *stmt = conn.prepare(sql);
+    if (!stmt) {
+      return false;
+    }
+    uint16_t keys[3] = { k.op, k.class_a, k.class_b };
+    MYSQL_BIND params[5];
+    vecdb::_bind_u64(&params[0], &id);
+    vecdb::_bind_u16(&params[1], &keys[0]);
+    vecdb::_bind_u16(&params[2], &keys[1]);
+    vecdb::_bind_u16(&params[3], &keys[2]);
+    vecdb::_bind_u64(&params[4], &id);
+    if (mysql_stmt_bind_param(stmt, params) || mysql_stmt_execute(stmt)) {
+      fprintf(stderr, "lookup in %s failed: %s\n", TABLE, mysql_stmt_error(stmt));
+      conn.broken();
+      return false;
+    }
+    uint64_t start = 0, n = 0;
+    uint16_t dim = 0;
+    char dtype[16];
+    unsigned long dtype_len = 0, len = 0;
+    std::vector<char> vec(quant::bytes(quant::DT_F32, d) + sizeof(float));
+    MYSQL_BIND cols[5];
+    vecdb::_bind_u64(&cols[0], &start);
+    vecdb::_bind_u64(&cols[1], &n);
+    vecdb::_bind_u16(&cols[2], &dim);
+    vecdb::_bind_blob(&cols[3], dtype, sizeof(dtype), &dtype_len);
+    vecdb::_bind_blob(&cols[4], vec.data(), vec.size(), &len);
+    quant::dtype t;
+    bool found = false;
+    if (!mysql_stmt_bind_result(stmt, cols)) {
+      const int rc = mysql_stmt_fetch(stmt);
+      found = rc == 0 && id < start + n && dim == d && _row_dtype(dtype, dtype_len, d, 1, len, &t);
+      if (rc == 1 || rc == MYSQL_DATA_TRUNCATED) {
+        fprintf(stderr, "lookup in %s failed: %s\n", TABLE, mysql_stmt_error(stmt));
+      }
+    }
+    mysql_stmt_free_result(stmt);
+    if (found) {
+      unpack(t, vec.data(), 1, d, out);
+    }
+    return found;
+  }
+}
+#endif // __packdb_hpp__
@@ -0,0 +1,269 @@
+#ifndef __pqdb_hpp__
+#define __pqdb_hpp__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+
+#include <mysql/mysql.h>
+
+#include "dbpool.hpp"
+#include "ivfpq.hpp"
+
+/*
+ * An IVF-PQ index kept in mysql in place of the vectors it encodes: the
+ * model (centroids and codebooks, ivfpq::index::serialize()) is one row of
+ * ivfpq_models, and each vector is a row of vectors_pq holding its id,
+ * its list and its m byte code. For SIFT1M with 16 byte codes that is 16
+ * MB of codes against 512 MB of floats. store() replaces what a model
+ * name had in one transaction; load() rebuilds the index from the two
+ * tables as of one snapshot, the codes streamed over the binary protocol.
+ */
+namespace pqdb {
+  const char MODEL_TABLE[] = "ivfpq_models";
+  const char MODEL_SCHEMA[] = "(id int unsigned not null auto_increment, "
+                              "name varchar(64) not null, "
+                              "model longblob not null, "
+                              "primary key (id), unique key name_key (name))";
+  const char CODE_TABLE[] = "vectors_pq";
+  const char CODE_SCHEMA[] = "(model int unsigned not null, "
+                             "id bigint unsigned not null, "
+                             "list int unsigned not null, "
+                             "code varbinary(255) not null, "
+                             "primary key (model, id))";
+  const unsigned int MAX_CODE_BYTES = 255;
+  // 4 placeholders a row, well under the server's 65535 a statement
+  const unsigned int BATCH_ROWS = 4096;
+
+  inline bool create_tables(dbpool::pool &pool) {
+    const std::string models = std::string("CREATE TABLE IF NOT EXISTS ") + MODEL_TABLE + " " + MODEL_SCHEMA;
+    const std::string codes = std::string("CREATE TABLE IF NOT EXISTS ") + CODE_TABLE + " " + CODE_SCHEMA;
+    dbpool::lease conn = pool.borrow();
+    return conn && conn.query(models.c_str()) && conn.query(codes.c_str());
+  }
+
+  inline void _bind(MYSQL_BIND *b, enum_field_types t, void *v, unsigned long room = 0, unsigned long *len = NULL) {
+    memset(b, 0, sizeof(*b));
+    b->buffer_type = t;
+    b->buffer = v;
+    b->buffer_length = room;
+    b->length = len;
+    b->is_unsigned = t != MYSQL_TYPE_BLOB;
+  }
+
+  /* Model names go into the SQL as they are, so they are kept to [A-Za-z0-9_] */
+  inline bool _valid_name(const char *name) {
+    const size_t n = strlen(name);
+    size_t i = 0;
+    for (; i < n; i++) {
+      if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+        break;
+      }
+    }
+    if (n == 0 || n > 64 || i < n) {
+      fprintf(stderr, "ivfpq model name '%s' is not 1 to 64 letters, digits and _\n", name);
+      return false;
+    }
+    return true;
+  }
+
+  /* The model's row id, or false if there is none */
+  inline bool _model_id(dbpool::lease &conn, const char *name, uint32_t *id, std::string *model = NULL) {
+    char sql[160];
+    snprintf(sql, sizeof(sql), "SELECT id%s FROM %s WHERE name = '%s'", model ? ", model" : "", MODEL_TABLE, name);
+    MYSQL_RES *res = conn.query(sql) ? mysql_store_result(conn.mysql()) : NULL;
+    MYSQL_ROW row = res ? mysql_fetch_row(res) : NULL;
+    if (row && row[0]) {
+      *id = strtoul(row[0], NULL, 10);
+      if (model) {
+        const unsigned long *lens = mysql_fetch_lengths(res);
+        model->assign(row[1] ? row[1] : "", row[1] ? lens[1] : 0);
+      }
+    }
+    if (res) {
+      mysql_free_result(res);
+    }
+    return row && row[0];
+  }
+
+  /* The statements of store(), in the transaction it opened on conn */
+  inline bool _store(dbpool::lease &conn, const char *name, const ivfpq::index &ix) {
+    std::string model;
+    ix.serialize(&model);
+    char sql[256];
+    snprintf(sql, sizeof(sql), "INSERT INTO %s (name, model) VALUES ('%s', ?) ON DUPLICATE KEY UPDATE model = VALUES(model)",
+             MODEL_TABLE, name);
+    MYSQL_STMT *stmt = conn.prepare(sql);
+    if (!stmt) {
+      return false;
+    }
+    unsigned long model_len = model.size();
+    MYSQL_BIND mb;
+    _bind(&mb, MYSQL_TYPE_BLOB, &model[0], model_len, &model_len);
+    if (mysql_stmt_bind_param(stmt, &mb) || mysql_stmt_execute(stmt)) {
+      fprintf(stderr, "storing ivfpq model %s failed: %s\n", name, mysql_stmt_error(stmt));
+      conn.broken();
+      return false;
+    }
+    uint32_t model_id;
+    if (!_model_id(conn, name, &model_id)) {
+      return false;
+    }
+    snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE model = %u", CODE_TABLE, model_id);
+    if (!conn.query(sql)) {
+      return false;
+    }
+
+    // full batches through one prepared statement, the last through its own
+    std::vector<uint64_t> ids(BATCH_ROWS);
+    std::vector<uint32_t> lists(BATCH_ROWS);
+    std::vector<unsigned long> lens(BATCH_ROWS, ix.m());
+    std::vector<const uint8_t *> codes(BATCH_ROWS);
+    std::vector<MYSQL_BIND> binds(4 * BATCH_ROWS);
+    unsigned int rows = 0;
+    auto flush = [&]() {
+      std::string stmt_sql = std::string("INSERT INTO ") + CODE_TABLE + " (model, id, list, code) VALUES ";
+      unsigned int i = 0;
+      for (; i < rows; i++) {
+        stmt_sql += i == 0 ? "(?,?,?,?)" : ",(?,?,?,?)";
+      }
+      MYSQL_STMT *ins = conn.prepare(stmt_sql.c_str());
+      if (!ins) {
+        return false;
+      }
+      for (i = 0; i < rows; i++) {
+        _bind(&binds[4 * i], MYSQL_TYPE_LONG, &model_id);
+        _bind(&binds[4 * i + 1], MYSQL_TYPE_LONGLONG, &ids[i]);
+        _bind(&binds[4 * i + 2], MYSQL_TYPE_LONG, &lists[i]);
+        _bind(&binds[4 * i + 3], MYSQL_TYPE_BLOB, (void *)codes[i], lens[i], &lens[i]);
+      }
+      if (mysql_stmt_bind_param(ins, binds.data()) || mysql_stmt_execute(ins)) {
+        fprintf(stderr, "insert of %u ivfpq codes failed: %s\n", rows, mysql_stmt_error(ins));
+        conn.broken();
+        return false;
+      }
+      rows = 0;
+      return true;
+    };
+    size_t l = 0;
+    for (; l < ix.nlist(); l++) {
+      size_t i = 0;
+      for (; i < ix.list_size(l); i++) {
+        ids[rows] = ix.list_ids(l)[i];
+        lists[rows] = l;
+        codes[rows] = ix.list_codes(l) + i * ix.m();
+        if (++rows == BATCH_ROWS && !flush()) {
+          return false;
+        }
+      }
+    }
+    return rows == 0 || flush();
+  }
+
+  /*
+   * Stores ix's model and every code under name, replacing what was
+   * there, in one transaction; false on any failure, which leaves what
+   * was there.
+   */
+  inline bool store(dbpool::pool &pool, const char *name, const ivfpq::index &ix) {
+    if (!_valid_name(name) || ix.m() > MAX_CODE_BYTES) {
+      return false;
+    }
+    dbpool::lease conn = pool.borrow();
+    if (!conn || !conn.query("START TRANSACTION")) {
+      return false;
+    }
+    const unsigned int gen = conn.generation();
+    bool ok = _store(conn, name, ix);
+    if (conn.generation() != gen) {
+      // remade on the way, and what ran after that ran in autocommit
+      fprintf(stderr, "connection remade while storing ivfpq model %s, it may be stored in part\n", name);
+      ok = false;
+    }
+    if (!ok) {
+      (void)mysql_rollback(conn.mysql());
+    } else if (mysql_commit(conn.mysql()) != 0) {
+      fprintf(stderr, "storing ivfpq model %s: commit failed: %s\n", name, mysql_error(conn.mysql()));
+      conn.broken();
+      ok = false;
+    }
+    return ok;
+  }
+
+  /* load()'s reads, in the snapshot it opened on conn */
+  inline long _load(dbpool::lease &conn, const char *name, ivfpq::index *ix, const ivfpq::config &cfg) {
+    uint32_t model_id;
+    std::string model;
+    if (!_model_id(conn, name, &model_id, &model)) {
+      fprintf(stderr, "no ivfpq model %s in %s\n", name, MODEL_TABLE);
+      return -1;
+    }
+    if (!ix->deserialize(model.data(), model.size(), cfg)) {
+      return -1;
+    }
+    char sql[128];
+    snprintf(sql, sizeof(sql), "SELECT id, list, code FROM %s WHERE model = ?", CODE_TABLE);
+    MYSQL_STMT *stmt = conn.prepare(sql);
+    if (!stmt) {
+      return -1;
+    }
+    MYSQL_BIND param;
+    _bind(&param, MYSQL_TYPE_LONG, &model_id);
+    if (mysql_stmt_bind_param(stmt, &param) || mysql_stmt_execute(stmt)) {
+      fprintf(stderr, "retrieve from %s failed: %s\n", CODE_TABLE, mysql_stmt_error(stmt));
+      conn.broken();
+      return -1;
+    }
+    uint64_t id;
+    uint32_t list;
+    uint8_t code[MAX_CODE_BYTES];
+    unsigned long len = 0;
+    MYSQL_BIND cols[3];
+    _bind(&cols[0], MYSQL_TYPE_LONGLONG, &id);
+    _bind(&cols[1], MYSQL_TYPE_LONG, &list);
+    _bind(&cols[2], MYSQL_TYPE_BLOB, code, sizeof(code), &len);
+    long rows = 0;
+    if (mysql_stmt_bind_result(stmt, cols)) {
+      rows = -1;
+    }
+    while (rows >= 0) {
+      const int rc = mysql_stmt_fetch(stmt);
+      if (rc == MYSQL_NO_DATA) {
+        break;
+      }
+      if (rc == 1 || rc == MYSQL_DATA_TRUNCATED || len != ix->m() || !ix->add_code(list, id, code)) {
+        fprintf(stderr, "retrieve from %s: row %ld is not a code of model %s\n", CODE_TABLE, rows, name);
+        rows = -1;
+        break;
+      }
+      rows++;
+    }
+    mysql_stmt_free_result(stmt);
+    return rows;
+  }
+
+  /*
+   * Rebuilds the index stored under name into ix, cfg giving what is not
+   * stored (nprobe, threads). Returns the number of codes, or -1 if there
+   * is no such model or a read fails.
+   */
+  inline long load(dbpool::pool &pool, const char *name, ivfpq::index *ix,
+                   const ivfpq::config &cfg = ivfpq::config()) {
+    if (!_valid_name(name)) {
+      return -1;
+    }
+    // the model and its codes from one snapshot, not across a store()
+    dbpool::lease conn = pool.borrow();
+    if (!conn || !conn.query("START TRANSACTION WITH CONSISTENT SNAPSHOT, READ ONLY")) {
+      return -1;
+    }
+    const long rows = _load(conn, name, ix, cfg);
+    (void)mysql_rollback(conn.mysql());
+    return rows;
+  }
+}
+#endif // __pqdb_hpp__
@@ -0,0 +1,363 @@
+#ifndef __quant_hpp__
+#define __quant_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Smaller forms to store a float vector in:
+ *
+ *   DT_F32   the floats as they are, 4 bytes a value
+ *   DT_F16   IEEE half, round to nearest even, 2 bytes a value
+ *   DT_BF16  the top half of the float, round to nearest even, 2 bytes
+ *   DT_I8    a float scale (max |v| / 127) then one int8 a value, each
+ *            value rounded to the nearest multiple of the scale; finite
+ *            values only
+ *
+ * Like base64.hpp the SIMD kernels (F16C for half, AVX2 for the rest) are
+ * compiled with per-function target attributes and picked at runtime from
+ * CPUID, and give bit for bit what the scalar code does. Define
+ * QUANT_NO_SIMD for the scalar code only. Encoded bytes are little endian.
+ */
+#if !defined(QUANT_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUANT_X86_SIMD 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+namespace quant {
+  enum dtype { DT_F32 = 0, DT_F16, DT_BF16, DT_I8, DT_COUNT };
+
+  /* The name a dtype goes by in the JSON envelope and on the command line */
+  inline const char *name(dtype t) {
+    static const char * const names[] = { "f32", "f16", "bf16", "i8" };
+    return (t >= DT_F32 && t < DT_COUNT) ? names[t] : "unknown";
+  }
+
+  inline bool from_name(const char *s, dtype *t) {
+    int i = 0;
+    for (; i < DT_COUNT; i++) {
+      if (strcmp(s, name((dtype)i)) == 0) {
+        *t = (dtype)i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /* Encoded size of a vector of dimension d */
+  constexpr size_t bytes(dtype t, size_t d) {
+    return t == DT_I8 ? sizeof(float) + d : (t == DT_F32 ? sizeof(float) : 2) * d;
+  }
+
+  enum kernel {
+    KERNEL_SCALAR = 0,
+    KERNEL_AVX2,    // AVX2 and F16C, 8 values a step
+    KERNEL_COUNT
+  };
+
+  inline const char *kernel_name(kernel k) {
+    static const char * const names[] = { "scalar", "avx2+f16c" };
+    return (k >= KERNEL_SCALAR && k < KERNEL_COUNT) ? names[k] : "unknown";
+  }
+
+  inline kernel kernel_detect() {
+#ifdef QUANT_X86_SIMD
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) ||
+        !(ecx & bit_F16C) || __get_cpuid_max(0, NULL) < 7) {
+      return KERNEL_SCALAR;
+    }
+    uint32_t xcr0, xcr0_hi;
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    (void)xcr0_hi;
+    if ((xcr0 & 0x6) != 0x6) {
+      return KERNEL_SCALAR;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) ? KERNEL_AVX2 : KERNEL_SCALAR;
+#else
+    return KERNEL_SCALAR;
+#endif
+  }
+
+  /* Kernel used by encode() and decode(), probed once */
+  inline kernel kernel_active() {
+    static const kernel k = kernel_detect();
+    return k;
+  }
+
+  inline bool kernel_supported(kernel k) {
+    return k >= KERNEL_SCALAR && k <= kernel_active();
+  }
+
+  /* Scalar conversions, the reference the kernels match */
+  inline uint16_t f32_to_f16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    const uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t ax = x & 0x7fffffff;
+    if (ax >= 0x7f800000) {
+      // infinity, or a NaN kept quiet with what fits of its payload
+      return sign | 0x7c00 | (ax > 0x7f800000 ? 0x200 | ((ax >> 13) & 0x3ff) : 0);
+    }
+    if (ax >= 0x477ff000) {
+      // rounds past 65504
+      return sign | 0x7c00;
+    }
+    if (ax < 0x38800000) {
+      // half subnormal: adding 0.5 leaves the value in units of 2^-24,
+      // rounded by the FPU, in the low mantissa bits
+      float a;
+      memcpy(&a, &ax, sizeof(a));
+      a += 0.5f;
+      uint32_t r;
+      memcpy(&r, &a, sizeof(r));
+      return sign | (uint16_t)(r - 0x3f000000);
+    }
+    // rebias the exponent and round the 13 dropped bits to nearest even
+    ax += 0xc8000fff + ((ax >> 13) & 1);
+    return sign | (uint16_t)(ax >> 13);
+  }
+
+  inline float f16_to_f32(uint16_t h) {
+    const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    const uint32_t em = h & 0x7fff;
+    uint32_t x;
+    if (em >= 0x7c00) {
+      x = sign | 0x7f800000 | ((em & 0x3ff) << 13) | (em > 0x7c00 ? 0x400000 : 0);
+    } else if (em >= 0x400) {
+      x = sign | ((em << 13) + 0x38000000);
+    } else {
+      const float f = em * (1.0f / 16777216);
+      memcpy(&x, &f, sizeof(x));
+      x |= sign;
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+
+  inline uint16_t f32_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+      return (x >> 16) | 0x40;
+    }
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+  }
+
+  inline float bf16_to_f32(uint16_t b) {
+    const uint32_t x = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+
+  inline float _max_abs_scalar(const float *v, size_t d) {
+    float m = 0;
+    size_t i = 0;
+    for (; i < d; i++) {
+      const float a = fabsf(v[i]);
+      if (a > m) {
+        m = a;
+      }
+    }
+    return m;
+  }
+
+  inline int8_t _i8(float x) {
+    long q = lrintf(x);
+    return q > 127 ? 127 : q < -127 ? -127 : (int8_t)q;
+  }
+
+  inline void _put_u16(uint8_t *out, uint16_t v) {
+    out[0] = v & 0xff;
+    out[1] = v >> 8;
+  }
+
+  inline uint16_t _get_u16(const uint8_t *in) {
+    return in[0] | (uint16_t)in[1] << 8;
+  }
+
+  /* Encodes the values [i, d) one at a time; the kernels hand over their tail */
+  inline void _encode_scalar(dtype t, const float *v, size_t d, uint8_t *out, size_t i, float inv) {
+    for (; i < d; i++) {
+      switch (t) {
+      case DT_F16: _put_u16(out + 2 * i, f32_to_f16(v[i])); break;
+      case DT_BF16: _put_u16(out + 2 * i, f32_to_bf16(v[i])); break;
+      case DT_I8: out[sizeof(float) + i] = (uint8_t)_i8(v[i] * inv); break;
+      default: memcpy(out + sizeof(float) * i, v + i, sizeof(float)); break;
+      }
+    }
+  }
+
+  inline void _decode_scalar(dtype t, const uint8_t *in, size_t d, float *v, size_t i, float scale) {
+    for (; i < d; i++) {
+      switch (t) {
+      case DT_F16: v[i] = f16_to_f32(_get_u16(in + 2 * i)); break;
+      case DT_BF16: v[i] = bf16_to_f32(_get_u16(in + 2 * i)); break;
+      case DT_I8: v[i] = (int8_t)in[sizeof(float) + i] * scale; break;
+      default: memcpy(v + i, in + sizeof(float) * i, sizeof(float)); break;
+      }
+    }
+  }
+
+#ifdef QUANT_X86_SIMD
+  __attribute__((target("avx2")))
+  inline float _max_abs_avx2(const float *v, size_t d) {
+    __m256 m = _mm256_setzero_ps();
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    size_t i = 0;
+    for (; i + 8 <= d; i += 8) {
+      // a NaN value is passed over, as in the scalar loop
+      m = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(v + i), abs_mask), m);
+    }
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+    float r = _mm_cvtss_f32(h);
+    for (; i < d; i++) {
+      const float a = fabsf(v[i]);
+      if (a > r) {
+        r = a;
+      }
+    }
+    return r;
+  }
+
+  __attribute__((target("avx2,f16c")))
+  inline size_t _encode_avx2(dtype t, const float *v, size_t d, uint8_t *out, float inv) {
+    size_t i = 0;
+    switch (t) {
+    case DT_F16:
+      for (; i + 8 <= d; i += 8) {
+        _mm_storeu_si128((__m128i *)(out + 2 * i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(v + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+      }
+      break;
+    case DT_BF16:
+      for (; i + 8 <= d; i += 8) {
+        const __m256 f = _mm256_loadu_ps(v + i);
+        const __m256i x = _mm256_castps_si256(f);
+        const __m256i hi = _mm256_srli_epi32(x, 16);
+        __m256i r = _mm256_add_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(0x7fff)),
+                                     _mm256_and_si256(hi, _mm256_set1_epi32(1)));
+        r = _mm256_blendv_epi8(_mm256_srli_epi32(r, 16), _mm256_or_si256(hi, _mm256_set1_epi32(0x40)),
+                               _mm256_castps_si256(_mm256_cmp_ps(f, f, _CMP_UNORD_Q)));
+        // 32 -> 16 bits packs within each 128 bit lane, so gather the two low quadwords
+        r = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm256_castsi256_si128(r));
+      }
+      break;
+    case DT_I8: {
+      const __m256 s = _mm256_set1_ps(inv);
+      for (; i + 8 <= d; i += 8) {
+        __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(v + i), s));
+        q = _mm256_max_epi32(_mm256_min_epi32(q, _mm256_set1_epi32(127)), _mm256_set1_epi32(-127));
+        q = _mm256_packs_epi16(_mm256_packs_epi32(q, q), _mm256_setzero_si256());
+        q = _mm256_permutevar8x32_epi32(q, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+        _mm_storel_epi64((__m128i *)(out + sizeof(float) + i), _mm256_castsi256_si128(q));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    return i;
+  }
+
+  __attribute__((target("avx2,f16c")))
+  inline size_t _decode_avx2(dtype t, const uint8_t *in, size_t d, float *v, float scale) {
+    size_t i = 0;
+    switch (t) {
+    case DT_F16:
+      for (; i + 8 <= d; i += 8) {
+        _mm256_storeu_ps(v + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + 2 * i))));
+      }
+      break;
+    case DT_BF16:
+      for (; i + 8 <= d; i += 8) {
+        const __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + 2 * i)));
+        _mm256_storeu_ps(v + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+      }
+      break;
+    case DT_I8: {
+      const __m256 s = _mm256_set1_ps(scale);
+      for (; i + 8 <= d; i += 8) {
+        const __m256i q = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)(in + sizeof(float) + i)));
+        _mm256_storeu_ps(v + i, _mm256_mul_ps(_mm256_cvtepi32_ps(q), s));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    return i;
+  }
+#endif
+
+  /* encode() with an explicit kernel; k must be kernel_supported() */
+  inline void encode_with(kernel k, dtype t, const float *v, size_t d, void *out) {
+    uint8_t *o = (uint8_t *)out;
+    if (t == DT_F32) {
+      memcpy(o, v, sizeof(float) * d);
+      return;
+    }
+    float inv = 0;
+    size_t i = 0;
+    if (t == DT_I8) {
+      float m;
+#ifdef QUANT_X86_SIMD
+      if (k == KERNEL_AVX2) {
+        m = _max_abs_avx2(v, d);
+      } else
+#endif
+      {
+        m = _max_abs_scalar(v, d);
+      }
+      const float scale = m / 127;
+      inv = m > 0 ? 127 / m : 0;
+      memcpy(o, &scale, sizeof(scale));
+    }
+#ifdef QUANT_X86_SIMD
+    if (k == KERNEL_AVX2) {
+      i = _encode_avx2(t, v, d, o, inv);
+    }
+#endif
+    _encode_scalar(t, v, d, o, i, inv);
+  }
+
+  /* decode() with an explicit kernel; k must be kernel_supported() */
+  inline void decode_with(kernel k, dtype t, const void *in, size_t d, float *v) {
+    const uint8_t *p = (const uint8_t *)in;
+    if (t == DT_F32) {
+      memcpy(v, p, sizeof(float) * d);
+      return;
+    }
+    float scale = 0;
+    size_t i = 0;
+    if (t == DT_I8) {
+      memcpy(&scale, p, sizeof(scale));
+    }
+#ifdef QUANT_X86_SIMD
+    if (k == KERNEL_AVX2) {
+      i = _decode_avx2(t, p, d, v, scale);
+    }
+#endif
+    _decode_scalar(t, p, d, v, i, scale);
+  }
+
+  /* Encodes the d values at v into bytes(t, d) at out */
+  inline void encode(dtype t, const float *v, size_t d, void *out) {
+    encode_with(kernel_active(), t, v, d, out);
+  }
+
+  /* Decodes bytes(t, d) at in into d floats at v */
+  inline void decode(dtype t, const void *in, size_t d, float *v) {
+    decode_with(kernel_active(), t, in, d, v);
+  }
+}
+#endif // __quant_hpp__
@@ -0,0 +1,223 @@
+//
+// Test program for quant.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "quant.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+float
+bits_float(uint32_t x)
+{
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Encode and decode v with every kernel this cpu has: the kernels must agree
+// byte for byte with the scalar code, and the values come back within the
+// dtype's rounding error
+unsigned int
+check_vector(quant::dtype t, const float *v, size_t d)
+{
+  using namespace std;
+  const size_t n = quant::bytes(t, d);
+  vector<uint8_t> ref(n + 1, 0xee), enc(n + 1, 0xee);
+  vector<float> ref_back(d + 1, -7), back(d + 1, -7);
+  quant::encode_with(quant::KERNEL_SCALAR, t, v, d, ref.data());
+  quant::decode_with(quant::KERNEL_SCALAR, t, ref.data(), d, ref_back.data());
+  unsigned int errors = 0;
+  int k = quant::KERNEL_SCALAR + 1;
+  for (; k < quant::KERNEL_COUNT; k++) {
+    if (!quant::kernel_supported((quant::kernel)k)) {
+      continue;
+    }
+    quant::encode_with((quant::kernel)k, t, v, d, enc.data());
+    quant::decode_with((quant::kernel)k, t, ref.data(), d, back.data());
+    if (memcmp(enc.data(), ref.data(), n + 1) != 0 || memcmp(back.data(), ref_back.data(), (d + 1) * sizeof(float)) != 0) {
+      cout << "ERROR: " << quant::kernel_name((quant::kernel)k) << " " << quant::name(t) << " of dimension " << d
+           << " differs from scalar" << endl;
+      errors++;
+    }
+  }
+  if (ref[n] != 0xee || ref_back[d] != -7) {
+    cout << "ERROR: " << quant::name(t) << " of dimension " << d << " wrote past the end" << endl;
+    errors++;
+  }
+  float scale = 0;
+  if (t == quant::DT_I8) {
+    memcpy(&scale, ref.data(), sizeof(scale));
+  }
+  size_t i = 0;
+  for (; i < d; i++) {
+    const float x = v[i], y = ref_back[i], ax = fabsf(x);
+    bool ok;
+    switch (isnan(x) ? quant::DT_COUNT : t) {
+    case quant::DT_F16:
+      ok = ax > 65504 || ax < 6.2e-5f ? fabsf(x - y) <= 3e-8f || (ax > 65519 && isinf(y))
+                                      : fabsf(x - y) <= ax / 2048;
+      break;
+    case quant::DT_BF16:
+      ok = fabsf(x - y) <= (ax < 1.18e-38f ? 4.6e-41f : ax / 256) || (ax > 3.3895e38f && isinf(y));
+      break;
+    case quant::DT_I8: ok = fabsf(x - y) <= scale * 0.5001f; break;
+    case quant::DT_COUNT: ok = isnan(y); break;
+    default: ok = memcmp(&x, &y, sizeof(x)) == 0; break;
+    }
+    if (!ok) {
+      cout << "ERROR: " << quant::name(t) << " of " << x << " came back " << y << endl;
+      errors++;
+      break;
+    }
+  }
+  return errors;
+}
+
+// Values at the edges of each format
+unsigned int
+check_edges()
+{
+  using namespace std;
+  unsigned int errors = 0;
+  struct { float f; uint16_t h; } halves[] = {
+    { 0.0f, 0x0000 }, { -0.0f, 0x8000 }, { 1.0f, 0x3c00 }, { -2.0f, 0xc000 }, { 65504.0f, 0x7bff },
+    { 65519.0f, 0x7bff }, { 65520.0f, 0x7c00 }, { 1e30f, 0x7c00 }, { -INFINITY, 0xfc00 },
+    { 6.103515625e-05f, 0x0400 }, { 5.9604645e-08f, 0x0001 }, { 2.9802322e-08f, 0x0000 },
+    { 2.9802326e-08f, 0x0001 }, { 1.0009765625f, 0x3c01 }, { 1.00048828125f, 0x3c00 }, { 1.00146484375f, 0x3c02 },
+  };
+  size_t i = 0;
+  for (; i < sizeof(halves) / sizeof(halves[0]); i++) {
+    if (quant::f32_to_f16(halves[i].f) != halves[i].h) {
+      printf("ERROR: half of %g is 0x%04x, expected 0x%04x\n", halves[i].f, quant::f32_to_f16(halves[i].f), halves[i].h);
+      errors++;
+    }
+  }
+  if (!isnan(quant::f16_to_f32(quant::f32_to_f16(NAN))) || !isnan(quant::bf16_to_f32(quant::f32_to_bf16(NAN))) ||
+      quant::f32_to_bf16(1.0f) != 0x3f80 || quant::f32_to_bf16(bits_float(0x3f808000)) != 0x3f80 ||
+      quant::f32_to_bf16(bits_float(0x3f818000)) != 0x3f82 || quant::f32_to_bf16(bits_float(0x7f7fffff)) != 0x7f80) {
+    cout << "ERROR: bf16 rounding or NaN" << endl;
+    errors++;
+  }
+  // every half back to float and to half again
+  uint32_t h = 0;
+  for (; h < 0x10000; h++) {
+    const float f = quant::f16_to_f32(h);
+    if (!isnan(f) && quant::f32_to_f16(f) != h) {
+      printf("ERROR: half 0x%04x does not survive a round trip\n", h);
+      errors++;
+      break;
+    }
+  }
+  // a sweep of float bit patterns through every kernel, NaNs, infinities and subnormals included
+  std::vector<float> sweep;
+  uint64_t x = 0;
+  for (; x < 0x100000000ull; x += 65521) {
+    sweep.push_back(bits_float((uint32_t)x));
+  }
+  const size_t step = 256;
+  for (i = 0; i + step <= sweep.size(); i += step) {
+    errors += check_vector(quant::DT_F16, &sweep[i], step);
+    errors += check_vector(quant::DT_BF16, &sweep[i], step);
+  }
+  // int8 of all zeros, of one value, and with values on the rounding midpoints
+  float zeros[9] = { 0 };
+  float one[1] = { -3.5f };
+  float mids[16];
+  for (i = 0; i < 16; i++) {
+    mids[i] = (i - 8) + 0.5f;
+  }
+  mids[15] = 127;
+  errors += check_vector(quant::DT_I8, zeros, 9);
+  errors += check_vector(quant::DT_I8, one, 1);
+  errors += check_vector(quant::DT_I8, mids, 16);
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  quant::dtype t;
+  int k;
+  for (k = 0; k < quant::DT_COUNT; k++) {
+    if (!quant::from_name(quant::name((quant::dtype)k), &t) || t != k) {
+      cout << "ERROR: dtype " << k << " does not come back from its name" << endl;
+      errors++;
+    }
+  }
+  if (quant::from_name("f64", &t) || quant::bytes(quant::DT_F32, 128) != 512 || quant::bytes(quant::DT_F16, 128) != 256 ||
+      quant::bytes(quant::DT_BF16, 960) != 1920 || quant::bytes(quant::DT_I8, 128) != 132) {
+    cout << "ERROR: dtype names or sizes" << endl;
+    errors++;
+  }
+  errors += check_edges();
+
+  // SIFT like values, small signed values, and wide ranges, at every tail length
+  srandom(17);
+  vector<float> v(960);
+  size_t d;
+  for (d = 1; d <= 960; d = d < 70 ? d + 1 : d == 70 ? 128 : 960) {
+    int shape = 0;
+    for (; shape < 3; shape++) {
+      size_t i = 0;
+      for (; i < d; i++) {
+        const double r = random() / (double)RAND_MAX;
+        v[i] = shape == 0 ? (float)(random() % 219) : shape == 1 ? (float)(r - 0.5) : (float)((r - 0.5) * pow(10, random() % 9 - 4));
+      }
+      for (k = 0; k < quant::DT_COUNT; k++) {
+        errors += check_vector((quant::dtype)k, v.data(), d);
+      }
+    }
+    if (d == 960) {
+      break;
+    }
+  }
+
+  // a SIFT sized set through the active kernel: rates and the error each dtype costs
+  const size_t rows = 10000;
+  vector<float> src(rows * 128), back(rows * 128);
+  for (float &f : src) {
+    f = (float)(random() % 219);
+  }
+  vector<uint8_t> enc(rows * quant::bytes(quant::DT_F32, 128));
+  printf("quant kernel %s\n", quant::kernel_name(quant::kernel_active()));
+  for (k = 0; k < quant::DT_COUNT; k++) {
+    t = (quant::dtype)k;
+    const size_t row_bytes = quant::bytes(t, 128);
+    double t0 = elapsed();
+    size_t i;
+    for (i = 0; i < rows; i++) {
+      quant::encode(t, &src[i * 128], 128, &enc[i * row_bytes]);
+    }
+    double t1 = elapsed();
+    for (i = 0; i < rows; i++) {
+      quant::decode(t, &enc[i * row_bytes], 128, &back[i * 128]);
+    }
+    double t2 = elapsed();
+    double sq = 0, max_err = 0;
+    for (i = 0; i < src.size(); i++) {
+      const double e = fabs(src[i] - back[i]);
+      sq += e * e;
+      max_err = e > max_err ? e : max_err;
+    }
+    printf("%-4s %3lu bytes a row: encode %.1f M rows/s, decode %.1f M rows/s, rms error %.4f, max %.4f\n", quant::name(t),
+           (unsigned long)row_bytes, rows / (t1 - t0) / 1e6, rows / (t2 - t1) / 1e6, sqrt(sq / src.size()), max_err);
+  }
+
+  cout << "quant errors " << errors << endl;
+  return errors != 0;
+}
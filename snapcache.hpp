@@ -0,0 +1,330 @@
+#ifndef __snapcache_hpp__
+#define __snapcache_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <string>
+#include <chrono>
+
+#include "dbpool.hpp"
+#include "vecdb.hpp"
+
+/*
+ * Local snapshots of retrieved classes, so a restart maps the vectors it
+ * had instead of fetching them all again. A snapshot is two files in the
+ * cache directory, named for the table, class, dimension and dtype:
+ *
+ *   <name>.snap  a header page, then the decoded float[n * d], page aligned
+ *   <name>.ids   the rows' ids, uint64_t[n], in id order
+ *
+ * The header holds n and the watermark, the highest id in the snapshot.
+ * open() maps what is there, checks with a COUNT over ids up to the
+ * watermark that the database still has exactly those rows, and fetches
+ * only the rows above it, straight into the grown file; if the count
+ * disagrees (rows deleted, table remade) the snapshot is fetched again
+ * from scratch. Updates only append and the header is written last, so a
+ * crash leaves the old snapshot good, and a flock keeps two processes from
+ * updating the same snapshot at once. A snapshot fetched again is built in
+ * <name>.snap.tmp and .ids.tmp and renamed over the old files, so a
+ * process that has the old one mapped (orca_vh -S, say) keeps reading it.
+ * Rows changed in place under the watermark are not noticed.
+ */
+namespace snapcache {
+  const char MAGIC[8] = { 'V', 'E', 'C', 'S', 'N', 'A', 'P', '1' };
+  const uint32_t VERSION = 1;
+  // the matrix starts a page in, so it maps aligned
+  const size_t HEADER_BYTES = 4096;
+
+  struct _header {
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;
+    uint32_t dtype;
+    uint32_t d;
+    uint16_t op, class_a, class_b, pad;
+    uint64_t n;
+    uint64_t watermark;
+  };
+
+  /* What the last open() did */
+  struct stats {
+    size_t cached_rows;    // rows that came from the snapshot
+    size_t fetched_rows;   // rows fetched from the database
+    bool rebuilt;          // the snapshot was missing or stale and fetched whole
+    double check_s;        // the COUNTs
+    double fetch_s;        // fetching and writing the new rows
+    stats() : cached_rows(0), fetched_rows(0), rebuilt(false), check_s(0), fetch_s(0) {}
+  };
+
+  /* Snapshot file name, without the .snap or .ids */
+  inline std::string path(const std::string &dir, const vecdb::selection &sel, size_t d) {
+    char name[128];
+    snprintf(name, sizeof(name), "/%s_%u_%u_%u_d%lu_%s", sel.table(), (unsigned int)sel.op,
+             (unsigned int)sel.class_a, (unsigned int)sel.class_b, (unsigned long)d, quant::name(sel.dtype));
+    return dir + name;
+  }
+
+  class snapshot {
+  public:
+    snapshot() : _snap(NULL), _snap_len(0), _ids(NULL), _ids_len(0), _n(0), _d(0), _watermark(0) {}
+    ~snapshot() { close(); }
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+
+    /*
+     * Maps the snapshot of every row of sel's class (sel's id range is
+     * ignored) in dir, bringing it up to date first: rows above the
+     * watermark are fetched with select_parallel() over parts
+     * connections. False, saying why on stderr, if it could not be read
+     * or brought up to date; the files are left as they were.
+     */
+    bool open(dbpool::pool &pool, const vecdb::selection &sel, size_t d, const std::string &dir,
+              unsigned int parts = 1) {
+      close();
+      _last = stats();
+      const std::string name = path(dir, sel, d);
+      const std::string snap_name = name + ".snap", ids_name = name + ".ids";
+      int snap_fd, ids_fd;
+      for (;;) {
+        snap_fd = ::open(snap_name.c_str(), O_RDWR | O_CREAT, 0644);
+        ids_fd = snap_fd < 0 ? -1 : ::open(ids_name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (snap_fd < 0 || ids_fd < 0) {
+          fprintf(stderr, "could not open snapshot %s: %s\n", name.c_str(), strerror(errno));
+          if (snap_fd >= 0) {
+            ::close(snap_fd);
+          }
+          return false;
+        }
+        flock(snap_fd, LOCK_EX);
+        // another process may have renamed a new snapshot in while this one waited
+        struct stat held, now;
+        if (fstat(snap_fd, &held) == 0 && stat(snap_name.c_str(), &now) == 0 && held.st_ino == now.st_ino &&
+            held.st_dev == now.st_dev) {
+          break;
+        }
+        flock(snap_fd, LOCK_UN);
+        ::close(snap_fd);
+        ::close(ids_fd);
+      }
+      const bool ok = _update(pool, sel, d, name, snap_fd, ids_fd, parts);
+      flock(snap_fd, LOCK_UN);
+      ::close(snap_fd);
+      ::close(ids_fd);
+      if (!ok) {
+        close();
+      }
+      return ok;
+    }
+
+    void close() {
+      if (_snap) {
+        munmap(_snap, _snap_len);
+      }
+      if (_ids) {
+        munmap(_ids, _ids_len);
+      }
+      _snap = _ids = NULL;
+      _snap_len = _ids_len = 0;
+      _n = _d = 0;
+      _watermark = 0;
+    }
+
+    bool is_open() const { return _d != 0; }
+    size_t n() const { return _n; }
+    size_t d() const { return _d; }
+    uint64_t watermark() const { return _watermark; }
+    const float *data() const { return _snap ? (const float *)((const char *)_snap + HEADER_BYTES) : NULL; }
+    const float *row(size_t i) const { return data() + i * _d; }
+    const uint64_t *ids() const { return (const uint64_t *)_ids; }
+    const stats &last() const { return _last; }
+
+  private:
+    static double _now() {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // The files a snapshot fetched again is built in: removed unless
+    // commit() renames them over the old ones
+    struct _tmp_files {
+      const std::string &snap_name, &ids_name;
+      int snap_fd, ids_fd;
+      bool committed;
+      _tmp_files(const std::string &s, const std::string &i)
+        : snap_name(s), ids_name(i), snap_fd(-1), ids_fd(-1), committed(false) {}
+      ~_tmp_files() {
+        if (snap_fd >= 0) {
+          ::close(snap_fd);
+          ::close(ids_fd);
+          if (!committed) {
+            unlink(snap_name.c_str());
+            unlink(ids_name.c_str());
+          }
+        }
+      }
+      bool is_open() const { return snap_fd >= 0; }
+      bool create() {
+        snap_fd = ::open(snap_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ids_fd = snap_fd < 0 ? -1 : ::open(ids_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (ids_fd < 0 && snap_fd >= 0) {
+          ::close(snap_fd);
+          unlink(snap_name.c_str());
+          snap_fd = -1;
+        }
+        return snap_fd >= 0;
+      }
+      // the ids first: the snapshot's header is what says they are good
+      bool commit(const std::string &snap_to, const std::string &ids_to) {
+        committed = fdatasync(snap_fd) == 0 && fdatasync(ids_fd) == 0 && rename(ids_name.c_str(), ids_to.c_str()) == 0 &&
+          rename(snap_name.c_str(), snap_to.c_str()) == 0;
+        return committed;
+      }
+    };
+
+    bool _map(int snap_fd, int ids_fd, size_t n, bool writable) {
+      const int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+      _snap_len = HEADER_BYTES + n * _d * sizeof(float);
+      _snap = mmap(NULL, _snap_len, prot, MAP_SHARED, snap_fd, 0);
+      if (_snap == MAP_FAILED) {
+        _snap = NULL;
+        return false;
+      }
+      if (n > 0) {
+        _ids_len = n * sizeof(uint64_t);
+        _ids = mmap(NULL, _ids_len, prot, MAP_SHARED, ids_fd, 0);
+        if (_ids == MAP_FAILED) {
+          _ids = NULL;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool _update(dbpool::pool &pool, const vecdb::selection &sel, size_t d, const std::string &name, int snap_fd,
+                 int ids_fd, unsigned int parts) {
+      _d = d;
+      _header h;
+      struct stat st, ids_st;
+      bool have = fstat(snap_fd, &st) == 0 && fstat(ids_fd, &ids_st) == 0 &&
+        pread(snap_fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+        h.version == VERSION && h.mode == (uint32_t)sel.mode && h.dtype == (uint32_t)sel.dtype && h.d == d &&
+        h.op == sel.op && h.class_a == sel.class_a && h.class_b == sel.class_b &&
+        (size_t)st.st_size >= HEADER_BYTES + h.n * d * sizeof(float) && (size_t)ids_st.st_size >= h.n * sizeof(uint64_t);
+      if (have && h.n > 0) {
+        // the ids go in before the snapshot they belong to, so a crash between the renames shows here
+        uint64_t last;
+        have = pread(ids_fd, &last, sizeof(last), (h.n - 1) * sizeof(uint64_t)) == (ssize_t)sizeof(last) &&
+          last == h.watermark;
+      }
+      const double t0 = _now();
+      vecdb::selection cached(sel);
+      cached.id_lo = 0;
+      if (have && h.n > 0) {
+        // the rows under the watermark must be the ones in the snapshot
+        size_t n_under;
+        cached.id_hi = h.watermark;
+        if (!vecdb::count(pool, cached, &n_under)) {
+          return false;
+        }
+        if (n_under != h.n) {
+          fprintf(stderr, "snapshot %s has %lu rows to id %llu, the table %lu: fetching it again\n", name.c_str(),
+                  (unsigned long)h.n, (unsigned long long)h.watermark, (unsigned long)n_under);
+          have = false;
+        }
+      }
+      // a snapshot fetched again goes to new files, renamed in at the end
+      const std::string snap_tmp = name + ".snap.tmp", ids_tmp = name + ".ids.tmp";
+      _tmp_files tmp(snap_tmp, ids_tmp);
+      if (!have) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.mode = sel.mode;
+        h.dtype = sel.dtype;
+        h.d = d;
+        h.op = sel.op;
+        h.class_a = sel.class_a;
+        h.class_b = sel.class_b;
+        _last.rebuilt = true;
+        if (!tmp.create() || ftruncate(tmp.snap_fd, HEADER_BYTES) != 0 ||
+            pwrite(tmp.snap_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+          fprintf(stderr, "could not write snapshot %s: %s\n", snap_tmp.c_str(), strerror(errno));
+          return false;
+        }
+        snap_fd = tmp.snap_fd;
+        ids_fd = tmp.ids_fd;
+      }
+      vecdb::selection fresh(sel);
+      fresh.id_lo = h.n > 0 ? h.watermark + 1 : 0;
+      fresh.id_hi = ~(uint64_t)0;
+      size_t m = 0;
+      uint64_t hi = 0;
+      if (!vecdb::count(pool, fresh, &m, NULL, &hi)) {
+        return false;
+      }
+      _last.check_s = _now() - t0;
+      _last.cached_rows = h.n;
+      if (m == 0) {
+        if (!_map(snap_fd, ids_fd, h.n, false) || (tmp.is_open() && !tmp.commit(name + ".snap", name + ".ids"))) {
+          fprintf(stderr, "could not map snapshot %s: %s\n", name.c_str(), strerror(errno));
+          return false;
+        }
+        _n = h.n;
+        _watermark = h.watermark;
+        return true;
+      }
+
+      // grow the files and fetch the new rows into their tail; rows
+      // inserted after the count are left for next time
+      const double t1 = _now();
+      fresh.id_hi = hi;
+      const size_t n = h.n + m;
+      if (ftruncate(snap_fd, HEADER_BYTES + n * d * sizeof(float)) != 0 || ftruncate(ids_fd, n * sizeof(uint64_t)) != 0 ||
+          !_map(snap_fd, ids_fd, n, true)) {
+        fprintf(stderr, "could not grow snapshot %s to %lu rows: %s\n", name.c_str(), (unsigned long)n, strerror(errno));
+        return false;
+      }
+      float *matrix = (float *)((char *)_snap + HEADER_BYTES);
+      vecdb::rows_info info;
+      const long got = parts > 1 ? vecdb::select_parallel(pool, fresh, d, matrix + h.n * d, m, &info, parts)
+                                 : vecdb::select_into(pool, fresh, d, matrix + h.n * d, m, &info);
+      if (got != (long)m) {
+        fprintf(stderr, "snapshot %s: fetched %ld of %lu new rows\n", name.c_str(), got, (unsigned long)m);
+        return false;
+      }
+      memcpy((uint64_t *)_ids + h.n, info.ids.data(), m * sizeof(uint64_t));
+      h.n = n;
+      h.watermark = info.ids.back();
+      // the rows reach the disk before the header that counts them
+      if (msync(_snap, _snap_len, MS_SYNC) != 0 || msync(_ids, _ids_len, MS_SYNC) != 0 ||
+          pwrite(snap_fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || fdatasync(snap_fd) != 0 ||
+          (tmp.is_open() && !tmp.commit(name + ".snap", name + ".ids"))) {
+        fprintf(stderr, "could not write snapshot %s: %s\n", name.c_str(), strerror(errno));
+        return false;
+      }
+      _n = n;
+      _watermark = h.watermark;
+      _last.fetched_rows = m;
+      _last.fetch_s = _now() - t1;
+      return true;
+    }
+
+    void *_snap;
+    size_t _snap_len;
+    void *_ids;
+    size_t _ids_len;
+    size_t _n;
+    size_t _d;
+    uint64_t _watermark;
+    stats _last;
+  };
+}
+#endif // __snapcache_hpp__
@@ -0,0 +1,387 @@
+#ifndef __timing_hpp__
+#define __timing_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define TIMING_TSC 1
+#endif
+
+/*
+ * Where the seconds of a load or a retrieve go, stage by stage. A stage
+ * is a name registered once (stage("vecdb.write")), and a scope on it
+ * times the code until it goes out of scope, with the bytes and rows it
+ * handled. Each thread keeps its own counters and a log-linear histogram
+ * a stage (16 steps to each power of two, so a percentile is within 6%),
+ * written without locks or read-modify-writes; report() adds up the
+ * threads, those still running and those gone, and prints calls, time,
+ * percentiles, rows and MB for each stage.
+ *
+ * The clock is the TSC, scaled to seconds against steady_clock over the
+ * time since enable(), so this assumes an invariant TSC (any x86 of the
+ * last decade); elsewhere it is steady_clock. Scopes cost a relaxed load
+ * and a branch until enable() is called, and nothing at all built with
+ * -DTIMING_OFF.
+ */
+namespace timing {
+  const unsigned int MAX_STAGES = 64;
+  // values under 16 ticks a bucket each, then 16 buckets to each power of two
+  const unsigned int SUB_BITS = 4;
+  const unsigned int SUB = 1u << SUB_BITS;
+  const unsigned int BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+  inline uint64_t ticks() {
+#ifdef TIMING_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  inline unsigned int bucket(uint64_t v) {
+    if (v < SUB) {
+      return v;
+    }
+    const unsigned int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+  }
+
+  /* The smallest value that falls in bucket b */
+  inline uint64_t bucket_low(unsigned int b) {
+    if (b < SUB) {
+      return b;
+    }
+    const unsigned int e = b / SUB + SUB_BITS - 1;
+    return (uint64_t)(SUB + b % SUB) << (e - SUB_BITS);
+  }
+
+  /* One stage added up over the threads */
+  struct summary {
+    std::string name;
+    uint64_t calls;
+    double seconds;
+    double max_s;
+    double p50_s, p90_s, p99_s;
+    uint64_t bytes;
+    uint64_t rows;
+  };
+
+  // one thread's numbers; only the thread writes them, report() reads them
+  struct _local {
+    std::atomic<uint64_t> calls[MAX_STAGES];
+    std::atomic<uint64_t> ticks[MAX_STAGES];
+    std::atomic<uint64_t> max[MAX_STAGES];
+    std::atomic<uint64_t> bytes[MAX_STAGES];
+    std::atomic<uint64_t> rows[MAX_STAGES];
+    std::atomic<std::atomic<uint64_t> *> hist[MAX_STAGES];
+    _local() {
+      unsigned int i = 0;
+      for (; i < MAX_STAGES; i++) {
+        calls[i] = 0;
+        ticks[i] = 0;
+        max[i] = 0;
+        bytes[i] = 0;
+        rows[i] = 0;
+        hist[i] = NULL;
+      }
+    }
+    ~_local() {
+      unsigned int i = 0;
+      for (; i < MAX_STAGES; i++) {
+        delete[] hist[i].load();
+      }
+    }
+  };
+
+  // the numbers of threads that have exited
+  struct _totals {
+    uint64_t calls[MAX_STAGES];
+    uint64_t ticks[MAX_STAGES];
+    uint64_t max[MAX_STAGES];
+    uint64_t bytes[MAX_STAGES];
+    uint64_t rows[MAX_STAGES];
+    std::vector<uint64_t> hist[MAX_STAGES];
+  };
+
+  struct _state {
+    std::atomic<bool> on;
+    std::mutex mtx;
+    std::vector<std::string> names;   // stage 0 is the one stage() hands out when the table is full
+    std::vector<_local *> threads;
+    _totals gone;
+    uint64_t tsc0;
+    double t0;
+    _state() : on(false), names(1, "(other)"), tsc0(0), t0(0) {
+      memset(gone.calls, 0, sizeof(gone.calls));
+      memset(gone.ticks, 0, sizeof(gone.ticks));
+      memset(gone.max, 0, sizeof(gone.max));
+      memset(gone.bytes, 0, sizeof(gone.bytes));
+      memset(gone.rows, 0, sizeof(gone.rows));
+    }
+  };
+
+  // never freed: threads exiting after main() and the atexit report still use it
+  inline _state &_global() {
+    static _state *s = new _state;
+    return *s;
+  }
+
+  inline double _now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // registers the thread's numbers while it lives, and folds them into gone when it exits
+  struct _attach {
+    _local *l;
+    _attach() : l(new _local) {
+      _state &s = _global();
+      std::lock_guard<std::mutex> lock(s.mtx);
+      s.threads.push_back(l);
+    }
+    ~_attach() {
+      _state &s = _global();
+      std::lock_guard<std::mutex> lock(s.mtx);
+      unsigned int i = 0;
+      for (; i < MAX_STAGES; i++) {
+        s.gone.calls[i] += l->calls[i];
+        s.gone.ticks[i] += l->ticks[i];
+        s.gone.max[i] = std::max(s.gone.max[i], l->max[i].load());
+        s.gone.bytes[i] += l->bytes[i];
+        s.gone.rows[i] += l->rows[i];
+        const std::atomic<uint64_t> *h = l->hist[i];
+        if (h) {
+          s.gone.hist[i].resize(BUCKETS);
+          unsigned int b = 0;
+          for (; b < BUCKETS; b++) {
+            s.gone.hist[i][b] += h[b];
+          }
+        }
+      }
+      size_t t = 0;
+      for (; t < s.threads.size(); t++) {
+        if (s.threads[t] == l) {
+          s.threads.erase(s.threads.begin() + t);
+          break;
+        }
+      }
+      delete l;
+    }
+  };
+
+  inline _local &_mine() {
+    static thread_local _attach a;
+    return *a.l;
+  }
+
+  // owner-only updates: a plain load and store, no lock prefix
+  inline void _bump(std::atomic<uint64_t> &c, uint64_t v) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  inline void _record(unsigned int id, uint64_t t, uint64_t bytes, uint64_t rows) {
+    _local &l = _mine();
+    _bump(l.calls[id], 1);
+    _bump(l.ticks[id], t);
+    _bump(l.bytes[id], bytes);
+    _bump(l.rows[id], rows);
+    if (t > l.max[id].load(std::memory_order_relaxed)) {
+      l.max[id].store(t, std::memory_order_relaxed);
+    }
+    std::atomic<uint64_t> *h = l.hist[id].load(std::memory_order_relaxed);
+    if (!h) {
+      h = new std::atomic<uint64_t>[BUCKETS];
+      unsigned int b = 0;
+      for (; b < BUCKETS; b++) {
+        h[b].store(0, std::memory_order_relaxed);
+      }
+      l.hist[id].store(h, std::memory_order_release);
+    }
+    _bump(h[bucket(t)], 1);
+  }
+
+  /*
+   * The id of the stage called name, registering it the first time. Call
+   * it once and keep the id (a function static); when MAX_STAGES are
+   * taken the rest share stage 0.
+   */
+  inline unsigned int stage(const char *name) {
+    _state &s = _global();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    size_t i = 1;
+    for (; i < s.names.size(); i++) {
+      if (s.names[i] == name) {
+        return i;
+      }
+    }
+    if (s.names.size() == MAX_STAGES) {
+      return 0;
+    }
+    s.names.push_back(name);
+    return s.names.size() - 1;
+  }
+
+  inline bool enabled() {
+#ifdef TIMING_OFF
+    return false;
+#else
+    return _global().on.load(std::memory_order_relaxed);
+#endif
+  }
+
+  /* Starts (or stops) timing; the report's wall time and TSC rate count from the first enable */
+  inline void enable(bool on = true) {
+    _state &s = _global();
+    if (on && s.t0 == 0) {
+      s.t0 = _now();
+      s.tsc0 = ticks();
+    }
+    s.on.store(on, std::memory_order_relaxed);
+  }
+
+  /* Times the enclosing block against a stage */
+  class scope {
+  public:
+#ifdef TIMING_OFF
+    explicit scope(unsigned int) {}
+    void add(uint64_t, uint64_t = 0) {}
+    void stop() {}
+#else
+    explicit scope(unsigned int id) : _id(id), _bytes(0), _rows(0), _t0(enabled() ? ticks() : 0) {}
+    ~scope() { stop(); }
+
+    /* Bytes and rows this call handled, counted when it ends */
+    void add(uint64_t bytes, uint64_t rows = 0) {
+      _bytes += bytes;
+      _rows += rows;
+    }
+
+    /* Ends the timing early */
+    void stop() {
+      if (_t0) {
+        _record(_id, ticks() - _t0, _bytes, _rows);
+        _t0 = 0;
+      }
+    }
+
+  private:
+    unsigned int _id;
+    uint64_t _bytes;
+    uint64_t _rows;
+    uint64_t _t0;
+#endif
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+  };
+
+  /* Adds up every thread, live and gone; stages never entered are left out */
+  inline std::vector<summary> collect(double *wall_s = NULL) {
+    _state &s = _global();
+    std::lock_guard<std::mutex> lock(s.mtx);
+    const double wall = s.t0 ? _now() - s.t0 : 0;
+    const double tick_s = !s.t0 ? 0 :
+#ifdef TIMING_TSC
+      wall / (double)(ticks() - s.tsc0);
+#else
+      1e-9;
+#endif
+    if (wall_s) {
+      *wall_s = wall;
+    }
+    std::vector<summary> out;
+    std::vector<uint64_t> hist(BUCKETS);
+    size_t id = 0;
+    for (; id < s.names.size(); id++) {
+      summary sum;
+      sum.name = s.names[id];
+      sum.calls = s.gone.calls[id];
+      uint64_t t = s.gone.ticks[id], mx = s.gone.max[id];
+      sum.bytes = s.gone.bytes[id];
+      sum.rows = s.gone.rows[id];
+      if (s.gone.hist[id].empty()) {
+        std::fill(hist.begin(), hist.end(), 0);
+      } else {
+        hist = s.gone.hist[id];
+      }
+      for (_local *l : s.threads) {
+        sum.calls += l->calls[id].load(std::memory_order_relaxed);
+        t += l->ticks[id].load(std::memory_order_relaxed);
+        mx = std::max(mx, l->max[id].load(std::memory_order_relaxed));
+        sum.bytes += l->bytes[id].load(std::memory_order_relaxed);
+        sum.rows += l->rows[id].load(std::memory_order_relaxed);
+        const std::atomic<uint64_t> *h = l->hist[id].load(std::memory_order_acquire);
+        unsigned int b = 0;
+        for (; h && b < BUCKETS; b++) {
+          hist[b] += h[b].load(std::memory_order_relaxed);
+        }
+      }
+      if (sum.calls == 0) {
+        continue;
+      }
+      sum.seconds = t * tick_s;
+      sum.max_s = mx * tick_s;
+      // nearest rank, each bucket taken at its middle, none past the max
+      uint64_t total = 0;
+      for (uint64_t c : hist) {
+        total += c;
+      }
+      const double ps[] = { 0.5, 0.9, 0.99 };
+      double *dst[] = { &sum.p50_s, &sum.p90_s, &sum.p99_s };
+      unsigned int p = 0;
+      for (; p < 3; p++) {
+        const uint64_t rank = std::max((uint64_t)1, (uint64_t)(ps[p] * total + 0.999999));
+        uint64_t seen = 0;
+        unsigned int b = 0;
+        for (; b + 1 < BUCKETS && seen + hist[b] < rank; b++) {
+          seen += hist[b];
+        }
+        const double mid = (bucket_low(b) + (b + 1 < BUCKETS ? bucket_low(b + 1) : bucket_low(b))) / 2.0;
+        *dst[p] = std::min(mid, (double)mx) * tick_s;
+      }
+      out.push_back(sum);
+    }
+    return out;
+  }
+
+  /* A line a stage. Time is summed over threads, so with several threads the share of wall time can pass 100% */
+  inline void report(FILE *f) {
+    double wall = 0;
+    const std::vector<summary> all = collect(&wall);
+    if (all.empty()) {
+      return;
+    }
+    fprintf(f, "%-22s %10s %10s %7s %9s %9s %9s %9s %9s %10s %12s %10s\n", "stage", "calls", "seconds", "wall%",
+            "mean us", "p50 us", "p90 us", "p99 us", "max us", "MB/s", "rows", "MB");
+    for (const summary &s : all) {
+      fprintf(f, "%-22s %10llu %10.3f %6.1f%% %9.2f %9.2f %9.2f %9.2f %9.1f %10.1f %12llu %10.1f\n", s.name.c_str(),
+              (unsigned long long)s.calls, s.seconds, wall > 0 ? 100 * s.seconds / wall : 0, 1e6 * s.seconds / s.calls,
+              1e6 * s.p50_s, 1e6 * s.p90_s, 1e6 * s.p99_s, 1e6 * s.max_s, s.seconds > 0 ? s.bytes / s.seconds / 1e6 : 0,
+              (unsigned long long)s.rows, s.bytes / 1e6);
+    }
+    fprintf(f, "%-22s %10s %10.3f\n", "wall", "", wall);
+  }
+
+  inline void _report_stderr() {
+    report(stderr);
+  }
+
+  /* enable(), and report() on stderr when the program exits */
+  inline void report_at_exit() {
+    static std::once_flag once;
+    enable();
+    std::call_once(once, []() { atexit(_report_stderr); });
+  }
+}
+#endif // __timing_hpp__
@@ -0,0 +1,148 @@
+//
+// Test program for timing.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "timing.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+const timing::summary *
+find(const std::vector<timing::summary> &all, const char *name)
+{
+  for (const timing::summary &s : all) {
+    if (s.name == name) {
+      return &s;
+    }
+  }
+  return NULL;
+}
+
+// Every value lands in a bucket whose bounds hold it, no wider than a sixteenth of it
+unsigned int
+check_buckets()
+{
+  using namespace std;
+  unsigned int errors = 0;
+  uint64_t v = 0;
+  for (; v < 100000 && errors < 5; v++) {
+    const unsigned int b = timing::bucket(v);
+    if (b >= timing::BUCKETS || timing::bucket_low(b) > v || timing::bucket_low(b + 1) <= v ||
+        (v >= timing::SUB && timing::bucket_low(b + 1) - timing::bucket_low(b) > v / timing::SUB)) {
+      cout << "ERROR: " << v << " in bucket " << b << " from " << timing::bucket_low(b) << endl;
+      errors++;
+    }
+  }
+  const uint64_t big[] = { 1ull << 40, (1ull << 40) + 12345, ~0ull };
+  for (uint64_t x : big) {
+    const unsigned int b = timing::bucket(x);
+    if (b >= timing::BUCKETS || timing::bucket_low(b) > x) {
+      cout << "ERROR: " << x << " in bucket " << b << endl;
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = check_buckets();
+
+  const unsigned int a = timing::stage("test.a");
+  if (timing::stage("test.a") != a || timing::stage("test.b") == a || a == 0) {
+    cout << "ERROR: stage ids" << endl;
+    errors++;
+  }
+
+  // nothing counts until enabled
+  {
+    timing::scope t(a);
+  }
+  if (!timing::collect().empty()) {
+    cout << "ERROR: timed while disabled" << endl;
+    errors++;
+  }
+
+  timing::enable();
+#ifdef TIMING_OFF
+  {
+    timing::scope t(a);
+  }
+  if (!timing::collect().empty()) {
+    cout << "ERROR: timed with the scopes compiled out" << endl;
+    errors++;
+  }
+  cout << "timing errors " << errors << endl;
+  return errors != 0;
+#endif
+  const double t0 = elapsed();
+  {
+    timing::scope t(a);
+    t.add(1000, 10);
+    usleep(20000);
+  }
+  const double slept = elapsed() - t0;
+
+  // threads that are gone by the report still count, with their histograms
+  const unsigned int b = timing::stage("test.b");
+  vector<thread> threads;
+  unsigned int i = 0;
+  for (; i < 4; i++) {
+    threads.push_back(thread([b]() {
+      unsigned int j = 1;
+      for (; j <= 1000; j++) {
+        timing::_record(b, j, 1, 0);
+      }
+    }));
+  }
+  for (thread &th : threads) {
+    th.join();
+  }
+  // and so do those still running
+  const unsigned int c = timing::stage("test.c");
+  timing::_record(c, 77, 0, 0);
+
+  const vector<timing::summary> all = timing::collect();
+  const timing::summary *sa = find(all, "test.a"), *sb = find(all, "test.b"), *sc = find(all, "test.c");
+  if (!sa || sa->calls != 1 || sa->bytes != 1000 || sa->rows != 10 || sa->seconds < 0.019 ||
+      sa->seconds > slept * 1.1 + 0.001) {
+    cout << "ERROR: test.a " << (sa ? sa->seconds : -1) << "s for " << slept << "s asleep" << endl;
+    errors++;
+  }
+  if (!sb || sb->calls != 4000 || sb->bytes != 4000) {
+    cout << "ERROR: test.b " << (sb ? sb->calls : 0) << " calls from exited threads" << endl;
+    errors++;
+  } else {
+    // 1..1000 ticks four times: the median near 500, the 99th near 990, the max 1000
+    const double p50 = sb->p50_s / sb->max_s, p90 = sb->p90_s / sb->max_s, p99 = sb->p99_s / sb->max_s;
+    printf("test.b p50 %.3f p90 %.3f p99 %.3f of the max\n", p50, p90, p99);
+    if (p50 < 0.47 || p50 > 0.54 || p90 < 0.85 || p90 > 0.96 || p99 < 0.93 || p99 > 1.0) {
+      cout << "ERROR: test.b percentiles off" << endl;
+      errors++;
+    }
+  }
+  if (!sc || sc->calls != 1 || sc->p50_s != sc->max_s) {
+    cout << "ERROR: test.c from this thread" << endl;
+    errors++;
+  }
+  timing::report(stdout);
+
+  cout << "timing errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,85 @@
+#ifndef __tuner_hpp__
+#define __tuner_hpp__
+
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+/*
+ * Finds the setting of one knob (a batch size) that gets the most work
+ * done a second, while the work is being done. Measurements come in as
+ * (work, seconds) pairs taken at the current value; every window of them
+ * gives a rate. The value moves by a factor of step at a time, keeps
+ * going while the rate rises, and turns around with a smaller step (the
+ * square root, down to min_step) when it falls. It ends up going back
+ * and forth by min_step around the best value, so it follows the best
+ * value if that moves as the server's load or the table changes.
+ * Measurements taken at any other value than the current one (a batch
+ * built before the last move) are dropped.
+ */
+namespace tuner {
+  class climber {
+  public:
+    climber(double start, double lo, double hi, unsigned int window = 8, double step = 2.0, double min_step = 1.1)
+      : _lo(lo), _hi(std::max(lo, hi)), _window(window ? window : 1), _step(step), _min_step(min_step), _dir(1),
+        _n(0), _work(0), _secs(0), _last_rate(0) {
+      _value = std::min(_hi, std::max(_lo, start));
+    }
+
+    climber(const climber &) = delete;
+    climber &operator=(const climber &) = delete;
+
+    /* The value to work at now */
+    double value() const { return _value.load(std::memory_order_relaxed); }
+
+    /* work done in seconds at value used; thread safe */
+    void observe(double used, double work, double seconds) {
+      std::lock_guard<std::mutex> lock(_mtx);
+      const double v = _value.load(std::memory_order_relaxed);
+      if (used != v || seconds <= 0) {
+        return;
+      }
+      _work += work;
+      _secs += seconds;
+      if (++_n < _window) {
+        return;
+      }
+      const double rate = _work / _secs;
+      _n = 0;
+      _work = 0;
+      _secs = 0;
+      if (_last_rate > 0 && rate < _last_rate) {
+        _dir = -_dir;
+        _step = std::max(_min_step, sqrt(_step));
+      }
+      _last_rate = rate;
+      double next = std::min(_hi, std::max(_lo, v * pow(_step, _dir)));
+      if (next == v) {
+        // at a bound: look the other way
+        _dir = -_dir;
+        next = std::min(_hi, std::max(_lo, v * pow(_step, _dir)));
+      }
+      _value.store(next, std::memory_order_relaxed);
+    }
+
+    double lo() const { return _lo; }
+    double hi() const { return _hi; }
+
+  private:
+    const double _lo;
+    const double _hi;
+    const unsigned int _window;
+    double _step;
+    const double _min_step;
+    int _dir;
+    unsigned int _n;
+    double _work;
+    double _secs;
+    double _last_rate;
+    std::atomic<double> _value;
+    std::mutex _mtx;
+  };
+}
+#endif // __tuner_hpp__
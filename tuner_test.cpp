@@ -0,0 +1,114 @@
+//
+// Test program for tuner.hpp
+//
+
+#include <iostream>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "tuner.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Seconds a statement of b bytes takes: a round trip, the bytes, and past
+// the knee (a log buffer filling, say) the bytes over it much slower
+double
+server(double b, double knee)
+{
+  return 0.005 + b / 200e6 + (b > knee ? (b - knee) / 20e6 : 0);
+}
+
+// Feeds the climber n statements timed by model, with noise of +-noise;
+// the value it ends at, and the range it kept to over the last quarter
+double
+climb(tuner::climber *c, const std::function<double (double)> &model, double noise, unsigned int n,
+      double *lo_out, double *hi_out)
+{
+  srandom(5);
+  *lo_out = 1e300;
+  *hi_out = 0;
+  unsigned int i = 0;
+  for (; i < n; i++) {
+    const double b = c->value();
+    const double jitter = 1 + noise * ((double)(random() % 2001) / 1000 - 1);
+    // rows go with bytes, so rows a second is bytes a second here
+    c->observe(b, b, model(b) * jitter);
+    if (i >= n * 3 / 4) {
+      *lo_out = std::min(*lo_out, c->value());
+      *hi_out = std::max(*hi_out, c->value());
+    }
+  }
+  return c->value();
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  double lo, hi;
+
+  // the best is at the knee, 8 MB, from a start of 2 MB
+  {
+    tuner::climber c(2 << 20, 64 << 10, 64 << 20);
+    const double v = climb(&c, [](double b) { return server(b, 8e6); }, 0, 2000, &lo, &hi);
+    printf("knee 8MB, exact: ends at %.2f MB, kept to %.2f..%.2f MB\n", v / 1e6, lo / 1e6, hi / 1e6);
+    if (lo < 6e6 || hi > 11e6) {
+      cout << "ERROR: did not settle at the knee" << endl;
+      errors++;
+    }
+  }
+  // the same with 5% noise a statement, from above
+  {
+    tuner::climber c(48 << 20, 64 << 10, 64 << 20);
+    const double v = climb(&c, [](double b) { return server(b, 8e6); }, 0.05, 4000, &lo, &hi);
+    printf("knee 8MB, noisy: ends at %.2f MB, kept to %.2f..%.2f MB\n", v / 1e6, lo / 1e6, hi / 1e6);
+    if (lo < 3e6 || hi > 20e6) {
+      cout << "ERROR: noise threw it off the knee" << endl;
+      errors++;
+    }
+  }
+  // bigger is always better: it goes to the top and stays near it
+  {
+    tuner::climber c(2 << 20, 64 << 10, 16 << 20);
+    const double v = climb(&c, [](double b) { return 0.005 + b / 200e6; }, 0, 1000, &lo, &hi);
+    printf("no knee: ends at %.2f MB, kept to %.2f..%.2f MB\n", v / 1e6, lo / 1e6, hi / 1e6);
+    if (lo < 12e6 || hi > c.hi()) {
+      cout << "ERROR: did not go to the top" << endl;
+      errors++;
+    }
+  }
+  // the knee moves (the server got busy): it follows
+  {
+    tuner::climber c(2 << 20, 64 << 10, 64 << 20);
+    climb(&c, [](double b) { return server(b, 8e6); }, 0, 2000, &lo, &hi);
+    const double v = climb(&c, [](double b) { return server(b, 1e6); }, 0, 2000, &lo, &hi);
+    printf("knee moved to 1MB: ends at %.2f MB, kept to %.2f..%.2f MB\n", v / 1e6, lo / 1e6, hi / 1e6);
+    if (lo < 0.7e6 || hi > 1.5e6) {
+      cout << "ERROR: did not follow the knee" << endl;
+      errors++;
+    }
+  }
+  // measurements at a stale value change nothing, and the bounds hold from the start
+  {
+    tuner::climber c(1e9, 10, 100, 1);
+    const double v0 = c.value();
+    c.observe(v0 / 2, 1, 1);
+    c.observe(v0, 1, 0);
+    if (v0 != 100 || c.value() != v0) {
+      cout << "ERROR: start " << v0 << ", then " << c.value() << " from stale measurements" << endl;
+      errors++;
+    }
+  }
+
+  cout << "tuner errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,1678 @@
+#ifndef __vecdb_hpp__
+#define __vecdb_hpp__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+#include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+
+#include "envelope.hpp"
+#include "quant.hpp"
+#include "dbpool.hpp"
+#include "timing.hpp"
+#include "tuner.hpp"
+
+// MySQL 8.0.16 on has the nonblocking query call the async writer is built on
+#if defined(MYSQL_VERSION_ID) && MYSQL_VERSION_ID >= 80016 && !defined(MARIADB_BASE_VERSION) && !defined(LIBMARIADB)
+#define VECDB_ASYNC 1
+#include <poll.h>
+#endif
+
+/*
+ * Storing vectors in mysql, two ways:
+ *
+ * STORE_JSON: base64 of the raw bytes in a JSON string in vectors.jstr60k,
+ * written with text extended INSERTs.
+ *
+ * STORE_BLOB: the raw bytes in vectors_bin.vec, a VARBINARY column, written
+ * and read with server side prepared statements over the binary protocol.
+ * Nothing is encoded or escaped on the way in and nothing parsed on the way
+ * out: a 512 byte SIFT vector is 512 bytes on the wire and in the row,
+ * against 700 odd as base64 in JSON. libmysqlclient has no array binding
+ * (STMT_ATTR_ARRAY_SIZE is MariaDB's Connector/C only), so a batch is one
+ * multi-row INSERT with a placeholder tuple per row, prepared once per
+ * connection and per row count.
+ *
+ * Either way rows are loaded through a loader: encoder threads turn rows
+ * into batches, writer threads holding a connection each send them. A
+ * batch is an extended INSERT (INGEST_INSERT) or the tab separated rows of
+ * a LOAD DATA LOCAL INFILE (INGEST_LOAD_DATA), streamed to the server from
+ * memory through a local infile handler, no file involved.
+ *
+ * Rows can be stored smaller than float32 (quant.hpp: f16, bf16, int8
+ * with a scale). JSON rows say which in the envelope's "dtype", so any
+ * reader decodes them right; a blob column holds just the bytes, so a
+ * STORE_BLOB selection says which dtype it was written with.
+ */
+namespace vecdb {
+  enum store_mode { STORE_JSON, STORE_BLOB };
+  enum ingest_mode { INGEST_INSERT, INGEST_LOAD_DATA };
+
+  const char JSON_TABLE[] = "vectors";
+  const char JSON_SCHEMA[] = "(id bigint unsigned not null auto_increment, "
+                             "op16 smallint unsigned default 0, "
+                             "cla16 smallint unsigned default 0, "
+                             "clb16 smallint unsigned default 0, "
+                             "jstr60k varchar(61440) default '{}', "
+                             "primary key (id), key class_key (op16, cla16, clb16))";
+  // statement sizes: where a load starts when the server does not say,
+  // and the range it keeps to (a loader holds a few dozen batches)
+  const size_t DEFAULT_STMT_BYTES = 2 * 1024 * 1024;
+  const size_t MIN_STMT_BYTES = 64 * 1024;
+  const size_t MAX_STMT_BYTES = 16 * 1024 * 1024;
+
+  const char BLOB_TABLE[] = "vectors_bin";
+  const char BLOB_SCHEMA[] = "(id bigint unsigned not null auto_increment, "
+                             "op16 smallint unsigned default 0, "
+                             "cla16 smallint unsigned default 0, "
+                             "clb16 smallint unsigned default 0, "
+                             "vec varbinary(8192) not null, "
+                             "primary key (id), key class_key (op16, cla16, clb16))";
+  const unsigned int MAX_BLOB_BYTES = 8192;
+  // 4 placeholders a row, the server takes at most 65535 a statement
+  const unsigned int MAX_BLOB_BATCH = 16383;
+  // what a row's keys and length prefixes add to a blob statement, about
+  const unsigned int BLOB_ROW_OVERHEAD = 16;
+
+  // resumable loads: a row for every batch committed, in the batch's transaction
+  const char CHECKPOINT_TABLE[] = "load_checkpoints";
+  const char CHECKPOINT_SCHEMA[] = "(dataset varchar(64) not null, "
+                                   "op16 smallint unsigned not null, "
+                                   "cla16 smallint unsigned not null, "
+                                   "clb16 smallint unsigned not null, "
+                                   "first bigint unsigned not null, "
+                                   "n int unsigned not null, "
+                                   "primary key (dataset, op16, cla16, clb16, first))";
+
+  /*
+   * CREATE TABLE IF NOT EXISTS for the mode's table. A table made before
+   * rows had ids gets the id key and the class index added.
+   */
+  inline bool create_table(dbpool::pool &pool, store_mode mode) {
+    const std::string table = mode == STORE_BLOB ? BLOB_TABLE : JSON_TABLE;
+    std::string q = "CREATE TABLE IF NOT EXISTS " + table + " " + (mode == STORE_BLOB ? BLOB_SCHEMA : JSON_SCHEMA);
+    dbpool::lease conn = pool.borrow();
+    if (!conn || !conn.query(q.c_str())) {
+      return false;
+    }
+    q = "SHOW COLUMNS FROM " + table + " LIKE 'id'";
+    MYSQL_RES *res = conn.query(q.c_str()) ? mysql_store_result(conn.mysql()) : NULL;
+    if (!res) {
+      return false;
+    }
+    const bool has_id = mysql_num_rows(res) > 0;
+    mysql_free_result(res);
+    if (!has_id) {
+      q = "ALTER TABLE " + table + " ADD COLUMN id bigint unsigned not null auto_increment primary key first, "
+          "ADD KEY class_key (op16, cla16, clb16)";
+      return conn.query(q.c_str());
+    }
+    return true;
+  }
+
+  /* What the server lets a load do; 0 where it did not say */
+  struct server_limits {
+    size_t max_allowed_packet;
+    size_t innodb_log_buffer_size;
+    server_limits() : max_allowed_packet(0), innodb_log_buffer_size(0) {}
+  };
+
+  /* Reads the server's limits on a pooled connection; all 0 if it cannot */
+  inline server_limits read_limits(dbpool::pool &pool) {
+    server_limits lim;
+    dbpool::lease conn = pool.borrow();
+    MYSQL_RES *res = conn && conn.query("SHOW VARIABLES WHERE Variable_name IN "
+                                        "('max_allowed_packet', 'innodb_log_buffer_size')")
+                       ? mysql_store_result(conn.mysql()) : NULL;
+    if (!res) {
+      return lim;
+    }
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(res)) != NULL && mysql_num_fields(res) >= 2) {
+      if (!row[0] || !row[1]) {
+        continue;
+      }
+      const size_t v = strtoull(row[1], NULL, 10);
+      if (strcmp(row[0], "max_allowed_packet") == 0) {
+        lim.max_allowed_packet = v;
+      } else if (strcmp(row[0], "innodb_log_buffer_size") == 0) {
+        lim.innodb_log_buffer_size = v;
+      }
+    }
+    mysql_free_result(res);
+    return lim;
+  }
+
+  inline double _now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /* The timing stages of loads and retrieves, registered on first use.
+   * encode is a row going into a batch, quantize and envelope parts of it;
+   * fetch is a row coming off the socket, parse and decode what follows. */
+  struct _stages {
+    unsigned int quantize, envelope, encode, insert, insert_blob, insert_async, load_data, commit, writer_wait, query,
+      fetch, parse, decode;
+    _stages() : quantize(timing::stage("vecdb.quantize")), envelope(timing::stage("vecdb.envelope")),
+                encode(timing::stage("vecdb.encode")), insert(timing::stage("vecdb.insert")),
+                insert_blob(timing::stage("vecdb.insert_blob")), insert_async(timing::stage("vecdb.insert_async")),
+                load_data(timing::stage("vecdb.load_data")), commit(timing::stage("vecdb.commit")),
+                writer_wait(timing::stage("vecdb.writer_wait")),
+                query(timing::stage("vecdb.query")), fetch(timing::stage("vecdb.fetch")),
+                parse(timing::stage("vecdb.parse")), decode(timing::stage("vecdb.decode")) {}
+  };
+
+  inline const _stages &_st() {
+    static const _stages s;
+    return s;
+  }
+
+  inline void _bind_u16(MYSQL_BIND *b, uint16_t *v) {
+    memset(b, 0, sizeof(*b));
+    b->buffer_type = MYSQL_TYPE_SHORT;
+    b->buffer = v;
+    b->is_unsigned = 1;
+  }
+
+  inline void _bind_u64(MYSQL_BIND *b, uint64_t *v) {
+    memset(b, 0, sizeof(*b));
+    b->buffer_type = MYSQL_TYPE_LONGLONG;
+    b->buffer = v;
+    b->is_unsigned = 1;
+  }
+
+  inline void _bind_blob(MYSQL_BIND *b, void *v, unsigned long room, unsigned long *len) {
+    memset(b, 0, sizeof(*b));
+    b->buffer_type = MYSQL_TYPE_BLOB;
+    b->buffer = v;
+    b->buffer_length = room;
+    b->length = len;
+  }
+
+  inline bool create_checkpoint_table(dbpool::pool &pool) {
+    const std::string q = std::string("CREATE TABLE IF NOT EXISTS ") + CHECKPOINT_TABLE + " " + CHECKPOINT_SCHEMA;
+    dbpool::lease conn = pool.borrow();
+    return conn && conn.query(q.c_str());
+  }
+
+  /* Rows [first, end) of a class, loaded */
+  struct loaded_range {
+    uint64_t first;
+    uint64_t end;
+  };
+
+  /* A class as one number, op16, cla16, clb16 high to low */
+  inline uint64_t class_key(uint16_t op, uint16_t class_a, uint16_t class_b) {
+    return ((uint64_t)op << 32) | ((uint64_t)class_a << 16) | class_b;
+  }
+
+  typedef std::map<uint64_t, std::vector<loaded_range>> loaded_map;
+
+  /*
+   * The rows a resumable load under dataset has committed, by class_key(),
+   * as sorted ranges with touching ones merged; false if the read fails.
+   */
+  inline bool checkpoints(dbpool::pool &pool, const std::string &dataset, loaded_map *out) {
+    out->clear();
+    dbpool::lease conn = pool.borrow();
+    if (!conn) {
+      return false;
+    }
+    char sql[192];
+    snprintf(sql, sizeof(sql), "SELECT op16, cla16, clb16, first, n FROM %s WHERE dataset = ? "
+             "ORDER BY op16, cla16, clb16, first", CHECKPOINT_TABLE);
+    MYSQL_STMT *stmt = conn.prepare(sql);
+    if (!stmt) {
+      return false;
+    }
+    unsigned long name_len = dataset.size();
+    MYSQL_BIND param;
+    _bind_blob(&param, (void *)dataset.data(), name_len, &name_len);
+    uint16_t keys[3];
+    uint64_t first, n;
+    MYSQL_BIND cols[5];
+    _bind_u16(&cols[0], &keys[0]);
+    _bind_u16(&cols[1], &keys[1]);
+    _bind_u16(&cols[2], &keys[2]);
+    _bind_u64(&cols[3], &first);
+    _bind_u64(&cols[4], &n);
+    if (mysql_stmt_bind_param(stmt, &param) || mysql_stmt_execute(stmt) || mysql_stmt_bind_result(stmt, cols)) {
+      fprintf(stderr, "reading %s failed: %s\n", CHECKPOINT_TABLE, mysql_stmt_error(stmt));
+      conn.broken();
+      return false;
+    }
+    int rc;
+    while ((rc = mysql_stmt_fetch(stmt)) == 0) {
+      std::vector<loaded_range> &done = (*out)[class_key(keys[0], keys[1], keys[2])];
+      if (!done.empty() && done.back().end >= first) {
+        done.back().end = std::max(done.back().end, first + n);
+      } else {
+        loaded_range r = { first, first + n };
+        done.push_back(r);
+      }
+    }
+    mysql_stmt_free_result(stmt);
+    return rc == MYSQL_NO_DATA;
+  }
+
+  /* Bytes as LOAD DATA reads them with ESCAPED BY '\\' */
+  inline void _tsv_escape(const char *p, size_t n, std::string *out) {
+    const char *run = p;
+    const char *end = p + n;
+    for (; p < end; p++) {
+      const char c = *p;
+      if (c != '\\' && c != '\t' && c != '\n' && c != 0) {
+        continue;
+      }
+      out->append(run, p - run);
+      out->push_back('\\');
+      out->push_back(c == '\t' ? 't' : c == '\n' ? 'n' : c == 0 ? '0' : '\\');
+      run = p + 1;
+    }
+    out->append(run, end - run);
+  }
+
+  /* LOAD DATA LOCAL INFILE reads the batch text through these */
+  struct _infile {
+    const char *p;
+    size_t left;
+  };
+
+  inline int _infile_init(void **ptr, const char *, void *userdata) {
+    *ptr = userdata;
+    return 0;
+  }
+
+  inline int _infile_read(void *ptr, char *buf, unsigned int len) {
+    _infile *in = (_infile *)ptr;
+    const size_t n = in->left < len ? in->left : len;
+    memcpy(buf, in->p, n);
+    in->p += n;
+    in->left -= n;
+    return (int)n;
+  }
+
+  inline void _infile_end(void *) {}
+
+  inline int _infile_error(void *, char *msg, unsigned int len) {
+    snprintf(msg, len, "vecdb batch infile failed");
+    return CR_UNKNOWN_ERROR;
+  }
+
+  /*
+   * One statement worth of rows. For STORE_JSON inserts the statement text
+   * is built as rows are added, for STORE_BLOB inserts the keys and bytes
+   * are kept for binding, and for LOAD DATA the text is the rows, tab
+   * separated. Reused batch after batch, so the buffers stop growing once
+   * the first few batches are through.
+   */
+  struct batch {
+    store_mode mode;
+    ingest_mode ingest;
+    quant::dtype dtype;
+    unsigned int rows;
+    std::string sql;
+    std::vector<uint16_t> keys;
+    std::vector<unsigned long> lens;
+    std::vector<size_t> offs;
+    std::vector<char> data;
+    std::vector<char> packed;  // a row in dtype, on its way into the statement
+    size_t max_bytes;          // the statement (or LOAD DATA rows) stops growing here
+    double target;             // the loader's size when it started the batch, 0 for one sent part full
+    uint64_t first;            // resumable loads: the class and first row the batch's rows are
+    uint16_t op, class_a, class_b;
+
+    explicit batch(store_mode m = STORE_JSON, ingest_mode i = INGEST_INSERT, quant::dtype t = quant::DT_F32)
+      : mode(m), ingest(i), dtype(t), rows(0), max_bytes(DEFAULT_STMT_BYTES), target(0), first(0), op(0),
+        class_a(0), class_b(0) {}
+
+    void clear() {
+      rows = 0;
+      sql.clear();
+      keys.clear();
+      lens.clear();
+      offs.clear();
+      data.clear();
+    }
+
+    /* What the rows take of max_bytes */
+    size_t bytes() const {
+      return mode == STORE_BLOB && ingest == INGEST_INSERT ? data.size() + rows * BLOB_ROW_OVERHEAD : sql.size();
+    }
+
+    /*
+     * false, adding nothing, when the row does not fit the statement. The
+     * JSON envelope is written straight into the statement text, so once
+     * the buffers have grown to a batch this does not allocate.
+     */
+    bool add(uint16_t op, uint16_t class_a, uint16_t class_b, const float *v, size_t d) {
+      const char *raw = (const char *)v;
+      const size_t bytes = quant::bytes(dtype, d);
+      envelope::fields tag;
+      if (dtype != quant::DT_F32) {
+        timing::scope t(_st().quantize);
+        t.add(d * sizeof(float), 1);
+        packed.resize(bytes);
+        quant::encode(dtype, v, d, packed.data());
+        raw = packed.data();
+        tag = envelope::fields(d, quant::name(dtype));
+      }
+      if (ingest == INGEST_LOAD_DATA) {
+        // streamed, not one packet, so a row may go a little past max_bytes
+        if (rows > 0 && sql.size() >= max_bytes) {
+          return false;
+        }
+        char head[64];
+        int head_len = snprintf(head, sizeof(head), "%u\t%u\t%u\t", (unsigned int)op, (unsigned int)class_a,
+                                (unsigned int)class_b);
+        sql.append(head, head_len);
+        if (mode == STORE_BLOB) {
+          _tsv_escape(raw, bytes, &sql);
+        } else {
+          // nothing in an envelope needs escaping
+          timing::scope t(_st().envelope);
+          t.add(bytes, 1);
+          envelope::append(&sql, raw, bytes, tag);
+        }
+        sql.push_back('\n');
+        rows++;
+        return true;
+      }
+      if (mode == STORE_BLOB) {
+        if (bytes > MAX_BLOB_BYTES || rows >= MAX_BLOB_BATCH ||
+            (rows > 0 && data.size() + bytes + (rows + 1) * BLOB_ROW_OVERHEAD > max_bytes)) {
+          return false;
+        }
+        keys.push_back(op);
+        keys.push_back(class_a);
+        keys.push_back(class_b);
+        lens.push_back(bytes);
+        offs.push_back(data.size());
+        data.insert(data.end(), raw, raw + bytes);
+        rows++;
+        return true;
+      }
+      char head[64];
+      int head_len = snprintf(head, sizeof(head), "%s(%u, %u, %u, '", rows == 0 ? "" : ", ",
+                              (unsigned int)op, (unsigned int)class_a, (unsigned int)class_b);
+      if (rows > 0 && sql.size() + head_len + envelope::max_size(bytes) + 2 > max_bytes) {
+        return false;
+      }
+      if (rows == 0) {
+        if (sql.capacity() < max_bytes) {
+          sql.reserve(max_bytes);
+        }
+        sql.assign("INSERT INTO ");
+        sql.append(JSON_TABLE);
+        sql.append(" (op16, cla16, clb16, jstr60k) VALUES ");
+      }
+      sql.append(head, head_len);
+      {
+        timing::scope t(_st().envelope);
+        t.add(bytes, 1);
+        envelope::append(&sql, raw, bytes, tag);
+      }
+      sql.append("')");
+      rows++;
+      return true;
+    }
+
+    /* Sends the batch on conn; binds is scratch space for STORE_BLOB */
+    bool write(dbpool::lease &conn, std::vector<MYSQL_BIND> *binds) {
+      if (rows == 0) {
+        return true;
+      }
+      timing::scope t(ingest == INGEST_LOAD_DATA ? _st().load_data : mode == STORE_JSON ? _st().insert : _st().insert_blob);
+      t.add(mode == STORE_BLOB && ingest == INGEST_INSERT ? data.size() : sql.size(), rows);
+      if (ingest == INGEST_LOAD_DATA) {
+        return _load_data(conn);
+      }
+      if (mode == STORE_JSON) {
+        return conn.query(sql.c_str(), sql.size());
+      }
+      // a statement for every row count would pile up prepared statements
+      // on the connection as batch sizes move, so the rows go in pieces of
+      // powers of two, largest first: at most one statement for each bit of
+      // MAX_BLOB_BATCH. Outside a transaction a failure may leave the
+      // pieces before it in.
+      unsigned int from = 0;
+      while (from < rows) {
+        unsigned int n = 1;
+        while (n * 2 <= rows - from) {
+          n *= 2;
+        }
+        if (!_write_blobs(conn, binds, from, n)) {
+          return false;
+        }
+        from += n;
+      }
+      return true;
+    }
+
+  private:
+    /* Inserts the n rows from row from in one prepared statement */
+    bool _write_blobs(dbpool::lease &conn, std::vector<MYSQL_BIND> *binds, unsigned int from, unsigned int n) {
+      std::string stmt_sql = std::string("INSERT INTO ") + BLOB_TABLE + " (op16, cla16, clb16, vec) VALUES ";
+      stmt_sql.reserve(stmt_sql.size() + n * 10);
+      unsigned int i = 0;
+      for (; i < n; i++) {
+        stmt_sql += i == 0 ? "(?,?,?,?)" : ",(?,?,?,?)";
+      }
+      MYSQL_STMT *stmt = conn.prepare(stmt_sql.c_str());
+      if (!stmt) {
+        return false;
+      }
+      binds->resize(4 * n);
+      for (i = 0; i < n; i++) {
+        const unsigned int r = from + i;
+        _bind_u16(&(*binds)[4 * i], &keys[3 * r]);
+        _bind_u16(&(*binds)[4 * i + 1], &keys[3 * r + 1]);
+        _bind_u16(&(*binds)[4 * i + 2], &keys[3 * r + 2]);
+        _bind_blob(&(*binds)[4 * i + 3], &data[offs[r]], lens[r], &lens[r]);
+      }
+      if (mysql_stmt_bind_param(stmt, binds->data()) || mysql_stmt_execute(stmt)) {
+        fprintf(stderr, "blob insert of %u rows failed: %s\n", n, mysql_stmt_error(stmt));
+        conn.broken();
+        return false;
+      }
+      return true;
+    }
+
+    bool _load_data(dbpool::lease &conn) {
+      char stmt_sql[256];
+      snprintf(stmt_sql, sizeof(stmt_sql), "LOAD DATA LOCAL INFILE 'vecdb_batch' INTO TABLE %s%s "
+               "FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\' LINES TERMINATED BY '\\n' (op16, cla16, clb16, %s)",
+               mode == STORE_BLOB ? BLOB_TABLE : JSON_TABLE, mode == STORE_BLOB ? " CHARACTER SET binary" : "",
+               mode == STORE_BLOB ? "vec" : "jstr60k");
+      // the handler goes on the connection the statement runs on, which
+      // may be remade between tries
+      int tries = 0;
+      for (; tries < 2; tries++) {
+        if (!conn.ready()) {
+          return false;
+        }
+        _infile in = { sql.data(), sql.size() };
+        mysql_set_local_infile_handler(conn.mysql(), _infile_init, _infile_read, _infile_end, _infile_error, &in);
+        if (mysql_real_query(conn.mysql(), stmt_sql, strlen(stmt_sql)) == 0) {
+          const unsigned long long loaded = mysql_affected_rows(conn.mysql());
+          if (loaded != rows) {
+            fprintf(stderr, "LOAD DATA of %u rows loaded %llu\n", rows, loaded);
+            return false;
+          }
+          return true;
+        }
+        const unsigned int err = mysql_errno(conn.mysql());
+        fprintf(stderr, "LOAD DATA of %u rows failed: %u %s\n", rows, err, mysql_error(conn.mysql()));
+        if (err == CR_SERVER_GONE_ERROR) {
+          // never sent, send it again on a new connection
+          conn.broken();
+          continue;
+        }
+        if (err == CR_SERVER_LOST) {
+          conn.broken();
+        }
+        return false;
+      }
+      return false;
+    }
+  };
+
+  /*
+   * Bounded FIFO between threads. push() waits while it is full, pop()
+   * while it is empty; after close() both give up once it is drained.
+   */
+  template <typename T>
+  class _queue {
+  public:
+    explicit _queue(size_t cap) : _cap(cap ? cap : 1), _closed(false) {}
+
+    bool push(T v) {
+      std::unique_lock<std::mutex> lock(_mtx);
+      _not_full.wait(lock, [this]() { return _q.size() < _cap || _closed; });
+      if (_closed) {
+        return false;
+      }
+      _q.push_back(v);
+      _not_empty.notify_one();
+      return true;
+    }
+
+    bool pop(T *v) {
+      std::unique_lock<std::mutex> lock(_mtx);
+      _not_empty.wait(lock, [this]() { return !_q.empty() || _closed; });
+      if (_q.empty()) {
+        return false;
+      }
+      *v = _q.front();
+      _q.pop_front();
+      _not_full.notify_one();
+      return true;
+    }
+
+    /* pop() that does not wait */
+    bool try_pop(T *v) {
+      std::lock_guard<std::mutex> lock(_mtx);
+      if (_q.empty()) {
+        return false;
+      }
+      *v = _q.front();
+      _q.pop_front();
+      _not_full.notify_one();
+      return true;
+    }
+
+    void close() {
+      std::lock_guard<std::mutex> lock(_mtx);
+      _closed = true;
+      _not_full.notify_all();
+      _not_empty.notify_all();
+    }
+
+  private:
+    const size_t _cap;
+    bool _closed;
+    std::deque<T> _q;
+    std::mutex _mtx;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+  };
+
+  struct load_config {
+    store_mode mode;
+    ingest_mode ingest;         // extended INSERTs, or LOAD DATA LOCAL INFILE (needs pool cfg local_infile)
+    quant::dtype dtype;         // what a row is stored as
+    unsigned int encoders;      // threads turning rows into statements
+    unsigned int writers;       // threads sending them, a pooled connection each
+    unsigned int queue_slots;   // batches waiting between the two
+    unsigned int batch_rows;    // rows add() hands the encoders at a time
+    size_t batch_bytes;         // bytes a statement to start at, 0 to size it from the server's limits
+    bool adapt;                 // move the statement size toward the most rows a second while loading
+    bool disable_keys;          // DISABLE KEYS for the load, unique and foreign key checks off
+    size_t txn_rows;            // commit every this many rows a writer, 0 to autocommit each statement
+    unsigned int inflight;      // JSON INSERTs: statements one nonblocking writer keeps going at once, 0 for writer threads
+    std::string dataset;        // resumable: each batch is checkpointed under this name, in its own transaction
+    load_config() : mode(STORE_JSON), ingest(INGEST_INSERT), dtype(quant::DT_F32), encoders(4), writers(4), queue_slots(8),
+                    batch_rows(2500), batch_bytes(0), adapt(true), disable_keys(false), txn_rows(0), inflight(0) {}
+  };
+
+  /* Whether cfg can use the nonblocking writer: this client library, text INSERTs, not resumable */
+  inline bool async_supported(const load_config &cfg) {
+#ifdef VECDB_ASYNC
+    return cfg.mode == STORE_JSON && cfg.ingest == INGEST_INSERT && cfg.dataset.empty();
+#else
+    (void)cfg;
+    return false;
+#endif
+  }
+
+  /*
+   * Bulk loads rows through encoders -> bounded queue -> writers. add()
+   * copies rows into a work item of batch_rows rows; full work items go to
+   * the encoders, which fill batches from them, and the writers send the
+   * batches. Work items and batches come from fixed free lists, so when
+   * the database falls behind the writers stop taking batches, the
+   * encoders stop taking work, and add() waits: memory stays at a few
+   * dozen batches however many rows go through. Rows are written in no
+   * particular order.
+   *
+   * With txn_rows each writer commits every txn_rows rows, and whenever it
+   * runs out of batches, so the binlog gets transactions of a bounded size
+   * and flush() still sees everything committed. A row counts as written
+   * once it is committed.
+   *
+   * Batches are sized in bytes, not rows. The size starts at batch_bytes,
+   * or from the server's innodb_log_buffer_size, and stays under its
+   * max_allowed_packet (LOAD DATA is streamed, so it is only held to
+   * MAX_STMT_BYTES). With adapt, every statement's rows and seconds go to
+   * a tuner::climber, which moves the size toward the most rows a second.
+   *
+   * With a dataset name the load is resumable. Rows go in through add_at()
+   * with their row number within the class (the file row, say), batches
+   * do not straddle work items (so a work item holds what fills a batch
+   * at the tuner's size, not batch_rows), and each batch is committed in
+   * its own transaction together with a load_checkpoints row naming its
+   * class and rows. After a crash, a loader under the same name reads the
+   * checkpoints: resume_from() says where the first missing rows are,
+   * and add_at() drops any rows already committed. A batch that was
+   * committed after all fails on the checkpoint's primary key and rolls
+   * back, so a rerun never doubles rows. (Only a reconnect in the middle
+   * of a batch, which leaves the connection in autocommit for the rest of
+   * it, can commit its rows and checkpoint apart; it is reported.)
+   */
+  class loader {
+  public:
+    loader(dbpool::pool &pool, const load_config &cfg)
+      : _pool(pool), _cfg(cfg), _cur(NULL), _inflight(0), _rows(0), _batches(0), _errors(0), _skipped(0), _stalled_s(0),
+        _finished(false), _resumable_ok(true), _row_bytes(0) {
+      if (_cfg.encoders == 0) _cfg.encoders = 1;
+      if (_cfg.writers == 0) _cfg.writers = 1;
+      if (_cfg.queue_slots == 0) _cfg.queue_slots = 1;
+      if (_cfg.batch_rows == 0) _cfg.batch_rows = 1;
+      if (_cfg.inflight && !async_supported(_cfg)) {
+        fprintf(stderr, "no nonblocking inserts for this mode or client library, using %u writer threads\n",
+                _cfg.writers);
+        _cfg.inflight = 0;
+      }
+      if (!_cfg.dataset.empty()) {
+        if (_cfg.txn_rows) {
+          fprintf(stderr, "resumable load: a transaction a batch, not every %lu rows\n", (unsigned long)_cfg.txn_rows);
+          _cfg.txn_rows = 0;
+        }
+        // read before the writers take their connections
+        _resumable_ok = create_checkpoint_table(_pool) && checkpoints(_pool, _cfg.dataset, &_done_ranges);
+        if (!_resumable_ok) {
+          fprintf(stderr, "resumable load: could not read %s, adding nothing\n", CHECKPOINT_TABLE);
+        }
+      }
+      _limits = read_limits(_pool);
+      size_t lo = MIN_STMT_BYTES, hi = MAX_STMT_BYTES;
+      if (_cfg.ingest == INGEST_INSERT) {
+        // room for the packet header and the statement around the rows
+        hi = _limits.max_allowed_packet > 4096 ? _limits.max_allowed_packet - 4096 : 4 * 1024 * 1024;
+        hi = std::min(MAX_STMT_BYTES, std::max(MIN_STMT_BYTES, hi));
+      }
+      size_t start = _cfg.batch_bytes;
+      if (!start) {
+        // a statement's redo should fit the log buffer a few times over
+        start = _limits.innodb_log_buffer_size ? _limits.innodb_log_buffer_size / 4 : DEFAULT_STMT_BYTES;
+      }
+      start = std::min(hi, std::max(lo, start));
+      if (!_cfg.adapt) {
+        lo = hi = start;
+      }
+      _tuner.reset(new tuner::climber(start, lo, hi));
+      const size_t n_work = _cfg.encoders + _cfg.queue_slots + 1;
+      const size_t n_batch = _cfg.encoders + (_cfg.inflight ? _cfg.inflight : _cfg.writers) + _cfg.queue_slots;
+      _work_store.resize(n_work);
+      _batch_store.resize(n_batch, batch(_cfg.mode, _cfg.ingest, _cfg.dtype));
+      _work_free.reset(new _queue<_work *>(n_work));
+      _todo.reset(new _queue<_work *>(n_work));
+      _batch_free.reset(new _queue<batch *>(n_batch));
+      _ready.reset(new _queue<batch *>(n_batch));
+      for (_work &w : _work_store) {
+        _work_free->push(&w);
+      }
+      for (batch &b : _batch_store) {
+        _batch_free->push(&b);
+      }
+      if (_cfg.disable_keys) {
+        _alter_keys("DISABLE");
+      }
+      unsigned int t = 0;
+      for (; t < _cfg.encoders; t++) {
+        _threads.push_back(std::thread(&loader::_encode_main, this));
+      }
+#ifdef VECDB_ASYNC
+      if (_cfg.inflight) {
+        _writers.push_back(std::thread(&loader::_async_main, this));
+      }
+#endif
+      for (t = 0; t < _cfg.writers && !_cfg.inflight; t++) {
+        _writers.push_back(std::thread(&loader::_write_main, this));
+      }
+    }
+
+    ~loader() { finish(); }
+
+    loader(const loader &) = delete;
+    loader &operator=(const loader &) = delete;
+
+    /* Copies n rows of dimension d; waits while the pipeline is full */
+    bool add(uint16_t op, uint16_t class_a, uint16_t class_b, const float *rows, size_t n, size_t d) {
+      if (!_cfg.dataset.empty()) {
+        fprintf(stderr, "resumable load: rows need their row numbers, add_at()\n");
+        return false;
+      }
+      return _add(op, class_a, class_b, 0, rows, n, d);
+    }
+
+    /*
+     * add() for a resumable load: the n rows are rows first, first + 1,
+     * ... of the class. Those already committed under the dataset are
+     * skipped (counted by skipped()).
+     */
+    bool add_at(uint16_t op, uint16_t class_a, uint16_t class_b, uint64_t first, const float *rows, size_t n,
+                size_t d) {
+      if (_cfg.dataset.empty()) {
+        return _add(op, class_a, class_b, first, rows, n, d);
+      }
+      if (!_resumable_ok) {
+        return false;
+      }
+      const std::vector<loaded_range> &done = _done_ranges[class_key(op, class_a, class_b)];
+      const uint64_t end = first + n;
+      uint64_t at = first;
+      for (const loaded_range &r : done) {
+        if (r.end <= at) {
+          continue;
+        }
+        if (r.first >= end) {
+          break;
+        }
+        if (r.first > at && !_add(op, class_a, class_b, at, rows + (at - first) * d, r.first - at, d)) {
+          return false;
+        }
+        const uint64_t skip_to = std::min(end, r.end);
+        _skipped += skip_to - std::max(at, r.first);
+        at = skip_to;
+      }
+      return at >= end || _add(op, class_a, class_b, at, rows + (at - first) * d, end - at, d);
+    }
+
+    /*
+     * Resumable loads: the first row of the class not yet committed under
+     * the dataset (0 for a fresh load), where the caller can start
+     * reading; ~0 if the checkpoints cannot be read.
+     */
+    uint64_t resume_from(uint16_t op, uint16_t class_a, uint16_t class_b) {
+      if (!_resumable_ok) {
+        return ~(uint64_t)0;
+      }
+      const std::vector<loaded_range> &done = _done_ranges[class_key(op, class_a, class_b)];
+      return !done.empty() && done.front().first == 0 ? done.front().end : 0;
+    }
+
+
+    /* Waits until every row added so far is written (or failed) */
+    void flush() {
+      _submit();
+      std::unique_lock<std::mutex> lock(_mtx);
+      _idle.wait(lock, [this]() { return _inflight == 0; });
+    }
+
+    /* flush(), then stop the threads. Returns true if no batch failed. */
+    bool finish() {
+      if (!_finished) {
+        flush();
+        _finished = true;
+        _todo->close();
+        for (std::thread &th : _threads) {
+          th.join();
+        }
+        _ready->close();
+        for (std::thread &th : _writers) {
+          th.join();
+        }
+        if (_cfg.disable_keys) {
+          _alter_keys("ENABLE");
+        }
+      }
+      return _errors == 0;
+    }
+
+    /* Rows written, statements (with txn_rows, transactions) that went
+     * through and that failed, rows add_at() found already loaded, and
+     * the seconds add() spent waiting for the pipeline to drain */
+    size_t rows() const { return _rows; }
+    size_t batches() const { return _batches; }
+    unsigned int errors() const { return _errors; }
+    size_t skipped() const { return _skipped; }
+    double stalled_seconds() const { return _stalled_s; }
+
+    /* The statement size batches are being built to now, and what the server said */
+    size_t stmt_bytes() const { return (size_t)_tuner->value(); }
+    const server_limits &limits() const { return _limits; }
+
+  private:
+    struct _work {
+      uint16_t op, class_a, class_b;
+      uint64_t first;  // row number of v's first row, for resumable loads
+      size_t d, n;
+      size_t cap;      // rows v has room for
+      double target;   // resumable: the statement size cap was worked out for
+      std::vector<float> v;
+    };
+
+    void _submit() {
+      if (!_cur) {
+        return;
+      }
+      if (_cur->n == 0) {
+        _work_free->push(_cur);
+      } else {
+        {
+          std::lock_guard<std::mutex> lock(_mtx);
+          _inflight += _cur->n;
+        }
+        const double t0 = _now();
+        _todo->push(_cur);
+        _stalled_s += _now() - t0;
+      }
+      _cur = NULL;
+    }
+
+    bool _add(uint16_t op, uint16_t class_a, uint16_t class_b, uint64_t first, const float *rows, size_t n, size_t d) {
+      if (_finished) {
+        return false;
+      }
+      while (n > 0) {
+        if (_cur && (_cur->d != d || _cur->op != op || _cur->class_a != class_a || _cur->class_b != class_b ||
+                     (!_cfg.dataset.empty() && _cur->first + _cur->n != first))) {
+          _submit();
+        }
+        if (!_cur) {
+          const double t0 = _now();
+          if (!_work_free->pop(&_cur)) {
+            return false;
+          }
+          _stalled_s += _now() - t0;
+          _cur->op = op;
+          _cur->class_a = class_a;
+          _cur->class_b = class_b;
+          _cur->d = d;
+          _cur->first = first;
+          _cur->n = 0;
+          _cur->target = _tuner->value();
+          _cur->cap = _cfg.dataset.empty() ? _cfg.batch_rows : _work_rows(_cur->target, d);
+          _cur->v.resize(_cur->cap * d);
+        }
+        size_t take = _cur->cap - _cur->n;
+        if (take > n) {
+          take = n;
+        }
+        memcpy(_cur->v.data() + _cur->n * d, rows, take * d * sizeof(float));
+        _cur->n += take;
+        rows += take * d;
+        first += take;
+        n -= take;
+        if (_cur->n == _cur->cap) {
+          _submit();
+        }
+      }
+      return true;
+    }
+
+    /*
+     * Rows of d floats for a resumable load's work item to fill a batch
+     * of target bytes, going by what a row took of the last batch. A
+     * little short, as rows differ a little in size, so the batch ends
+     * with the work item rather than leaving a row or two to a batch of
+     * their own.
+     */
+    size_t _work_rows(double target, size_t d) const {
+      size_t row = _row_bytes.load(std::memory_order_relaxed);
+      if (!row) {
+        row = quant::bytes(_cfg.dtype, d);
+      }
+      size_t n = (size_t)target / row;
+      n -= n / 32;
+      if (_cfg.mode == STORE_BLOB && _cfg.ingest == INGEST_INSERT) {
+        n = std::min(n, (size_t)MAX_BLOB_BATCH);
+      }
+      return std::max(n, (size_t)1);
+    }
+
+    void _done(size_t rows, bool ok) {
+      std::lock_guard<std::mutex> lock(_mtx);
+      if (ok) {
+        _rows += rows;
+        _batches++;
+      } else {
+        _errors++;
+      }
+      _inflight -= rows;
+      if (_inflight == 0) {
+        _idle.notify_all();
+      }
+    }
+
+    /*
+     * A batch can take rows from several work items, so it gets as big as
+     * the tuner says whatever batch_rows is. When no work is waiting the
+     * part full batch goes out rather than sitting here through a flush();
+     * it is not a measurement of the size it was meant to be. In a
+     * resumable load a batch is a run of rows of one class, so it ends
+     * with its work item; it counts as full if it holds the whole of a
+     * full work item sized for its target.
+     */
+    void _encode_main() {
+      _work *w;
+      batch *b = NULL;
+      for (;;) {
+        if (!_todo->try_pop(&w)) {
+          if (b) {
+            b->target = 0;
+            _ready->push(b);
+            b = NULL;
+          }
+          if (!_todo->pop(&w)) {
+            break;
+          }
+        }
+        size_t i = 0;
+        while (i < w->n) {
+          if (!b) {
+            _batch_free->pop(&b);
+            b->clear();
+            b->target = _tuner->value();
+            b->max_bytes = (size_t)b->target;
+            b->first = w->first + i;
+            b->op = w->op;
+            b->class_a = w->class_a;
+            b->class_b = w->class_b;
+          }
+          timing::scope t(_st().encode);
+          if (b->add(w->op, w->class_a, w->class_b, w->v.data() + i * w->d, w->d)) {
+            t.add(w->d * sizeof(float), 1);
+            i++;
+          } else if (b->rows == 0) {
+            // a row no statement can take
+            _done(1, false);
+            i++;
+          } else {
+            _row_bytes.store(b->bytes() / b->rows, std::memory_order_relaxed);
+            _ready->push(b);
+            b = NULL;
+          }
+        }
+        if (b && !_cfg.dataset.empty()) {
+          if (b->rows) {
+            _row_bytes.store(b->bytes() / b->rows, std::memory_order_relaxed);
+          }
+          if (b->first != w->first || w->n != w->cap || w->target != b->target) {
+            b->target = 0;
+          }
+          _ready->push(b);
+          b = NULL;
+        }
+        _work_free->push(w);
+      }
+    }
+
+    /* Hands the tuner a statement's rows and seconds, if it was a full one */
+    void _measured(const batch *b, size_t rows, double secs, bool ok) {
+      if (ok && b->target > 0) {
+        _tuner->observe(b->target, rows, secs);
+      }
+    }
+
+    void _alter_keys(const char *how) {
+      std::string q = std::string("ALTER TABLE ") + (_cfg.mode == STORE_BLOB ? BLOB_TABLE : JSON_TABLE) + " " + how + " KEYS";
+      dbpool::lease conn = _pool.borrow();
+      if (conn) {
+        (void)conn.query(q.c_str());
+      }
+    }
+
+    /* Session settings for a writer's connection, on or back off */
+    void _session(dbpool::lease &conn, bool on) {
+      if (!conn) {
+        return;
+      }
+      if (_cfg.txn_rows || !_cfg.dataset.empty()) {
+        mysql_autocommit(conn.mysql(), on ? 0 : 1);
+      }
+      if (_cfg.disable_keys) {
+        (void)conn.query(on ? "SET unique_checks = 0, foreign_key_checks = 0"
+                            : "SET unique_checks = 1, foreign_key_checks = 1");
+      }
+    }
+
+    bool _commit(dbpool::lease &conn) {
+      timing::scope t(_st().commit);
+      if (!conn || mysql_commit(conn.mysql()) != 0) {
+        fprintf(stderr, "commit failed: %s\n", conn ? mysql_error(conn.mysql()) : "no connection");
+        return false;
+      }
+      return true;
+    }
+
+    /* The load_checkpoints row of a resumable load's batch, in its transaction */
+    bool _checkpoint(dbpool::lease &conn, const batch *b) {
+      char sql[160];
+      snprintf(sql, sizeof(sql), "INSERT INTO %s (dataset, op16, cla16, clb16, first, n) VALUES (?, ?, ?, ?, ?, ?)",
+               CHECKPOINT_TABLE);
+      MYSQL_STMT *stmt = conn.prepare(sql);
+      if (!stmt) {
+        return false;
+      }
+      unsigned long name_len = _cfg.dataset.size();
+      uint16_t keys[3] = { b->op, b->class_a, b->class_b };
+      uint64_t range[2] = { b->first, b->rows };
+      MYSQL_BIND params[6];
+      _bind_blob(&params[0], (void *)_cfg.dataset.data(), name_len, &name_len);
+      _bind_u16(&params[1], &keys[0]);
+      _bind_u16(&params[2], &keys[1]);
+      _bind_u16(&params[3], &keys[2]);
+      _bind_u64(&params[4], &range[0]);
+      _bind_u64(&params[5], &range[1]);
+      if (mysql_stmt_bind_param(stmt, params) || mysql_stmt_execute(stmt)) {
+        // 1062, ER_DUP_ENTRY: a rerun of a batch that was committed after all
+        fprintf(stderr, "checkpoint of rows %llu..%llu of class %u/%u/%u failed%s: %s\n",
+                (unsigned long long)b->first, (unsigned long long)(b->first + b->rows - 1), (unsigned int)b->op,
+                (unsigned int)b->class_a, (unsigned int)b->class_b,
+                mysql_stmt_errno(stmt) == 1062 ? ", already loaded" : "", mysql_stmt_error(stmt));
+        return false;
+      }
+      return true;
+    }
+
+    /*
+     * A resumable load's batch: its rows and its checkpoint in one
+     * transaction, committed, or rolled back if either fails. gen is the
+     * writer's, as for _sent().
+     */
+    bool _write_checkpointed(dbpool::lease &conn, batch *b, std::vector<MYSQL_BIND> *binds, unsigned int *gen) {
+      // remake a broken connection first, so the batch starts in a transaction
+      if (!conn || !conn.ready()) {
+        return false;
+      }
+      if (conn.generation() != *gen) {
+        _session(conn, true);
+        *gen = conn.generation();
+      }
+      bool ok = b->write(conn, binds) && _checkpoint(conn, b);
+      if (conn.generation() != *gen) {
+        // remade on the way, and what ran after that ran in autocommit
+        fprintf(stderr, "connection remade during rows %llu.. of class %u/%u/%u, they may be in without their "
+                "checkpoint\n", (unsigned long long)b->first, (unsigned int)b->op, (unsigned int)b->class_a,
+                (unsigned int)b->class_b);
+        _session(conn, true);
+        *gen = conn.generation();
+      }
+      if (ok) {
+        ok = _commit(conn);
+      } else {
+        (void)mysql_rollback(conn.mysql());
+      }
+      return ok;
+    }
+
+    /*
+     * Counts rows a writer sent on conn, committing every txn_rows. gen
+     * and txn_rows are the writer's: the connection generation its
+     * session settings are on, and its rows sent but not yet committed.
+     */
+    void _sent(dbpool::lease &conn, unsigned int *gen, size_t *txn_rows, size_t rows, bool ok) {
+      if (conn && conn.generation() != *gen) {
+        // remade during the write: the open transaction went with the
+        // old connection, and this batch ran without the session settings
+        if (*txn_rows > 0) {
+          fprintf(stderr, "connection lost, %lu uncommitted rows dropped\n", (unsigned long)*txn_rows);
+          _done(*txn_rows, false);
+          *txn_rows = 0;
+        }
+        _done(rows, ok);
+        _session(conn, true);
+        *gen = conn.generation();
+      } else if (ok && _cfg.txn_rows) {
+        *txn_rows += rows;
+        if (*txn_rows >= _cfg.txn_rows) {
+          _done(*txn_rows, _commit(conn));
+          *txn_rows = 0;
+        }
+      } else {
+        _done(rows, ok);
+      }
+    }
+
+    void _write_main() {
+      mysql_thread_init();
+      {
+        dbpool::lease conn = _pool.borrow();
+        std::vector<MYSQL_BIND> binds;
+        unsigned int gen = 0;
+        size_t txn_rows = 0;  // sent but not yet committed
+        batch *b;
+        for (;;) {
+          bool got = _ready->try_pop(&b);
+          if (!got && txn_rows > 0) {
+            // nothing waiting, commit rather than hold rows back from flush()
+            _done(txn_rows, _commit(conn));
+            txn_rows = 0;
+          }
+          if (!got) {
+            timing::scope t(_st().writer_wait);
+            if (!_ready->pop(&b)) {
+              break;
+            }
+          }
+          if (conn && conn.generation() != gen) {
+            _session(conn, true);
+            gen = conn.generation();
+          }
+          const double t0 = _now();
+          const bool ok = _cfg.dataset.empty() ? conn && b->write(conn, &binds)
+                                               : _write_checkpointed(conn, b, &binds, &gen);
+          const size_t rows = b->rows;
+          _measured(b, rows, _now() - t0, ok);
+          b->clear();
+          _batch_free->push(b);
+          if (_cfg.dataset.empty()) {
+            _sent(conn, &gen, &txn_rows, rows, ok);
+          } else {
+            _done(rows, ok);
+          }
+        }
+        if (txn_rows > 0) {
+          _done(txn_rows, _commit(conn));
+        }
+        _session(conn, false);
+      }
+      mysql_thread_end();
+    }
+
+#ifdef VECDB_ASYNC
+    /* A connection of the async writer and the statement it has going */
+    struct _flight {
+      dbpool::lease conn;
+      batch *b;
+      unsigned int gen;
+      size_t txn_rows;
+      double t0;
+      std::unique_ptr<timing::scope> timer;
+      _flight() : b(NULL), gen(0), txn_rows(0), t0(0) {}
+    };
+
+    /* Sends b's statement on f's connection, or as much of it as goes without waiting */
+    void _start(_flight &f, batch *b) {
+      f.b = b;
+      if (f.conn && f.conn.ready() && f.conn.generation() != f.gen) {
+        _session(f.conn, true);
+        f.gen = f.conn.generation();
+      }
+      f.t0 = _now();
+      f.timer.reset(new timing::scope(_st().insert_async));
+      f.timer->add(b->sql.size(), b->rows);
+      _step(f);
+    }
+
+    /* Moves f's statement along; once it is done the batch is counted and goes back to the encoders */
+    void _step(_flight &f) {
+      bool ok = false;
+      if (f.conn && f.conn.ready()) {
+        const net_async_status st = mysql_real_query_nonblocking(f.conn.mysql(), f.b->sql.data(), f.b->sql.size());
+        if (st == NET_ASYNC_NOT_READY) {
+          return;
+        }
+        ok = st != NET_ASYNC_ERROR;
+        if (!ok) {
+          const unsigned int err = mysql_errno(f.conn.mysql());
+          fprintf(stderr, "query failed: %u %s\n", err, mysql_error(f.conn.mysql()));
+          if (err == CR_SERVER_GONE_ERROR) {
+            // never sent: send it again, blocking, on a new connection
+            f.conn.broken();
+            ok = f.b->write(f.conn, NULL);
+          } else if (err == CR_SERVER_LOST) {
+            f.conn.broken();
+          }
+        }
+      }
+      f.timer.reset();
+      const size_t rows = f.b->rows;
+      // with several going at once this is latency, not a share of the
+      // writer; rows a second still peak where latency a row is least
+      _measured(f.b, rows, _now() - f.t0, ok);
+      f.b->clear();
+      _batch_free->push(f.b);
+      f.b = NULL;
+      _sent(f.conn, &f.gen, &f.txn_rows, rows, ok);
+    }
+
+    /*
+     * The writer when inflight > 0: one thread keeps up to inflight
+     * INSERTs going at once, each on its own pooled connection, through
+     * mysql_real_query_nonblocking(). The next statements are on their way
+     * while the server runs one, and the encoders fill the batches after
+     * them; a batch goes back to the encoders only when its statement is
+     * done. Commits (txn_rows) are made blocking, as the writer threads do.
+     */
+    void _async_main() {
+      mysql_thread_init();
+      {
+        std::vector<_flight> flights(_cfg.inflight);
+        for (_flight &f : flights) {
+          f.conn = _pool.borrow();
+        }
+        std::vector<struct pollfd> fds;
+        for (;;) {
+          size_t busy = 0;
+          for (_flight &f : flights) {
+            batch *b;
+            if (!f.b && _ready->try_pop(&b)) {
+              _start(f, b);
+            }
+            busy += f.b != NULL;
+          }
+          if (busy == 0) {
+            // nothing going and nothing waiting: commit rather than hold rows back from flush()
+            for (_flight &f : flights) {
+              if (f.txn_rows > 0) {
+                _done(f.txn_rows, _commit(f.conn));
+                f.txn_rows = 0;
+              }
+            }
+            batch *b;
+            timing::scope t(_st().writer_wait);
+            if (!_ready->pop(&b)) {
+              break;
+            }
+            t.stop();
+            _start(flights[0], b);
+            continue;
+          }
+          // until a reply comes in, or a millisecond to take new batches or push a long statement along
+          fds.clear();
+          for (_flight &f : flights) {
+            if (f.b) {
+              struct pollfd p = { f.conn.mysql()->net.fd, POLLIN, 0 };
+              fds.push_back(p);
+            }
+          }
+          (void)poll(fds.data(), fds.size(), 1);
+          for (_flight &f : flights) {
+            if (f.b) {
+              _step(f);
+            }
+          }
+        }
+        for (_flight &f : flights) {
+          if (f.txn_rows > 0) {
+            _done(f.txn_rows, _commit(f.conn));
+          }
+          _session(f.conn, false);
+        }
+      }
+      mysql_thread_end();
+    }
+#endif
+
+    dbpool::pool &_pool;
+    load_config _cfg;
+    std::vector<_work> _work_store;
+    std::vector<batch> _batch_store;
+    std::unique_ptr<_queue<_work *>> _work_free;
+    std::unique_ptr<_queue<_work *>> _todo;
+    std::unique_ptr<_queue<batch *>> _batch_free;
+    std::unique_ptr<_queue<batch *>> _ready;
+    std::unique_ptr<tuner::climber> _tuner;
+    server_limits _limits;
+    std::vector<std::thread> _threads;
+    std::vector<std::thread> _writers;
+    _work *_cur;
+    std::mutex _mtx;
+    std::condition_variable _idle;
+    size_t _inflight;
+    size_t _rows;
+    size_t _batches;
+    unsigned int _errors;
+    size_t _skipped;
+    double _stalled_s;
+    bool _finished;
+    bool _resumable_ok;
+    std::atomic<size_t> _row_bytes;  // resumable: what a row took of the last batch, 0 before one
+    loaded_map _done_ranges;    // resumable: rows committed before this loader, read when it starts
+  };
+
+  /* The rows a retrieval is after: one op and class pair, within an id range */
+  struct selection {
+    store_mode mode;
+    quant::dtype dtype;  // what STORE_BLOB rows were stored as; JSON rows carry their own
+    uint16_t op;
+    uint16_t class_a;
+    uint16_t class_b;
+    uint64_t id_lo;   // inclusive
+    uint64_t id_hi;   // inclusive
+    selection(store_mode m, uint16_t o, uint16_t a, uint16_t b)
+      : mode(m), dtype(quant::DT_F32), op(o), class_a(a), class_b(b), id_lo(0), id_hi(~(uint64_t)0) {}
+
+    const char *table() const { return mode == STORE_BLOB ? BLOB_TABLE : JSON_TABLE; }
+
+    /* The WHERE clause, values inline */
+    std::string where() const {
+      char w[192];
+      snprintf(w, sizeof(w), "WHERE op16 = %u AND cla16 = %u AND clb16 = %u AND id BETWEEN %llu AND %llu",
+               (unsigned int)op, (unsigned int)class_a, (unsigned int)class_b, (unsigned long long)id_lo,
+               (unsigned long long)id_hi);
+      return w;
+    }
+  };
+
+  /* COUNT(*), MIN(id), MAX(id) of a selection; false if the query fails */
+  inline bool count(dbpool::pool &pool, const selection &sel, size_t *n, uint64_t *lo = NULL, uint64_t *hi = NULL) {
+    std::string q = std::string("SELECT COUNT(*), MIN(id), MAX(id) FROM ") + sel.table() + " " + sel.where();
+    dbpool::lease conn = pool.borrow();
+    MYSQL_RES *res = conn && conn.query(q.c_str()) ? mysql_store_result(conn.mysql()) : NULL;
+    MYSQL_ROW row = res ? mysql_fetch_row(res) : NULL;
+    if (row) {
+      *n = row[0] ? strtoull(row[0], NULL, 10) : 0;
+      if (lo) {
+        *lo = row[1] ? strtoull(row[1], NULL, 10) : 0;
+      }
+      if (hi) {
+        *hi = row[2] ? strtoull(row[2], NULL, 10) : 0;
+      }
+    }
+    if (res) {
+      mysql_free_result(res);
+    }
+    return row != NULL;
+  }
+
+  /* Who each retrieved row is: its id and class tags */
+  struct rows_info {
+    std::vector<uint64_t> ids;
+    std::vector<uint16_t> op;
+    std::vector<uint16_t> class_a;
+    std::vector<uint16_t> class_b;
+
+    void clear() {
+      ids.clear();
+      op.clear();
+      class_a.clear();
+      class_b.clear();
+    }
+
+    void push(uint64_t id, uint16_t o, uint16_t a, uint16_t b) {
+      ids.push_back(id);
+      op.push_back(o);
+      class_a.push_back(a);
+      class_b.push_back(b);
+    }
+
+    void append(const rows_info &o) {
+      ids.insert(ids.end(), o.ids.begin(), o.ids.end());
+      op.insert(op.end(), o.op.begin(), o.op.end());
+      class_a.insert(class_a.end(), o.class_a.begin(), o.class_a.end());
+      class_b.insert(class_b.end(), o.class_b.begin(), o.class_b.end());
+    }
+  };
+
+  /* The envelope's payload, in dtype t, as d floats at out */
+  inline bool _decode_row(const envelope::view &env, quant::dtype t, size_t d, float *out, std::vector<char> *packed) {
+    if (t == quant::DT_F32) {
+      return envelope::decode(env, out, d * sizeof(float));
+    }
+    packed->resize(quant::bytes(t, d));
+    if (!envelope::decode(env, packed->data(), packed->size())) {
+      return false;
+    }
+    quant::decode(t, packed->data(), d, out);
+    return true;
+  }
+
+  /* Called as rows land in the matrix: rows [first, first + count) are usable */
+  typedef std::function<void (size_t first, size_t count)> rows_ready;
+
+  /*
+   * Streams every vector of the selection, of dimension d, in id order,
+   * into dst, a caller owned (malloc'd, mmap'd, ...) float[max_rows * d].
+   * The rows come off the socket one at a time (mysql_use_result, or an
+   * unbuffered prepared statement for STORE_BLOB) and are decoded or
+   * fetched straight into their row of dst, so nothing but dst and info
+   * grows with the result. ready, if given, is called every ready_rows
+   * rows and at the end, so the first rows can be used while the rest are
+   * still coming. Rows stored in a smaller dtype are widened back to
+   * float as they land. Returns the number of rows, or -1 on a bad row, a
+   * failed query, or more than max_rows rows.
+   */
+  inline long select_into(dbpool::pool &pool, const selection &sel, size_t d, float *dst, size_t max_rows,
+                          rows_info *info,
+                          const rows_ready &ready = rows_ready(), size_t ready_rows = 4096) {
+    if (info) {
+      info->clear();
+    }
+    dbpool::lease conn = pool.borrow();
+    if (!conn) {
+      return -1;
+    }
+    long rows = 0;
+    size_t told = 0;
+    if (sel.mode == STORE_JSON) {
+      std::string sql = std::string("SELECT id, op16, cla16, clb16, jstr60k FROM ") + JSON_TABLE + " " + sel.where() +
+        " ORDER BY id";
+      timing::scope tq(_st().query);
+      MYSQL_RES *res = conn.query(sql.c_str()) ? mysql_use_result(conn.mysql()) : NULL;
+      tq.stop();
+      if (!res) {
+        fprintf(stderr, "retrieve from %s failed: %s\n", JSON_TABLE, mysql_error(conn.mysql()));
+        return -1;
+      }
+      MYSQL_ROW row;
+      envelope::view env;
+      std::string spill;
+      std::vector<char> packed;
+      for (;;) {
+        timing::scope tf(_st().fetch);
+        if ((row = mysql_fetch_row(res)) == NULL) {
+          break;
+        }
+        const unsigned long *lens = mysql_fetch_lengths(res);
+        tf.add(lens[4], 1);
+        tf.stop();
+        if ((size_t)rows >= max_rows) {
+          fprintf(stderr, "retrieve from %s: more than %lu rows\n", JSON_TABLE, (unsigned long)max_rows);
+          rows = -1;
+          break;
+        }
+        quant::dtype t = quant::DT_F32;
+        timing::scope tp(_st().parse);
+        const bool parsed = row[4] && envelope::parse(row[4], lens[4], &env, &spill) && (!env.f.dim || env.f.dim == d) &&
+          (!env.f.dtype[0] || quant::from_name(env.f.dtype, &t));
+        tp.stop();
+        timing::scope td(_st().decode);
+        td.add(d * sizeof(float), 1);
+        if (!parsed || !_decode_row(env, t, d, dst + rows * d, &packed)) {
+          fprintf(stderr, "retrieve from %s: row %ld is not a vector of dimension %lu\n", JSON_TABLE, rows,
+                  (unsigned long)d);
+          rows = -1;
+          break;
+        }
+        td.stop();
+        if (info) {
+          info->push(strtoull(row[0], NULL, 10), atoi(row[1]), atoi(row[2]), atoi(row[3]));
+        }
+        rows++;
+        if (ready && rows - told >= ready_rows) {
+          ready(told, rows - told);
+          told = rows;
+        }
+      }
+      if (rows >= 0 && mysql_errno(conn.mysql())) {
+        fprintf(stderr, "retrieve from %s failed: %s\n", JSON_TABLE, mysql_error(conn.mysql()));
+        rows = -1;
+      }
+      // frees (and on an early stop, drains) the rest of the result
+      mysql_free_result(res);
+    } else {
+      // f32 rows are fetched straight into dst, others into spill and decoded from there
+      const size_t row_bytes = quant::bytes(sel.dtype, d);
+      const bool direct = sel.dtype == quant::DT_F32;
+      if (row_bytes > MAX_BLOB_BYTES) {
+        fprintf(stderr, "retrieve from %s: %lu byte rows do not fit the column\n", BLOB_TABLE, (unsigned long)row_bytes);
+        return -1;
+      }
+      char sql[256];
+      snprintf(sql, sizeof(sql), "SELECT id, op16, cla16, clb16, vec FROM %s WHERE op16 = ? AND cla16 = ? AND clb16 = ? "
+               "AND id BETWEEN ? AND ? ORDER BY id", BLOB_TABLE);
+      MYSQL_STMT *stmt = conn.prepare(sql);
+      if (!stmt) {
+        return -1;
+      }
+      uint16_t keys[3] = { sel.op, sel.class_a, sel.class_b };
+      uint64_t range[2] = { sel.id_lo, sel.id_hi };
+      MYSQL_BIND params[5];
+      _bind_u16(&params[0], &keys[0]);
+      _bind_u16(&params[1], &keys[1]);
+      _bind_u16(&params[2], &keys[2]);
+      _bind_u64(&params[3], &range[0]);
+      _bind_u64(&params[4], &range[1]);
+      // no mysql_stmt_store_result(): each fetch reads the next row off the socket
+      timing::scope tq(_st().query);
+      if (mysql_stmt_bind_param(stmt, params) || mysql_stmt_execute(stmt)) {
+        fprintf(stderr, "retrieve from %s failed: %s\n", BLOB_TABLE, mysql_stmt_error(stmt));
+        conn.broken();
+        return -1;
+      }
+      tq.stop();
+      uint64_t id;
+      uint16_t tags[3];
+      unsigned long len = 0;
+      float spill[MAX_BLOB_BYTES / sizeof(float)];
+      MYSQL_BIND cols[5];
+      _bind_u64(&cols[0], &id);
+      _bind_u16(&cols[1], &tags[0]);
+      _bind_u16(&cols[2], &tags[1]);
+      _bind_u16(&cols[3], &tags[2]);
+      for (;;) {
+        // point the vector column at the row's place in dst, the fetch copies there
+        if ((size_t)rows < max_rows && direct) {
+          _bind_blob(&cols[4], dst + rows * d, row_bytes, &len);
+        } else {
+          _bind_blob(&cols[4], spill, sizeof(spill), &len);
+        }
+        if (mysql_stmt_bind_result(stmt, cols)) {
+          rows = -1;
+          break;
+        }
+        timing::scope tf(_st().fetch);
+        const int rc = mysql_stmt_fetch(stmt);
+        if (rc == MYSQL_NO_DATA) {
+          break;
+        }
+        tf.add(len, 1);
+        tf.stop();
+        if (rc == 1) {
+          fprintf(stderr, "retrieve from %s failed: %s\n", BLOB_TABLE, mysql_stmt_error(stmt));
+          rows = -1;
+          break;
+        }
+        if ((size_t)rows >= max_rows) {
+          fprintf(stderr, "retrieve from %s: more than %lu rows\n", BLOB_TABLE, (unsigned long)max_rows);
+          rows = -1;
+          break;
+        }
+        if (rc == MYSQL_DATA_TRUNCATED || len != row_bytes) {
+          fprintf(stderr, "retrieve from %s: row %ld is %lu bytes, expected %lu\n", BLOB_TABLE, rows, len,
+                  (unsigned long)row_bytes);
+          rows = -1;
+          break;
+        }
+        if (!direct) {
+          timing::scope td(_st().decode);
+          td.add(d * sizeof(float), 1);
+          quant::decode(sel.dtype, spill, d, dst + rows * d);
+        }
+        if (info) {
+          info->push(id, tags[0], tags[1], tags[2]);
+        }
+        rows++;
+        if (ready && rows - told >= ready_rows) {
+          ready(told, rows - told);
+          told = rows;
+        }
+      }
+      // drains whatever was not fetched
+      mysql_stmt_free_result(stmt);
+    }
+    if (rows > 0 && ready && (size_t)rows > told) {
+      ready(told, rows - told);
+    }
+    return rows;
+  }
+
+  /*
+   * select_into() split over parts id ranges, each fetched on its own
+   * pooled connection and thread into its own slice of dst, so a reload is
+   * bound by the connections and cores rather than one socket and one
+   * decode thread. The ranges are equal slices of [MIN(id), MAX(id)] of
+   * the selection, each counted first to place its slice; rows added to
+   * the selection in the meantime make the fetch fail. ready may be called
+   * from any of the threads, one at a time. info, if given, is in id order.
+   */
+  inline long select_parallel(dbpool::pool &pool, const selection &sel, size_t d, float *dst, size_t max_rows,
+                              rows_info *info, unsigned int parts,
+                              const rows_ready &ready = rows_ready(), size_t ready_rows = 4096) {
+    if (info) {
+      info->clear();
+    }
+    size_t n;
+    uint64_t lo, hi;
+    if (!count(pool, sel, &n, &lo, &hi)) {
+      return -1;
+    }
+    if (n > max_rows) {
+      fprintf(stderr, "retrieve from %s: %lu rows, room for %lu\n", sel.table(), (unsigned long)n,
+              (unsigned long)max_rows);
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (parts == 0) {
+      parts = 1;
+    }
+    if (parts > n) {
+      parts = n;
+    }
+    std::vector<selection> part(parts, sel);
+    std::vector<size_t> first(parts + 1, 0);
+    const uint64_t width = (hi - lo) / parts + 1;
+    unsigned int k = 0;
+    for (; k < parts; k++) {
+      part[k].id_lo = lo + k * width;
+      part[k].id_hi = k + 1 == parts ? hi : lo + (k + 1) * width - 1;
+      size_t part_n;
+      if (!count(pool, part[k], &part_n)) {
+        return -1;
+      }
+      first[k + 1] = first[k] + part_n;
+    }
+    if (first[parts] > max_rows) {
+      return -1;
+    }
+    std::vector<long> got(parts, -1);
+    std::vector<rows_info> part_info(info ? parts : 0);
+    std::mutex ready_mtx;
+    std::vector<std::thread> threads;
+    for (k = 0; k < parts; k++) {
+      threads.push_back(std::thread([&, k]() {
+            mysql_thread_init();
+            rows_ready part_ready;
+            if (ready) {
+              part_ready = [&, k](size_t f, size_t c) {
+                std::lock_guard<std::mutex> lock(ready_mtx);
+                ready(first[k] + f, c);
+              };
+            }
+            got[k] = select_into(pool, part[k], d, dst + first[k] * d, first[k + 1] - first[k],
+                                 info ? &part_info[k] : NULL, part_ready, ready_rows);
+            mysql_thread_end();
+          }));
+    }
+    for (std::thread &th : threads) {
+      th.join();
+    }
+    long rows = 0;
+    for (k = 0; k < parts; k++) {
+      if (got[k] != (long)(first[k + 1] - first[k])) {
+        fprintf(stderr, "retrieve of ids %llu..%llu from %s got %ld of %lu rows\n",
+                (unsigned long long)part[k].id_lo, (unsigned long long)part[k].id_hi, sel.table(), got[k],
+                (unsigned long)(first[k + 1] - first[k]));
+        return -1;
+      }
+      rows += got[k];
+      if (info) {
+        info->append(part_info[k]);
+      }
+    }
+    return rows;
+  }
+}
+#endif // __vecdb_hpp__
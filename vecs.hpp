@@ -0,0 +1,386 @@
+#ifndef __vecs_hpp__
+#define __vecs_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+ * Zero copy views of the texmex vector files (http://corpus-texmex.irisa.fr/):
+ * fvecs (float), ivecs (int32) and bvecs (uint8). Every row is a 32 bit
+ * dimension followed by the vector, so the file is mapped read only and
+ * shared and row(i) points straight into it, stride() elements apart.
+ * Nothing is read until it is touched, and every process mapping the same
+ * file shares one copy in the page cache.
+ */
+namespace vecs {
+  enum flags {
+    ADVISE_NORMAL = 0,
+    ADVISE_SEQUENTIAL = 1 << 0,  // MADV_SEQUENTIAL: read ahead hard, drop behind
+    ADVISE_RANDOM = 1 << 1,      // MADV_RANDOM: no read ahead
+    ADVISE_WILLNEED = 1 << 2,    // MADV_WILLNEED: start reading it all in now
+    ADVISE_HUGEPAGE = 1 << 3,    // MADV_HUGEPAGE, where the kernel does it for files
+    MAP_PREFAULT = 1 << 4,       // MAP_POPULATE: fault everything in at open
+    CHECK_ALL_ROWS = 1 << 5      // check every row's dimension, touches the whole file
+  };
+
+  const int32_t MAX_DIM = 1000000;
+
+  template <typename T>
+  class mapped {
+  public:
+    mapped() : _base(NULL), _len(0), _d(0), _n(0), _row_bytes(0) {}
+    explicit mapped(const char *fname, unsigned flags = ADVISE_SEQUENTIAL) : mapped() {
+      open(fname, flags);
+    }
+    ~mapped() { close(); }
+    mapped(const mapped &) = delete;
+    mapped &operator=(const mapped &) = delete;
+    mapped(mapped &&o) : _base(o._base), _len(o._len), _d(o._d), _n(o._n), _row_bytes(o._row_bytes) {
+      o._base = NULL;
+      o._len = 0;
+    }
+
+    /* Map fname; on failure says why on stderr and returns false */
+    bool open(const char *fname, unsigned flags = ADVISE_SEQUENTIAL) {
+      close();
+      int fd = ::open(fname, O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "could not open %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      struct stat st;
+      int32_t d = 0;
+      if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "could not stat %s: %s\n", fname, strerror(errno));
+        ::close(fd);
+        return false;
+      }
+      if (pread(fd, &d, sizeof(d), 0) != (ssize_t)sizeof(d)) {
+        fprintf(stderr, "%s: too short to hold a row\n", fname);
+        ::close(fd);
+        return false;
+      }
+      if (d <= 0 || d >= MAX_DIM) {
+        fprintf(stderr, "%s: unreasonable dimension %d\n", fname, d);
+        ::close(fd);
+        return false;
+      }
+      const size_t row_bytes = sizeof(int32_t) + d * sizeof(T);
+      if ((size_t)st.st_size % row_bytes != 0) {
+        fprintf(stderr, "%s: size %ld is not a whole number of %zu byte rows, wrong type?\n",
+                fname, (long)st.st_size, row_bytes);
+        ::close(fd);
+        return false;
+      }
+      void *base = mmap(NULL, st.st_size, PROT_READ,
+                        MAP_SHARED | ((flags & MAP_PREFAULT) ? MAP_POPULATE : 0), fd, 0);
+      ::close(fd);
+      if (base == MAP_FAILED) {
+        fprintf(stderr, "could not map %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      _base = (const uint8_t *)base;
+      _len = st.st_size;
+      _d = d;
+      _n = _len / row_bytes;
+      _row_bytes = row_bytes;
+      advise(flags);
+      /* a file of another type rarely has a matching header at the end
+       * as well as the start, but look at every row if asked */
+      size_t i = (flags & CHECK_ALL_ROWS) ? 0 : _n - 1;
+      for (; i < _n; i++) {
+        if (dim_of(i) != d) {
+          fprintf(stderr, "%s: row %zu has dimension %d, expected %d\n", fname, i, dim_of(i), d);
+          close();
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void close() {
+      if (_base) {
+        munmap((void *)_base, _len);
+      }
+      _base = NULL;
+      _len = 0;
+      _d = _n = _row_bytes = 0;
+    }
+
+    /* madvise() the rows [first, first + count) */
+    bool advise(unsigned flags, size_t first = 0, size_t count = ~(size_t)0) {
+      if (!_base || first >= _n) {
+        return false;
+      }
+      if (count > _n - first) {
+        count = _n - first;
+      }
+      const size_t page = sysconf(_SC_PAGESIZE);
+      const size_t from = (first * _row_bytes) & ~(page - 1);
+      const size_t to = (first + count) * _row_bytes;
+      void *addr = (void *)(_base + from);
+      bool ok = true;
+      if (flags & ADVISE_SEQUENTIAL) ok &= madvise(addr, to - from, MADV_SEQUENTIAL) == 0;
+      if (flags & ADVISE_RANDOM) ok &= madvise(addr, to - from, MADV_RANDOM) == 0;
+      if (flags & ADVISE_WILLNEED) ok &= madvise(addr, to - from, MADV_WILLNEED) == 0;
+#ifdef MADV_HUGEPAGE
+      /* only a hint, refused by kernels without huge pages for files */
+      if (flags & ADVISE_HUGEPAGE) (void)madvise(addr, to - from, MADV_HUGEPAGE);
+#endif
+      return ok;
+    }
+
+    bool is_open() const { return _base != NULL; }
+    size_t d() const { return _d; }
+    size_t n() const { return _n; }
+    /* elements from one row to the next: d + 1 for fvecs/ivecs, d + 4 for bvecs */
+    size_t stride() const { return _row_bytes / sizeof(T); }
+
+    const T *row(size_t i) const { return (const T *)(_base + i * _row_bytes + sizeof(int32_t)); }
+    const T *operator[](size_t i) const { return row(i); }
+    int32_t dim_of(size_t i) const {
+      int32_t d;
+      memcpy(&d, _base + i * _row_bytes, sizeof(d));
+      return d;
+    }
+
+    /* Rows [first, first + count) without their headers into dst[count * d] */
+    void copy_dense(T *dst, size_t first, size_t count) const {
+      size_t i = 0;
+      for (; i < count; i++) {
+        memcpy(dst + i * _d, row(first + i), _d * sizeof(T));
+      }
+    }
+
+    /* The whole file as a new T[n * d], for code that wants it dense */
+    T *read_dense() const {
+      T *x = new T[_n * _d];
+      copy_dense(x, 0, _n);
+      return x;
+    }
+
+  private:
+    const uint8_t *_base;
+    size_t _len;
+    size_t _d;
+    size_t _n;
+    size_t _row_bytes;
+  };
+
+  /* A run of consecutive rows, dense (no row headers): row i is data + i * d */
+  template <typename T>
+  struct batch {
+    size_t first;   // file row of data[0]
+    size_t count;
+    size_t d;
+    const T *data;
+    const T *row(size_t i) const { return data + i * d; }
+  };
+
+  /*
+   * Streams a vecs file of any size in batches of batch_rows rows. Reader
+   * threads pread batches ahead into a ring of ring_slots reusable buffers,
+   * strip and check the row headers, and for_each() hands the batches to
+   * the consumer in file order on the calling thread. A reader waits for
+   * its slot to come back, so memory stays at ring_slots batches however
+   * big the file is, and reading overlaps whatever the consumer does.
+   */
+  template <typename T>
+  class reader {
+  public:
+    explicit reader(size_t batch_rows = 4096, unsigned threads = 4, unsigned ring_slots = 8)
+      : _fd(-1), _d(0), _n(0), _row_bytes(0), _batch_rows(batch_rows ? batch_rows : 1),
+        _threads(threads ? threads : 1), _slots(ring_slots > _threads ? ring_slots : _threads + 1) {}
+    ~reader() { close(); }
+    reader(const reader &) = delete;
+    reader &operator=(const reader &) = delete;
+
+    /* Reads only the first header and the size; says why on stderr on failure */
+    bool open(const char *fname) {
+      close();
+      _fd = ::open(fname, O_RDONLY);
+      if (_fd < 0) {
+        fprintf(stderr, "could not open %s: %s\n", fname, strerror(errno));
+        return false;
+      }
+      struct stat st;
+      int32_t d = 0;
+      if (fstat(_fd, &st) != 0 || pread(_fd, &d, sizeof(d), 0) != (ssize_t)sizeof(d) ||
+          d <= 0 || d >= MAX_DIM || (size_t)st.st_size % (sizeof(int32_t) + d * sizeof(T)) != 0) {
+        fprintf(stderr, "%s: not a vecs file of this type (dimension %d, size %ld)\n", fname, d, (long)st.st_size);
+        close();
+        return false;
+      }
+      _d = d;
+      _row_bytes = sizeof(int32_t) + d * sizeof(T);
+      _n = st.st_size / _row_bytes;
+#ifdef POSIX_FADV_SEQUENTIAL
+      (void)posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      return true;
+    }
+
+    void close() {
+      if (_fd >= 0) {
+        ::close(_fd);
+      }
+      _fd = -1;
+      _d = _n = _row_bytes = 0;
+    }
+
+    size_t d() const { return _d; }
+    size_t n() const { return _n; }
+
+    /*
+     * consume(batch) for the rows [first, first + count) in order. Returns
+     * false on a read error or a bad row header (said on stderr), or when
+     * consume returns false to stop early.
+     */
+    bool for_each(const std::function<bool (const batch<T> &)> &consume,
+                  size_t first = 0, size_t count = ~(size_t)0) {
+      if (_fd < 0 || first > _n) {
+        return false;
+      }
+      if (count > _n - first) {
+        count = _n - first;
+      }
+      const size_t n_batches = (count + _batch_rows - 1) / _batch_rows;
+      std::vector<slot> ring(_slots);
+      size_t s = 0;
+      for (; s < _slots; s++) {
+        ring[s].buf.resize(_batch_rows * _row_bytes);
+        ring[s].free_for = s;
+        ring[s].ready = ~(size_t)0;
+      }
+      std::mutex mtx;
+      std::condition_variable cv;
+      size_t next = 0;
+      bool stop = false;
+      bool failed = false;
+
+      auto read_batches = [&]() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stop && next < n_batches) {
+          const size_t k = next++;
+          slot &sl = ring[k % _slots];
+          cv.wait(lock, [&]() { return stop || sl.free_for == k; });
+          if (stop) {
+            break;
+          }
+          lock.unlock();
+          const size_t row0 = first + k * _batch_rows;
+          const size_t rows = (k + 1 == n_batches) ? count - k * _batch_rows : _batch_rows;
+          const bool ok = _fill(sl.buf.data(), row0, rows);
+          lock.lock();
+          if (!ok) {
+            failed = stop = true;
+          }
+          sl.ready = k;
+          sl.rows = rows;
+          cv.notify_all();
+        }
+      };
+
+      std::vector<std::thread> threads;
+      unsigned t = 0;
+      for (; t < _threads && t < n_batches; t++) {
+        threads.push_back(std::thread(read_batches));
+      }
+      size_t k = 0;
+      for (; k < n_batches; k++) {
+        slot &sl = ring[k % _slots];
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return stop || sl.ready == k; });
+        if (stop) {
+          break;
+        }
+        lock.unlock();
+        batch<T> b;
+        b.first = first + k * _batch_rows;
+        b.count = sl.rows;
+        b.d = _d;
+        b.data = (const T *)sl.buf.data();
+        const bool more = consume(b);
+        lock.lock();
+        sl.free_for = k + _slots;
+        if (!more) {
+          stop = true;
+        }
+        cv.notify_all();
+        if (!more) {
+          break;
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+        cv.notify_all();
+      }
+      for (std::thread &th : threads) {
+        th.join();
+      }
+      return !failed && k == n_batches;
+    }
+
+  private:
+    struct slot {
+      std::vector<uint8_t> buf;
+      size_t free_for;  // batch that may fill this slot next
+      size_t ready;     // batch the slot holds, once filled
+      size_t rows;
+    };
+
+    /* pread rows [row0, row0 + rows) into buf and squeeze out the headers */
+    bool _fill(uint8_t *buf, size_t row0, size_t rows) const {
+      const size_t len = rows * _row_bytes;
+      size_t got = 0;
+      while (got < len) {
+        ssize_t r = pread(_fd, buf + got, len - got, row0 * _row_bytes + got);
+        if (r <= 0) {
+          fprintf(stderr, "read of rows %zu..%zu failed: %s\n", row0, row0 + rows,
+                  r == 0 ? "short file" : strerror(errno));
+          return false;
+        }
+        got += r;
+      }
+      const size_t vec_bytes = _d * sizeof(T);
+      size_t i = 0;
+      for (; i < rows; i++) {
+        int32_t d;
+        memcpy(&d, buf + i * _row_bytes, sizeof(d));
+        if ((size_t)d != _d) {
+          fprintf(stderr, "row %zu has dimension %d, expected %zu\n", row0 + i, d, _d);
+          return false;
+        }
+        memmove(buf + i * vec_bytes, buf + i * _row_bytes + sizeof(int32_t), vec_bytes);
+      }
+      return true;
+    }
+
+    int _fd;
+    size_t _d;
+    size_t _n;
+    size_t _row_bytes;
+    size_t _batch_rows;
+    unsigned _threads;
+    unsigned _slots;
+  };
+
+  typedef mapped<float> fvecs;
+  typedef mapped<int32_t> ivecs;
+  typedef mapped<uint8_t> bvecs;
+}
+#endif // __vecs_hpp__
@@ -0,0 +1,190 @@
+//
+// Test program for vecs.hpp
+//
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vecs.hpp"
+
+// Write n rows of dimension d in texmex layout, values from seed
+template <typename T>
+void
+write_vecs(const char *fname, int32_t d, size_t n, unsigned int seed)
+{
+  FILE *f = fopen(fname, "w");
+  T *row = new T[d];
+  srandom(seed);
+  size_t i = 0;
+  for (; i < n; i++) {
+    int32_t j = 0;
+    for (; j < d; j++) {
+      row[j] = (T)(random() % 251);
+    }
+    fwrite(&d, sizeof(d), 1, f);
+    fwrite(row, sizeof(T), d, f);
+  }
+  delete [] row;
+  fclose(f);
+}
+
+// Map fname and compare every row against the same seed
+template <typename T>
+unsigned int
+check_vecs(const char *fname, int32_t d, size_t n, unsigned int seed, unsigned flags)
+{
+  using namespace std;
+  vecs::mapped<T> v;
+  if (!v.open(fname, flags)) {
+    cout << "ERROR: could not map " << fname << endl;
+    return 1;
+  }
+  if (v.d() != (size_t)d || v.n() != n || v.stride() != (sizeof(int32_t) + d * sizeof(T)) / sizeof(T)) {
+    cout << "ERROR: " << fname << " d " << v.d() << " n " << v.n() << " stride " << v.stride() << endl;
+    return 1;
+  }
+  unsigned int errors = 0;
+  srandom(seed);
+  size_t i = 0;
+  for (; i < n; i++) {
+    int32_t j = 0;
+    for (; j < d; j++) {
+      if (v.row(i)[j] != (T)(random() % 251)) {
+        errors++;
+      }
+    }
+  }
+  T *dense = v.read_dense();
+  for (i = 0; i < n; i++) {
+    if (memcmp(dense + i * d, v[i], d * sizeof(T)) != 0) {
+      errors++;
+    }
+  }
+  delete [] dense;
+  if (errors) {
+    cout << "ERROR: " << fname << " has " << errors << " mismatched values" << endl;
+  }
+  return errors;
+}
+
+// Stream fname in batches and compare every row, in order, against the mapping
+template <typename T>
+unsigned int
+check_reader(const char *fname, size_t batch_rows, unsigned threads, unsigned slots, size_t first, size_t count)
+{
+  using namespace std;
+  vecs::mapped<T> v(fname);
+  vecs::reader<T> r(batch_rows, threads, slots);
+  if (!r.open(fname) || r.d() != v.d() || r.n() != v.n()) {
+    cout << "ERROR: reader could not open " << fname << endl;
+    return 1;
+  }
+  if (count > v.n() - first) {
+    count = v.n() - first;
+  }
+  unsigned int errors = 0;
+  size_t expect = first;
+  bool ok = r.for_each([&](const vecs::batch<T> &b) {
+      if (b.first != expect || b.count > batch_rows || b.d != v.d()) {
+        errors++;
+      }
+      size_t i = 0;
+      for (; i < b.count; i++) {
+        if (memcmp(b.row(i), v.row(b.first + i), v.d() * sizeof(T)) != 0) {
+          errors++;
+        }
+      }
+      expect += b.count;
+      return true;
+    }, first, count);
+  if (!ok || expect != first + count) {
+    cout << "ERROR: reader of " << fname << " batch " << batch_rows << " threads " << threads
+         << " stopped at row " << expect << " of " << first + count << endl;
+    errors++;
+  }
+  if (errors) {
+    cout << "ERROR: reader batch " << batch_rows << " threads " << threads << " slots " << slots
+         << " has " << errors << " mismatches" << endl;
+  }
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  char fname[] = { "/tmp/vecs_test_XXXXXX" };
+  int fd = mkstemp(fname);
+  close(fd);
+  unsigned int errors = 0;
+
+  write_vecs<float>(fname, 128, 1000, 17);
+  errors += check_vecs<float>(fname, 128, 1000, 17, vecs::ADVISE_SEQUENTIAL);
+  errors += check_vecs<float>(fname, 128, 1000, 17, vecs::ADVISE_RANDOM | vecs::CHECK_ALL_ROWS);
+  write_vecs<int32_t>(fname, 100, 333, 19);
+  errors += check_vecs<int32_t>(fname, 100, 333, 19, vecs::ADVISE_WILLNEED | vecs::MAP_PREFAULT);
+  write_vecs<uint8_t>(fname, 128, 777, 23);
+  errors += check_vecs<uint8_t>(fname, 128, 777, 23, vecs::ADVISE_HUGEPAGE | vecs::CHECK_ALL_ROWS);
+
+  write_vecs<float>(fname, 128, 10000, 37);
+  errors += check_reader<float>(fname, 1, 1, 2, 0, ~(size_t)0);
+  errors += check_reader<float>(fname, 100, 4, 8, 0, ~(size_t)0);
+  errors += check_reader<float>(fname, 333, 8, 3, 17, 5000);
+  errors += check_reader<float>(fname, 4096, 3, 16, 9999, 10);
+  write_vecs<uint8_t>(fname, 128, 5001, 41);
+  errors += check_reader<uint8_t>(fname, 250, 4, 8, 0, ~(size_t)0);
+  {
+    // the consumer can stop early
+    vecs::reader<uint8_t> r(100, 4, 4);
+    size_t seen = 0;
+    r.open(fname);
+    if (r.for_each([&](const vecs::batch<uint8_t> &b) { seen += b.count; return seen < 1000; }) || seen != 1000) {
+      cout << "ERROR: reader did not stop at 1000 rows, saw " << seen << endl;
+      errors++;
+    }
+  }
+
+  // things that must not map: wrong type for the size, a bad row, nonsense
+  // dimension, nothing at all
+  write_vecs<uint8_t>(fname, 127, 10, 29);
+  vecs::fvecs f;
+  if (f.open(fname)) {
+    cout << "ERROR: bvecs of dimension 127 mapped as fvecs" << endl;
+    errors++;
+  }
+  write_vecs<float>(fname, 16, 10, 31);
+  FILE *fp = fopen(fname, "r+");
+  int32_t bad_d = 15;
+  fseek(fp, 5 * (16 + 1) * sizeof(float), SEEK_SET);
+  fwrite(&bad_d, sizeof(bad_d), 1, fp);
+  fclose(fp);
+  if (!f.open(fname)) {
+    cout << "ERROR: a bad middle row should only be caught with CHECK_ALL_ROWS" << endl;
+    errors++;
+  }
+  if (f.open(fname, vecs::CHECK_ALL_ROWS)) {
+    cout << "ERROR: bad dimension in row 5 not caught" << endl;
+    errors++;
+  }
+  bad_d = -3;
+  fp = fopen(fname, "w");
+  fwrite(&bad_d, sizeof(bad_d), 1, fp);
+  fclose(fp);
+  if (f.open(fname)) {
+    cout << "ERROR: negative dimension mapped" << endl;
+    errors++;
+  }
+  fp = fopen(fname, "w");
+  fclose(fp);
+  if (f.open(fname) || f.open("/nonexistent/sift_base.fvecs")) {
+    cout << "ERROR: empty or missing file mapped" << endl;
+    errors++;
+  }
+
+  unlink(fname);
+  cout << "vecs errors " << errors << endl;
+  return errors != 0;
+}
@@ -0,0 +1,196 @@
+//
+// Load generator for the query server of orca_vh -S
+//
+// -c connections, each on a thread of its own with -d requests in flight,
+// send -n requests in all: k nearest (-k) of the vectors of a query fvecs
+// file taken in turn, and -g percent of them a get of a random id. It
+// reports requests a second and the p50, p90, p99 and max seconds from a
+// request's send to its reply, for knn and get apart. With -G, the knn
+// replies are checked against a groundtruth ivecs file (R@1).
+//
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "vecs.hpp"
+#include "vserve.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Nearest rank percentile of sorted s, p in (0, 1]
+double
+percentile(const std::vector<double> &s, double p)
+{
+  size_t r = (size_t)ceil(p * s.size());
+  return s[r == 0 ? 0 : std::min(r, s.size()) - 1];
+}
+
+void
+report(const char *what, std::vector<double> &s)
+{
+  if (s.empty()) {
+    return;
+  }
+  std::sort(s.begin(), s.end());
+  printf("%-4s %8lu replies  p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  max %9.1f us\n", what, (unsigned long)s.size(),
+         percentile(s, 0.5) * 1e6, percentile(s, 0.9) * 1e6, percentile(s, 0.99) * 1e6, s.back() * 1e6);
+}
+
+// What one connection saw
+struct tally {
+  std::vector<double> knn_s;
+  std::vector<double> get_s;
+  size_t hits;      // knn replies whose first result is the groundtruth's
+  size_t failed;    // replies that were not ST_OK
+  bool ok;
+  tally() : hits(0), failed(0), ok(true) {}
+};
+
+int
+main(int argc, char **argv)
+{
+  unsigned int conns = 4, depth = 1, k = 10, get_pct = 0;
+  size_t total = 10000;
+  const char *gt_fname = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:n:k:g:G:")) != -1) {
+    switch (opt) {
+    case 'c': conns = atoi(optarg); break;
+    case 'd': depth = atoi(optarg); break;
+    case 'n': total = strtoull(optarg, NULL, 10); break;
+    case 'k': k = atoi(optarg); break;
+    case 'g': get_pct = atoi(optarg); break;
+    case 'G': gt_fname = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-c connections] [-d depth] [-n requests] [-k k] [-g get percent] [-G groundtruth ivecs] "
+              "socket [query fvecs]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc || conns == 0 || depth == 0 || k == 0 || k > vserve::MAX_K || get_pct > 100) {
+    fprintf(stderr, "usage: %s [-c connections] [-d depth] [-n requests] [-k k] [-g get percent] [-G groundtruth ivecs] "
+            "socket [query fvecs]\n", argv[0]);
+    return 1;
+  }
+  const char *path = argv[optind];
+  const char *q_fname = optind + 1 < argc ? argv[optind + 1] : "sift1M/sift_query.fvecs";
+
+  vecs::fvecs xq;
+  vecs::ivecs gt;
+  if (!xq.open(q_fname) || (gt_fname && !gt.open(gt_fname))) {
+    return 1;
+  }
+  if (gt_fname && gt.n() < xq.n()) {
+    fprintf(stderr, "%s has %lu rows for %lu queries\n", gt_fname, gt.n(), xq.n());
+    return 1;
+  }
+  vserve::client probe;
+  vserve::reply info;
+  if (!probe.connect(path) || !probe.send_info(0) || !probe.recv(&info, NULL, NULL)) {
+    return 1;
+  }
+  probe.close();
+  if (info.d != xq.d()) {
+    fprintf(stderr, "the server has vectors of d=%u, %s d=%lu\n", info.d, q_fname, xq.d());
+    return 1;
+  }
+  printf("%s: %lu vectors, d=%u; %u connections, %u deep, %lu requests, k=%u, %u%% gets\n", path,
+         (unsigned long)info.n, info.d, conns, depth, (unsigned long)total, k, get_pct);
+
+  std::vector<tally> tallies(conns);
+  std::vector<std::thread> threads;
+  const double start = elapsed();
+  unsigned int t = 0;
+  for (; t < conns; t++) {
+    threads.push_back(std::thread([&, t]() {
+      tally &my = tallies[t];
+      const size_t mine = total / conns + (t < total % conns);
+      vserve::client c;
+      if (!c.connect(path)) {
+        my.ok = false;
+        return;
+      }
+      unsigned int seed = t + 1;
+      // send time and query row of each request, by tag
+      std::vector<double> sent_at(mine);
+      std::vector<size_t> row(mine);
+      std::vector<int64_t> labels;
+      std::vector<float> floats;
+      vserve::reply r;
+      size_t sent = 0, got = 0;
+      while (got < mine) {
+        for (; sent < mine && sent - got < depth; sent++) {
+          const bool get = get_pct && (unsigned int)(rand_r(&seed) % 100) < get_pct;
+          bool ok;
+          sent_at[sent] = elapsed();
+          if (get) {
+            row[sent] = ~(size_t)0;
+            const uint64_t hi = rand_r(&seed);
+            ok = c.send_get(sent, (hi * ((uint64_t)RAND_MAX + 1) + rand_r(&seed)) % info.n);
+          } else {
+            row[sent] = (t + sent * conns) % xq.n();
+            ok = c.send_knn(sent, xq.row(row[sent]), xq.d(), k);
+          }
+          if (!ok) {
+            my.ok = false;
+            return;
+          }
+        }
+        if (!c.recv(&r, &labels, &floats) || r.tag >= mine) {
+          my.ok = false;
+          return;
+        }
+        const double secs = elapsed() - sent_at[r.tag];
+        got++;
+        if (r.status != vserve::ST_OK) {
+          my.failed++;
+        } else if (r.op == vserve::OP_GET) {
+          my.get_s.push_back(secs);
+        } else {
+          my.knn_s.push_back(secs);
+          my.hits += gt_fname && !labels.empty() && labels[0] == gt.row(row[r.tag])[0];
+        }
+      }
+    }));
+  }
+  for (std::thread &th : threads) {
+    th.join();
+  }
+  const double secs = elapsed() - start;
+
+  std::vector<double> knn_s, get_s;
+  size_t hits = 0, failed = 0;
+  bool ok = true;
+  for (const tally &my : tallies) {
+    knn_s.insert(knn_s.end(), my.knn_s.begin(), my.knn_s.end());
+    get_s.insert(get_s.end(), my.get_s.begin(), my.get_s.end());
+    hits += my.hits;
+    failed += my.failed;
+    ok = ok && my.ok;
+  }
+  const size_t answered = knn_s.size() + get_s.size() + failed;
+  printf("%lu requests in %.3fs: %.1f requests/s\n", (unsigned long)answered, secs, answered / secs);
+  if (gt_fname && !knn_s.empty()) {
+    printf("knn R@1 %.4f\n", (double)hits / knn_s.size());
+  }
+  report("knn", knn_s);
+  report("get", get_s);
+  if (!ok || failed) {
+    printf("ERROR: %lu requests refused%s\n", (unsigned long)failed, ok ? "" : ", a connection failed");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,817 @@
+#ifndef __vserve_hpp__
+#define __vserve_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "knn.hpp"
+#include "timing.hpp"
+
+/*
+ * A vector query service over a Unix domain socket, for a matrix that
+ * stays in this process's memory. Requests and replies are fixed 32 byte
+ * headers in host byte order (the socket is local), followed by floats:
+ *
+ *   OP_KNN   request: k, d and the d floats of the query; reply: n results,
+ *            n int64 base row numbers best first, then their n distances
+ *   OP_GET   request: id; reply: n = 1, d and the row's d floats
+ *   OP_INFO  reply: n rows of d floats
+ *
+ * A client may send many requests before reading any replies. Replies
+ * carry the request's tag back and need not come in the order asked: a
+ * GET is answered as it is read, a KNN when its batch has been searched.
+ *
+ * One thread runs an epoll loop over the listening socket and every
+ * connection, nonblocking, with a buffer each way a connection. KNN
+ * queries from all connections go into one pending batch, and a searcher
+ * thread takes up to max_batch of them at a time into a single
+ * knn::search, so concurrent queries share each pass over the base
+ * matrix rather than making one pass each. While the searcher is busy the
+ * next batch fills; when it is idle a query waits at most max_wait_us for
+ * company (0: none). A connection whose unsent replies and unsearched
+ * queries pass max_out_bytes is not read from until the client catches
+ * up. A client that shuts down its sending side still gets the replies
+ * to what it sent before the connection is closed.
+ */
+namespace vserve {
+  const uint32_t MAGIC = 0x76737276;   // "vrsv"
+  const uint32_t MAX_K = 1024;
+  const uint32_t MAX_D = 65536;
+
+  enum op {
+    OP_INFO = 0,
+    OP_KNN = 1,
+    OP_GET = 2
+  };
+
+  enum status {
+    ST_OK = 0,
+    ST_BAD_REQUEST = 1,   // wrong d, k out of range or an unknown op
+    ST_NOT_FOUND = 2      // no row with that id
+  };
+
+  struct request {
+    uint32_t magic;
+    uint32_t op;
+    uint64_t tag;     // echoed in the reply
+    uint64_t id;      // OP_GET
+    uint32_t k;       // OP_KNN
+    uint32_t d;       // OP_KNN: floats that follow
+  };
+
+  struct reply {
+    uint32_t magic;
+    uint32_t status;
+    uint64_t tag;
+    uint32_t op;
+    uint32_t d;
+    uint64_t n;
+  };
+
+  static_assert(sizeof(request) == 32 && sizeof(reply) == 32, "vserve headers are 32 bytes");
+
+  struct config {
+    size_t max_batch;           // KNN queries one search takes at most
+    unsigned int max_wait_us;   // how long a query waits for others while the searcher is idle
+    size_t max_out_bytes;       // unsent replies and queued queries a connection may have before it is not read
+    knn::config search;
+    config() : max_batch(256), max_wait_us(0), max_out_bytes(4 << 20) {}
+  };
+
+  struct stats {
+    uint64_t conns;      // accepted
+    uint64_t requests;
+    uint64_t knn;
+    uint64_t gets;
+    uint64_t errors;     // bad requests and dropped connections
+    uint64_t batches;    // searches
+    uint64_t batched;    // KNN queries in them
+  };
+
+  class server {
+  public:
+    /* Serves n rows of d floats, row i at base + i * stride; base must outlive the server */
+    server(const float *base, size_t n, size_t stride, size_t d, const config &cfg = config())
+      : _base(base), _n(n), _stride(stride), _d(d), _cfg(cfg), _listen(-1), _ep(-1), _wake(-1), _timer(-1),
+        _next_id(ID_FIRST), _busy(false), _due(false), _job_ready(false), _job_done(false), _quit(false),
+        _stopping(false), _stage(timing::stage("vserve.search")) {
+      if (_cfg.max_batch == 0) {
+        _cfg.max_batch = 1;
+      }
+      for (std::atomic<uint64_t> &c : _count) {
+        c.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    server(const server &) = delete;
+    server &operator=(const server &) = delete;
+
+    ~server() {
+      _close_all();
+      if (!_path.empty()) {
+        unlink(_path.c_str());
+      }
+    }
+
+    /* Binds path (replacing a stale socket there) and sets up the loop */
+    bool listen(const char *path) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vserve: socket path %s is too long\n", path);
+        return false;
+      }
+      strcpy(addr.sun_path, path);
+      _listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (_listen < 0) {
+        fprintf(stderr, "vserve: socket: %s\n", strerror(errno));
+        return false;
+      }
+      unlink(path);
+      if (bind(_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(_listen, 128) != 0) {
+        fprintf(stderr, "vserve: could not listen on %s: %s\n", path, strerror(errno));
+        return false;
+      }
+      _path = path;
+      _ep = epoll_create1(EPOLL_CLOEXEC);
+      _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (_ep < 0 || _wake < 0 || _timer < 0 || !_watch(_listen, ID_LISTEN, EPOLLIN) ||
+          !_watch(_wake, ID_WAKE, EPOLLIN) || !_watch(_timer, ID_TIMER, EPOLLIN)) {
+        fprintf(stderr, "vserve: could not set up the event loop: %s\n", strerror(errno));
+        return false;
+      }
+      return true;
+    }
+
+    /* Serves until stop(); false if the loop failed */
+    bool run() {
+      if (_ep < 0) {
+        return false;
+      }
+      std::thread searcher(&server::_search_main, this);
+      struct epoll_event evs[64];
+      bool ok = true;
+      while (!_stopping.load(std::memory_order_acquire)) {
+        const int m = epoll_wait(_ep, evs, 64, -1);
+        if (m < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          fprintf(stderr, "vserve: epoll_wait: %s\n", strerror(errno));
+          ok = false;
+          break;
+        }
+        int i = 0;
+        for (; i < m; i++) {
+          const uint64_t id = evs[i].data.u64;
+          if (id == ID_LISTEN) {
+            _accept();
+          } else if (id == ID_WAKE) {
+            uint64_t v;
+            if (read(_wake, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+              fprintf(stderr, "vserve: eventfd: %s\n", strerror(errno));
+            }
+            _deliver();
+          } else if (id == ID_TIMER) {
+            uint64_t v;
+            if (read(_timer, &v, sizeof(v)) > 0) {
+              _due = true;
+            }
+          } else {
+            if (evs[i].events & EPOLLOUT) {
+              _flush(id);
+            }
+            if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+              _read(id);
+            }
+          }
+        }
+        // sending can let held back requests in, so it goes first
+        _flush_dirty();
+        _dispatch();
+      }
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _quit = true;
+      }
+      _cv.notify_one();
+      searcher.join();
+      _close_all();
+      return ok;
+    }
+
+    /* Ends run() from any thread, or from a signal handler */
+    void stop() {
+      _stopping.store(true, std::memory_order_release);
+      const uint64_t one = 1;
+      if (_wake >= 0 && write(_wake, &one, sizeof(one)) < 0) {
+        // the counter is full, so the loop is already being woken
+      }
+    }
+
+    stats counters() const {
+      stats s;
+      s.conns = _count[C_CONNS].load(std::memory_order_relaxed);
+      s.requests = _count[C_REQUESTS].load(std::memory_order_relaxed);
+      s.knn = _count[C_KNN].load(std::memory_order_relaxed);
+      s.gets = _count[C_GETS].load(std::memory_order_relaxed);
+      s.errors = _count[C_ERRORS].load(std::memory_order_relaxed);
+      s.batches = _count[C_BATCHES].load(std::memory_order_relaxed);
+      s.batched = _count[C_BATCHED].load(std::memory_order_relaxed);
+      return s;
+    }
+
+  private:
+    enum { ID_LISTEN = 0, ID_WAKE = 1, ID_TIMER = 2, ID_FIRST = 3 };
+    enum { C_CONNS, C_REQUESTS, C_KNN, C_GETS, C_ERRORS, C_BATCHES, C_BATCHED, C_COUNT };
+
+    struct _conn {
+      int fd;
+      uint32_t events;         // what epoll watches for it
+      bool dirty;              // on _dirty, with replies to send
+      bool eof;                // the client sends no more; closed once answered
+      std::vector<char> in;    // bytes not yet a whole request
+      std::vector<char> out;   // replies not yet sent, from out_off
+      size_t out_off;
+      size_t queued;           // what its KNNs not yet answered hold, _queued_bytes() each
+      _conn() : fd(-1), events(0), dirty(false), eof(false), out_off(0), queued(0) {}
+      size_t backlog() const { return out.size() - out_off; }
+      size_t load() const { return backlog() + queued; }
+    };
+
+    // who asked for each query of a batch
+    struct _query {
+      uint64_t conn;
+      uint64_t tag;
+      uint32_t k;
+    };
+
+    struct _batch {
+      std::vector<_query> who;
+      std::vector<float> q;          // who.size() * d, dense
+      size_t k;                      // the largest k of who
+      std::vector<int64_t> labels;   // who.size() * k
+      std::vector<float> dist;
+    };
+
+    void _bump(unsigned int c, uint64_t by = 1) {
+      _count[c].store(_count[c].load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    bool _watch(int fd, uint64_t id, uint32_t events) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = events;
+      ev.data.u64 = id;
+      return epoll_ctl(_ep, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    // A KNN waiting for its search: the query, and the reply it will be
+    size_t _queued_bytes(size_t k) const {
+      return _d * sizeof(float) + sizeof(reply) + k * (sizeof(int64_t) + sizeof(float));
+    }
+
+    // read while the replies keep up, write while there are some
+    void _arm(uint64_t id, _conn &c) {
+      const uint32_t want = (!c.eof && c.load() < _cfg.max_out_bytes ? (uint32_t)EPOLLIN : 0) |
+                            (c.backlog() ? (uint32_t)EPOLLOUT : 0);
+      if (want == c.events) {
+        return;
+      }
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = want;
+      ev.data.u64 = id;
+      if (epoll_ctl(_ep, EPOLL_CTL_MOD, c.fd, &ev) == 0) {
+        c.events = want;
+      }
+    }
+
+    void _accept() {
+      for (;;) {
+        const int fd = accept4(_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "vserve: accept: %s\n", strerror(errno));
+          }
+          return;
+        }
+        const uint64_t id = _next_id++;
+        if (!_watch(fd, id, EPOLLIN)) {
+          fprintf(stderr, "vserve: could not watch a connection: %s\n", strerror(errno));
+          ::close(fd);
+          continue;
+        }
+        _conn &c = _conns[id];
+        c.fd = fd;
+        c.events = EPOLLIN;
+        _bump(C_CONNS);
+      }
+    }
+
+    void _drop(uint64_t id) {
+      auto it = _conns.find(id);
+      if (it == _conns.end()) {
+        return;
+      }
+      epoll_ctl(_ep, EPOLL_CTL_DEL, it->second.fd, NULL);
+      ::close(it->second.fd);
+      _conns.erase(it);
+    }
+
+    void _read(uint64_t id) {
+      auto it = _conns.find(id);
+      if (it == _conns.end()) {
+        return;
+      }
+      _conn &c = it->second;
+      if (c.eof) {
+        // hung up altogether, or failed, with replies still due: no one to send them to
+        _drop(id);
+        return;
+      }
+      char buf[65536];
+      for (;;) {
+        const ssize_t got = ::read(c.fd, buf, sizeof(buf));
+        if (got > 0) {
+          c.in.insert(c.in.end(), buf, buf + got);
+          if (c.in.size() > (size_t)_cfg.max_out_bytes + sizeof(buf)) {
+            break;   // parse some before reading more
+          }
+          continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        if (got < 0 && errno == EINTR) {
+          continue;
+        }
+        if (got < 0) {
+          _drop(id);
+          return;
+        }
+        // shut down for sending: what was read is still answered
+        c.eof = true;
+        break;
+      }
+      if (!_parse(id, c)) {
+        _bump(C_ERRORS);
+        _drop(id);
+        return;
+      }
+      _close_if_done(id, c);
+    }
+
+    // A connection whose client sends no more, once it is all answered
+    void _close_if_done(uint64_t id, _conn &c) {
+      if (c.eof && c.backlog() == 0 && c.queued == 0) {
+        _drop(id);
+      }
+    }
+
+    void _append(uint64_t id, _conn &c, const reply &r, const void *a, size_t a_bytes, const void *b, size_t b_bytes) {
+      const char *h = (const char *)&r;
+      c.out.insert(c.out.end(), h, h + sizeof(r));
+      c.out.insert(c.out.end(), (const char *)a, (const char *)a + a_bytes);
+      c.out.insert(c.out.end(), (const char *)b, (const char *)b + b_bytes);
+      if (!c.dirty) {
+        c.dirty = true;
+        _dirty.push_back(id);
+      }
+    }
+
+    void _answer(uint64_t id, _conn &c, const request &rq, uint32_t st) {
+      reply r;
+      memset(&r, 0, sizeof(r));
+      r.magic = MAGIC;
+      r.status = st;
+      r.tag = rq.tag;
+      r.op = rq.op;
+      if (st != ST_OK) {
+        _append(id, c, r, NULL, 0, NULL, 0);
+        return;
+      }
+      if (rq.op == OP_INFO) {
+        r.d = _d;
+        r.n = _n;
+        _append(id, c, r, NULL, 0, NULL, 0);
+      } else {
+        r.d = _d;
+        r.n = 1;
+        _append(id, c, r, _base + rq.id * _stride, _d * sizeof(float), NULL, 0);
+      }
+    }
+
+    // Takes the whole requests off c.in while its replies keep up; false
+    // if the stream is not this protocol
+    bool _parse(uint64_t id, _conn &c) {
+      size_t off = 0;
+      while (c.in.size() - off >= sizeof(request) && c.load() < _cfg.max_out_bytes) {
+        request rq;
+        memcpy(&rq, c.in.data() + off, sizeof(rq));
+        if (rq.magic != MAGIC || (rq.op == OP_KNN && rq.d > MAX_D)) {
+          return false;
+        }
+        const size_t payload = rq.op == OP_KNN ? rq.d * sizeof(float) : 0;
+        if (c.in.size() - off < sizeof(rq) + payload) {
+          break;
+        }
+        const float *q = (const float *)(c.in.data() + off + sizeof(rq));
+        off += sizeof(rq) + payload;
+        _bump(C_REQUESTS);
+        if (rq.op == OP_KNN) {
+          if (rq.d != _d || rq.k == 0 || rq.k > MAX_K) {
+            _bump(C_ERRORS);
+            _answer(id, c, rq, ST_BAD_REQUEST);
+            continue;
+          }
+          _query w;
+          w.conn = id;
+          w.tag = rq.tag;
+          w.k = std::min((size_t)rq.k, _n);
+          _filling.who.push_back(w);
+          _filling.q.insert(_filling.q.end(), q, q + _d);
+          c.queued += _queued_bytes(w.k);
+          _bump(C_KNN);
+          if (_filling.who.size() == 1 && _cfg.max_wait_us) {
+            _arm_timer(_cfg.max_wait_us);
+          }
+        } else if (rq.op == OP_GET) {
+          _bump(C_GETS);
+          _answer(id, c, rq, rq.id < _n ? ST_OK : ST_NOT_FOUND);
+        } else if (rq.op == OP_INFO) {
+          _answer(id, c, rq, ST_OK);
+        } else {
+          _bump(C_ERRORS);
+          _answer(id, c, rq, ST_BAD_REQUEST);
+        }
+      }
+      c.in.erase(c.in.begin(), c.in.begin() + off);
+      _arm(id, c);
+      return true;
+    }
+
+    void _arm_timer(unsigned int us) {
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = us / 1000000;
+      its.it_value.tv_nsec = (long)(us % 1000000) * 1000;
+      timerfd_settime(_timer, 0, &its, NULL);
+    }
+
+    // Sends what the connection has queued, as far as the socket takes it
+    void _flush(uint64_t id) {
+      auto it = _conns.find(id);
+      if (it == _conns.end()) {
+        return;
+      }
+      _conn &c = it->second;
+      while (c.backlog()) {
+        const ssize_t put = ::send(c.fd, c.out.data() + c.out_off, c.backlog(), MSG_NOSIGNAL);
+        if (put > 0) {
+          c.out_off += put;
+          continue;
+        }
+        if (put < 0 && errno == EINTR) {
+          continue;
+        }
+        if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        _bump(C_ERRORS);
+        _drop(id);
+        return;
+      }
+      if (c.out_off == c.out.size()) {
+        c.out.clear();
+        c.out_off = 0;
+      } else if (c.out_off > (1 << 20) && c.out_off * 2 > c.out.size()) {
+        c.out.erase(c.out.begin(), c.out.begin() + c.out_off);
+        c.out_off = 0;
+      }
+      if (c.in.size() >= sizeof(request) && c.load() < _cfg.max_out_bytes && !_parse(id, c)) {
+        // requests held back while the replies were behind
+        _bump(C_ERRORS);
+        _drop(id);
+        return;
+      }
+      _arm(id, c);
+      _close_if_done(id, c);
+    }
+
+    void _flush_dirty() {
+      // _flush can parse, and parsing can make more dirty
+      while (!_dirty.empty()) {
+        std::vector<uint64_t> ids;
+        ids.swap(_dirty);
+        for (uint64_t id : ids) {
+          auto it = _conns.find(id);
+          if (it != _conns.end()) {
+            it->second.dirty = false;
+            _flush(id);
+          }
+        }
+      }
+    }
+
+    // Hands the searcher the next batch, if it is free and the batch is due
+    void _dispatch() {
+      if (_busy || _filling.who.empty()) {
+        return;
+      }
+      if (_cfg.max_wait_us && !_due && _filling.who.size() < _cfg.max_batch) {
+        return;
+      }
+      const size_t take = std::min(_filling.who.size(), _cfg.max_batch);
+      _searching.who.assign(_filling.who.begin(), _filling.who.begin() + take);
+      _searching.q.assign(_filling.q.begin(), _filling.q.begin() + take * _d);
+      _filling.who.erase(_filling.who.begin(), _filling.who.begin() + take);
+      _filling.q.erase(_filling.q.begin(), _filling.q.begin() + take * _d);
+      _searching.k = 0;
+      for (const _query &w : _searching.who) {
+        _searching.k = std::max(_searching.k, (size_t)w.k);
+      }
+      // the rest have waited behind this batch already
+      _due = !_filling.who.empty();
+      if (!_due && _cfg.max_wait_us) {
+        _arm_timer(0);
+      }
+      _busy = true;
+      _bump(C_BATCHES);
+      _bump(C_BATCHED, take);
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _job_ready = true;
+      }
+      _cv.notify_one();
+    }
+
+    // Queues the replies of a finished batch
+    void _deliver() {
+      {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (!_job_done) {
+          return;
+        }
+        _job_done = false;
+      }
+      const size_t k = _searching.k;
+      size_t i = 0;
+      for (; i < _searching.who.size(); i++) {
+        const _query &w = _searching.who[i];
+        auto it = _conns.find(w.conn);
+        if (it == _conns.end()) {
+          continue;   // gone while its query was searched
+        }
+        it->second.queued -= _queued_bytes(w.k);
+        reply r;
+        memset(&r, 0, sizeof(r));
+        r.magic = MAGIC;
+        r.status = ST_OK;
+        r.tag = w.tag;
+        r.op = OP_KNN;
+        r.d = _d;
+        r.n = w.k;
+        _append(w.conn, it->second, r, &_searching.labels[i * k], w.k * sizeof(int64_t), &_searching.dist[i * k],
+                w.k * sizeof(float));
+      }
+      _searching.who.clear();
+      _busy = false;
+      _due = _due || !_filling.who.empty();
+    }
+
+    void _search_main() {
+      std::unique_lock<std::mutex> lock(_mtx);
+      for (;;) {
+        _cv.wait(lock, [this] { return _quit || _job_ready; });
+        if (_quit) {
+          return;
+        }
+        _job_ready = false;
+        lock.unlock();
+        const size_t nq = _searching.who.size(), k = _searching.k;
+        _searching.labels.resize(nq * k);
+        _searching.dist.resize(nq * k);
+        {
+          timing::scope t(_stage);
+          t.add(nq * _d * sizeof(float), nq);
+          knn::search(_base, _n, _stride, _searching.q.data(), nq, _d, k, _searching.labels.data(),
+                      _searching.dist.data(), _cfg.search);
+        }
+        lock.lock();
+        _job_done = true;
+        const uint64_t one = 1;
+        if (write(_wake, &one, sizeof(one)) < 0) {
+          // the counter is full, so the loop is already being woken
+        }
+      }
+    }
+
+    void _close_all() {
+      for (auto &e : _conns) {
+        ::close(e.second.fd);
+      }
+      _conns.clear();
+      _dirty.clear();
+      int *fds[] = { &_listen, &_ep, &_wake, &_timer };
+      for (int *fd : fds) {
+        if (*fd >= 0) {
+          ::close(*fd);
+          *fd = -1;
+        }
+      }
+    }
+
+    const float *_base;
+    const size_t _n;
+    const size_t _stride;
+    const size_t _d;
+    config _cfg;
+    std::string _path;
+    int _listen;
+    int _ep;
+    int _wake;
+    int _timer;
+    uint64_t _next_id;
+    std::unordered_map<uint64_t, _conn> _conns;
+    std::vector<uint64_t> _dirty;
+    _batch _filling;      // the loop's
+    _batch _searching;    // the searcher's while _busy
+    bool _busy;
+    bool _due;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    bool _job_ready;
+    bool _job_done;
+    bool _quit;
+    std::atomic<bool> _stopping;
+    const unsigned int _stage;
+    std::atomic<uint64_t> _count[C_COUNT];
+  };
+
+  /*
+   * A blocking client: send requests, then read the replies back with
+   * recv(), matching them to the requests by tag. One thread may send
+   * while another receives.
+   */
+  class client {
+  public:
+    client() : _fd(-1) {}
+    ~client() { close(); }
+
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    bool connect(const char *path) {
+      close();
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vserve: socket path %s is too long\n", path);
+        return false;
+      }
+      strcpy(addr.sun_path, path);
+      _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (_fd < 0 || ::connect(_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "vserve: could not connect to %s: %s\n", path, strerror(errno));
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void close() {
+      if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+      }
+    }
+
+    bool send_knn(uint64_t tag, const float *q, uint32_t d, uint32_t k) {
+      request rq = _request(OP_KNN, tag);
+      rq.k = k;
+      rq.d = d;
+      return _send(rq, q, d * sizeof(float));
+    }
+
+    bool send_get(uint64_t tag, uint64_t id) {
+      request rq = _request(OP_GET, tag);
+      rq.id = id;
+      return _send(rq, NULL, 0);
+    }
+
+    bool send_info(uint64_t tag) {
+      return _send(_request(OP_INFO, tag), NULL, 0);
+    }
+
+    /*
+     * The next reply; for OP_KNN its labels and distances (into floats),
+     * for OP_GET the row (into floats). Either may be NULL to skip it.
+     */
+    bool recv(reply *r, std::vector<int64_t> *labels, std::vector<float> *floats) {
+      if (!_read_all(r, sizeof(*r))) {
+        return false;
+      }
+      if (r->magic != MAGIC) {
+        fprintf(stderr, "vserve: reply out of step with the stream\n");
+        return false;
+      }
+      if (r->status != ST_OK || r->op == OP_INFO) {
+        return true;
+      }
+      const size_t nl = r->op == OP_KNN ? r->n : 0, nf = r->op == OP_KNN ? r->n : (size_t)r->d;
+      if (r->n > MAX_K && r->op == OP_KNN) {
+        fprintf(stderr, "vserve: reply of %lu results\n", (unsigned long)r->n);
+        return false;
+      }
+      _in.resize(nl * sizeof(int64_t) + nf * sizeof(float));
+      if (!_read_all(_in.data(), _in.size())) {
+        return false;
+      }
+      if (labels) {
+        labels->resize(nl);
+        memcpy(labels->data(), _in.data(), nl * sizeof(int64_t));
+      }
+      if (floats) {
+        floats->resize(nf);
+        memcpy(floats->data(), _in.data() + nl * sizeof(int64_t), nf * sizeof(float));
+      }
+      return true;
+    }
+
+  private:
+    static request _request(uint32_t op, uint64_t tag) {
+      request rq;
+      memset(&rq, 0, sizeof(rq));
+      rq.magic = MAGIC;
+      rq.op = op;
+      rq.tag = tag;
+      return rq;
+    }
+
+    bool _send(const request &rq, const void *payload, size_t bytes) {
+      _out.resize(sizeof(rq) + bytes);
+      memcpy(_out.data(), &rq, sizeof(rq));
+      if (bytes) {
+        memcpy(_out.data() + sizeof(rq), payload, bytes);
+      }
+      size_t off = 0;
+      while (off < _out.size()) {
+        const ssize_t put = ::send(_fd, _out.data() + off, _out.size() - off, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR) {
+          continue;
+        }
+        if (put <= 0) {
+          fprintf(stderr, "vserve: send: %s\n", strerror(errno));
+          return false;
+        }
+        off += put;
+      }
+      return true;
+    }
+
+    bool _read_all(void *dst, size_t bytes) {
+      size_t off = 0;
+      while (off < bytes) {
+        const ssize_t got = ::read(_fd, (char *)dst + off, bytes - off);
+        if (got < 0 && errno == EINTR) {
+          continue;
+        }
+        if (got <= 0) {
+          if (got < 0) {
+            fprintf(stderr, "vserve: read: %s\n", strerror(errno));
+          }
+          return false;
+        }
+        off += got;
+      }
+      return true;
+    }
+
+    int _fd;
+    std::vector<char> _out;   // the request being sent
+    std::vector<char> _in;    // the reply's payload
+  };
+}
+#endif // __vserve_hpp__
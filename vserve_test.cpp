@@ -0,0 +1,408 @@
+//
+// Test program for vserve.hpp
+//
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "vserve.hpp"
+
+double elapsed ()
+{
+  struct timeval tv;
+  gettimeofday (&tv, nullptr);
+  return  tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void
+fill(std::vector<float> *v, unsigned int seed)
+{
+  srandom(seed);
+  for (float &f : *v) {
+    f = (float)(random() % 100000) / 1000 - 50;
+  }
+}
+
+bool
+close_to(float a, float b)
+{
+  return fabsf(a - b) <= 1e-4f * std::max(1.0f, std::max(fabsf(a), fabsf(b)));
+}
+
+const size_t NB = 3000, D = 24, STRIDE = D + 1;   // strided, like a mapped fvecs file
+std::vector<float> base(NB * STRIDE), queries(400 * D);
+
+// A KNN reply for query j against the search done here, one query at a time
+bool
+check_knn(size_t j, size_t k, const vserve::reply &r, const std::vector<int64_t> &labels,
+          const std::vector<float> &dist)
+{
+  std::vector<int64_t> want_l(k);
+  std::vector<float> want_d(k);
+  knn::config cfg;
+  cfg.threads = 1;
+  knn::search(base.data(), NB, STRIDE, &queries[j * D], 1, D, k, want_l.data(), want_d.data(), cfg);
+  if (r.status != vserve::ST_OK || r.n != k || labels.size() != k || dist.size() != k) {
+    return false;
+  }
+  size_t i = 0;
+  for (; i < k; i++) {
+    // ties may come back in either order; the distances may not
+    if (!close_to(dist[i], want_d[i]) || labels[i] < 0 || labels[i] >= (int64_t)NB ||
+        !close_to(distance::_l2sq_scalar(&base[labels[i] * STRIDE], &queries[j * D], D), dist[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// INFO, GET, a bad d, an id past the end, and KNN pipelined on one connection
+unsigned int
+check_one_client(const char *path)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  vserve::client c;
+  if (!c.connect(path)) {
+    cout << "ERROR: could not connect" << endl;
+    return 1;
+  }
+  vserve::reply r;
+  vector<int64_t> labels;
+  vector<float> floats;
+  if (!c.send_info(7) || !c.recv(&r, NULL, NULL) || r.tag != 7 || r.n != NB || r.d != D) {
+    cout << "ERROR: info" << endl;
+    errors++;
+  }
+  size_t id = 0;
+  for (; id < NB; id += 97) {
+    if (!c.send_get(id, id) || !c.recv(&r, NULL, &floats) || r.status != vserve::ST_OK || r.tag != id ||
+        floats.size() != D || memcmp(floats.data(), &base[id * STRIDE], D * sizeof(float)) != 0) {
+      cout << "ERROR: get " << id << endl;
+      errors++;
+      break;
+    }
+  }
+  if (!c.send_get(1, NB) || !c.recv(&r, NULL, &floats) || r.status != vserve::ST_NOT_FOUND) {
+    cout << "ERROR: get past the end" << endl;
+    errors++;
+  }
+  if (!c.send_knn(2, queries.data(), D - 1, 10) || !c.recv(&r, &labels, &floats) || r.status != vserve::ST_BAD_REQUEST ||
+      !c.send_knn(3, queries.data(), D, 0) || !c.recv(&r, &labels, &floats) || r.status != vserve::ST_BAD_REQUEST) {
+    cout << "ERROR: bad requests not refused" << endl;
+    errors++;
+  }
+  // all sent before any is read, with a GET among them; k from 1 to 100
+  const size_t nq = 200;
+  size_t j = 0;
+  for (; j < nq; j++) {
+    c.send_knn(j, &queries[j * D], D, 1 + j % 100);
+  }
+  c.send_get(1000000, 5);
+  vector<bool> seen(nq);
+  bool got_get = false;
+  for (j = 0; j <= nq; j++) {
+    if (!c.recv(&r, &labels, &floats)) {
+      cout << "ERROR: lost the connection after " << j << " replies" << endl;
+      return errors + 1;
+    }
+    if (r.op == vserve::OP_GET) {
+      got_get = r.tag == 1000000 && memcmp(floats.data(), &base[5 * STRIDE], D * sizeof(float)) == 0;
+      continue;
+    }
+    if (r.tag >= nq || seen[r.tag] || !check_knn(r.tag, 1 + r.tag % 100, r, labels, floats)) {
+      cout << "ERROR: knn reply tagged " << r.tag << endl;
+      errors++;
+    } else {
+      seen[r.tag] = true;
+    }
+  }
+  if (!got_get) {
+    cout << "ERROR: the get among the queries" << endl;
+    errors++;
+  }
+  return errors;
+}
+
+// A connection that sends garbage is dropped; others are not
+unsigned int
+check_garbage(const char *path)
+{
+  using namespace std;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    cout << "ERROR: raw connect" << endl;
+    return 1;
+  }
+  char junk[64];
+  memset(junk, 0xab, sizeof(junk));
+  char b;
+  const bool closed = write(fd, junk, sizeof(junk)) == sizeof(junk) && read(fd, &b, 1) == 0;
+  close(fd);
+  vserve::client c;
+  vserve::reply r;
+  if (!closed || !c.connect(path) || !c.send_info(1) || !c.recv(&r, NULL, NULL) || r.n != NB) {
+    cout << "ERROR: garbage not dropped, or it took the server with it" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Many clients at once, each with several queries in flight: every reply
+// is right, and the server searched them in batches
+unsigned int
+check_concurrent(const char *path, const vserve::server &srv)
+{
+  using namespace std;
+  const unsigned int clients = 8, per_client = 150, depth = 8;
+  const vserve::stats before = srv.counters();
+  atomic<unsigned int> bad(0), answered(0);
+  vector<thread> threads;
+  unsigned int t = 0;
+  const double start = elapsed();
+  for (; t < clients; t++) {
+    threads.push_back(thread([&, t]() {
+      vserve::client c;
+      if (!c.connect(path)) {
+        bad++;
+        return;
+      }
+      vserve::reply r;
+      vector<int64_t> labels;
+      vector<float> dist;
+      unsigned int sent = 0, got = 0;
+      while (got < per_client) {
+        while (sent < per_client && sent - got < depth) {
+          const size_t j = (t * per_client + sent) % 400;
+          c.send_knn(j, &queries[j * D], D, 10);
+          sent++;
+        }
+        if (!c.recv(&r, &labels, &dist)) {
+          bad++;
+          return;
+        }
+        got++;
+        answered++;
+        if (!check_knn(r.tag, 10, r, labels, dist)) {
+          bad++;
+        }
+      }
+    }));
+  }
+  for (thread &th : threads) {
+    th.join();
+  }
+  const double secs = elapsed() - start;
+  const vserve::stats after = srv.counters();
+  const uint64_t knn = after.knn - before.knn, batches = after.batches - before.batches;
+  printf("%u clients, %u deep: %u queries in %.3fs, %lu searches of %.1f queries on average\n", clients, depth,
+         answered.load(), secs, (unsigned long)batches, batches ? (double)knn / batches : 0.0);
+  unsigned int errors = 0;
+  if (bad || answered != clients * per_client || knn != clients * per_client) {
+    cout << "ERROR: " << bad << " bad replies, " << answered << " of " << clients * per_client << " answered" << endl;
+    errors++;
+  }
+  if (after.batched - before.batched != knn || batches * 2 > knn) {
+    cout << "ERROR: " << knn << " queries in " << batches << " searches: not batched" << endl;
+    errors++;
+  }
+  return errors;
+}
+
+// A client that sends far more than the reply buffer holds before it
+// reads anything still gets every reply
+unsigned int
+check_backpressure(const char *path)
+{
+  using namespace std;
+  vserve::client c;
+  if (!c.connect(path)) {
+    return 1;
+  }
+  // sent from a thread, so neither side's socket buffer filling stalls the test
+  const unsigned int n = 20000;
+  thread sender([&c]() {
+    unsigned int i = 0;
+    for (; i < n; i++) {
+      c.send_get(i, i % NB);
+    }
+  });
+  usleep(100000);
+  vserve::reply r;
+  vector<float> row;
+  unsigned int i = 0, wrong = 0;
+  for (; i < n; i++) {
+    if (!c.recv(&r, NULL, &row)) {
+      break;
+    }
+    wrong += r.tag != i || memcmp(row.data(), &base[(i % NB) * STRIDE], D * sizeof(float)) != 0;
+  }
+  sender.join();
+  if (i != n || wrong) {
+    cout << "ERROR: " << i << " of " << n << " gets came back under backpressure, " << wrong << " wrong" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Queries waiting to be searched count against the buffer too: a client
+// that pipelines KNNs and does not read gets only so many taken in
+unsigned int
+check_knn_backpressure(const char *path, const vserve::server &srv)
+{
+  using namespace std;
+  vserve::client c;
+  if (!c.connect(path)) {
+    return 1;
+  }
+  const unsigned int n = 6000;
+  const uint64_t before = srv.counters().knn;
+  thread sender([&c]() {
+    unsigned int i = 0;
+    for (; i < n; i++) {
+      c.send_knn(i, &queries[(i % 400) * D], D, 10);
+    }
+  });
+  usleep(300000);
+  const uint64_t taken = srv.counters().knn - before;
+  vserve::reply r;
+  vector<int64_t> labels;
+  vector<float> dist;
+  unsigned int i = 0, wrong = 0;
+  for (; i < n; i++) {
+    if (!c.recv(&r, &labels, &dist)) {
+      break;
+    }
+    wrong += r.tag >= n || !check_knn(r.tag % 400, 10, r, labels, dist);
+  }
+  sender.join();
+  printf("knn backpressure: %lu of %u queries taken in while the client did not read\n", (unsigned long)taken, n);
+  if (i != n || wrong || taken * 2 > n) {
+    cout << "ERROR: " << i << " of " << n << " knn came back under backpressure, " << wrong << " wrong, "
+         << taken << " taken in unread" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+// A client that shuts down its sending side gets every reply to what it
+// sent, then the server closes the connection
+unsigned int
+check_half_close(const char *path)
+{
+  using namespace std;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    cout << "ERROR: raw connect" << endl;
+    return 1;
+  }
+  vector<char> sent;
+  vserve::request rq;
+  memset(&rq, 0, sizeof(rq));
+  rq.magic = vserve::MAGIC;
+  rq.op = vserve::OP_GET;
+  rq.tag = 100;
+  rq.id = 17;
+  sent.insert(sent.end(), (char *)&rq, (char *)&rq + sizeof(rq));
+  const unsigned int knns = 3;
+  unsigned int j = 0;
+  for (; j < knns; j++) {
+    rq.op = vserve::OP_KNN;
+    rq.tag = j;
+    rq.k = 5;
+    rq.d = D;
+    sent.insert(sent.end(), (char *)&rq, (char *)&rq + sizeof(rq));
+    sent.insert(sent.end(), (char *)&queries[j * D], (char *)&queries[(j + 1) * D]);
+  }
+  vector<char> got;
+  char buf[4096];
+  ssize_t m = 0;
+  if (write(fd, sent.data(), sent.size()) == (ssize_t)sent.size() && shutdown(fd, SHUT_WR) == 0) {
+    while ((m = read(fd, buf, sizeof(buf))) > 0) {
+      got.insert(got.end(), buf, buf + m);
+    }
+  }
+  close(fd);
+  // the get's row, then each knn's 5 labels and distances, in any order
+  const size_t want = sizeof(vserve::reply) + D * sizeof(float) +
+    knns * (sizeof(vserve::reply) + 5 * (sizeof(int64_t) + sizeof(float)));
+  unsigned int replies = 0;
+  size_t off = 0;
+  while (m == 0 && off + sizeof(vserve::reply) <= got.size()) {
+    vserve::reply r;
+    memcpy(&r, &got[off], sizeof(r));
+    if (r.magic != vserve::MAGIC || r.status != vserve::ST_OK) {
+      break;
+    }
+    off += sizeof(r) + (r.op == vserve::OP_GET ? r.d * sizeof(float) : r.n * (sizeof(int64_t) + sizeof(float)));
+    replies++;
+  }
+  if (m != 0 || got.size() != want || off != want || replies != knns + 1) {
+    cout << "ERROR: half closed client got " << got.size() << " of " << want << " bytes, " << replies
+         << " replies" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  using namespace std;
+  unsigned int errors = 0;
+  fill(&base, 1);
+  fill(&queries, 2);
+  const string path = "/tmp/vserve_test." + to_string(getpid()) + ".sock";
+
+  vserve::config cfg;
+  cfg.max_wait_us = 500;
+  cfg.max_batch = 64;
+  cfg.max_out_bytes = 64 << 10;
+  vserve::server srv(base.data(), NB, STRIDE, D, cfg);
+  if (!srv.listen(path.c_str())) {
+    cout << "vserve errors 1" << endl;
+    return 1;
+  }
+  bool run_ok = false;
+  thread loop([&]() { run_ok = srv.run(); });
+
+  errors += check_one_client(path.c_str());
+  errors += check_garbage(path.c_str());
+  errors += check_concurrent(path.c_str(), srv);
+  errors += check_backpressure(path.c_str());
+  errors += check_knn_backpressure(path.c_str(), srv);
+  errors += check_half_close(path.c_str());
+
+  const double start = elapsed();
+  srv.stop();
+  loop.join();
+  const vserve::stats s = srv.counters();
+  printf("stopped in %.3fs: %lu connections, %lu requests, %lu knn, %lu gets, %lu errors\n", elapsed() - start,
+         (unsigned long)s.conns, (unsigned long)s.requests, (unsigned long)s.knn, (unsigned long)s.gets,
+         (unsigned long)s.errors);
+  if (!run_ok || s.errors != 3) {
+    // the two bad KNNs and the garbage connection; a get past the end is not one
+    cout << "ERROR: run " << run_ok << ", " << s.errors << " errors counted" << endl;
+    errors++;
+  }
+
+  cout << "vserve errors " << errors << endl;
+  return errors != 0;
+}